@@ -0,0 +1,160 @@
+/* bench-common.h
+ * Synthetic captions shared by the line generation, filter and history
+ * benchmarks, and a scratch data directory so they never see user files.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <april_api.h>
+
+#define REPEATS 5
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Mostly everyday words, plus some sharing a prefix with a filtered word so
+// the filter has to look past the first letters. cumulus and sextant are
+// filtered, as the built-in lists match on prefixes
+static const char *synth_words[] = {
+    "the", "and", "you", "that", "was", "for", "are", "with", "his", "they",
+    "this", "have", "from", "one", "had", "word", "but", "not", "what", "all",
+    "were", "when", "your", "can", "said", "there", "use", "each", "which", "she",
+    "people", "because", "something", "actually", "important", "everything",
+    "probably", "information", "understand", "government", "development",
+    "shipping", "cockpit", "dictionary", "pension", "session", "homework",
+    "compare", "document", "shelf", "fabric", "cumulus", "sextant",
+};
+
+// Longest token text, with the leading space and terminator
+#define SYNTH_TOKEN_CHARS 8
+
+// Tokens as the models emit them: words are split into pieces of up to four
+// letters, the first of which starts with a space and has the word boundary
+// flag. Sentences end in a "." token with the sentence end flag
+struct synth_stream {
+    AprilToken *tokens;
+    size_t count;
+
+    char *text;
+};
+
+static void synth_stream_init(struct synth_stream *s, size_t count) {
+    s->tokens = calloc(count, sizeof(AprilToken));
+    s->text = calloc(count, SYNTH_TOKEN_CHARS);
+    s->count = count;
+
+    srand(1234);
+
+    size_t i = 0;
+    while(i < count) {
+        const char *word = synth_words[rand() % G_N_ELEMENTS(synth_words)];
+
+        for(size_t c=0; (word[c] != '\0') && (i < count); i++){
+            char *out = &s->text[i * SYNTH_TOKEN_CHARS];
+            bool first = (c == 0);
+
+            if(first) *out++ = ' ';
+
+            size_t len = 1 + rand() % 4;
+            for(size_t k=0; (k < len) && (word[c] != '\0'); k++) *out++ = word[c++];
+
+            s->tokens[i].token = &s->text[i * SYNTH_TOKEN_CHARS];
+            s->tokens[i].logprob = -3.0f * rand() / (float)RAND_MAX;
+            s->tokens[i].flags = first ? APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT : 0;
+        }
+
+        if((i < count) && ((rand() % 12) == 0)) {
+            strcpy(&s->text[i * SYNTH_TOKEN_CHARS], ".");
+
+            s->tokens[i].token = &s->text[i * SYNTH_TOKEN_CHARS];
+            s->tokens[i].logprob = -0.5f;
+            s->tokens[i].flags = APRIL_TOKEN_FLAG_SENTENCE_END_BIT;
+            i++;
+        }
+    }
+}
+
+static size_t synth_stream_text_bytes(const struct synth_stream *s) {
+    size_t bytes = 0;
+    for(size_t i=0; i<s->count; i++) bytes += strlen(s->tokens[i].token);
+
+    return bytes;
+}
+
+static void synth_stream_free(struct synth_stream *s) {
+    free(s->tokens);
+    free(s->text);
+}
+
+// Points the user data directory at an empty temporary one, so the user's
+// filter lists and history are neither read nor overwritten, and keeps
+// settings in memory so they're the defaults. Must be called before anything
+// else asks GLib for these
+static char *bench_scratch_dir(void) {
+    GError *error = NULL;
+    char *dir = g_dir_make_tmp("livecaptions-bench-XXXXXX", &error);
+    if(dir == NULL) {
+        fprintf(stderr, "Can't create a temporary directory: %s\n", error->message);
+        exit(1);
+    }
+
+    g_setenv("XDG_DATA_HOME", dir, true);
+    g_setenv("GSETTINGS_BACKEND", "memory", true);
+
+    return dir;
+}
+
+static void bench_remove_scratch_dir(char *dir) {
+    GDir *d = g_dir_open(dir, 0, NULL);
+    if(d != NULL) {
+        const char *name;
+        while((name = g_dir_read_name(d)) != NULL) {
+            char *path = g_build_filename(dir, name, NULL);
+            g_remove(path);
+            g_free(path);
+        }
+
+        g_dir_close(d);
+    }
+
+    g_rmdir(dir);
+    g_free(dir);
+}
+
+// The size argument of a benchmark, or the default when run by meson
+static size_t bench_size_arg(int argc, char **argv, int idx, size_t fallback) {
+    if(argc <= idx) return fallback;
+
+    size_t value = strtoull(argv[idx], NULL, 10);
+    if(value == 0) {
+        fprintf(stderr, "Invalid size %s\n", argv[idx]);
+        exit(1);
+    }
+
+    return value;
+}
@@ -0,0 +1,106 @@
+/* filter-bench.c
+ * Measures the cost of checking every word against the filter lists, over
+ * both the live recognition results and the tokens stored in history.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench-common.h"
+#include "profanity-filter.h"
+#include "token-view.h"
+
+#define DEFAULT_TOKENS 1000000
+
+// Filters every word the way the line generator does. Returns the number of
+// words filtered
+static size_t run(const struct token_view *view, FilterMode mode) {
+    struct filter_matcher *filter = profanity_filter_acquire();
+    size_t filtered = 0;
+
+    for(size_t i=0; i<view->count;){
+        size_t skip = 0;
+        if(token_view_flags(view, i) & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)
+            skip = get_filter_skip(filter, view, i, mode);
+
+        if(skip > 0) {
+            filtered++;
+            i += skip;
+        } else {
+            i++;
+        }
+    }
+
+    profanity_filter_release(filter);
+
+    return filtered;
+}
+
+static void bench_case(const char *name, const struct token_view *view, FilterMode mode, size_t text_bytes) {
+    double best_ns = 0;
+    size_t filtered = 0;
+
+    for(int r=0; r<REPEATS; r++){
+        double t0 = now_ns();
+        filtered = run(view, mode);
+        double t1 = now_ns();
+
+        if((r == 0) || ((t1 - t0) < best_ns)) best_ns = t1 - t0;
+    }
+
+    printf("%-18s %6.2f ns/token, %7.1f MB/s, %zu words filtered\n",
+           name,
+           best_ns / view->count,
+           (text_bytes / (1024.0 * 1024.0)) / (best_ns / 1e9),
+           filtered);
+}
+
+int main(int argc, char **argv) {
+    char *scratch = bench_scratch_dir();
+
+    size_t count = bench_size_arg(argc, argv, 1, DEFAULT_TOKENS);
+
+    struct synth_stream s;
+    synth_stream_init(&s, count);
+
+    size_t text_bytes = synth_stream_text_bytes(&s);
+
+    struct history_token *history = calloc(count, sizeof(struct history_token));
+    for(size_t i=0; i<count; i++){
+        g_strlcpy(history[i].token, s.tokens[i].token, HISTORY_TOKEN_MAX_CHARS);
+        history[i].logprob = s.tokens[i].logprob;
+        history[i].flags = s.tokens[i].flags;
+    }
+
+    struct token_view live = token_view_from_april(s.tokens, count);
+    struct token_view stored = token_view_from_history(history, count);
+
+    printf("%zu tokens, %.1f MB of text\n\n", count, text_bytes / (1024.0 * 1024.0));
+
+    // Compiles the built-in lists. The user lists are only loaded from the
+    // main loop, which never runs here
+    profanity_filter_init();
+
+    bench_case("slurs", &live, FILTER_SLURS, text_bytes);
+    bench_case("profanity", &live, FILTER_PROFANITY, text_bytes);
+    bench_case("profanity history", &stored, FILTER_PROFANITY, text_bytes);
+
+    free(history);
+    synth_stream_free(&s);
+
+    bench_remove_scratch_dir(scratch);
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+/* history-bench.c
+ * Measures how fast history is recorded, saved and loaded, on a synthetic
+ * history file of a given size. The file stays in the page cache, so this
+ * measures the parsing and copying rather than the disk.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+
+#include "bench-common.h"
+#include "history.h"
+
+// Usage: history-bench [megabytes] [sessions]
+#define DEFAULT_MEGABYTES 16
+#define DEFAULT_SESSIONS 16
+
+static size_t file_size(const char *path) {
+    struct stat st;
+    if(stat(path, &st) != 0) return 0;
+
+    return st.st_size;
+}
+
+// Commits sentences from the stream to the active session until it holds
+// the given number of bytes of tokens, wrapping around the stream. Returns
+// the time spent committing
+static double fill_session(const struct synth_stream *s, size_t *pos, size_t bytes, size_t *tokens_committed) {
+    double total_ns = 0;
+    size_t committed = 0;
+
+    while(committed * sizeof(struct history_token) < bytes) {
+        size_t start = *pos;
+        size_t end = start;
+        while((end < s->count) && !(s->tokens[end].flags & APRIL_TOKEN_FLAG_SENTENCE_END_BIT) && ((end - start) < HISTORY_MAX_TOKENS - 1)) end++;
+        if(end < s->count) end++;
+
+        double t0 = now_ns();
+        commit_tokens_to_current_history(CAPTION_SOURCE_DESKTOP, "en", &s->tokens[start], end - start);
+        double t1 = now_ns();
+
+        total_ns += t1 - t0;
+        committed += end - start;
+
+        *pos = (end >= s->count) ? 0 : end;
+    }
+
+    *tokens_committed += committed;
+    return total_ns;
+}
+
+// Each session is recorded into the active session and saved alongside
+// the ones before it, as happens over several runs of the app. Returns the
+// time it took to commit each token
+static double build_history(const char *path, size_t bytes, size_t sessions) {
+    struct synth_stream s;
+    synth_stream_init(&s, 100000);
+
+    size_t pos = 0;
+    size_t tokens = 0;
+    double commit_ns = 0;
+
+    for(size_t i=0; i<sessions; i++){
+        erase_all_history();
+        if(i > 0) load_history_from(path);
+
+        commit_ns += fill_session(&s, &pos, bytes / sessions, &tokens);
+
+        save_current_history(path);
+    }
+
+    erase_all_history();
+    synth_stream_free(&s);
+
+    return commit_ns / tokens;
+}
+
+static void report(const char *name, double ns, size_t bytes) {
+    printf("%-14s %8.1f MB/s, %8.2f ms\n", name, (bytes / (1024.0 * 1024.0)) / (ns / 1e9), ns / 1e6);
+}
+
+int main(int argc, char **argv) {
+    char *scratch = bench_scratch_dir();
+
+    size_t megabytes = bench_size_arg(argc, argv, 1, DEFAULT_MEGABYTES);
+    size_t sessions = bench_size_arg(argc, argv, 2, DEFAULT_SESSIONS);
+
+    history_init();
+
+    char *path = g_build_filename(scratch, "history.bin", NULL);
+    char *out_path = g_build_filename(scratch, "history-out.bin", NULL);
+
+    double commit_ns = build_history(path, megabytes * 1024 * 1024, sessions);
+
+    size_t size = file_size(path);
+    printf("%.1f MB in %zu sessions\n\n", size / (1024.0 * 1024.0), sessions);
+
+    printf("%-14s %8.1f ns/token\n", "commit", commit_ns);
+
+    double best_index = 0, best_decode = 0, best_save_raw = 0, best_save_decoded = 0;
+
+    for(int r=0; r<REPEATS; r++){
+        erase_all_history();
+
+        // Only indexes the sessions, as on startup
+        double t0 = now_ns();
+        load_history_from(path);
+        double t1 = now_ns();
+
+        // Sessions that were never opened are copied out as they were read
+        save_current_history(out_path);
+        double t2 = now_ns();
+
+        // As when scrolling through all of history
+        for(size_t i=1; i<get_history_session_count(); i++) get_history_session(i);
+        double t3 = now_ns();
+
+        save_current_history(out_path);
+        double t4 = now_ns();
+
+        if((r == 0) || ((t1 - t0) < best_index)) best_index = t1 - t0;
+        if((r == 0) || ((t2 - t1) < best_save_raw)) best_save_raw = t2 - t1;
+        if((r == 0) || ((t3 - t2) < best_decode)) best_decode = t3 - t2;
+        if((r == 0) || ((t4 - t3) < best_save_decoded)) best_save_decoded = t4 - t3;
+    }
+
+    report("load", best_index, size);
+    report("decode", best_decode, size);
+    report("save", best_save_raw, size);
+    report("save decoded", best_save_decoded, size);
+
+    erase_all_history();
+
+    g_free(path);
+    g_free(out_path);
+
+    bench_remove_scratch_dir(scratch);
+
+    return 0;
+}
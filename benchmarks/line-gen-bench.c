@@ -0,0 +1,142 @@
+/* line-gen-bench.c
+ * Measures the cost of turning recognition results into caption lines, with
+ * the partial results growing one token at a time as they do while decoding.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <adwaita.h>
+
+#include "bench-common.h"
+#include "line-gen.h"
+#include "profanity-filter.h"
+
+#define DEFAULT_TOKENS 50000
+
+// The default font and line width
+#define FONT "Sans Regular 24"
+#define LINE_CHARS 50
+
+static struct line_generator lg;
+
+static PangoLayout *make_layout(int *max_text_width) {
+    PangoContext *context = pango_font_map_create_context(pango_cairo_font_map_get_default());
+    PangoLayout *layout = pango_layout_new(context);
+    g_object_unref(context);
+
+    PangoFontDescription *desc = pango_font_description_from_string(FONT);
+    pango_layout_set_font_description(layout, desc);
+    pango_font_description_free(desc);
+
+    // Measured the way the window does it
+    const char *text = "This program is free software: you can redistribute it and/or modify it";
+
+    int width, height;
+    pango_layout_set_width(layout, -1);
+    pango_layout_set_text(layout, text, LINE_CHARS);
+    pango_layout_get_size(layout, &width, &height);
+
+    *max_text_width = width / PANGO_SCALE;
+
+    return layout;
+}
+
+// Every sentence is passed in as a partial result of 1, 2, ... tokens and
+// then finalized. Returns the number of tokens passed in over all updates
+static size_t run(const struct synth_stream *s, size_t *updates) {
+    size_t processed = 0;
+    size_t start = 0;
+
+    for(size_t i=0; i<s->count; i++){
+        size_t len = i - start + 1;
+
+        line_generator_update(&lg, len, &s->tokens[start]);
+        processed += len;
+        (*updates)++;
+
+        if((s->tokens[i].flags & APRIL_TOKEN_FLAG_SENTENCE_END_BIT) || (len == 1024)) {
+            line_generator_finalize(&lg);
+            start = i + 1;
+        }
+    }
+
+    return processed;
+}
+
+static void bench_case(const char *name, const struct synth_stream *s, PangoLayout *layout, int max_text_width) {
+    double best_ns = 0;
+    size_t processed = 0, updates = 0;
+
+    for(int r=0; r<REPEATS; r++){
+        memset(&lg, 0, sizeof(lg));
+        line_generator_init(&lg);
+        line_generator_set_language(&lg, "en");
+
+        lg.layout = layout;
+        lg.max_text_width = max_text_width;
+
+        updates = 0;
+
+        double t0 = now_ns();
+        processed = run(s, &updates);
+        double t1 = now_ns();
+
+        if((r == 0) || ((t1 - t0) < best_ns)) best_ns = t1 - t0;
+    }
+
+    printf("%-12s %8.1f ns/token, %6.1f ns/token updated, %7.2f us/update\n",
+           name,
+           best_ns / s->count,
+           best_ns / processed,
+           best_ns / updates / 1000.0);
+}
+
+int main(int argc, char **argv) {
+    char *scratch = bench_scratch_dir();
+
+    size_t count = bench_size_arg(argc, argv, 1, DEFAULT_TOKENS);
+
+    struct synth_stream s;
+    synth_stream_init(&s, count);
+
+    int max_text_width;
+    PangoLayout *layout = make_layout(&max_text_width);
+
+    printf("%zu tokens, lines %d px wide in %s\n\n", count, max_text_width, FONT);
+
+    GSettings *settings = g_settings_new("net.sapples.LiveCaptions");
+
+    // The built-in lists, as the application filters with
+    profanity_filter_init();
+
+    bench_case("default", &s, layout, max_text_width);
+
+    g_settings_set_boolean(settings, "fade-text", true);
+    bench_case("fade", &s, layout, max_text_width);
+    g_settings_reset(settings, "fade-text");
+
+    g_settings_set_boolean(settings, "filter-slurs", false);
+    g_settings_set_boolean(settings, "filter-profanity", false);
+    bench_case("unfiltered", &s, layout, max_text_width);
+
+    g_object_unref(settings);
+    g_object_unref(layout);
+    synth_stream_free(&s);
+
+    bench_remove_scratch_dir(scratch);
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+/* preprocess-bench.c
+ * Measures the cost of each audio preprocessing stage on its own, and
+ * checks that each one does what it's meant to on synthetic input.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "preprocess.h"
+
+#define RATE 16000
+#define SECONDS 30
+
+// Capture callbacks deliver roughly this much at a time
+#define CHUNK 800
+
+#define REPEATS 5
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double rms_db(const short *x, size_t count) {
+    double sum = 0;
+    for(size_t i=0; i<count; i++)
+        sum += (x[i] / 32768.0) * (x[i] / 32768.0);
+
+    return 10.0 * log10(fmax(sum / (double)count, 1e-20));
+}
+
+// Speech-band tone bursts (1 s on, 1 s off) over white noise, plus an
+// optional DC offset and low rumble
+static void make_input(short *x, size_t count, double tone_db, double noise_db, double dc, double rumble_db) {
+    double tone = pow(10.0, tone_db / 20.0);
+    double noise = pow(10.0, noise_db / 20.0) * sqrt(3.0);
+    double rumble = pow(10.0, rumble_db / 20.0);
+
+    srand(1234);
+    for(size_t i=0; i<count; i++){
+        double t = (double)i / RATE;
+        bool on = ((i / RATE) % 2) == 0;
+
+        double v = dc;
+        if(on) v += tone * sin(2.0 * M_PI * 500.0 * t);
+        v += noise * (2.0 * rand() / (double)RAND_MAX - 1.0);
+        v += rumble * sin(2.0 * M_PI * 30.0 * t);
+
+        x[i] = (short)lrint(fmax(fmin(v * 32768.0, 32767.0), -32768.0));
+    }
+}
+
+static void run(struct preprocessor *pp, short *x, size_t count, unsigned int stages) {
+    for(size_t i=0; i<count; i+=CHUNK){
+        size_t n = count - i;
+        if(n > CHUNK) n = CHUNK;
+
+        preprocessor_process(pp, &x[i], n, stages);
+    }
+}
+
+static void bench_stage(const char *name, unsigned int stages, const short *input, size_t count) {
+    short *x = malloc(count * sizeof(short));
+
+    double best_ns = 0;
+    uint64_t best_cycles = 0;
+
+    // The first run also pays for faulting in the buffer and warming the
+    // caches, keep the fastest
+    for(int r=0; r<REPEATS; r++){
+        memcpy(x, input, count * sizeof(short));
+
+        struct preprocessor *pp = preprocessor_new(RATE);
+
+        // Enabling a stage resets it, do that outside the measurement
+        preprocessor_process(pp, x, 0, stages);
+
+        double t0 = now_ns();
+        uint64_t c0 = cycles();
+        run(pp, x, count, stages);
+        uint64_t c1 = cycles();
+        double t1 = now_ns();
+
+        if((r == 0) || ((t1 - t0) < best_ns)) {
+            best_ns = t1 - t0;
+            best_cycles = c1 - c0;
+        }
+
+        preprocessor_free(pp);
+    }
+
+    printf("%-12s %7.2f cycles/sample, %6.2f ns/sample, %7.0fx realtime\n",
+           name,
+           (double)best_cycles / count,
+           best_ns / count,
+           (SECONDS * 1e9) / best_ns);
+
+    free(x);
+}
+
+// Level during the tone and during the gaps, skipping the first seconds
+// while the AGC and noise estimate settle
+static void levels(const short *x, size_t count, size_t delay, double *tone_db, double *gap_db) {
+    double tone_sum = 0, gap_sum = 0;
+    size_t tone_n = 0, gap_n = 0;
+
+    for(size_t i=4*RATE; i<count; i++){
+        size_t src = (i >= delay) ? (i - delay) : 0;
+        bool on = ((src / RATE) % 2) == 0;
+
+        // Leave out the edges of the bursts
+        size_t within = src % RATE;
+        if((within < RATE / 10) || (within > RATE - RATE / 10)) continue;
+
+        double v = (x[i] / 32768.0) * (x[i] / 32768.0);
+        if(on) { tone_sum += v; tone_n++; }
+        else { gap_sum += v; gap_n++; }
+    }
+
+    *tone_db = 10.0 * log10(fmax(tone_sum / (double)tone_n, 1e-20));
+    *gap_db = 10.0 * log10(fmax(gap_sum / (double)gap_n, 1e-20));
+}
+
+static void check_effects(void) {
+    size_t count = (size_t)RATE * SECONDS;
+    short *x = malloc(count * sizeof(short));
+
+    struct preprocessor *pp;
+    double tone_db, gap_db;
+
+    // High-pass: DC and 30 Hz rumble are removed, the tone stays
+    make_input(x, count, -20.0, -90.0, 0.1, -20.0);
+    levels(x, count, 0, &tone_db, &gap_db);
+    printf("\nhighpass: gaps (DC + rumble) %6.1f dB", gap_db);
+
+    pp = preprocessor_new(RATE);
+    run(pp, x, count, PREPROCESS_HIGHPASS);
+    preprocessor_free(pp);
+
+    levels(x, count, 0, &tone_db, &gap_db);
+    printf(" -> %6.1f dB, tone %6.1f dB (input -23.0 dB)\n", gap_db, tone_db);
+
+    // AGC: a quiet source is brought up towards -20 dBFS
+    make_input(x, count, -45.0, -90.0, 0.0, -200.0);
+    levels(x, count, 0, &tone_db, &gap_db);
+    printf("agc:      tone %6.1f dB", tone_db);
+
+    pp = preprocessor_new(RATE);
+    run(pp, x, count, PREPROCESS_AGC);
+    printf(" -> %6.1f dB, final gain %5.1f dB\n", (levels(x, count, 0, &tone_db, &gap_db), tone_db), preprocessor_get_gain_db(pp));
+    preprocessor_free(pp);
+
+    // Limiter: a source that's too loud does not clip
+    make_input(x, count, 0.0, -90.0, 0.0, -200.0);
+    pp = preprocessor_new(RATE);
+    run(pp, x, count, PREPROCESS_AGC);
+    preprocessor_free(pp);
+
+    int max = 0;
+    for(size_t i=0; i<count; i++) max = (abs(x[i]) > max) ? abs(x[i]) : max;
+    printf("limiter:  full scale input peaks at %.1f dBFS\n", 20.0 * log10(max / 32768.0));
+
+    // Noise gate: noise in the gaps is reduced more than the tone
+    make_input(x, count, -20.0, -45.0, 0.0, -200.0);
+    double in_tone, in_gap;
+    levels(x, count, 0, &in_tone, &in_gap);
+
+    pp = preprocessor_new(RATE);
+    run(pp, x, count, PREPROCESS_NOISE_GATE);
+    preprocessor_free(pp);
+
+    levels(x, count, PREPROCESS_GATE_FRAME, &tone_db, &gap_db);
+    printf("gate:     tone %6.1f -> %6.1f dB, noise %6.1f -> %6.1f dB\n", in_tone, tone_db, in_gap, gap_db);
+
+    free(x);
+}
+
+int main(void) {
+    size_t count = (size_t)RATE * SECONDS;
+    short *input = malloc(count * sizeof(short));
+    make_input(input, count, -30.0, -50.0, 0.01, -30.0);
+
+    printf("%zu samples at %d Hz in chunks of %d, input %.1f dBFS\n\n", count, RATE, CHUNK, rms_db(input, count));
+
+    bench_stage("bypass", 0, input, count);
+    bench_stage("highpass", PREPROCESS_HIGHPASS, input, count);
+    bench_stage("agc", PREPROCESS_AGC, input, count);
+    bench_stage("noise-gate", PREPROCESS_NOISE_GATE, input, count);
+    bench_stage("all", PREPROCESS_ALL, input, count);
+
+    check_effects();
+
+    free(input);
+    return 0;
+}
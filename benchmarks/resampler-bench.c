@@ -0,0 +1,193 @@
+/* resampler-bench.c
+ * Measures the cost and accuracy of the native capture resampler for
+ * common device formats, at several filter lengths.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "resampler.h"
+
+#define OUT_RATE 16000
+#define SECONDS 10
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Interleaved tone of the given frequency, same on every channel
+static float *make_tone(unsigned int rate, unsigned int channels, size_t frames, double freq) {
+    float *buf = malloc(frames * channels * sizeof(float));
+    for(size_t i=0; i<frames; i++){
+        float v = 0.5f * (float)sin(2.0 * M_PI * freq * i / rate);
+        for(unsigned int c=0; c<channels; c++)
+            buf[i * channels + c] = v;
+    }
+
+    return buf;
+}
+
+static size_t run(struct resampler *r, const float *in, unsigned int channels, size_t frames, short *out) {
+    size_t written = 0;
+    for(size_t i=0; i<frames; i+=RESAMPLER_MAX_BLOCK_FRAMES){
+        size_t n = frames - i;
+        if(n > RESAMPLER_MAX_BLOCK_FRAMES) n = RESAMPLER_MAX_BLOCK_FRAMES;
+
+        written += resampler_process(r, &in[i * channels], n, &out[written]);
+    }
+
+    return written;
+}
+
+// Fits a sinusoid of the expected frequency by least squares and returns the
+// ratio of its power to the residual power, in dB
+static double tone_snr(const short *out, size_t count, double freq) {
+    // Skip the filter's warm-up
+    size_t skip = OUT_RATE / 10;
+
+    double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0;
+    for(size_t i=skip; i<count; i++){
+        double s = sin(2.0 * M_PI * freq * i / OUT_RATE);
+        double c = cos(2.0 * M_PI * freq * i / OUT_RATE);
+        double y = out[i] / 32767.0;
+
+        ss += s * s; cc += c * c; sc += s * c;
+        ys += y * s; yc += y * c;
+    }
+
+    double det = ss * cc - sc * sc;
+    double a = (ys * cc - yc * sc) / det;
+    double b = (yc * ss - ys * sc) / det;
+
+    double signal = 0, noise = 0;
+    for(size_t i=skip; i<count; i++){
+        double fit = a * sin(2.0 * M_PI * freq * i / OUT_RATE) + b * cos(2.0 * M_PI * freq * i / OUT_RATE);
+        double y = out[i] / 32767.0;
+
+        signal += fit * fit;
+        noise += (y - fit) * (y - fit);
+    }
+
+    return 10.0 * log10(signal / fmax(noise, 1e-20));
+}
+
+// Level of a tone above the output Nyquist frequency that made it through,
+// relative to the input level, in dB. -INFINITY if it rounded to nothing
+static double alias_level(const short *out, size_t count) {
+    size_t skip = OUT_RATE / 10;
+
+    double power = 0;
+    for(size_t i=skip; i<count; i++){
+        double y = out[i] / 32767.0;
+        power += y * y;
+    }
+
+    power /= (double)(count - skip);
+
+    if(power == 0.0) return -INFINITY;
+
+    // The input tone has amplitude 0.5, so power 0.125
+    return 10.0 * log10(power / 0.125);
+}
+
+static void bench_format(unsigned int in_rate, unsigned int channels) {
+    static const unsigned int taps_list[] = { 8, 16, 32, 64 };
+
+    size_t frames = (size_t)in_rate * SECONDS;
+
+    float *passband = make_tone(in_rate, channels, frames, 1000.0);
+
+    // Between the output and input Nyquist frequencies, and away from
+    // multiples of the output rate, which alias to DC and are sampled at
+    // their zero crossings
+    bool downsampling = in_rate > OUT_RATE;
+    float *stopband = make_tone(in_rate, channels, frames, OUT_RATE / 2.0 + 0.37 * (in_rate / 2.0 - OUT_RATE / 2.0));
+
+    for(size_t t=0; t<sizeof(taps_list)/sizeof(taps_list[0]); t++){
+        struct resampler *r = resampler_new(in_rate, OUT_RATE, channels, taps_list[t]);
+        if(r == NULL) {
+            printf("%6u Hz %u ch: unsupported ratio\n", in_rate, channels);
+            break;
+        }
+
+        short *out = malloc(resampler_max_output(r, frames) * sizeof(short) + RESAMPLER_MAX_BLOCK_FRAMES * sizeof(short));
+
+        double t0 = now_ns();
+        uint64_t c0 = cycles();
+        size_t count = run(r, passband, channels, frames, out);
+        uint64_t c1 = cycles();
+        double t1 = now_ns();
+
+        double snr = tone_snr(out, count, 1000.0);
+        resampler_free(r);
+
+        double alias = 0.0;
+        if(downsampling) {
+            r = resampler_new(in_rate, OUT_RATE, channels, taps_list[t]);
+            size_t alias_count = run(r, stopband, channels, frames, out);
+            alias = alias_level(out, alias_count);
+            resampler_free(r);
+        }
+
+        // Nothing can alias without downsampling
+        char alias_text[16];
+        if(!downsampling) snprintf(alias_text, sizeof(alias_text), "n/a");
+        else if(isinf(alias)) snprintf(alias_text, sizeof(alias_text), "below 16-bit");
+        else snprintf(alias_text, sizeof(alias_text), "%6.1f dB", alias);
+
+        printf("%6u Hz %u ch, %2u taps: %6.2f ns/in-frame, %7.2f cycles/out-sample, %5.1fx realtime, SNR %5.1f dB, alias %s\n",
+               in_rate, channels, taps_list[t],
+               (t1 - t0) / frames,
+               (double)(c1 - c0) / count,
+               SECONDS * 1e9 / (t1 - t0),
+               snr, alias_text);
+
+        free(out);
+    }
+
+    free(passband);
+    free(stopband);
+}
+
+int main(void) {
+    bench_format(48000, 2);
+    bench_format(44100, 2);
+    bench_format(48000, 1);
+    bench_format(16000, 1);
+
+    return 0;
+}
@@ -0,0 +1,508 @@
+/* asr-governor.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <april_api.h>
+
+#include "asr-governor.h"
+#include "livecaptions-application.h"
+#include "asrproc.h"
+#include "model-cache.h"
+#include "rt.h"
+#include "common.h"
+
+#define GOVERNOR_INTERVAL_S 1
+
+// The decoder is behind above this speedup, the same threshold as the
+// slow warning in the main window
+#define GOVERNOR_LAG_SPEEDUP 1.1f
+
+// With a backlog, seconds of audio waiting to be decoded that count as
+// being behind, and the most there may be to have room
+#define GOVERNOR_LAG_S 2.0
+#define GOVERNOR_HEADROOM_LAG_S 0.5
+
+// Being behind for this many intervals in a row lowers the quality a step
+#define GOVERNOR_LAG_INTERVALS 5
+
+// Having room for this many intervals in a row raises it a step. Doubled
+// each time the quality had to be lowered again soon after, up to
+// GOVERNOR_MAX_BACKOFF times
+#define GOVERNOR_HEADROOM_INTERVALS 30
+#define GOVERNOR_MAX_BACKOFF 16
+#define GOVERNOR_FLAP_US (5 * 60 * G_USEC_PER_SEC)
+
+// There's room for the next step up if no session would use more than
+// this share of a core with it
+#define GOVERNOR_HEADROOM_CPU 0.6
+
+struct asr_governor {
+    LiveCaptionsApplication *app;
+    guint timer;
+    bool enabled;
+
+    GovernorLevel level;
+
+    // The model picked by the user, and its language. Set when first
+    // switching to a smaller model
+    char *original_model;
+    char *language;
+
+    // Models switched to, the one in use last. Only used at
+    // GOVERNOR_SMALLER_MODEL
+    GPtrArray *models;
+
+    // No smaller model was found for the one in use
+    bool no_smaller_model;
+
+    int lag_intervals;
+    int headroom_intervals;
+    int backoff;
+    gint64 last_raise;
+    int last_cant_keep_up;
+
+    // A model is being looked for or loaded, decisions wait for it
+    bool busy;
+    GCancellable *cancellable;
+
+    // Of the load in progress
+    bool lowering;
+    int rate_before;
+};
+
+static gint64 file_size(const char *path) {
+    struct stat st;
+    if(stat(path, &st) != 0) return -1;
+
+    return st.st_size;
+}
+
+static const char *current_model(struct asr_governor *gov) {
+    if(gov->models->len > 0) return g_ptr_array_index(gov->models, gov->models->len - 1);
+    return gov->original_model;
+}
+
+// The model to go back to when raising the quality from a smaller model
+static const char *previous_model(struct asr_governor *gov) {
+    if(gov->models->len > 1) return g_ptr_array_index(gov->models, gov->models->len - 2);
+    return gov->original_model;
+}
+
+static void set_level(struct asr_governor *gov, GovernorLevel level) {
+    gov->level = level;
+    asr_thread_set_skip_silence(gov->app->asr, level >= GOVERNOR_SKIP_SILENCE);
+}
+
+
+struct model_probe {
+    struct asr_governor *gov;
+    GCancellable *cancellable;
+
+    char *language;
+
+    // Smaller than the model in use, largest first
+    GPtrArray *candidates;
+
+    // Candidates whose language is still unknown after the probe
+    guint unknown;
+
+    char *result;
+};
+
+static gint compare_size_descending(gconstpointer a, gconstpointer b) {
+    gint64 size_a = file_size(*(const char **)a);
+    gint64 size_b = file_size(*(const char **)b);
+
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+static GPtrArray *find_smaller_models(struct asr_governor *gov) {
+    GPtrArray *candidates = g_ptr_array_new_with_free_func(g_free);
+
+    const char *current = current_model(gov);
+    gint64 current_size = file_size(current);
+
+    GSettings *settings = gov->app->settings;
+    char **installed = g_settings_get_strv(settings, "installed-models");
+
+    GPtrArray *all = g_ptr_array_new();
+    g_ptr_array_add(all, (gpointer)GET_MODEL_PATH());
+    for(size_t i=0; installed[i] != NULL; i++) g_ptr_array_add(all, installed[i]);
+
+    for(guint i=0; i<all->len; i++){
+        const char *path = g_ptr_array_index(all, i);
+        gint64 size = file_size(path);
+
+        if((size < 0) || (size >= current_size) || g_str_equal(path, current)) continue;
+
+        bool duplicate = false;
+        for(guint j=0; j<candidates->len; j++)
+            duplicate = duplicate || g_str_equal(g_ptr_array_index(candidates, j), path);
+
+        if(!duplicate) g_ptr_array_add(candidates, g_strdup(path));
+    }
+
+    g_ptr_array_sort(candidates, compare_size_descending);
+
+    g_ptr_array_free(all, true);
+    g_strfreev(installed);
+
+    return candidates;
+}
+
+static gboolean finish_model_probe(void *userdata);
+
+// Only the model knows its language. The languages of models loaded before
+// are remembered, and at most one other candidate is loaded per probe, as
+// the machine is already struggling. It stays in the model cache, so the
+// switch itself is quick
+static void *run_model_probe(void *userdata) {
+    struct model_probe *probe = userdata;
+
+    for(guint i=0; i<probe->candidates->len; i++){
+        const char *path = g_ptr_array_index(probe->candidates, i);
+
+        char *language = model_cache_get_language(path);
+        if(language == NULL) {
+            probe->unknown++;
+            continue;
+        }
+
+        bool same_language = g_str_equal(language, probe->language);
+        g_free(language);
+
+        if(same_language) {
+            probe->result = g_strdup(path);
+            break;
+        }
+    }
+
+    if((probe->result == NULL) && (probe->unknown > 0) && !g_cancellable_is_cancelled(probe->cancellable)) {
+        // Models loaded here may be used for decoding later
+        rt_place_current_thread();
+
+        for(guint i=0; i<probe->candidates->len; i++){
+            const char *path = g_ptr_array_index(probe->candidates, i);
+
+            char *language = model_cache_get_language(path);
+            if(language != NULL) {
+                g_free(language);
+                continue;
+            }
+
+            probe->unknown--;
+
+            AprilASRModel model = model_cache_acquire(path);
+            if(model == NULL) continue;
+
+            if(g_str_equal(aam_get_language(model), probe->language))
+                probe->result = g_strdup(path);
+
+            model_cache_release(model);
+            break;
+        }
+
+        rt_forget_current_thread();
+    }
+
+    g_idle_add(finish_model_probe, probe);
+    return NULL;
+}
+
+static void on_model_loaded(GObject *target, const char *model_path, bool success, bool cancelled);
+
+static void switch_model(struct asr_governor *gov, const char *path, bool lowering) {
+    gov->busy = true;
+    gov->lowering = lowering;
+    gov->rate_before = asr_thread_samplerate(gov->app->asr);
+
+    g_clear_object(&gov->cancellable);
+    gov->cancellable = g_cancellable_new();
+
+    asr_thread_load_model_async(gov->app->asr, path, gov->cancellable, G_OBJECT(gov->app), NULL, on_model_loaded);
+}
+
+static gboolean finish_model_probe(void *userdata) {
+    struct model_probe *probe = userdata;
+    struct asr_governor *gov = probe->gov;
+
+    if(!g_cancellable_is_cancelled(probe->cancellable)) {
+        gov->busy = false;
+
+        if(probe->result != NULL) {
+            printf("Governor: switching to the smaller model %s\n", probe->result);
+            switch_model(gov, probe->result, true);
+        } else if(probe->unknown > 0) {
+            // The next one is checked when lowering the quality again
+            printf("Governor: no smaller %s model found yet, %u left to check, staying with %s\n",
+                   probe->language, probe->unknown, current_model(gov));
+        } else {
+            printf("Governor: no smaller %s model is installed, staying with %s\n", probe->language, current_model(gov));
+            gov->no_smaller_model = true;
+        }
+    }
+
+    g_object_unref(probe->cancellable);
+    g_ptr_array_free(probe->candidates, true);
+    g_free(probe->language);
+    g_free(probe->result);
+    g_free(probe);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void lower_to_smaller_model(struct asr_governor *gov) {
+    if(gov->original_model == NULL) {
+        AprilASRModel model = asr_thread_get_model(gov->app->asr);
+        if(model == NULL) return;
+
+        gov->original_model = g_settings_get_string(gov->app->settings, "active-model");
+        gov->language = g_strdup(aam_get_language(model));
+    }
+
+    GPtrArray *candidates = find_smaller_models(gov);
+    if(candidates->len == 0) {
+        printf("Governor: no smaller model is installed, staying with %s\n", current_model(gov));
+        gov->no_smaller_model = true;
+
+        g_ptr_array_free(candidates, true);
+        return;
+    }
+
+    struct model_probe *probe = g_new0(struct model_probe, 1);
+    probe->gov = gov;
+    probe->language = g_strdup(gov->language);
+    probe->candidates = candidates;
+
+    g_clear_object(&gov->cancellable);
+    gov->cancellable = g_cancellable_new();
+    probe->cancellable = g_object_ref(gov->cancellable);
+
+    gov->busy = true;
+    g_thread_unref(g_thread_new("lcap-governor", run_model_probe, probe));
+}
+
+static void on_model_loaded(GObject *target, const char *model_path, bool success, bool cancelled) {
+    struct asr_governor *gov = LIVECAPTIONS_APPLICATION(target)->governor;
+
+    // Another load replaced this one, e.g. the user picked a model. Unless
+    // the governor started something newer itself, it's idle again
+    if(cancelled) {
+        if((gov->cancellable == NULL) || g_cancellable_is_cancelled(gov->cancellable)) gov->busy = false;
+        return;
+    }
+
+    gov->busy = false;
+
+    if(!success) {
+        printf("Governor: loading %s failed, staying with %s\n", model_path, current_model(gov));
+        if(gov->lowering) gov->no_smaller_model = true;
+        return;
+    }
+
+    if(gov->lowering) {
+        g_ptr_array_add(gov->models, g_strdup(model_path));
+        set_level(gov, GOVERNOR_SMALLER_MODEL);
+    } else if(gov->models->len > 0) {
+        g_ptr_array_remove_index(gov->models, gov->models->len - 1);
+        gov->no_smaller_model = false;
+
+        if(gov->models->len == 0) {
+            // Back to the user's model, still without decoding silence
+            g_clear_pointer(&gov->original_model, g_free);
+            g_clear_pointer(&gov->language, g_free);
+            set_level(gov, GOVERNOR_SKIP_SILENCE);
+        }
+    }
+
+    // The audio threads capture at the model's rate
+    if(asr_thread_samplerate(gov->app->asr) != gov->rate_before)
+        livecaptions_application_restart_audio(gov->app);
+}
+
+
+static void lower_quality(struct asr_governor *gov, const struct asr_load *load) {
+    if(gov->level == GOVERNOR_FULL) {
+        printf("Governor: decoding is behind (speedup %.2f, %.0f%% CPU), skipping audio without speech\n",
+               load->speedup, load->cpu * 100.0);
+        set_level(gov, GOVERNOR_SKIP_SILENCE);
+    } else if(!gov->no_smaller_model) {
+        printf("Governor: decoding is still behind (speedup %.2f, %.0f%% CPU), looking for a smaller model\n",
+               load->speedup, load->cpu * 100.0);
+        lower_to_smaller_model(gov);
+    } else {
+        return;
+    }
+
+    // Raising it again was too much, wait longer next time
+    if((gov->last_raise != 0) && ((g_get_monotonic_time() - gov->last_raise) < GOVERNOR_FLAP_US))
+        gov->backoff = MIN(gov->backoff * 2, GOVERNOR_MAX_BACKOFF);
+}
+
+static void raise_quality(struct asr_governor *gov, const struct asr_load *load) {
+    gov->last_raise = g_get_monotonic_time();
+
+    if(gov->level == GOVERNOR_SMALLER_MODEL) {
+        printf("Governor: room to spare (%.0f%% CPU), going back to %s\n", load->cpu * 100.0, previous_model(gov));
+        switch_model(gov, previous_model(gov), false);
+    } else {
+        printf("Governor: room to spare (%.0f%% CPU), decoding all audio again\n", load->cpu * 100.0);
+        set_level(gov, GOVERNOR_FULL);
+        gov->no_smaller_model = false;
+    }
+}
+
+// Whether the next step up would fit. A larger model is assumed to cost
+// more in proportion to its size
+static bool has_headroom(struct asr_governor *gov, const struct asr_load *load) {
+    if(load->speedup > 1.0f) return false;
+    if(load->lag > GOVERNOR_HEADROOM_LAG_S) return false;
+
+    double cost = 1.0;
+    if(gov->level == GOVERNOR_SMALLER_MODEL) {
+        gint64 current = file_size(current_model(gov));
+        gint64 previous = file_size(previous_model(gov));
+
+        if((current > 0) && (previous > 0)) cost = (double)previous / (double)current;
+    }
+
+    return (load->cpu * cost) < GOVERNOR_HEADROOM_CPU;
+}
+
+static gboolean governor_tick(void *userdata) {
+    struct asr_governor *gov = userdata;
+
+    struct asr_load load;
+    asr_thread_get_load(gov->app->asr, &load);
+
+    bool lagging = (load.speedup > GOVERNOR_LAG_SPEEDUP) || (load.lag > GOVERNOR_LAG_S) ||
+                   (load.cant_keep_up != gov->last_cant_keep_up);
+    gov->last_cant_keep_up = load.cant_keep_up;
+
+    if(gov->busy) return G_SOURCE_CONTINUE;
+
+    if(lagging) {
+        gov->headroom_intervals = 0;
+
+        if(++gov->lag_intervals >= GOVERNOR_LAG_INTERVALS) {
+            gov->lag_intervals = 0;
+            lower_quality(gov, &load);
+        }
+    } else {
+        gov->lag_intervals = 0;
+
+        if((gov->level > GOVERNOR_FULL) && has_headroom(gov, &load)) {
+            if(++gov->headroom_intervals >= (GOVERNOR_HEADROOM_INTERVALS * gov->backoff)) {
+                gov->headroom_intervals = 0;
+                raise_quality(gov, &load);
+            }
+        } else {
+            gov->headroom_intervals = 0;
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void reset(struct asr_governor *gov) {
+    if(gov->cancellable != NULL) g_cancellable_cancel(gov->cancellable);
+    g_clear_object(&gov->cancellable);
+
+    gov->busy = false;
+    gov->no_smaller_model = false;
+    gov->lag_intervals = 0;
+    gov->headroom_intervals = 0;
+    gov->backoff = 1;
+    gov->last_raise = 0;
+
+    g_ptr_array_set_size(gov->models, 0);
+    g_clear_pointer(&gov->original_model, g_free);
+    g_clear_pointer(&gov->language, g_free);
+
+    set_level(gov, GOVERNOR_FULL);
+}
+
+struct asr_governor *asr_governor_new(LiveCaptionsApplication *app) {
+    struct asr_governor *gov = g_new0(struct asr_governor, 1);
+    gov->app = app;
+    gov->models = g_ptr_array_new_with_free_func(g_free);
+    gov->backoff = 1;
+
+    return gov;
+}
+
+void asr_governor_set_enabled(struct asr_governor *gov, bool enabled) {
+    if(gov->enabled == enabled) return;
+    gov->enabled = enabled;
+
+    if(enabled) {
+        struct asr_load load;
+        asr_thread_get_load(gov->app->asr, &load);
+        gov->last_cant_keep_up = load.cant_keep_up;
+
+        gov->timer = g_timeout_add_seconds(GOVERNOR_INTERVAL_S, governor_tick, gov);
+        return;
+    }
+
+    g_source_remove(gov->timer);
+    gov->timer = 0;
+
+    char *original = (gov->models->len > 0) ? g_strdup(gov->original_model) : NULL;
+    reset(gov);
+
+    if(original != NULL) {
+        printf("Governor: disabled, going back to %s\n", original);
+        switch_model(gov, original, false);
+        gov->busy = false;
+        g_free(original);
+    }
+}
+
+void asr_governor_model_changed(struct asr_governor *gov) {
+    if(gov->level != GOVERNOR_FULL) printf("Governor: the model was changed, starting over at full quality\n");
+    reset(gov);
+}
+
+char *asr_governor_describe(struct asr_governor *gov) {
+    if(!gov->enabled) return g_strdup("Adaptive quality: disabled\n");
+
+    switch(gov->level) {
+        case GOVERNOR_SKIP_SILENCE:
+            return g_strdup("Adaptive quality: skipping audio without speech\n");
+        case GOVERNOR_SMALLER_MODEL:
+            return g_strdup_printf("Adaptive quality: skipping audio without speech, using %s instead of %s\n",
+                                   current_model(gov), gov->original_model);
+        case GOVERNOR_FULL:
+        default:
+            return g_strdup("Adaptive quality: full\n");
+    }
+}
+
+void asr_governor_free(struct asr_governor *gov) {
+    if(gov->timer != 0) g_source_remove(gov->timer);
+    if(gov->cancellable != NULL) g_cancellable_cancel(gov->cancellable);
+    g_clear_object(&gov->cancellable);
+
+    g_ptr_array_free(gov->models, true);
+    g_free(gov->original_model);
+    g_free(gov->language);
+    g_free(gov);
+}
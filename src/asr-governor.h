@@ -0,0 +1,54 @@
+/* asr-governor.h
+ * Lowers the cost of decoding step by step while it can't keep up, and
+ * raises it again once there's room
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+struct _LiveCaptionsApplication;
+
+// Each step keeps the ones before it
+typedef enum GovernorLevel {
+    GOVERNOR_FULL = 0,
+
+    // Audio the voice activity detector rejects is not decoded
+    GOVERNOR_SKIP_SILENCE,
+
+    // A smaller installed model in the same language is used instead of
+    // the active one. Can go down more than one model
+    GOVERNOR_SMALLER_MODEL
+} GovernorLevel;
+
+struct asr_governor;
+
+// Starts disabled. Runs on the main thread
+struct asr_governor *asr_governor_new(struct _LiveCaptionsApplication *app);
+
+// Disabling it goes back to full quality
+void asr_governor_set_enabled(struct asr_governor *gov, bool enabled);
+
+// Call when the user picks another model, which becomes the one to return
+// to. Starts over from full quality
+void asr_governor_model_changed(struct asr_governor *gov);
+
+// A line on the current level, for diagnostics. Free with g_free
+char *asr_governor_describe(struct asr_governor *gov);
+
+void asr_governor_free(struct asr_governor *gov);
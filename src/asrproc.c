@@ -19,6 +19,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <math.h>
@@ -26,37 +27,332 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <glib.h>
 
 #include <stdbool.h>
 #include <april_api.h>
 
 #include "asrproc.h"
+#include "profanity-filter.h"
 #include "line-gen.h"
+#include "model-cache.h"
 #include "livecaptions-window.h"
 #include "history.h"
+#include "preprocess.h"
+#include "rt.h"
+#include "token-log.h"
 #include "common.h"
 
-struct asr_thread_i {
-    volatile size_t sound_counter;
-    size_t silence_counter;
+// Audio is preprocessed in a copy of at most this many samples at a time,
+// as the capture buffers can't be modified
+#define PREPROCESS_CHUNK 2048
 
-    GThread * thread_id;
+// Samples queued per source with the capture queue, 4 seconds at 16 kHz.
+// Must be a power of two
+#define CAPTURE_RING_SIZE 65536
+
+// How long the consumer waits before checking whether to stop
+#define CAPTURE_CONSUMER_POLL_MS 100
+
+// The main model and the parallel ones
+#define ASR_MAX_LANES (1 + ASR_MAX_PARALLEL_MODELS)
+
+// Voice activity detection for skipping audio without speech. Audio is
+// speech when it's this much above the noise floor, which falls to quieter
+// audio at once and rises this fast otherwise
+#define VAD_THRESHOLD_DB 9.0f
+#define VAD_FLOOR_RISE_DB_PER_S 2.0f
+#define VAD_MIN_SPEECH_DB -60.0f
+
+// Audio after speech that's still decoded, so word endings and short
+// pauses are not cut
+#define VAD_HANGOVER_MS 600
+
+// While idle, only every this many samples is looked at for sound
+#define IDLE_DECIMATION 4
+
+// Audio queued per lane with a backlog policy, on top of the limit, so
+// the limit is enforced before the ring fills up
+#define BACKLOG_MARGIN_MS 2000
+
+// Once the backlog is longer than this, the policy starts catching up. The
+// oldest audio is dropped down to this length when over the limit
+#define BACKLOG_CATCHUP_MS 1000
+
+// Decoded at a time from the backlog
+#define BACKLOG_BLOCK 1600
+
+// Single producer, single consumer ring of samples, for the capture queue
+// and the backlogs. The positions only ever increase and wrap around as
+// unsigned integers
+struct sample_ring {
+    short *samples;
+
+    // Power of two
+    guint size;
+
+    // Written only by the producer
+    gint write_pos;
+
+    // Written only by the consumer
+    gint read_pos;
+
+    // Writes whose audio didn't fit
+    gint overflows;
+};
+
+static bool ring_write(struct sample_ring *ring, const short *data, size_t count) {
+    guint write_pos = (guint)ring->write_pos;
+    guint read_pos = (guint)g_atomic_int_get(&ring->read_pos);
+
+    if(count > ring->size - (write_pos - read_pos)) return false;
+
+    size_t start = write_pos & (ring->size - 1);
+    size_t first = MIN(count, ring->size - start);
+
+    memcpy(&ring->samples[start], data, first * sizeof(short));
+    memcpy(ring->samples, &data[first], (count - first) * sizeof(short));
+
+    g_atomic_int_set(&ring->write_pos, (gint)(write_pos + count));
+    return true;
+}
+
+static size_t ring_read(struct sample_ring *ring, short *out, size_t max) {
+    guint read_pos = (guint)ring->read_pos;
+    guint write_pos = (guint)g_atomic_int_get(&ring->write_pos);
+
+    size_t count = MIN(write_pos - read_pos, max);
+    if(count == 0) return 0;
+
+    size_t start = read_pos & (ring->size - 1);
+    size_t first = MIN(count, ring->size - start);
+
+    memcpy(out, &ring->samples[start], first * sizeof(short));
+    memcpy(&out[first], ring->samples, (count - first) * sizeof(short));
+
+    g_atomic_int_set(&ring->read_pos, (gint)(read_pos + count));
+    return count;
+}
+
+// Samples queued. Exact from the consumer, a snapshot from other threads
+static size_t ring_fill(struct sample_ring *ring) {
+    return (guint)g_atomic_int_get(&ring->write_pos) - (guint)g_atomic_int_get(&ring->read_pos);
+}
+
+// Only from the consumer
+static void ring_skip(struct sample_ring *ring, size_t count) {
+    g_atomic_int_set(&ring->read_pos, (gint)((guint)ring->read_pos + count));
+}
+
+// Energy based voice activity detection, only used from the thread feeding
+// the source, or the lane's decoder with a backlog
+struct vad {
+    float floor_db;
+    bool have_floor;
+
+    // Samples left to decode after the last speech
+    size_t hangover;
+
+    // Audio is being skipped, the sessions were flushed when it started
+    bool skipping;
+};
+
+struct asr_stream;
+
+// One model decoding a source. Lane 0 uses the main model, the others the
+// parallel models. Every utterance is decoded by all of them, and the
+// result of the most confident one is kept
+struct asr_lane {
+    struct asr_stream *stream;
+
+    AprilASRSession session;
+
+    // Copied from the model, so they outlive it
+    char language[HISTORY_LANGUAGE_MAX_CHARS];
+    char model_name[64];
+    gint sample_rate;
+
+    // AprilToken of the latest result in the current utterance, final if
+    // done is set. The token text belongs to the model
+    GArray *tokens;
+    bool done;
+
+    // The last result was silence
+    bool silent;
+
+    // Still in an utterance that was already decided without it, its
+    // results are ignored until that ends
+    bool stale;
+
+    // Utterances where this lane's result was kept
+    int wins;
+
+    // For the CPU use. Asynchronous sessions decode on their own thread,
+    // whose clock is taken from the first result. Otherwise the time spent
+    // feeding is added up
+    gint64 created;
+    clockid_t cpu_clock;
+    bool cpu_clock_valid;
+    gint64 cpu_ns;
+
+    // At the previous asr_thread_get_load
+    gint64 load_cpu_ns;
+    gint64 load_time;
+
+    // With a backlog policy, the audio of a lane with a session queues
+    // here and its own thread decodes it with a synchronous session. The
+    // thread is started and stopped along with the session, and only
+    // wakes for audio or to stop
+    struct sample_ring backlog;
+    GThread *decoder;
+    int decoder_wakeup;
+    gint decoder_stop;
+
+    // A flush requested while the backlog is on, to happen once the
+    // decoder has read up to this write position, so it lands in order
+    // and only the decoder uses the session
+    GMutex flush_mutex;
+    guint flush_pos;
+    gint flush_pending;
+
+    // Only used by the decoder
+    struct vad backlog_vad;
+    size_t silence_run;
+
+    // Samples the backlog policy didn't decode
+    gint64 dropped_samples;
+    gint64 skipped_samples;
+};
+
+// One capture source, with its own sessions on the shared models. Each
+// session decodes on its own aprilasr thread, so the sources and models
+// are processed in parallel
+struct asr_stream {
+    asr_thread thread;
+    CaptionSource source;
+
+    bool enabled;
+    struct asr_lane lanes[ASR_MAX_LANES];
+
+    // Language of the last tag put in the captions
+    char tag_language[HISTORY_LANGUAGE_MAX_CHARS];
+
+    // Every session is silent and the captions were broken for it
+    bool in_silence;
+
+    size_t sound_counter;
+    size_t silence_counter;
 
     struct line_generator line;
+    size_t layout_counter;
+
+    // When the current (or last) utterance started, to order the sources
+    // in the window
+    gint64 utterance_start;
+    bool in_utterance;
+
+    // Only used from the thread feeding this source to the session, which
+    // is the capture thread or the capture queue's consumer. Created on the
+    // first audio after the model's sample rate changes
+    struct preprocessor *preprocessor;
+    unsigned int preprocessor_rate;
+    short preprocess_buffer[PREPROCESS_CHUNK];
+
+    struct sample_ring ring;
+
+    struct vad vad;
+
+    // Samples not decoded for not containing speech
+    gint64 skipped_samples;
+
+    // PowerState. The thread feeding the source moves between active and
+    // idle, the main thread in and out of suspended
+    gint power_state;
+
+    // Samples since the VAD last heard speech, and the peak level that
+    // ends idling. Only used by the thread feeding the source
+    size_t quiet_samples;
+    int wake_level;
+
+    // Time spent in each state, up to power_since. Guarded by power_mutex
+    gint64 power_since;
+    gint64 power_time_us[POWER_STATE_COUNT];
+
+    // Feeds in progress. A replaced session is only freed once this drops
+    // to zero, as feeding doesn't take a lock
+    gint feeding;
+};
+
+struct asr_thread_i {
+    GThread * thread_id;
 
     GMutex text_mutex;
     char text_buffer[32768];
 
     AprilASRModel model;
-    AprilASRSession session;
+    struct asr_stream streams[CAPTION_SOURCE_COUNT];
 
-    LiveCaptionsWindow *window;
+    // Run alongside the main model, NULL for unused lanes
+    AprilASRModel parallel_models[ASR_MAX_PARALLEL_MODELS];
 
-    size_t layout_counter;
+    // Only the latest call to asr_thread_set_parallel_models is applied
+    guint parallel_generation;
+
+    // Of the current model, read while feeding
+    gint sample_rate;
+
+    // The model being loaded in the background, if any
+    struct model_load *current_load;
+
+    LiveCaptionsWindow *window;
 
     volatile bool pause;
 
+    // Realtime sessions decode asynchronously and drop audio to keep up.
+    // Otherwise audio is decoded synchronously as it is fed, for input
+    // that is read as fast as possible
+    bool realtime;
+
+    // PreprocessStage bitmask, may be changed while capturing
+    gint preprocess_stages;
+
+    // Audio without speech is not decoded
+    gint skip_silence;
+
+    // Silence before a source goes idle, 0 to never
+    gint idle_timeout_ms;
+    GMutex power_mutex;
+
+    // APRIL_RESULT_ERROR_CANT_KEEP_UP results so far
+    gint cant_keep_up;
+
+    // BacklogPolicy, BACKLOG_OFF unless realtime. The decoders read the
+    // limits while running
+    gint backlog_policy;
+    gint backlog_max_ms;
+    gint backlog_squash_ms;
+
+    // Lanes get a decoder along with their session. Only changed with
+    // text_mutex held
+    bool decoders_running;
+
+    // How many backlog decoders may decode at once, 0 for no limit
+    gint decoder_threads;
+    GMutex decode_slots_mutex;
+    GCond decode_slots_cond;
+    int decode_slots_used;
+
+    // With the capture queue, capture callbacks only push into the rings
+    // and this thread feeds the sessions
+    gint capture_queue;
+    GThread *consumer;
+    gint consumer_stop;
+    int consumer_wakeup;
+
     bool errored;
 };
 
@@ -73,20 +369,232 @@ static void *run_asr_thread(void *userdata) {
     return NULL;
 }
 
+// Sources are only tagged when more than one is being captioned
+static bool is_multi_source(asr_thread data) {
+    size_t enabled = 0;
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(data->streams[i].enabled) enabled++;
+    }
+
+    return enabled > 1;
+}
+
+static char *format_source_tag(CaptionSource source) {
+    return g_markup_printf_escaped("<b>%s:</b> ", caption_source_name(source));
+}
+
+// Shows the latest line of every source, the most recently started
+// utterance last
+static void set_multi_source_text(asr_thread data) {
+    struct asr_stream *order[CAPTION_SOURCE_COUNT];
+    size_t count = 0;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(!data->streams[i].enabled) continue;
+
+        struct asr_stream *stream = &data->streams[i];
+
+        size_t j = count++;
+        while((j > 0) && (order[j - 1]->utterance_start > stream->utterance_start)) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = stream;
+    }
+
+    GString *text = g_string_sized_new(AC_LINE_MAX * AC_LINE_COUNT);
+    for(size_t i=0; i<count; i++){
+        char *tag = format_source_tag(order[i]->source);
+
+        if(i != 0) g_string_append_c(text, '\n');
+        g_string_append(text, tag);
+        g_string_append(text, line_generator_get_last_line(&order[i]->line));
+
+        g_free(tag);
+    }
+
+    gtk_label_set_markup(data->window->label, text->str);
+    g_string_free(text, true);
+}
+
 static gboolean main_thread_update_label(void *userdata){
     asr_thread data = userdata;
 
     if((data->window == NULL) || (data->pause)) return G_SOURCE_REMOVE;
 
     g_mutex_lock(&data->text_mutex);
-    line_generator_set_text(&data->line, data->window->label);
+    if(is_multi_source(data)) {
+        set_multi_source_text(data);
+    } else {
+        for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+            if(data->streams[i].enabled) line_generator_set_text(&data->streams[i].line, data->window->label);
+        }
+    }
     g_mutex_unlock(&data->text_mutex);
 
     return G_SOURCE_REMOVE;
 }
 
+// Called with text_mutex held
+static void update_layout(struct asr_stream *stream) {
+    LiveCaptionsWindow *window = stream->thread->window;
+
+    if((stream->layout_counter == window->font_layout_counter) && (stream->line.layout != NULL)) return;
+
+    if(stream->line.layout != NULL) g_object_unref(stream->line.layout);
+
+    stream->line.layout = pango_layout_copy(window->font_layout);
+    stream->line.max_text_width = window->max_text_width;
+
+    // The tag is on the same line, so leave room for it
+    if(is_multi_source(stream->thread)) {
+        char *tag = format_source_tag(stream->source);
+
+        int width, height;
+        pango_layout_set_width(stream->line.layout, -1);
+        pango_layout_set_markup(stream->line.layout, tag, -1);
+        pango_layout_get_size(stream->line.layout, &width, &height);
+
+        stream->line.max_text_width -= width / PANGO_SCALE;
+
+        g_free(tag);
+    }
+
+    stream->layout_counter = window->font_layout_counter;
+}
+
+// Mean token logprob of the lane's latest result, which decides between
+// the models
+static float lane_score(const struct asr_lane *lane) {
+    const AprilToken *tokens = (const AprilToken *)lane->tokens->data;
+
+    float sum = 0.0f;
+    for(size_t i=0; i<lane->tokens->len; i++) sum += tokens[i].logprob;
+
+    return sum / (float)lane->tokens->len;
+}
+
+// Called with text_mutex held. Whether the lane's session gets the audio,
+// a parallel model of another rate than the main one is left unfed
+static bool lane_decodes(struct asr_lane *lane) {
+    return (lane->session != NULL) &&
+           (g_atomic_int_get(&lane->sample_rate) == g_atomic_int_get(&lane->stream->thread->sample_rate));
+}
+
+// Called with text_mutex held. The most confident lane with any tokens,
+// or NULL
+static struct asr_lane *leading_lane(struct asr_stream *stream) {
+    struct asr_lane *leader = NULL;
+    float best = 0.0f;
+
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
+        if(!lane_decodes(lane) || (lane->tokens->len == 0)) continue;
+
+        float score = lane_score(lane);
+        if((leader == NULL) || (score > best)) {
+            leader = lane;
+            best = score;
+        }
+    }
+
+    return leader;
+}
+
+// Called with text_mutex held. Whether every lane has a final result for
+// the current utterance, or went silent without any
+static bool all_lanes_done(struct asr_stream *stream) {
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
+        if(!lane_decodes(lane)) continue;
+
+        if(!lane->done && !(lane->silent && (lane->tokens->len == 0))) return false;
+    }
+
+    return true;
+}
+
+static bool all_lanes_silent(struct asr_stream *stream) {
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
+        if(lane_decodes(lane) && !lane->silent) return false;
+    }
+
+    return true;
+}
+
+// Captions are only tagged with their language when the models differ
+static bool is_multilingual(struct asr_stream *stream) {
+    const char *first = NULL;
+
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
+        if(!lane_decodes(lane)) continue;
+
+        if(first == NULL) first = lane->language;
+        else if(strcmp(first, lane->language) != 0) return true;
+    }
+
+    return false;
+}
+
+static void reset_lane(struct asr_lane *lane) {
+    g_array_set_size(lane->tokens, 0);
+    lane->done = false;
+    lane->silent = false;
+    lane->stale = false;
+}
+
+// Called with text_mutex held
+static void show_lane(struct asr_stream *stream, struct asr_lane *lane) {
+    line_generator_set_language(&stream->line, lane->language);
+    line_generator_update(&stream->line, lane->tokens->len, (const AprilToken *)lane->tokens->data);
+}
+
+// Called with text_mutex held. Keeps the most confident result for the
+// utterance and starts the next one. Lanes still in the middle of it have
+// the rest of theirs ignored
+static void decide_utterance(struct asr_stream *stream) {
+    struct asr_lane *winner = leading_lane(stream);
+
+    if(winner != NULL) {
+        if(is_multilingual(stream) && (strcmp(stream->tag_language, winner->language) != 0)) {
+            char *tag = g_markup_printf_escaped("<b>[%s]</b> ", winner->language);
+            line_generator_add_tag(&stream->line, tag);
+            g_free(tag);
+
+            g_strlcpy(stream->tag_language, winner->language, HISTORY_LANGUAGE_MAX_CHARS);
+        }
+
+        show_lane(stream, winner);
+        line_generator_finalize(&stream->line);
+        commit_tokens_to_current_history(stream->source, winner->language,
+                                         (const AprilToken *)winner->tokens->data, winner->tokens->len);
+        winner->wins++;
+    }
+
+    stream->in_utterance = false;
+
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
+
+        lane->stale = lane_decodes(lane) && !lane->done && (lane->tokens->len > 0);
+        lane->done = false;
+        g_array_set_size(lane->tokens, 0);
+    }
+}
+
 static void april_result_handler(void* userdata, AprilResultType result, size_t count, const AprilToken* tokens) {
-    asr_thread data = userdata;
+    struct asr_lane *lane = userdata;
+    struct asr_stream *stream = lane->stream;
+    asr_thread data = stream->thread;
+
+    // Asynchronous sessions decode on a thread aprilasr creates, this is
+    // the first chance to place it
+    rt_place_current_thread();
+
+    token_log_result(stream->source, lane - stream->lanes, lane->language, result, count, tokens);
+
     if((data->window == NULL) || (data->pause)) return;
 
     switch(result) {
@@ -95,19 +603,41 @@ static void april_result_handler(void* userdata, AprilResultType result, size_t
         {
             g_mutex_lock(&data->text_mutex);
 
-            if((data->layout_counter != data->window->font_layout_counter) || (data->line.layout == NULL)) {
-                if(data->line.layout != NULL) g_object_unref(data->line.layout);
+            // Asynchronous sessions and the backlog decoders call this from
+            // the thread that decodes the lane
+            if(data->realtime && !lane->cpu_clock_valid)
+                lane->cpu_clock_valid = pthread_getcpuclockid(pthread_self(), &lane->cpu_clock) == 0;
 
-                data->line.layout = pango_layout_copy(data->window->font_layout);
-                data->line.max_text_width = data->window->max_text_width;
+            lane->silent = false;
+            stream->in_silence = false;
 
-                data->layout_counter = data->window->font_layout_counter;
+            if(lane->stale) {
+                if(result == APRIL_RESULT_RECOGNITION_FINAL) lane->stale = false;
+
+                g_mutex_unlock(&data->text_mutex);
+                break;
+            }
+
+            update_layout(stream);
+
+            if(!stream->in_utterance) {
+                stream->utterance_start = g_get_monotonic_time();
+                stream->in_utterance = true;
             }
 
-            line_generator_update(&data->line, count, tokens);
-            if(result == APRIL_RESULT_RECOGNITION_FINAL) {
-                line_generator_finalize(&data->line);
-                commit_tokens_to_current_history(tokens, count);
+            // This lane went on to the next utterance before the others
+            // finished the previous one
+            if(lane->done) decide_utterance(stream);
+
+            g_array_set_size(lane->tokens, count);
+            memcpy(lane->tokens->data, tokens, count * sizeof(AprilToken));
+            lane->done = (result == APRIL_RESULT_RECOGNITION_FINAL);
+
+            if(all_lanes_done(stream)) {
+                decide_utterance(stream);
+            } else {
+                struct asr_lane *leader = leading_lane(stream);
+                if(leader != NULL) show_lane(stream, leader);
             }
 
             g_mutex_unlock(&data->text_mutex);
@@ -116,6 +646,7 @@ static void april_result_handler(void* userdata, AprilResultType result, size_t
         }
 
         case APRIL_RESULT_ERROR_CANT_KEEP_UP: {
+            g_atomic_int_inc(&data->cant_keep_up);
             livecaptions_window_warn_slow(data->window);
             break;
         }
@@ -123,8 +654,21 @@ static void april_result_handler(void* userdata, AprilResultType result, size_t
         case APRIL_RESULT_SILENCE: {
             g_mutex_lock(&data->text_mutex);
 
-            line_generator_break(&data->line);
-            save_silence_to_history();
+            lane->stale = false;
+            lane->silent = true;
+            if(lane->tokens->len > 0) lane->done = true;
+
+            if(all_lanes_done(stream)) decide_utterance(stream);
+
+            if(all_lanes_silent(stream) && !stream->in_silence) {
+                line_generator_break(&stream->line);
+                save_silence_to_history(stream->source);
+                stream->in_utterance = false;
+                stream->in_silence = true;
+
+                // Lines after a pause start with a tag again
+                stream->tag_language[0] = '\0';
+            }
 
             g_mutex_unlock(&data->text_mutex);
             g_idle_add(main_thread_update_label, data);
@@ -133,164 +677,1626 @@ static void april_result_handler(void* userdata, AprilResultType result, size_t
     }
 }
 
-void asr_thread_enqueue_audio(asr_thread thread, short *data, size_t num_shorts) {
-    if((thread->window == NULL) || thread->pause) return;
-    if((thread->session == NULL) || (thread->model == NULL)) return;
+// Every lane decodes on its own thread, except for non-realtime sessions
+// which decode here, one after the other
+static void feed_lanes(asr_thread thread, struct asr_stream *stream, short *data, size_t num_shorts) {
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
 
+        AprilASRSession session = g_atomic_pointer_get(&lane->session);
+        if(session == NULL) continue;
 
-    bool found_nonzero = false;
-    for(size_t i=0; i<num_shorts; i++){
-        if((data[i] > 16) || (data[i] < -16)){
-            found_nonzero = true;
-            break;
+        // A parallel model left behind by a main model of another rate
+        if(g_atomic_int_get(&lane->sample_rate) != g_atomic_int_get(&thread->sample_rate)) continue;
+
+        if(g_atomic_int_get(&thread->backlog_policy) != BACKLOG_OFF) {
+            if(!ring_write(&lane->backlog, data, num_shorts))
+                g_atomic_int_inc(&lane->backlog.overflows);
+
+            guint64 one = 1;
+            if(write(lane->decoder_wakeup, &one, sizeof(one)) < 0) {
+                // The counter is full, so the decoder is being woken anyway
+            }
+            continue;
+        }
+
+        if(thread->realtime) {
+            aas_feed_pcm16(session, data, num_shorts); // TODO?
+            continue;
         }
-    }
 
-    thread->silence_counter = found_nonzero ? 0 : (thread->silence_counter + num_shorts);
+        struct timespec start, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        aas_feed_pcm16(session, data, num_shorts);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
 
-    if(thread->silence_counter >= 24000){
-        thread->silence_counter = 24000;
-        return aas_flush(thread->session);
+        lane->cpu_ns += (gint64)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
     }
-    
-    thread->sound_counter += num_shorts;
-    aas_feed_pcm16(thread->session, data, num_shorts); // TODO?
 }
 
-gpointer asr_thread_get_model(asr_thread thread) {
-    return thread->model;
-}
+// Counted as feeding, as it may be called from outside the capture path
+static void flush_lanes(struct asr_stream *stream) {
+    asr_thread thread = stream->thread;
 
-gpointer asr_thread_get_session(asr_thread thread) {
-    return thread->session;
-}
+    g_atomic_int_inc(&stream->feeding);
 
-void asr_thread_pause(asr_thread thread, bool pause) {
-    thread->pause = pause;
-}
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
 
-int asr_thread_samplerate(asr_thread thread) {
-    return aam_get_sample_rate(thread->model);
-}
+        AprilASRSession session = g_atomic_pointer_get(&lane->session);
+        if(session == NULL) continue;
 
-asr_thread create_asr_thread(const char *model_path){
-    asr_thread data = calloc(1, sizeof(struct asr_thread_i));
+        if(g_atomic_int_get(&thread->backlog_policy) == BACKLOG_OFF) {
+            aas_flush(session);
+            continue;
+        }
 
-    line_generator_init(&data->line);
+        // After the audio that is already queued
+        g_mutex_lock(&lane->flush_mutex);
+        lane->flush_pos = (guint)g_atomic_int_get(&lane->backlog.write_pos);
+        g_atomic_int_set(&lane->flush_pending, 1);
+        g_mutex_unlock(&lane->flush_mutex);
 
-    if(!asr_thread_update_model(data, model_path)){
-        char *model_default = GET_MODEL_PATH();
-        if(!asr_thread_update_model(data, model_default)) {
-            return NULL;
+        guint64 one = 1;
+        if(write(lane->decoder_wakeup, &one, sizeof(one)) < 0) {
+            // The counter is full, so the decoder is being woken anyway
         }
-
-        GSettings *settings = g_settings_new("net.sapples.LiveCaptions");
-        g_settings_set_string(settings, "active-model", model_default);
-        g_object_unref(G_OBJECT(settings));
     }
 
-    g_mutex_init(&data->text_mutex);
+    g_atomic_int_dec_and_test(&stream->feeding);
+}
 
-    data->thread_id = g_thread_new("lcap-audiothread", run_asr_thread, data);
+// Whether the audio may contain speech
+static bool vad_update(struct vad *vad, unsigned int rate, const short *data, size_t num_shorts) {
+    if(num_shorts == 0) return false;
 
-    return data;
-}
+    double sum = 0.0;
+    for(size_t i=0; i<num_shorts; i++) sum += (double)data[i] * (double)data[i];
 
-bool asr_thread_update_model(asr_thread data, const char *model_path) {
-    // Freeing model frees token list, which may be being accessed during
-    // line generation
-    g_mutex_lock(&data->text_mutex);
+    float level_db = 10.0f * log10f((float)(sum / (double)num_shorts) / (32768.0f * 32768.0f) + 1e-12f);
 
-    data->pause = true;
+    if(!vad->have_floor || (level_db < vad->floor_db)) {
+        vad->floor_db = level_db;
+        vad->have_floor = true;
+    } else {
+        vad->floor_db += VAD_FLOOR_RISE_DB_PER_S * (float)num_shorts / (float)rate;
+    }
 
-    AprilASRModel old_model = data->model;
-    AprilASRSession old_session = data->session;
+    if((level_db > vad->floor_db + VAD_THRESHOLD_DB) && (level_db > VAD_MIN_SPEECH_DB)) {
+        vad->hangover = (size_t)rate * VAD_HANGOVER_MS / 1000;
+        return true;
+    }
 
-    data->model = NULL;
-    data->session = NULL;
+    if(vad->hangover == 0) return false;
 
-    if(old_session != NULL)
-        aas_free(old_session);
+    vad->hangover = (vad->hangover > num_shorts) ? (vad->hangover - num_shorts) : 0;
+    return true;
+}
 
-    if(old_model != NULL)
-        aam_free(old_model);
+static const char *power_state_name(PowerState state) {
+    switch(state) {
+        case POWER_ACTIVE: return "active";
+        case POWER_IDLE: return "idle";
+        case POWER_SUSPENDED: return "suspended";
+        default: return "?";
+    }
+}
 
+// Returns false if the stream wasn't in the state from, unless it's -1
+static bool set_power_state(struct asr_stream *stream, int from, PowerState to) {
+    asr_thread data = stream->thread;
 
-    AprilConfig config = {
-        .handler = april_result_handler,
-        .flags = APRIL_CONFIG_FLAG_ASYNC_RT_BIT,
-        .userdata = data
-    };
+    g_mutex_lock(&data->power_mutex);
 
-    AprilASRModel new_model = aam_create_model(model_path);
-    if(new_model == NULL) {
-        printf("Loading model %s failed!\n", model_path);
-        data->errored = true;
-        g_mutex_unlock(&data->text_mutex);
-        return false;
-    }
+    PowerState current = g_atomic_int_get(&stream->power_state);
+    bool changed = ((from == -1) || (current == (PowerState)from)) && (current != to);
 
-    {
-        printf("\n-- Model metadata --\n");
-        printf("Name: %s\n", aam_get_name(new_model));
-        char *description = (char*)aam_get_description(new_model);
-        for(int i=0; description[i]; i++){
-            if((description[i] == ' ') && (description[i+1] == 'D') && (description[i+2] == 'i')){
-                description[i] = 0;
-                break;
-            }
-        }
-        printf("Description: %s\n", description);
-        printf("Language: %s\n", aam_get_language(new_model));
-        printf("-- --\n\n");
+    if(changed) {
+        gint64 now = g_get_monotonic_time();
+        stream->power_time_us[current] += now - stream->power_since;
+        stream->power_since = now;
+
+        g_atomic_int_set(&stream->power_state, to);
     }
 
-    line_generator_set_language(&data->line, aam_get_language(new_model));
+    g_mutex_unlock(&data->power_mutex);
 
-    AprilASRSession new_session = aas_create_session(new_model, config);
-    if(new_session == NULL) {
-        printf("Creating session %s failed!\n", model_path);
-        data->errored = true;
-        g_mutex_unlock(&data->text_mutex);
-        return false;
-    }
+    return changed;
+}
 
-    data->model = new_model;
-    data->session = new_session;
+// Goes idle after enough audio without speech
+static void update_quiet(asr_thread thread, struct asr_stream *stream, bool speech, size_t num_shorts, unsigned int rate) {
+    stream->quiet_samples = speech ? 0 : (stream->quiet_samples + num_shorts);
 
-    data->errored = false;
-    data->pause = false;
+    int timeout_ms = g_atomic_int_get(&thread->idle_timeout_ms);
+    if((timeout_ms == 0) || (stream->quiet_samples < (size_t)timeout_ms * rate / 1000)) return;
 
-    line_generator_finalize(&data->line);
+    // Anything the VAD could take for speech wakes it up. The digital
+    // silence of a muted microphone never does
+    float wake_db = stream->vad.have_floor ? (stream->vad.floor_db + VAD_THRESHOLD_DB) : VAD_MIN_SPEECH_DB;
+    wake_db = MAX(wake_db, VAD_MIN_SPEECH_DB);
+    stream->wake_level = (int)(32768.0f * powf(10.0f, wake_db / 20.0f));
 
-    g_mutex_unlock(&data->text_mutex);
+    if(!set_power_state(stream, POWER_ACTIVE, POWER_IDLE)) return;
 
-    return true;
-}
+    flush_lanes(stream);
 
-bool asr_thread_is_errored(asr_thread thread) {
-    return thread->errored;
+    printf("%s: no speech for %d s, idling until there's sound\n",
+           caption_source_name(stream->source), timeout_ms / 1000);
 }
 
-void asr_thread_set_main_window(asr_thread thread, LiveCaptionsWindow *window) {
-    thread->window = window;
-}
+// All there is to do while idle. Returns true if the audio should be
+// decoded again, starting with this chunk
+static bool idle_wakes(struct asr_stream *stream, const short *data, size_t num_shorts) {
+    int peak = 0;
+    for(size_t i=0; i<num_shorts; i+=IDLE_DECIMATION) peak = MAX(peak, ABS((int)data[i]));
 
-void asr_thread_flush(asr_thread thread) {
-    if(thread->session == NULL) return;
-    aas_flush(thread->session);
-}
+    if(peak < stream->wake_level) return false;
+    if(!set_power_state(stream, POWER_IDLE, POWER_ACTIVE)) return false;
 
-void free_asr_thread(asr_thread thread) {
-    g_mutex_lock(&thread->text_mutex);
+    stream->quiet_samples = 0;
+
+    printf("%s: sound again, decoding\n", caption_source_name(stream->source));
+    return true;
+}
+
+static void feed_session(asr_thread thread, struct asr_stream *stream, short *data, size_t num_shorts) {
+    unsigned int rate = g_atomic_int_get(&thread->sample_rate);
+    if(rate == 0) return;
+
+
+    bool found_nonzero = false;
+    for(size_t i=0; i<num_shorts; i++){
+        if((data[i] > 16) || (data[i] < -16)){
+            found_nonzero = true;
+            break;
+        }
+    }
+
+    stream->silence_counter = found_nonzero ? 0 : (stream->silence_counter + num_shorts);
+
+    if(stream->silence_counter >= 24000){
+        stream->silence_counter = 24000;
+        update_quiet(thread, stream, false, num_shorts, rate);
+        return flush_lanes(stream);
+    }
+    
+    stream->sound_counter += num_shorts;
+
+    // Kept up to date while not skipping, so it's ready when needed
+    bool speech = vad_update(&stream->vad, rate, data, num_shorts);
+
+    update_quiet(thread, stream, speech, num_shorts, rate);
+    if(g_atomic_int_get(&stream->power_state) != POWER_ACTIVE) return;
+
+    if(g_atomic_int_get(&thread->skip_silence) && !speech) {
+        // The decoder won't hear the pause, so finish the utterance now
+        if(!stream->vad.skipping) flush_lanes(stream);
+
+        stream->vad.skipping = true;
+        stream->skipped_samples += num_shorts;
+        return;
+    }
+
+    stream->vad.skipping = false;
+
+    unsigned int stages = g_atomic_int_get(&thread->preprocess_stages);
+    if(stages == 0) {
+        feed_lanes(thread, stream, data, num_shorts);
+        return;
+    }
+
+    if((stream->preprocessor == NULL) || (stream->preprocessor_rate != rate)) {
+        if(stream->preprocessor != NULL) preprocessor_free(stream->preprocessor);
+
+        stream->preprocessor = preprocessor_new(rate);
+        stream->preprocessor_rate = rate;
+    }
+
+    for(size_t i=0; i<num_shorts; i+=PREPROCESS_CHUNK){
+        size_t count = MIN(num_shorts - i, PREPROCESS_CHUNK);
+
+        memcpy(stream->preprocess_buffer, &data[i], count * sizeof(short));
+        preprocessor_process(stream->preprocessor, stream->preprocess_buffer, count, stages);
+
+        feed_lanes(thread, stream, stream->preprocess_buffer, count);
+    }
+}
+
+static void feed_stream(asr_thread thread, struct asr_stream *stream, short *data, size_t num_shorts) {
+    if((thread->window == NULL) || thread->pause) return;
+
+    // Counted before reading the session, so whoever replaces it sees this
+    // feed and waits for it. The same goes for suspending
+    g_atomic_int_inc(&stream->feeding);
+
+    PowerState power = g_atomic_int_get(&stream->power_state);
+    if((power == POWER_SUSPENDED) || ((power == POWER_IDLE) && !idle_wakes(stream, data, num_shorts))) {
+        g_atomic_int_dec_and_test(&stream->feeding);
+        return;
+    }
+
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        if(g_atomic_pointer_get(&stream->lanes[i].session) != NULL) {
+            feed_session(thread, stream, data, num_shorts);
+            break;
+        }
+    }
+
+    g_atomic_int_dec_and_test(&stream->feeding);
+}
+
+// Call after replacing sessions and before freeing the old ones
+static void wait_for_feeders(asr_thread thread) {
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        while(g_atomic_int_get(&thread->streams[i].feeding) > 0) g_usleep(100);
+    }
+}
+
+void asr_thread_enqueue_audio(asr_thread thread, CaptionSource source, short *data, size_t num_shorts) {
+    struct asr_stream *stream = &thread->streams[source];
+
+    if(!g_atomic_int_get(&thread->capture_queue)) {
+        feed_stream(thread, stream, data, num_shorts);
+        return;
+    }
+
+    // Realtime safe, no locks or allocations
+    if(!ring_write(&stream->ring, data, num_shorts))
+        g_atomic_int_inc(&stream->ring.overflows);
+
+    guint64 one = 1;
+    if(write(thread->consumer_wakeup, &one, sizeof(one)) < 0) {
+        // The counter is full, so the consumer is being woken anyway
+    }
+}
+
+static void *run_capture_consumer(void *userdata) {
+    asr_thread data = userdata;
+
+    rt_make_current_thread_realtime("capture queue", RT_PRIORITY_CONSUMER);
+
+    short block[PREPROCESS_CHUNK];
+    gint reported_overflows[CAPTION_SOURCE_COUNT] = { 0 };
+
+    struct pollfd pfd = { .fd = data->consumer_wakeup, .events = POLLIN };
+
+    while(!g_atomic_int_get(&data->consumer_stop)) {
+        if(poll(&pfd, 1, CAPTURE_CONSUMER_POLL_MS) > 0) {
+            guint64 count;
+            if(read(data->consumer_wakeup, &count, sizeof(count)) < 0) {
+                // Already cleared, nothing to do
+            }
+        }
+
+        for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+            struct asr_stream *stream = &data->streams[i];
+
+            size_t count;
+            while((count = ring_read(&stream->ring, block, PREPROCESS_CHUNK)) > 0)
+                feed_stream(data, stream, block, count);
+
+            gint overflows = g_atomic_int_get(&stream->ring.overflows);
+            if(overflows != reported_overflows[i]) {
+                printf("Capture queue for %s overflowed, %d callbacks dropped\n",
+                       caption_source_name((CaptionSource)i), overflows - reported_overflows[i]);
+                reported_overflows[i] = overflows;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void asr_thread_set_capture_queue(asr_thread thread, bool enable) {
+    if((thread->consumer != NULL) == enable) return;
+
+    if(enable) {
+        thread->consumer_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(thread->consumer_wakeup < 0) {
+            printf("Can't create the capture queue: %s\n", strerror(errno));
+            return;
+        }
+
+        for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+            struct sample_ring *ring = &thread->streams[i].ring;
+            ring->samples = calloc(CAPTURE_RING_SIZE, sizeof(short));
+            ring->size = CAPTURE_RING_SIZE;
+            ring->write_pos = 0;
+            ring->read_pos = 0;
+            ring->overflows = 0;
+
+            rt_lock_memory(ring->samples, CAPTURE_RING_SIZE * sizeof(short));
+        }
+
+        // The preprocessing buffers are touched by the consumer
+        rt_lock_memory(thread, sizeof(struct asr_thread_i));
+
+        g_atomic_int_set(&thread->consumer_stop, 0);
+        thread->consumer = g_thread_new("lcap-capqueue", run_capture_consumer, thread);
+
+        g_atomic_int_set(&thread->capture_queue, 1);
+    } else {
+        g_atomic_int_set(&thread->capture_queue, 0);
+
+        g_atomic_int_set(&thread->consumer_stop, 1);
+        g_thread_join(thread->consumer);
+        thread->consumer = NULL;
+
+        close(thread->consumer_wakeup);
+
+        for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+            struct sample_ring *ring = &thread->streams[i].ring;
+
+            rt_unlock_memory(ring->samples, CAPTURE_RING_SIZE * sizeof(short));
+            free(ring->samples);
+            ring->samples = NULL;
+        }
+
+        rt_unlock_memory(thread, sizeof(struct asr_thread_i));
+    }
+}
+
+void asr_thread_set_preprocess_stages(asr_thread thread, unsigned int stages) {
+    g_atomic_int_set(&thread->preprocess_stages, stages);
+}
+
+void asr_thread_set_skip_silence(asr_thread thread, bool skip) {
+    g_atomic_int_set(&thread->skip_silence, skip);
+}
+
+void asr_thread_set_idle_timeout(asr_thread thread, int timeout_ms) {
+    g_atomic_int_set(&thread->idle_timeout_ms, MAX(timeout_ms, 0));
+
+    // Idle sources would otherwise only notice once there's sound
+    if(timeout_ms > 0) return;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++)
+        set_power_state(&thread->streams[i], POWER_IDLE, POWER_ACTIVE);
+}
+
+void asr_thread_set_suspended(asr_thread thread, bool suspended) {
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        struct asr_stream *stream = &thread->streams[i];
+
+        if(suspended) set_power_state(stream, -1, POWER_SUSPENDED);
+        else set_power_state(stream, POWER_SUSPENDED, POWER_ACTIVE);
+    }
+
+    if(!suspended) return;
+
+    // Nothing is fed from here on, so the last utterance is finished now
+    wait_for_feeders(thread);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++)
+        flush_lanes(&thread->streams[i]);
+}
+
+PowerState asr_thread_get_power_state(asr_thread thread, CaptionSource source) {
+    return g_atomic_int_get(&thread->streams[source].power_state);
+}
+
+char *asr_thread_describe_power(asr_thread thread) {
+    GString *str = g_string_new(NULL);
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&thread->power_mutex);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        struct asr_stream *stream = &thread->streams[i];
+        if(!stream->enabled) continue;
+
+        PowerState current = g_atomic_int_get(&stream->power_state);
+
+        g_string_append_printf(str, "%s power state: %s", caption_source_name((CaptionSource)i), power_state_name(current));
+
+        for(int j=0; j<POWER_STATE_COUNT; j++){
+            gint64 time_us = stream->power_time_us[j];
+            if(j == (int)current) time_us += now - stream->power_since;
+
+            g_string_append_printf(str, "%s %s %.0f s", (j == 0) ? "," : ";", power_state_name((PowerState)j),
+                                   time_us / (double)G_USEC_PER_SEC);
+        }
+
+        g_string_append_c(str, '\n');
+    }
+
+    g_mutex_unlock(&thread->power_mutex);
+
+    return g_string_free(str, false);
+}
+
+gpointer asr_thread_get_model(asr_thread thread) {
+    return thread->model;
+}
+
+float asr_thread_get_speedup(asr_thread thread, CaptionSource source) {
+    struct asr_stream *stream = &thread->streams[source];
+
+    // Counted as feeding, so a model swap doesn't free the session meanwhile
+    g_atomic_int_inc(&stream->feeding);
+
+    AprilASRSession session = g_atomic_pointer_get(&stream->lanes[0].session);
+    float speedup = (session != NULL) ? aas_realtime_get_speedup(session) : -1.0f;
+
+    g_atomic_int_dec_and_test(&stream->feeding);
+
+    return speedup;
+}
+
+void asr_thread_pause(asr_thread thread, bool pause) {
+    thread->pause = pause;
+}
+
+int asr_thread_samplerate(asr_thread thread) {
+    return g_atomic_int_get(&thread->sample_rate);
+}
+
+asr_thread create_asr_thread(const char *model_path){
+    asr_thread data = calloc(1, sizeof(struct asr_thread_i));
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        data->streams[i].thread = data;
+        data->streams[i].source = (CaptionSource)i;
+        data->streams[i].power_since = g_get_monotonic_time();
+        line_generator_init(&data->streams[i].line);
+
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            data->streams[i].lanes[j].stream = &data->streams[i];
+            g_mutex_init(&data->streams[i].lanes[j].flush_mutex);
+            data->streams[i].lanes[j].tokens = g_array_new(false, false, sizeof(AprilToken));
+        }
+    }
+
+    // Until the application picks the sources
+    data->streams[CAPTION_SOURCE_DESKTOP].enabled = true;
+    data->realtime = true;
+
+    if(!asr_thread_update_model(data, model_path)){
+        char *model_default = GET_MODEL_PATH();
+        if(!asr_thread_update_model(data, model_default)) {
+            return NULL;
+        }
+
+        GSettings *settings = g_settings_new("net.sapples.LiveCaptions");
+        g_settings_set_string(settings, "active-model", model_default);
+        g_object_unref(G_OBJECT(settings));
+    }
+
+    g_mutex_init(&data->text_mutex);
+    g_mutex_init(&data->decode_slots_mutex);
+    g_mutex_init(&data->power_mutex);
+    g_cond_init(&data->decode_slots_cond);
+
+    data->thread_id = g_thread_new("lcap-audiothread", run_asr_thread, data);
+
+    return data;
+}
+
+static AprilASRSession create_session(struct asr_lane *lane, AprilASRModel model) {
+    AprilConfig config = {
+        .handler = april_result_handler,
+        .flags = (lane->stream->thread->realtime && (lane->stream->thread->backlog_policy == BACKLOG_OFF))
+                    ? APRIL_CONFIG_FLAG_ASYNC_RT_BIT : APRIL_CONFIG_FLAG_ZERO_BIT,
+        .userdata = lane
+    };
+
+    return aas_create_session(model, config);
+}
+
+static AprilASRModel lane_model(asr_thread data, size_t lane) {
+    return (lane == 0) ? data->model : data->parallel_models[lane - 1];
+}
+
+static void start_lane_decoder(asr_thread thread, struct asr_lane *lane);
+static void signal_lane_decoder_stop(asr_thread thread, struct asr_lane *lane);
+static void reap_lane_decoders(asr_thread thread);
+
+// Called with text_mutex held. Returns the replaced session, to be freed
+// once wait_for_feeders returns. A lane losing its session has its decoder
+// stopped, to be joined by reap_lane_decoders
+static AprilASRSession set_lane_session(struct asr_lane *lane, AprilASRSession session, AprilASRModel model) {
+    asr_thread thread = lane->stream->thread;
+
+    // The backlog has to exist before the capture path sees the session
+    if((session != NULL) && thread->decoders_running && (lane->decoder == NULL))
+        start_lane_decoder(thread, lane);
+
+    g_atomic_int_set(&lane->sample_rate, (model != NULL) ? (gint)aam_get_sample_rate(model) : 0);
+
+    AprilASRSession old_session = lane->session;
+    g_atomic_pointer_set(&lane->session, session);
+
+    if((session == NULL) && (lane->decoder != NULL))
+        signal_lane_decoder_stop(thread, lane);
+
+    g_strlcpy(lane->language, (model != NULL) ? aam_get_language(model) : "", HISTORY_LANGUAGE_MAX_CHARS);
+    g_strlcpy(lane->model_name, (model != NULL) ? aam_get_name(model) : "", sizeof(lane->model_name));
+
+    reset_lane(lane);
+    lane->wins = 0;
+    lane->created = g_get_monotonic_time();
+    lane->cpu_clock_valid = false;
+    lane->cpu_ns = 0;
+
+    return old_session;
+}
+
+static void print_model_metadata(AprilASRModel model) {
+    printf("\n-- Model metadata --\n");
+    printf("Name: %s\n", aam_get_name(model));
+    char *description = (char*)aam_get_description(model);
+    for(int i=0; description[i]; i++){
+        if((description[i] == ' ') && (description[i+1] == 'D') && (description[i+2] == 'i')){
+            description[i] = 0;
+            break;
+        }
+    }
+    printf("Description: %s\n", description);
+    printf("Language: %s\n", aam_get_language(model));
+    printf("-- --\n\n");
+}
+
+// Called with text_mutex held
+static void apply_model_language(asr_thread data, AprilASRModel model) {
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++)
+        line_generator_set_language(&data->streams[i].line, aam_get_language(model));
+
+    profanity_filter_set_language(aam_get_language(model));
+}
+
+bool asr_thread_update_model(asr_thread data, const char *model_path) {
+    // Freeing model frees token list, which may be being accessed during
+    // line generation
+    g_mutex_lock(&data->text_mutex);
+
+    data->pause = true;
+
+    AprilASRModel old_model = data->model;
+    data->model = NULL;
+    g_atomic_int_set(&data->sample_rate, 0);
+
+    AprilASRSession old_sessions[CAPTION_SOURCE_COUNT];
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++)
+        old_sessions[i] = set_lane_session(&data->streams[i].lanes[0], NULL, NULL);
+
+    wait_for_feeders(data);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(old_sessions[i] != NULL)
+            aas_free(old_sessions[i]);
+    }
+
+    // Stays loaded in the cache if the budget allows
+    if(old_model != NULL)
+        model_cache_release(old_model);
+
+
+    AprilASRModel new_model = model_cache_acquire(model_path);
+    if(new_model == NULL) {
+        printf("Loading model %s failed!\n", model_path);
+        data->errored = true;
+        g_mutex_unlock(&data->text_mutex);
+        return false;
+    }
+
+    print_model_metadata(new_model);
+    apply_model_language(data, new_model);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        struct asr_stream *stream = &data->streams[i];
+        if(!stream->enabled) continue;
+
+        AprilASRSession session = create_session(&stream->lanes[0], new_model);
+        set_lane_session(&stream->lanes[0], session, new_model);
+        if(session == NULL) {
+            printf("Creating session %s failed!\n", model_path);
+            data->errored = true;
+            g_mutex_unlock(&data->text_mutex);
+            return false;
+        }
+    }
+
+    data->model = new_model;
+    g_atomic_int_set(&data->sample_rate, aam_get_sample_rate(new_model));
+
+    data->errored = false;
+    data->pause = false;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++)
+        line_generator_finalize(&data->streams[i].line);
+
+    g_mutex_unlock(&data->text_mutex);
+
+    return true;
+}
+
+
+// Models are read through once before parsing, in chunks of this size.
+// This is what takes long for a large model on a cold cache, and it can
+// report progress and be cancelled, unlike aam_create_model
+#define MODEL_PREFETCH_CHUNK (1024 * 1024)
+
+// Progress updates are sent to the main thread at most this often
+#define MODEL_PROGRESS_INTERVAL_US (50 * 1000)
+
+struct model_load {
+    asr_thread thread;
+    char *model_path;
+
+    GCancellable *cancellable;
+    GWeakRef target;
+    asr_model_progress_cb progress;
+    asr_model_loaded_cb done;
+
+    gint64 last_progress;
+
+    // Created on the loading thread, swapped in on the main thread
+    AprilASRModel model;
+    AprilASRSession sessions[CAPTION_SOURCE_COUNT];
+    bool success;
+};
+
+struct model_progress {
+    GCancellable *cancellable;
+    GWeakRef target;
+    asr_model_progress_cb progress;
+
+    ModelLoadStage stage;
+    double fraction;
+};
+
+static gboolean deliver_model_progress(void *userdata) {
+    struct model_progress *update = userdata;
+
+    if(!g_cancellable_is_cancelled(update->cancellable)) {
+        GObject *target = g_weak_ref_get(&update->target);
+        if(target != NULL) {
+            update->progress(target, update->stage, update->fraction);
+            g_object_unref(target);
+        }
+    }
+
+    g_object_unref(update->cancellable);
+    g_weak_ref_clear(&update->target);
+    g_free(update);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void report_model_progress(struct model_load *load, ModelLoadStage stage, double fraction, bool force) {
+    if(load->progress == NULL) return;
+
+    gint64 now = g_get_monotonic_time();
+    if(!force && (now - load->last_progress < MODEL_PROGRESS_INTERVAL_US)) return;
+    load->last_progress = now;
+
+    struct model_progress *update = g_new0(struct model_progress, 1);
+    update->cancellable = g_object_ref(load->cancellable);
+    update->progress = load->progress;
+    update->stage = stage;
+    update->fraction = fraction;
+
+    GObject *target = g_weak_ref_get(&load->target);
+    g_weak_ref_init(&update->target, target);
+    if(target != NULL) g_object_unref(target);
+
+    g_idle_add(deliver_model_progress, update);
+}
+
+// Returns false if the model can't be read or the load was cancelled
+static bool prefetch_model(struct model_load *load) {
+    FILE *f = fopen(load->model_path, "rb");
+    if(f == NULL) {
+        printf("Can't open model %s: %s\n", load->model_path, strerror(errno));
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *buffer = g_malloc(MODEL_PREFETCH_CHUNK);
+    long done = 0;
+
+    report_model_progress(load, MODEL_LOAD_READING, 0.0, true);
+
+    bool ok = true;
+    for(;;) {
+        if(g_cancellable_is_cancelled(load->cancellable)) {
+            ok = false;
+            break;
+        }
+
+        size_t n = fread(buffer, 1, MODEL_PREFETCH_CHUNK, f);
+        if(n == 0) break;
+
+        done += n;
+        report_model_progress(load, MODEL_LOAD_READING, (size > 0) ? (double)done / size : -1.0, false);
+    }
+
+    g_free(buffer);
+    fclose(f);
+
+    return ok;
+}
+
+static gboolean finish_model_load(void *userdata);
+
+static void *run_model_load(void *userdata) {
+    struct model_load *load = userdata;
+
+    // The model's own worker threads start from here and inherit this
+    rt_place_current_thread();
+
+    // A cached model is already in memory, reading it again is wasted work
+    if(!model_cache_contains(load->model_path) && !prefetch_model(load)) goto finish;
+
+    // aam_create_model can't report progress or be interrupted
+    report_model_progress(load, MODEL_LOAD_PARSING, -1.0, true);
+
+    load->model = model_cache_acquire(load->model_path);
+    if(load->model == NULL) {
+        printf("Loading model %s failed!\n", load->model_path);
+        goto finish;
+    }
+
+    if(g_cancellable_is_cancelled(load->cancellable)) goto finish;
+
+    report_model_progress(load, MODEL_LOAD_CREATING_SESSIONS, -1.0, true);
+
+    // Sources enabled or disabled in the meantime are sorted out in the swap
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        struct asr_stream *stream = &load->thread->streams[i];
+        if(!stream->enabled) continue;
+
+        load->sessions[i] = create_session(&stream->lanes[0], load->model);
+        if(load->sessions[i] == NULL) {
+            printf("Creating session %s failed!\n", load->model_path);
+            goto finish;
+        }
+    }
+
+    load->success = true;
+
+finish:
+    rt_forget_current_thread();
+
+    g_idle_add(finish_model_load, load);
+    return NULL;
+}
+
+// Called on the main thread. The old sessions keep captioning until their
+// pointers are replaced, then are freed once the last feed into them is
+// over. Their results until then still go to the same line generators
+static void swap_model(asr_thread data, struct model_load *load) {
+    AprilASRSession old_sessions[CAPTION_SOURCE_COUNT] = { NULL };
+    AprilASRSession unused_sessions[CAPTION_SOURCE_COUNT] = { NULL };
+
+    g_mutex_lock(&data->text_mutex);
+
+    AprilASRModel old_model = data->model;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        struct asr_stream *stream = &data->streams[i];
+
+        AprilASRSession session = load->sessions[i];
+        load->sessions[i] = NULL;
+
+        if(stream->enabled && (session == NULL)) {
+            session = create_session(&stream->lanes[0], load->model);
+        } else if(!stream->enabled && (session != NULL)) {
+            unused_sessions[i] = session;
+            session = NULL;
+        }
+
+        old_sessions[i] = set_lane_session(&stream->lanes[0], session, load->model);
+    }
+
+    data->model = load->model;
+    load->model = NULL;
+
+    g_atomic_int_set(&data->sample_rate, aam_get_sample_rate(data->model));
+    data->errored = false;
+
+    for(size_t i=0; i<ASR_MAX_PARALLEL_MODELS; i++){
+        AprilASRModel model = data->parallel_models[i];
+        if((model != NULL) && (aam_get_sample_rate(model) != aam_get_sample_rate(data->model)))
+            printf("Parallel model %s is for %zu Hz audio, not decoding with it until the main model takes that again\n",
+                   aam_get_name(model), aam_get_sample_rate(model));
+    }
+
+    g_mutex_unlock(&data->text_mutex);
+
+    print_model_metadata(data->model);
+
+    wait_for_feeders(data);
+    reap_lane_decoders(data);
+
+    // Outside of text_mutex, the sessions' threads may be waiting on it
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(old_sessions[i] != NULL) aas_free(old_sessions[i]);
+        if(unused_sessions[i] != NULL) aas_free(unused_sessions[i]);
+    }
+
+    // Nothing from the old model can reach the line generators anymore,
+    // apart from results the old sessions left in the lanes
+    g_mutex_lock(&data->text_mutex);
+
+    apply_model_language(data, data->model);
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        reset_lane(&data->streams[i].lanes[0]);
+        line_generator_finalize(&data->streams[i].line);
+    }
+
+    g_mutex_unlock(&data->text_mutex);
+
+    if(old_model != NULL) model_cache_release(old_model);
+}
+
+static gboolean finish_model_load(void *userdata) {
+    struct model_load *load = userdata;
+    asr_thread data = load->thread;
+
+    if(data->current_load == load) data->current_load = NULL;
+
+    bool cancelled = g_cancellable_is_cancelled(load->cancellable);
+    bool success = load->success && !cancelled;
+
+    if(success) swap_model(data, load);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(load->sessions[i] != NULL) aas_free(load->sessions[i]);
+    }
+
+    if(load->model != NULL) model_cache_release(load->model);
+
+    GObject *target = g_weak_ref_get(&load->target);
+    if(target != NULL) {
+        if(load->done != NULL) load->done(target, load->model_path, success, cancelled);
+        g_object_unref(target);
+    }
+
+    g_object_unref(load->cancellable);
+    g_weak_ref_clear(&load->target);
+    g_free(load->model_path);
+    g_free(load);
+
+    return G_SOURCE_REMOVE;
+}
+
+void asr_thread_load_model_async(asr_thread thread,
+                                 const char *model_path,
+                                 GCancellable *cancellable,
+                                 GObject *target,
+                                 asr_model_progress_cb progress,
+                                 asr_model_loaded_cb done)
+{
+    if(thread->current_load != NULL) g_cancellable_cancel(thread->current_load->cancellable);
+
+    struct model_load *load = g_new0(struct model_load, 1);
+    load->thread = thread;
+    load->model_path = g_strdup(model_path);
+    load->cancellable = (cancellable != NULL) ? g_object_ref(cancellable) : g_cancellable_new();
+    g_weak_ref_init(&load->target, target);
+    load->progress = progress;
+    load->done = done;
+
+    thread->current_load = load;
+
+    g_thread_unref(g_thread_new("lcap-modelload", run_model_load, load));
+}
+
+struct parallel_load {
+    asr_thread thread;
+    guint generation;
+    char **model_paths;
+
+    // Created on the loading thread, swapped in on the main thread
+    AprilASRModel models[ASR_MAX_PARALLEL_MODELS];
+    AprilASRSession sessions[ASR_MAX_PARALLEL_MODELS][CAPTION_SOURCE_COUNT];
+};
+
+static gboolean finish_parallel_load(void *userdata);
+
+static void *run_parallel_load(void *userdata) {
+    struct parallel_load *load = userdata;
+    asr_thread data = load->thread;
+
+    rt_place_current_thread();
+
+    size_t count = 0;
+    for(size_t i=0; load->model_paths[i] != NULL; i++){
+        if(count == ASR_MAX_PARALLEL_MODELS) {
+            printf("Only %d parallel models are supported, ignoring %s\n", ASR_MAX_PARALLEL_MODELS, load->model_paths[i]);
+            continue;
+        }
+
+        AprilASRModel model = model_cache_acquire(load->model_paths[i]);
+        if(model == NULL) {
+            printf("Loading parallel model %s failed!\n", load->model_paths[i]);
+            continue;
+        }
+
+        // The audio is captured at the main model's rate, another one
+        // would only produce garbage
+        int rate = g_atomic_int_get(&data->sample_rate);
+        if((rate != 0) && ((int)aam_get_sample_rate(model) != rate)) {
+            printf("Parallel model %s is for %zu Hz audio but the main model takes %d Hz, skipping it\n",
+                   load->model_paths[i], aam_get_sample_rate(model), rate);
+            model_cache_release(model);
+            continue;
+        }
+
+        print_model_metadata(model);
+
+        // Sources enabled or disabled in the meantime are sorted out in
+        // the swap
+        for(size_t j=0; j<CAPTION_SOURCE_COUNT; j++){
+            struct asr_stream *stream = &data->streams[j];
+            if(!stream->enabled) continue;
+
+            load->sessions[count][j] = create_session(&stream->lanes[count + 1], model);
+        }
+
+        load->models[count++] = model;
+    }
+
+    rt_forget_current_thread();
+
+    g_idle_add(finish_parallel_load, load);
+    return NULL;
+}
+
+// Called on the main thread, the same way as swap_model
+static void swap_parallel_models(asr_thread data, struct parallel_load *load) {
+    AprilASRSession old_sessions[ASR_MAX_PARALLEL_MODELS][CAPTION_SOURCE_COUNT] = { { NULL } };
+    AprilASRModel old_models[ASR_MAX_PARALLEL_MODELS];
+
+    g_mutex_lock(&data->text_mutex);
+
+    for(size_t i=0; i<ASR_MAX_PARALLEL_MODELS; i++){
+        AprilASRModel model = load->models[i];
+
+        for(size_t j=0; j<CAPTION_SOURCE_COUNT; j++){
+            struct asr_stream *stream = &data->streams[j];
+
+            AprilASRSession session = load->sessions[i][j];
+            load->sessions[i][j] = NULL;
+
+            // Sessions left in the load are freed with it
+            if(stream->enabled && (session == NULL) && (model != NULL)) {
+                session = create_session(&stream->lanes[i + 1], model);
+            } else if(!stream->enabled && (session != NULL)) {
+                load->sessions[i][j] = session;
+                session = NULL;
+            }
+
+            old_sessions[i][j] = set_lane_session(&stream->lanes[i + 1], session, model);
+        }
+
+        old_models[i] = data->parallel_models[i];
+        data->parallel_models[i] = model;
+        load->models[i] = NULL;
+    }
+
+    g_mutex_unlock(&data->text_mutex);
+
+    wait_for_feeders(data);
+    reap_lane_decoders(data);
+
+    for(size_t i=0; i<ASR_MAX_PARALLEL_MODELS; i++){
+        for(size_t j=0; j<CAPTION_SOURCE_COUNT; j++){
+            if(old_sessions[i][j] != NULL) aas_free(old_sessions[i][j]);
+        }
+    }
+
+    // Clear out whatever the old sessions delivered before being freed
+    g_mutex_lock(&data->text_mutex);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=1; j<ASR_MAX_LANES; j++)
+            reset_lane(&data->streams[i].lanes[j]);
+    }
+
+    g_mutex_unlock(&data->text_mutex);
+
+    for(size_t i=0; i<ASR_MAX_PARALLEL_MODELS; i++){
+        if(old_models[i] != NULL) model_cache_release(old_models[i]);
+    }
+}
+
+static gboolean finish_parallel_load(void *userdata) {
+    struct parallel_load *load = userdata;
+    asr_thread data = load->thread;
+
+    // Superseded by a later call
+    if(load->generation == data->parallel_generation) swap_parallel_models(data, load);
+
+    for(size_t i=0; i<ASR_MAX_PARALLEL_MODELS; i++){
+        for(size_t j=0; j<CAPTION_SOURCE_COUNT; j++){
+            if(load->sessions[i][j] != NULL) aas_free(load->sessions[i][j]);
+        }
+
+        if(load->models[i] != NULL) model_cache_release(load->models[i]);
+    }
+
+    g_strfreev(load->model_paths);
+    g_free(load);
+
+    return G_SOURCE_REMOVE;
+}
+
+void asr_thread_set_parallel_models(asr_thread thread, const char *const *model_paths) {
+    struct parallel_load *load = g_new0(struct parallel_load, 1);
+    load->thread = thread;
+    load->generation = ++thread->parallel_generation;
+    load->model_paths = g_strdupv((char **)model_paths);
+
+    if(load->model_paths == NULL) load->model_paths = g_new0(char *, 1);
+
+    // Nothing to load, only the current ones to stop
+    if(load->model_paths[0] == NULL) {
+        finish_parallel_load(load);
+        return;
+    }
+
+    g_thread_unref(g_thread_new("lcap-parallelload", run_parallel_load, load));
+}
+
+// Called with text_mutex held
+static double lane_cpu_seconds(struct asr_lane *lane) {
+    struct timespec ts;
+
+    // Fails once the thread is gone, keep the last reading
+    if(lane->cpu_clock_valid) {
+        if(clock_gettime(lane->cpu_clock, &ts) == 0)
+            lane->cpu_ns = (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        else
+            lane->cpu_clock_valid = false;
+    }
+
+    return lane->cpu_ns / 1e9;
+}
+
+void asr_thread_get_load(asr_thread thread, struct asr_load *load) {
+    load->speedup = 0.0f;
+    load->cpu = 0.0;
+    load->cant_keep_up = g_atomic_int_get(&thread->cant_keep_up);
+    load->lag = asr_thread_get_lag(thread);
+
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&thread->text_mutex);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+            if(lane->session == NULL) continue;
+
+            load->speedup = MAX(load->speedup, aas_realtime_get_speedup(lane->session));
+
+            lane_cpu_seconds(lane);
+
+            // Since the previous call, or since the session was created
+            gint64 since = MAX(lane->load_time, lane->created);
+            gint64 cpu_since = (lane->load_time >= lane->created) ? lane->load_cpu_ns : 0;
+
+            if(now > since)
+                load->cpu = MAX(load->cpu, (lane->cpu_ns - cpu_since) / (1000.0 * (now - since)));
+
+            lane->load_cpu_ns = lane->cpu_ns;
+            lane->load_time = now;
+        }
+    }
+
+    g_mutex_unlock(&thread->text_mutex);
+}
+
+char *asr_thread_describe_sessions(asr_thread thread) {
+    GString *str = g_string_new(NULL);
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&thread->text_mutex);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+            if(lane->session == NULL) continue;
+
+            double cpu = lane_cpu_seconds(lane);
+            double elapsed = MAX((now - lane->created) / (double)G_USEC_PER_SEC, 1e-3);
+
+            g_string_append_printf(str, "%s session, %s (%s)\n  %.1f%% CPU (%.1f s in %.0f s), result kept %d times\n",
+                                   caption_source_name((CaptionSource)i),
+                                   lane->model_name,
+                                   lane->language,
+                                   100.0 * cpu / elapsed,
+                                   cpu,
+                                   elapsed,
+                                   lane->wins);
+        }
+
+        gint64 skipped = thread->streams[i].skipped_samples;
+        int rate = g_atomic_int_get(&thread->sample_rate);
+        if((skipped > 0) && (rate > 0))
+            g_string_append_printf(str, "%s audio without speech skipped: %.0f s\n",
+                                   caption_source_name((CaptionSource)i), skipped / (double)rate);
+
+        if((rate == 0) || (g_atomic_int_get(&thread->backlog_policy) == BACKLOG_OFF)) continue;
+
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+            if(lane->session == NULL) continue;
+
+            g_string_append_printf(str, "%s backlog, %s: %.1f s behind, %.0f s dropped, %.0f s of silence left out\n",
+                                   caption_source_name((CaptionSource)i),
+                                   lane->model_name,
+                                   ring_fill(&lane->backlog) / (double)rate,
+                                   lane->dropped_samples / (double)rate,
+                                   lane->skipped_samples / (double)rate);
+        }
+    }
+
+    if(g_atomic_int_get(&thread->backlog_policy) != BACKLOG_OFF) {
+        int limit = g_atomic_int_get(&thread->decoder_threads);
+        if(limit > 0) g_string_append_printf(str, "Backlog decoders: at most %d at once\n", limit);
+        else g_string_append(str, "Backlog decoders: one per session\n");
+    }
+
+    g_mutex_unlock(&thread->text_mutex);
+
+    return g_string_free(str, false);
+}
+
+void asr_thread_enable_source(asr_thread thread, CaptionSource source, bool enable) {
+    struct asr_stream *stream = &thread->streams[source];
+    AprilASRSession old_sessions[ASR_MAX_LANES] = { NULL };
+
+    g_mutex_lock(&thread->text_mutex);
+
+    stream->enabled = enable;
+
+    for(size_t i=0; i<ASR_MAX_LANES; i++){
+        struct asr_lane *lane = &stream->lanes[i];
+        AprilASRModel model = lane_model(thread, i);
+
+        if(enable && (lane->session == NULL) && (model != NULL)) {
+            AprilASRSession session = create_session(lane, model);
+            if(session == NULL) printf("Creating session for %s failed!\n", caption_source_name(source));
+
+            set_lane_session(lane, session, model);
+        } else if(!enable) {
+            old_sessions[i] = set_lane_session(lane, NULL, NULL);
+        }
+    }
+
+    // Whether the tags take up room changed, so all layouts are redone
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++)
+        thread->streams[i].layout_counter = (size_t)-1;
+
+    g_mutex_unlock(&thread->text_mutex);
+
+    // The sessions' threads may be waiting on text_mutex in the handler
+    if(!enable) {
+        wait_for_feeders(thread);
+        reap_lane_decoders(thread);
+
+        for(size_t i=0; i<ASR_MAX_LANES; i++){
+            if(old_sessions[i] != NULL) aas_free(old_sessions[i]);
+        }
+    }
+}
+
+// With new flags
+static void recreate_sessions(asr_thread thread) {
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(!thread->streams[i].enabled) continue;
+
+        asr_thread_enable_source(thread, (CaptionSource)i, false);
+        asr_thread_enable_source(thread, (CaptionSource)i, true);
+    }
+}
+
+void asr_thread_set_realtime(asr_thread thread, bool realtime) {
+    if(thread->realtime == realtime) return;
+
+    thread->realtime = realtime;
+
+    // Backlogs only make sense for audio arriving in real time
+    if(!realtime) asr_thread_set_backlog(thread, BACKLOG_OFF, 0, 0);
+
+    recreate_sessions(thread);
+}
+
+// Feeds the session with the feeding count held, like feed_stream
+static void feed_lane(struct asr_lane *lane, const short *data, size_t count, bool flush) {
+    struct asr_stream *stream = lane->stream;
+
+    g_atomic_int_inc(&stream->feeding);
+
+    AprilASRSession session = g_atomic_pointer_get(&lane->session);
+    if(session != NULL) {
+        if(flush) aas_flush(session);
+        else aas_feed_pcm16(session, (short *)data, count);
+    }
+
+    g_atomic_int_dec_and_test(&stream->feeding);
+}
+
+// Returns how many samples may be read before a requested flush is due. If
+// it is due now, flushes and returns 0. Only from the decoder
+static size_t backlog_until_flush(struct asr_lane *lane) {
+    if(!g_atomic_int_get(&lane->flush_pending)) return BACKLOG_BLOCK;
+
+    g_mutex_lock(&lane->flush_mutex);
+
+    gint ahead = (gint)(lane->flush_pos - (guint)lane->backlog.read_pos);
+
+    // A later request moved it further, that one stays pending
+    if(ahead <= 0) g_atomic_int_set(&lane->flush_pending, 0);
+
+    g_mutex_unlock(&lane->flush_mutex);
+
+    if(ahead > 0) return MIN((size_t)ahead, BACKLOG_BLOCK);
+
+    feed_lane(lane, NULL, 0, true);
+    return 0;
+}
+
+// Applies the backlog policy to the next block of at most max samples.
+// Returns how many samples of it to decode, or 0 to leave it out
+static size_t backlog_next_block(asr_thread data, struct asr_lane *lane, short *block, size_t max_count, unsigned int rate) {
+    BacklogPolicy policy = g_atomic_int_get(&data->backlog_policy);
+    size_t max = (size_t)g_atomic_int_get(&data->backlog_max_ms) * rate / 1000;
+    size_t catchup = (size_t)BACKLOG_CATCHUP_MS * rate / 1000;
+    size_t squash = (size_t)g_atomic_int_get(&data->backlog_squash_ms) * rate / 1000;
+
+    size_t backlog = ring_fill(&lane->backlog);
+
+    // Every policy jumps ahead once over the limit. The utterance that was
+    // cut off is finished first
+    if(backlog > MAX(max, catchup)) {
+        size_t drop = backlog - catchup;
+        ring_skip(&lane->backlog, drop);
+
+        lane->dropped_samples += drop;
+        backlog -= drop;
+
+        feed_lane(lane, NULL, 0, true);
+
+        printf("%s decoding was %.1f s behind, skipped the oldest %.1f s\n",
+               caption_source_name(lane->stream->source), (backlog + drop) / (double)rate, drop / (double)rate);
+    }
+
+    size_t count = ring_read(&lane->backlog, block, max_count);
+    if(count == 0) return 0;
+
+    bool behind = backlog > catchup;
+    bool speech = vad_update(&lane->backlog_vad, rate, block, count);
+
+    lane->silence_run = speech ? 0 : (lane->silence_run + count);
+
+    bool skip = false;
+    if(behind && !speech) {
+        if(policy == BACKLOG_SKIP_SILENCE) skip = true;
+        else if(policy == BACKLOG_SQUASH_SILENCE) skip = lane->silence_run > squash;
+    }
+
+    if(!skip) {
+        lane->backlog_vad.skipping = false;
+        return count;
+    }
+
+    // Without the pause, the decoder has to be told the utterance is over
+    if((policy == BACKLOG_SKIP_SILENCE) && !lane->backlog_vad.skipping)
+        feed_lane(lane, NULL, 0, true);
+
+    lane->backlog_vad.skipping = true;
+    lane->skipped_samples += count;
+
+    return 0;
+}
+
+// Returns false if the decoder is stopping
+static bool acquire_decode_slot(asr_thread data, struct asr_lane *lane) {
+    bool acquired = false;
+
+    g_mutex_lock(&data->decode_slots_mutex);
+
+    while(!g_atomic_int_get(&lane->decoder_stop)) {
+        int limit = g_atomic_int_get(&data->decoder_threads);
+        if((limit == 0) || (data->decode_slots_used < limit)) {
+            data->decode_slots_used++;
+            acquired = true;
+            break;
+        }
+
+        g_cond_wait(&data->decode_slots_cond, &data->decode_slots_mutex);
+    }
+
+    g_mutex_unlock(&data->decode_slots_mutex);
+
+    return acquired;
+}
+
+static void release_decode_slot(asr_thread data) {
+    g_mutex_lock(&data->decode_slots_mutex);
+    data->decode_slots_used--;
+    g_cond_signal(&data->decode_slots_cond);
+    g_mutex_unlock(&data->decode_slots_mutex);
+}
+
+static void *run_lane_decoder(void *userdata) {
+    struct asr_lane *lane = userdata;
+    asr_thread data = lane->stream->thread;
+
+    short block[BACKLOG_BLOCK];
+    gint reported_overflows = 0;
+
+    struct pollfd pfd = { .fd = lane->decoder_wakeup, .events = POLLIN };
+
+    rt_place_current_thread();
+
+    // Woken by the capture path for audio and by signal_lane_decoder_stop,
+    // never on a timer
+    while(!g_atomic_int_get(&lane->decoder_stop)) {
+        if(poll(&pfd, 1, -1) > 0) {
+            guint64 count;
+            if(read(lane->decoder_wakeup, &count, sizeof(count)) < 0) {
+                // Already cleared, nothing to do
+            }
+        }
+
+        while(!g_atomic_int_get(&lane->decoder_stop)) {
+            // Flushes are due even with nothing queued after them
+            size_t max_count = backlog_until_flush(lane);
+            if(max_count == 0) continue;
+
+            if(ring_fill(&lane->backlog) == 0) break;
+
+            unsigned int rate = g_atomic_int_get(&data->sample_rate);
+            if(rate == 0) {
+                ring_skip(&lane->backlog, ring_fill(&lane->backlog));
+                break;
+            }
+
+            size_t count = backlog_next_block(data, lane, block, max_count, rate);
+            if(count == 0) continue;
+
+            if(!acquire_decode_slot(data, lane)) break;
+            feed_lane(lane, block, count, false);
+            release_decode_slot(data);
+        }
+
+        gint overflows = g_atomic_int_get(&lane->backlog.overflows);
+        if(overflows != reported_overflows) {
+            printf("%s backlog overflowed, %d writes dropped\n",
+                   caption_source_name(lane->stream->source), overflows - reported_overflows);
+            reported_overflows = overflows;
+        }
+    }
+
+    rt_forget_current_thread();
+
+    return NULL;
+}
+
+// Called with text_mutex held
+static void start_lane_decoder(asr_thread thread, struct asr_lane *lane) {
+    int rate = g_atomic_int_get(&thread->sample_rate);
+    if(rate == 0) rate = 16000;
+
+    size_t samples = (size_t)(g_atomic_int_get(&thread->backlog_max_ms) + BACKLOG_MARGIN_MS) * rate / 1000;
+
+    lane->backlog.size = 1;
+    while(lane->backlog.size < samples) lane->backlog.size *= 2;
+
+    lane->backlog.samples = calloc(lane->backlog.size, sizeof(short));
+    lane->backlog.write_pos = 0;
+    lane->backlog.read_pos = 0;
+    lane->backlog.overflows = 0;
+
+    // Written from the capture path
+    rt_lock_memory(lane->backlog.samples, lane->backlog.size * sizeof(short));
+
+    memset(&lane->backlog_vad, 0, sizeof(lane->backlog_vad));
+    lane->silence_run = 0;
+
+    g_atomic_int_set(&lane->flush_pending, 0);
+    g_atomic_int_set(&lane->decoder_stop, 0);
+    lane->decoder_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    lane->decoder = g_thread_new("lcap-decode", run_lane_decoder, lane);
+}
+
+// Called with text_mutex held, so it can't wait for the decoder, which
+// may be waiting on text_mutex in the result handler
+static void signal_lane_decoder_stop(asr_thread thread, struct asr_lane *lane) {
+    g_atomic_int_set(&lane->decoder_stop, 1);
+
+    guint64 one = 1;
+    if(write(lane->decoder_wakeup, &one, sizeof(one)) < 0) {
+        // The counter is full, so the decoder is being woken anyway
+    }
+
+    // It may be waiting for a decode slot instead
+    g_mutex_lock(&thread->decode_slots_mutex);
+    g_cond_broadcast(&thread->decode_slots_cond);
+    g_mutex_unlock(&thread->decode_slots_mutex);
+}
+
+// Joins the decoders that were told to stop, and frees their backlogs.
+// Call without text_mutex held, once wait_for_feeders returned
+static void reap_lane_decoders(asr_thread thread) {
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+            if((lane->decoder == NULL) || !g_atomic_int_get(&lane->decoder_stop)) continue;
+
+            g_thread_join(lane->decoder);
+
+            g_mutex_lock(&thread->text_mutex);
+
+            if((lane->session != NULL) && thread->decoders_running) {
+                // Got a session again meanwhile, which may already be
+                // queueing audio in the backlog
+                g_atomic_int_set(&lane->decoder_stop, 0);
+                lane->decoder = g_thread_new("lcap-decode", run_lane_decoder, lane);
+            } else {
+                lane->decoder = NULL;
+                close(lane->decoder_wakeup);
+
+                rt_unlock_memory(lane->backlog.samples, lane->backlog.size * sizeof(short));
+                free(lane->backlog.samples);
+                lane->backlog.samples = NULL;
+            }
+
+            g_mutex_unlock(&thread->text_mutex);
+        }
+    }
+}
+
+static void start_decoders(asr_thread thread) {
+    g_mutex_lock(&thread->text_mutex);
+
+    thread->decoders_running = true;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+            if((lane->session != NULL) && (lane->decoder == NULL)) start_lane_decoder(thread, lane);
+        }
+    }
+
+    g_mutex_unlock(&thread->text_mutex);
+}
+
+static void stop_decoders(asr_thread thread) {
+    g_mutex_lock(&thread->text_mutex);
+
+    thread->decoders_running = false;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+            if(lane->decoder != NULL) signal_lane_decoder_stop(thread, lane);
+        }
+    }
+
+    g_mutex_unlock(&thread->text_mutex);
+
+    // Producers that saw a policy may still be writing to the backlogs
+    wait_for_feeders(thread);
+    reap_lane_decoders(thread);
+}
+
+void asr_thread_set_backlog(asr_thread thread, BacklogPolicy policy, int max_ms, int squash_ms) {
+    if(!thread->realtime) policy = BACKLOG_OFF;
+
+    BacklogPolicy old_policy = g_atomic_int_get(&thread->backlog_policy);
+
+    // The capture path feeds the sessions directly until the decoders
+    // are running again
+    g_atomic_int_set(&thread->backlog_policy, BACKLOG_OFF);
+    stop_decoders(thread);
+
+    g_atomic_int_set(&thread->backlog_max_ms, max_ms);
+    g_atomic_int_set(&thread->backlog_squash_ms, squash_ms);
+
+    if(policy != BACKLOG_OFF) start_decoders(thread);
+
+    // Sessions are synchronous with a backlog
+    if((old_policy == BACKLOG_OFF) != (policy == BACKLOG_OFF)) {
+        thread->backlog_policy = policy;
+        recreate_sessions(thread);
+    }
+
+    g_atomic_int_set(&thread->backlog_policy, policy);
+}
+
+// Not with text_mutex held
+double asr_thread_get_lag(asr_thread thread) {
+    int rate = g_atomic_int_get(&thread->sample_rate);
+    if((rate == 0) || (g_atomic_int_get(&thread->backlog_policy) == BACKLOG_OFF)) return 0.0;
+
+    // The backlogs are only freed with text_mutex held
+    g_mutex_lock(&thread->text_mutex);
+
+    size_t lag = 0;
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+            if((lane->backlog.samples != NULL) && (g_atomic_pointer_get(&lane->session) != NULL))
+                lag = MAX(lag, ring_fill(&lane->backlog));
+        }
+    }
+
+    g_mutex_unlock(&thread->text_mutex);
+
+    return lag / (double)rate;
+}
+
+void asr_thread_set_decoder_threads(asr_thread thread, int count) {
+    g_atomic_int_set(&thread->decoder_threads, MAX(count, 0));
+
+    g_mutex_lock(&thread->decode_slots_mutex);
+    g_cond_broadcast(&thread->decode_slots_cond);
+    g_mutex_unlock(&thread->decode_slots_mutex);
+}
+
+bool asr_thread_replay_result(asr_thread thread, CaptionSource source, size_t lane, AprilResultType result, size_t count, const AprilToken *tokens) {
+    if(((unsigned int)source >= CAPTION_SOURCE_COUNT) || (lane >= ASR_MAX_LANES)) return false;
+
+    struct asr_lane *l = &thread->streams[source].lanes[lane];
+    if(g_atomic_pointer_get(&l->session) == NULL) return false;
+
+    april_result_handler(l, result, count, tokens);
+    return true;
+}
+
+bool asr_thread_is_errored(asr_thread thread) {
+    return thread->errored;
+}
+
+void asr_thread_set_main_window(asr_thread thread, LiveCaptionsWindow *window) {
+    thread->window = window;
+}
+
+void asr_thread_flush(asr_thread thread) {
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++)
+        flush_lanes(&thread->streams[i]);
+}
+
+void free_asr_thread(asr_thread thread) {
+    asr_thread_set_capture_queue(thread, false);
+    stop_decoders(thread);
+
+    g_mutex_lock(&thread->text_mutex);
 
     g_thread_join(thread->thread_id);
 
-    if(thread->session != NULL)
-        aas_free(thread->session);
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<ASR_MAX_LANES; j++){
+            struct asr_lane *lane = &thread->streams[i].lanes[j];
+
+            if(lane->session != NULL)
+                aas_free(lane->session);
+
+            g_array_free(lane->tokens, true);
+            g_mutex_clear(&lane->flush_mutex);
+        }
+
+        if(thread->streams[i].preprocessor != NULL)
+            preprocessor_free(thread->streams[i].preprocessor);
+    }
     
     if(thread->model != NULL)
-        aam_free(thread->model);
+        model_cache_release(thread->model);
+
+    for(size_t i=0; i<ASR_MAX_PARALLEL_MODELS; i++){
+        if(thread->parallel_models[i] != NULL)
+            model_cache_release(thread->parallel_models[i]);
+    }
 
     g_thread_unref(thread->thread_id); // ?
 
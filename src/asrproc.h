@@ -21,6 +21,7 @@
 #pragma once
 
 #include <adwaita.h>
+#include "history.h"
 
 struct _LiveCaptionsWindow;
 
@@ -29,12 +30,168 @@ typedef struct asr_thread_i * asr_thread;
 
 
 asr_thread create_asr_thread(const char *model_path);
+
+// Loads the model synchronously, captioning stops until it's done. Only
+// used at startup, see asr_thread_load_model_async
 bool asr_thread_update_model(asr_thread thread, const char *model_path);
+
+typedef enum ModelLoadStage {
+    MODEL_LOAD_READING = 0,
+    MODEL_LOAD_PARSING,
+    MODEL_LOAD_CREATING_SESSIONS
+} ModelLoadStage;
+
+// Called on the main thread. fraction is between 0 and 1, or negative if
+// the progress of the stage is unknown
+typedef void (*asr_model_progress_cb)(GObject *target, ModelLoadStage stage, double fraction);
+
+// Called on the main thread when the load is over. On success the new
+// model is already in use
+typedef void (*asr_model_loaded_cb)(GObject *target, const char *model_path, bool success, bool cancelled);
+
+// Loads the model and creates its sessions on a background thread while
+// the current model keeps captioning, then swaps them in on the main
+// thread. Starting another load cancels this one. The callbacks are not
+// called once the target has been finalized, the load itself goes on
+// unless cancelled. The cancellable may be NULL
+void asr_thread_load_model_async(asr_thread thread,
+                                 const char *model_path,
+                                 GCancellable *cancellable,
+                                 GObject *target,
+                                 asr_model_progress_cb progress,
+                                 asr_model_loaded_cb done);
+
+// Models that can run alongside the main one
+#define ASR_MAX_PARALLEL_MODELS 3
+
+// Runs these models alongside the main one, each in its own sessions on
+// the same audio and on its own thread. Every utterance is taken from the
+// model with the highest mean token logprob for it, and tagged with its
+// language when the models differ. Loaded in the background, an empty
+// list or NULL stops them.
+// Models whose sample rate differs from the main model's are skipped, as
+// the audio is captured at the main model's rate. The profanity filter
+// uses the main model's language for every lane, so an utterance taken
+// from a model in another language is filtered with the main word lists
+void asr_thread_set_parallel_models(asr_thread thread, const char *const *model_paths);
+
+// CPU use of each session, and how often its result was kept. Free with
+// g_free
+char *asr_thread_describe_sessions(asr_thread thread);
+
+// How well decoding keeps up, over all sessions
+struct asr_load {
+    // Highest aas_realtime_get_speedup, above 1 a session is behind
+    float speedup;
+
+    // Highest share of a core a session used since the previous call
+    double cpu;
+
+    // APRIL_RESULT_ERROR_CANT_KEEP_UP results so far
+    int cant_keep_up;
+
+    // See asr_thread_get_lag
+    double lag;
+};
+
+void asr_thread_get_load(asr_thread thread, struct asr_load *load);
+
+// What to do when decoding falls behind. Stored in the settings, so
+// existing values must not be renumbered
+typedef enum BacklogPolicy {
+    // The realtime sessions speed up and drop audio on their own
+    BACKLOG_OFF = 0,
+
+    // Audio queues up to a limit, after which the oldest is dropped so
+    // decoding jumps back to about a second behind
+    BACKLOG_DROP_OLDEST = 1,
+
+    // As above, and while behind, audio without speech is left out
+    BACKLOG_SKIP_SILENCE = 2,
+
+    // As above, but pauses are only shortened to a fixed length, so the
+    // decoder still hears them
+    BACKLOG_SQUASH_SILENCE = 3
+} BacklogPolicy;
+
+// With a policy other than BACKLOG_OFF, each session gets a bounded queue
+// of audio and its own thread decoding it synchronously, so the lag is
+// known and the policy can act on it. max_ms is the limit, squash_ms what
+// pauses are shortened to. Ignored for non-realtime sessions
+void asr_thread_set_backlog(asr_thread thread, BacklogPolicy policy, int max_ms, int squash_ms);
+
+// Seconds of audio waiting to be decoded by the furthest behind session.
+// Only known with a backlog policy, 0 otherwise
+double asr_thread_get_lag(asr_thread thread);
+
+// How many of the backlog decoders may decode at once, 0 for as many as
+// there are sessions. aprilasr has no setting for the threads it uses
+// itself, so without a backlog this changes nothing
+void asr_thread_set_decoder_threads(asr_thread thread, int count);
+
+typedef enum PowerState {
+    // Audio is decoded
+    POWER_ACTIVE = 0,
+
+    // Nothing was said for a while. Until there's sound again, the audio
+    // is only checked for its level and capture uses its largest fragments
+    POWER_IDLE,
+
+    // Nobody can see the captions, and capture is corked
+    POWER_SUSPENDED,
+
+    POWER_STATE_COUNT
+} PowerState;
+
+// How long a source has to go without speech before it idles, 0 to never.
+// The chunk that wakes it up is decoded, so nothing is lost
+void asr_thread_set_idle_timeout(asr_thread thread, int timeout_ms);
+
+// Drops all audio until unsuspended. The capture streams should be corked
+// as well, see audio_thread_set_corked
+void asr_thread_set_suspended(asr_thread thread, bool suspended);
+
+PowerState asr_thread_get_power_state(asr_thread thread, CaptionSource source);
+
+// The current state of each source and the time spent in each, for
+// diagnostics. Free with g_free
+char *asr_thread_describe_power(asr_thread thread);
+
+// Audio the voice activity detector rejects is not decoded. The sessions
+// are flushed when skipping starts, so the current utterance finishes
+void asr_thread_set_skip_silence(asr_thread thread, bool skip);
+
+// Handles a recorded result as if the lane's session had produced it. The
+// tokens must stay valid until the lane's next result. Returns false if the
+// lane has no session
+bool asr_thread_replay_result(asr_thread thread, CaptionSource source, size_t lane, AprilResultType result, size_t count, const AprilToken *tokens);
+
 bool asr_thread_is_errored(asr_thread thread);
 void asr_thread_set_main_window(asr_thread thread, struct _LiveCaptionsWindow *window);
-void asr_thread_enqueue_audio(asr_thread thread, short *data, size_t num_shorts);
+
+// Each enabled source gets its own session on the shared model. Only the
+// desktop source is enabled initially
+void asr_thread_enable_source(asr_thread thread, CaptionSource source, bool enable);
+
+// Sessions are realtime by default. Non-realtime sessions decode on the
+// thread that enqueues the audio and never drop any
+void asr_thread_set_realtime(asr_thread thread, bool realtime);
+void asr_thread_enqueue_audio(asr_thread thread, CaptionSource source, short *data, size_t num_shorts);
+
+// With the capture queue, asr_thread_enqueue_audio only copies the audio
+// into a locked lock-free ring, and a dedicated realtime thread feeds it to
+// the sessions. Only change it while no audio threads exist
+void asr_thread_set_capture_queue(asr_thread thread, bool enable);
 gpointer asr_thread_get_model(asr_thread thread);
-gpointer asr_thread_get_session(asr_thread thread);
+
+// Bitmask of PreprocessStage applied to the audio of every source before
+// it is decoded. Can be changed at any time
+void asr_thread_set_preprocess_stages(asr_thread thread, unsigned int stages);
+
+// aas_realtime_get_speedup of the source's main session, negative if the
+// source is not enabled. Safe from any thread, including the capture
+// callbacks
+float asr_thread_get_speedup(asr_thread thread, CaptionSource source);
 void asr_thread_pause(asr_thread thread, bool pause);
 int asr_thread_samplerate(asr_thread thread);
 void asr_thread_flush(asr_thread thread);
@@ -0,0 +1,388 @@
+/* audiocap-file.c
+ * This file contains the file implementation of audio_thread, which reads
+ * WAV or raw PCM from a file, a named pipe or stdin instead of capturing
+ * from a sound server.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+
+#include "audiocap-internal.h"
+#include "audiocap.h"
+#include "wav.h"
+
+// How long a blocked read waits before checking whether to stop
+#define POLL_INTERVAL_MS 100
+
+// The input outlives the audio threads, which are recreated whenever the
+// audio settings change. Reading continues where the previous thread left
+// off, which also keeps stdin usable since it can't be reopened
+struct file_input {
+    char *path;
+    int fd;
+    bool is_fifo;
+    bool is_stdin;
+
+    bool wav;
+    bool auto_detect;
+    bool header_parsed;
+
+    struct wav_format format;
+    off_t data_offset;
+
+    // Anything after the data chunk (e.g. metadata) is not audio
+    uint64_t data_size;
+    uint64_t data_remaining;
+
+    bool realtime;
+    bool loop;
+};
+
+static struct file_input *input = NULL;
+
+struct audio_thread_file_i {
+    asr_thread asr;
+    CaptionSource source;
+    unsigned int sample_rate;
+
+    GThread *thread;
+    gint stop;
+
+    // Input that's already in the model's format skips the resampler
+    bool passthrough;
+    struct native_converter converter;
+
+    struct fragment_control fragment;
+    gint fragment_ms;
+};
+
+bool audio_file_input_open(const struct audio_file_options *options) {
+    g_assert(input == NULL);
+
+    struct file_input *in = calloc(1, sizeof(struct file_input));
+    in->path = g_strdup(options->path);
+    in->realtime = options->realtime;
+    in->loop = options->loop;
+    in->is_stdin = g_str_equal(options->path, "-");
+
+    if(in->is_stdin) {
+        in->fd = STDIN_FILENO;
+    } else {
+        struct stat st;
+        in->is_fifo = (stat(options->path, &st) == 0) && S_ISFIFO(st.st_mode);
+
+        // Opening a FIFO blocks until there's a writer, unless non-blocking
+        in->fd = open(options->path, O_RDONLY | (in->is_fifo ? O_NONBLOCK : 0));
+        if(in->fd < 0) {
+            printf("Can't open %s: %s\n", options->path, strerror(errno));
+            g_free(in->path);
+            free(in);
+            return false;
+        }
+    }
+
+    const char *format = (options->format != NULL) ? options->format : "auto";
+    if(g_str_equal(format, "auto")) {
+        in->auto_detect = true;
+    } else if(g_str_equal(format, "wav")) {
+        in->wav = true;
+    } else if(g_str_equal(format, "s16le") || g_str_equal(format, "f32le")) {
+        in->format.sample_format = g_str_equal(format, "s16le") ? WAV_FORMAT_S16 : WAV_FORMAT_F32;
+        in->header_parsed = true;
+        in->data_size = WAV_DATA_SIZE_UNKNOWN;
+        in->data_remaining = WAV_DATA_SIZE_UNKNOWN;
+    } else {
+        printf("Unknown input format %s, expected auto, wav, s16le or f32le\n", format);
+        if(!in->is_stdin) close(in->fd);
+        g_free(in->path);
+        free(in);
+        return false;
+    }
+
+    // For raw input, and for auto-detected input that turns out to be raw
+    in->format.rate = options->rate;
+    in->format.channels = (options->channels > 0) ? options->channels : 1;
+    if(in->auto_detect) in->format.sample_format = WAV_FORMAT_S16;
+
+    printf("Reading audio from %s (%s, %s)\n",
+           in->is_stdin ? "stdin" : in->path,
+           in->is_fifo ? "named pipe" : "file",
+           in->realtime ? "paced in real time" : "as fast as possible");
+
+    input = in;
+    return true;
+}
+
+bool audio_file_input_is_open(void) {
+    return input != NULL;
+}
+
+static gboolean quit_application(void *userdata) {
+    GApplication *app = g_application_get_default();
+    if(app != NULL) g_application_quit(app);
+
+    return G_SOURCE_REMOVE;
+}
+
+// Waits until there's something to read or the thread should stop
+static bool wait_readable(audio_thread_file data) {
+    struct pollfd pfd = { .fd = input->fd, .events = POLLIN };
+
+    while(!g_atomic_int_get(&data->stop)) {
+        int result = poll(&pfd, 1, POLL_INTERVAL_MS);
+        if(result > 0) return true;
+        if((result < 0) && (errno != EINTR)) return false;
+    }
+
+    return false;
+}
+
+// Reads up to len bytes. Returns the number read, short only at the end of
+// the input or when stopping
+static size_t read_some(audio_thread_file data, void *out, size_t len) {
+    size_t total = 0;
+    while(total < len) {
+        if(!wait_readable(data)) break;
+
+        ssize_t n = read(input->fd, (char *)out + total, len - total);
+        if(n > 0) {
+            total += n;
+        } else if(n == 0) {
+            break;
+        } else if((errno != EAGAIN) && (errno != EINTR)) {
+            printf("Reading %s failed: %s\n", input->path, strerror(errno));
+            break;
+        }
+    }
+
+    return total;
+}
+
+static bool read_exact(void *userdata, void *out, size_t len) {
+    return read_some(userdata, out, len) == len;
+}
+
+// A writer closed the named pipe, wait for the next one
+static bool reopen_fifo(void) {
+    close(input->fd);
+
+    input->fd = open(input->path, O_RDONLY | O_NONBLOCK);
+    if(input->fd < 0) {
+        printf("Can't reopen %s: %s\n", input->path, strerror(errno));
+        return false;
+    }
+
+    // Every writer sends its own header
+    if(input->wav || input->auto_detect) input->header_parsed = false;
+
+    return true;
+}
+
+static bool configure_converter(audio_thread_file data) {
+    struct wav_format *format = &input->format;
+    if(format->rate == 0) format->rate = data->sample_rate;
+
+    data->passthrough = (format->sample_format == WAV_FORMAT_S16) &&
+                        (format->channels == 1) &&
+                        (format->rate == data->sample_rate);
+
+    if(data->passthrough) return true;
+
+    return native_converter_init(&data->converter, format->rate, format->channels, data->sample_rate);
+}
+
+static bool parse_header(audio_thread_file data, uint8_t *pending, size_t *pending_len) {
+    *pending_len = 0;
+
+    input->data_size = WAV_DATA_SIZE_UNKNOWN;
+
+    bool wav = input->wav;
+    if(input->auto_detect) {
+        // Raw input starts with samples, keep them
+        *pending_len = read_some(data, pending, 4);
+        if(*pending_len < 4) return false;
+
+        wav = memcmp(pending, "RIFF", 4) == 0;
+    }
+
+    if(wav) {
+        if(!wav_parse_header(read_exact, data, input->auto_detect, &input->format, &input->data_size)) return false;
+
+        *pending_len = 0;
+        if(!input->is_fifo && !input->is_stdin) input->data_offset = lseek(input->fd, 0, SEEK_CUR);
+    }
+
+    printf("Input format: %s, %u Hz, %u channels\n",
+           wav ? "WAV" : "raw PCM", (input->format.rate != 0) ? input->format.rate : data->sample_rate, input->format.channels);
+
+    input->data_remaining = input->data_size;
+    input->header_parsed = true;
+    return true;
+}
+
+// Sleeps until the stream position catches up with the wall clock
+static void pace(audio_thread_file data, gint64 start_time, uint64_t frames_read) {
+    gint64 due = start_time + (gint64)(frames_read * G_USEC_PER_SEC / input->format.rate);
+
+    for(;;) {
+        gint64 now = g_get_monotonic_time();
+        if((now >= due) || g_atomic_int_get(&data->stop)) return;
+
+        g_usleep(MIN(due - now, POLL_INTERVAL_MS * 1000));
+    }
+}
+
+static void feed(audio_thread_file data, void *block, size_t frames, float *scratch) {
+    if(data->passthrough) {
+        asr_thread_enqueue_audio(data->asr, data->source, block, frames);
+    } else {
+        wav_to_float(&input->format, block, frames, scratch);
+        native_converter_feed(&data->converter, data->asr, data->source, scratch, frames);
+    }
+}
+
+static void *run_file_thread(void *userdata) {
+    audio_thread_file data = userdata;
+
+    uint8_t pending[4];
+    size_t pending_len = 0;
+
+    void *block = NULL;
+    float *scratch = NULL;
+    size_t block_frames = 0;
+
+    gint64 start_time = g_get_monotonic_time();
+    uint64_t frames_read = 0;
+    gint64 next_update = start_time + FRAGMENT_UPDATE_INTERVAL_MS * 1000;
+
+    while(!g_atomic_int_get(&data->stop)) {
+        bool end_of_input = false;
+
+        if(!input->header_parsed) {
+            if(parse_header(data, pending, &pending_len)) {
+                if(!configure_converter(data)) break;
+                block_frames = 0;
+            } else {
+                end_of_input = true;
+            }
+        }
+
+        if(!end_of_input) {
+            size_t frame_size = wav_bytes_per_frame(&input->format);
+
+            size_t wanted = (size_t)data->fragment.fragment_ms * input->format.rate / 1000;
+            if(wanted == 0) wanted = 1;
+
+            if(block_frames != wanted) {
+                block_frames = wanted;
+                block = g_realloc(block, block_frames * frame_size);
+                scratch = g_realloc(scratch, block_frames * input->format.channels * sizeof(float));
+
+                g_atomic_int_set(&data->fragment_ms, data->fragment.fragment_ms);
+            }
+
+            // Bytes consumed by format detection are the start of the samples
+            memcpy(block, pending, pending_len);
+
+            size_t wanted_bytes = block_frames * frame_size - pending_len;
+            if(input->data_remaining != WAV_DATA_SIZE_UNKNOWN)
+                wanted_bytes = MIN(wanted_bytes, input->data_remaining);
+
+            size_t got = read_some(data, (uint8_t *)block + pending_len, wanted_bytes);
+            if(input->data_remaining != WAV_DATA_SIZE_UNKNOWN) input->data_remaining -= got;
+
+            size_t len = pending_len + got;
+            pending_len = 0;
+
+            size_t frames = len / frame_size;
+            if(frames > 0) {
+                feed(data, block, frames, scratch);
+                frames_read += frames;
+            }
+
+            end_of_input = len < (block_frames * frame_size);
+        }
+
+        if(g_atomic_int_get(&data->stop)) break;
+
+        if(end_of_input) {
+            if(input->is_fifo) {
+                printf("Writer closed %s, waiting for the next one\n", input->path);
+                if(!reopen_fifo()) break;
+
+                start_time = g_get_monotonic_time();
+                frames_read = 0;
+                continue;
+            }
+
+            if(input->loop && !input->is_stdin && (lseek(input->fd, input->data_offset, SEEK_SET) >= 0)) {
+                input->data_remaining = input->data_size;
+                continue;
+            }
+
+            printf("End of input\n");
+            asr_thread_flush(data->asr);
+            g_idle_add(quit_application, NULL);
+            break;
+        }
+
+        if(input->realtime) pace(data, start_time, frames_read);
+
+        gint64 now = g_get_monotonic_time();
+        if(now >= next_update) {
+            fragment_control_update(&data->fragment, data->asr, data->source);
+            next_update = now + FRAGMENT_UPDATE_INTERVAL_MS * 1000;
+        }
+    }
+
+    g_free(block);
+    g_free(scratch);
+
+    return NULL;
+}
+
+audio_thread_file create_audio_thread_file(asr_thread asr) {
+    audio_thread_file data = calloc(1, sizeof(struct audio_thread_file_i));
+
+    data->asr = asr;
+    data->source = CAPTION_SOURCE_DESKTOP;
+    data->sample_rate = asr_thread_samplerate(asr);
+
+    fragment_control_init(&data->fragment);
+
+    // The format is known already if a previous thread read the header
+    if(input->header_parsed) configure_converter(data);
+
+    data->thread = g_thread_new("lcap-fileinput", run_file_thread, data);
+
+    return data;
+}
+
+void audio_thread_file_get_latency(audio_thread_file thread, int *fragment_ms, double *latency_ms) {
+    *fragment_ms = g_atomic_int_get(&thread->fragment_ms);
+    *latency_ms = 0.0;
+}
+
+void free_audio_thread_file(audio_thread_file thread) {
+    g_atomic_int_set(&thread->stop, 1);
+    g_thread_join(thread->thread);
+
+    native_converter_free(&thread->converter);
+}
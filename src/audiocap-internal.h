@@ -31,6 +31,99 @@
 
 #include "asrproc.h"
 #include "audiocap.h"
+#include "resampler.h"
+
+// Bounds of the capture fragment size
+#define FRAGMENT_MIN_MS 10
+#define FRAGMENT_MAX_MS 500
+
+// How often the backends measure latency and re-evaluate the fragment size
+#define FRAGMENT_UPDATE_INTERVAL_MS 2000
+
+// Capture fragment size picked from the fragment-size-ms setting. In
+// adaptive mode it starts there and follows the decoder's realtime speedup.
+// While the source is idle it's FRAGMENT_MAX_MS, for the fewest wakeups
+struct fragment_control {
+    bool adaptive;
+    int fragment_ms;
+
+    bool idle;
+
+    // To go back to after idling
+    int active_fragment_ms;
+};
+
+void fragment_control_init(struct fragment_control *fc);
+
+// Returns true if fragment_ms has changed and should be applied to the stream
+bool fragment_control_update(struct fragment_control *fc, asr_thread asr, CaptionSource source);
+
+// Whether the source went idle or active since the last update, so it
+// should be updated now instead of at the next interval. Realtime safe
+bool fragment_control_power_changed(struct fragment_control *fc, asr_thread asr, CaptionSource source);
+
+
+// With the native-capture-format setting, audio is captured as float32 in
+// the device's rate and channel layout and converted to the model's format
+// here instead of by the sound server
+struct native_converter {
+    struct resampler *resampler;
+    short *scratch;
+    size_t scratch_len;
+
+    unsigned int rate;
+    unsigned int channels;
+};
+
+bool native_capture_enabled(void);
+
+// Returns false if the format is not supported. Keeps the filter state if
+// the format is unchanged, e.g. when the stream was moved to another device
+bool native_converter_init(struct native_converter *nc, unsigned int rate, unsigned int channels, unsigned int model_rate);
+
+// Does not allocate, so it can be used from realtime threads
+void native_converter_feed(struct native_converter *nc, asr_thread asr, CaptionSource source, const float *data, size_t frames);
+
+void native_converter_free(struct native_converter *nc);
+
+
+// Records struct capture_stats from the capture callbacks. The counters are
+// read from other threads, everything else is only used by the thread
+// running the callbacks
+struct capture_stats_recorder {
+    gint callbacks;
+    gint holes;
+    gint errors;
+    gint overruns;
+    gint lost_ms;
+    gint callback_hist[CAPTURE_HISTOGRAM_BUCKETS];
+    gint max_callback_us;
+    gint jitter_hist[CAPTURE_HISTOGRAM_BUCKETS];
+    gint max_jitter_us;
+
+    gint64 last_callback;
+    gint64 interval_us;
+
+    guint64 lost_us;
+
+    // Audio received since window_start, to detect overruns
+    gint64 window_start;
+    guint64 window_frames;
+};
+
+// Call at the start of each capture callback with the expected time between
+// callbacks. Returns the time to pass to capture_stats_end
+gint64 capture_stats_begin(struct capture_stats_recorder *rec, gint64 interval_us);
+
+// Call at the end of each capture callback with the number of frames
+// received in it at the given rate
+void capture_stats_end(struct capture_stats_recorder *rec, gint64 start, size_t frames, unsigned int rate);
+
+void capture_stats_hole(struct capture_stats_recorder *rec, guint64 lost_us);
+void capture_stats_error(struct capture_stats_recorder *rec);
+
+void capture_stats_read(struct capture_stats_recorder *rec, struct capture_stats *stats);
+
 
 struct audio_thread_pa_i;
 typedef struct audio_thread_pa_i * audio_thread_pa;
@@ -38,6 +131,9 @@ typedef struct audio_thread_pa_i * audio_thread_pa;
 audio_thread_pa create_audio_thread_pa(bool microphone, asr_thread asr);
 void *run_audio_thread_pa(void *thread);
 void free_audio_thread_pa(audio_thread_pa thread);
+void audio_thread_pa_get_latency(audio_thread_pa thread, int *fragment_ms, double *latency_ms);
+void audio_thread_pa_set_corked(audio_thread_pa thread, bool corked);
+struct capture_stats_recorder *audio_thread_pa_get_stats(audio_thread_pa thread);
 
 
 #ifdef LIVE_CAPTIONS_PIPEWIRE
@@ -45,6 +141,21 @@ struct audio_thread_pw_i;
 typedef struct audio_thread_pw_i * audio_thread_pw;
 
 audio_thread_pw create_audio_thread_pw(bool microphone, asr_thread asr);
-void *run_audio_thread_pw(void *thread);
+
+// Starts capturing on a PipeWire thread loop. Returns false if PipeWire is
+// not available, in which case the thread still needs to be freed
+bool run_audio_thread_pw(audio_thread_pw thread);
 void free_audio_thread_pw(audio_thread_pw thread);
+void audio_thread_pw_get_latency(audio_thread_pw thread, int *fragment_ms, double *latency_ms);
+void audio_thread_pw_set_corked(audio_thread_pw thread, bool corked);
+struct capture_stats_recorder *audio_thread_pw_get_stats(audio_thread_pw thread);
 #endif
+
+
+struct audio_thread_file_i;
+typedef struct audio_thread_file_i * audio_thread_file;
+
+// Reads from the input opened with audio_file_input_open on its own thread
+audio_thread_file create_audio_thread_file(asr_thread asr);
+void free_audio_thread_file(audio_thread_file thread);
+void audio_thread_file_get_latency(audio_thread_file thread, int *fragment_ms, double *latency_ms);
@@ -33,10 +33,12 @@
 
 #include "audiocap-internal.h"
 #include "audiocap.h"
+#include "rt.h"
 
 struct audio_thread_pa_i {
     asr_thread asr;
     bool microphone;
+    CaptionSource source;
     size_t sample_rate;
 
     char *sink_name;
@@ -47,15 +49,86 @@ struct audio_thread_pa_i {
     pa_context *context;
     pa_stream *stream;
 
+    pa_sample_spec sample_spec;
+    pa_sample_spec server_spec;
+    bool native;
+    struct native_converter converter;
+
+    struct fragment_control fragment;
+    pa_time_event *update_event;
+
+    // Read from other threads
+    gint fragment_ms;
+    gint latency_us;
+
+    // Set from the main thread
+    gint corked;
+
+    struct capture_stats_recorder stats;
+
+    // The mainloop thread is promoted on the first callback
+    bool realtime;
+    bool promoted;
 };
 
 static void context_state_cb(pa_context* context, void* userdata);
 static void stream_state_cb(pa_stream *s, void *userdata);
 static void stream_success_cb(pa_stream *stream, int success, void *userdata);
 static void stream_read_cb(pa_stream *stream, size_t nbytes, void *userdata);
+static void update_event_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata);
 
-static void server_info_callback(pa_context *c, const pa_server_info *i, void *userdata){
-    audio_thread_pa data = (audio_thread_pa)userdata;
+static void schedule_update(audio_thread_pa data) {
+    struct timeval tv;
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, FRAGMENT_UPDATE_INTERVAL_MS * PA_USEC_PER_MSEC);
+
+    if(data->update_event == NULL)
+        data->update_event = data->mainloop_api->time_new(data->mainloop_api, &tv, update_event_cb, data);
+    else
+        data->mainloop_api->time_restart(data->update_event, &tv);
+}
+
+static void buffer_attr_cb(pa_stream *stream, int success, void *userdata) {
+    audio_thread_pa data = userdata;
+
+    // The server may not give exactly what was asked for
+    const pa_buffer_attr *attr = pa_stream_get_buffer_attr(stream);
+    if(success && (attr != NULL)) {
+        int fragment_ms = (int)(pa_bytes_to_usec(attr->fragsize, &data->sample_spec) / PA_USEC_PER_MSEC);
+        g_atomic_int_set(&data->fragment_ms, fragment_ms);
+
+        printf("Capture fragment size: %d ms (requested %d ms)\n", fragment_ms, data->fragment.fragment_ms);
+    }
+}
+
+// Runs on the mainloop thread with the lock held
+static void update_fragment(audio_thread_pa data) {
+    if(fragment_control_update(&data->fragment, data->asr, data->source)) {
+        pa_buffer_attr attr = *pa_stream_get_buffer_attr(data->stream);
+        attr.fragsize = pa_usec_to_bytes(data->fragment.fragment_ms * PA_USEC_PER_MSEC, &data->sample_spec);
+
+        pa_operation *o = pa_stream_set_buffer_attr(data->stream, &attr, buffer_attr_cb, data);
+        if(o != NULL) pa_operation_unref(o);
+    }
+}
+
+// Runs on the mainloop thread with the lock held
+static void update_event_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    audio_thread_pa data = userdata;
+
+    pa_usec_t latency;
+    int negative;
+    if(pa_stream_get_latency(data->stream, &latency, &negative) == 0)
+        g_atomic_int_set(&data->latency_us, negative ? 0 : (gint)latency);
+
+    update_fragment(data);
+
+    schedule_update(data);
+}
+
+static void set_device_names(audio_thread_pa data, const pa_server_info *i) {
+    free(data->source_name);
+    free(data->sink_name);
 
     data->source_name = (char *)calloc(1, strlen(i->default_source_name) + 1);
     strcpy(data->source_name, i->default_source_name);
@@ -63,10 +136,60 @@ static void server_info_callback(pa_context *c, const pa_server_info *i, void *u
     data->sink_name = (char *)calloc(1, strlen(i->default_sink_name) + 9);
     strcpy(data->sink_name, i->default_sink_name);
     strcat(data->sink_name, ".monitor");
+}
+
+static void server_info_callback(pa_context *c, const pa_server_info *i, void *userdata){
+    audio_thread_pa data = (audio_thread_pa)userdata;
+
+    set_device_names(data, i);
+    data->server_spec = i->sample_spec;
 
     pa_threaded_mainloop_signal(data->mainloop, 0);
 }
 
+static void move_callback(pa_context *c, int success, void *userdata) {
+    if(!success) printf("Moving capture stream failed: %s\n", pa_strerror(pa_context_errno(c)));
+}
+
+// The default device changed. The stream is moved to the new one in place,
+// so the ASR session keeps going without a flush or a new stream
+static void server_changed_callback(pa_context *c, const pa_server_info *i, void *userdata){
+    audio_thread_pa data = (audio_thread_pa)userdata;
+    if((i == NULL) || (data->stream == NULL)) return;
+
+    const char *current = data->microphone ? data->source_name : data->sink_name;
+    char *target = data->microphone ? g_strdup(i->default_source_name)
+                                    : g_strconcat(i->default_sink_name, ".monitor", NULL);
+
+    if(g_str_equal(current, target)) {
+        g_free(target);
+        return;
+    }
+
+    set_device_names(data, i);
+
+    printf("Default device changed, moving capture to %s\n", target);
+
+    pa_operation *o = pa_context_move_source_output_by_name(c, pa_stream_get_index(data->stream), target, move_callback, data);
+    if(o != NULL) pa_operation_unref(o);
+
+    g_free(target);
+}
+
+static void subscribe_callback(pa_context *c, pa_subscription_event_type_t t, uint32_t idx, void *userdata) {
+    audio_thread_pa data = (audio_thread_pa)userdata;
+
+    if(((t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) != PA_SUBSCRIPTION_EVENT_SERVER) ||
+       ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) != PA_SUBSCRIPTION_EVENT_CHANGE)) return;
+
+    pa_operation *o = pa_context_get_server_info(c, server_changed_callback, data);
+    if(o != NULL) pa_operation_unref(o);
+}
+
+static void stream_moved_callback(pa_stream *stream, void *userdata) {
+    printf("Capturing from %s\n", pa_stream_get_device_name(stream));
+}
+
 void *run_audio_thread_pa(void *userdata) {
     audio_thread_pa data = (audio_thread_pa)userdata;
 
@@ -110,11 +233,27 @@ void *run_audio_thread_pa(void *userdata) {
     pa_channel_map map;
     pa_channel_map_init_mono(&map);
 
+    // The server's default format stands in for the device's native format
+    data->native = native_capture_enabled() && native_converter_init(&data->converter,
+        data->server_spec.rate, data->server_spec.channels, data->sample_rate);
+
+    if(data->native) {
+        sample_specifications.format = PA_SAMPLE_FLOAT32LE;
+        sample_specifications.rate = data->server_spec.rate;
+        sample_specifications.channels = data->server_spec.channels;
+        pa_channel_map_init_auto(&map, sample_specifications.channels, PA_CHANNEL_MAP_DEFAULT);
+    }
+
+    data->sample_spec = sample_specifications;
+
+    fragment_control_init(&data->fragment);
+
     data->stream = pa_stream_new(data->context, "Record", &sample_specifications, &map);
     g_assert(data->stream);
 
     pa_stream_set_state_callback(data->stream, stream_state_cb, data);
     pa_stream_set_read_callback(data->stream, stream_read_cb, data);
+    pa_stream_set_moved_callback(data->stream, stream_moved_callback, data);
 
     // recommended settings, i.e. server uses sensible values
     pa_buffer_attr buffer_attr;
@@ -122,7 +261,7 @@ void *run_audio_thread_pa(void *userdata) {
     buffer_attr.tlength = (uint32_t) -1;
     buffer_attr.prebuf = (uint32_t) -1;
     buffer_attr.minreq = (uint32_t) -1;
-    buffer_attr.fragsize = pa_usec_to_bytes(50000, &sample_specifications);
+    buffer_attr.fragsize = pa_usec_to_bytes(data->fragment.fragment_ms * PA_USEC_PER_MSEC, &sample_specifications);
 
     // Settings copied as per the chromium browser source
     pa_stream_flags_t stream_flags;
@@ -141,13 +280,24 @@ void *run_audio_thread_pa(void *userdata) {
         pa_threaded_mainloop_wait(data->mainloop);
     }
 
-    // Uncork the stream so it will start recording
-    pa_stream_cork(data->stream, 0, stream_success_cb, data);
-    for(;;) {
-        if (pa_stream_is_corked(data->stream) == 0) break;
-        pa_threaded_mainloop_wait(data->mainloop);
+    // Uncork the stream so it will start recording, unless it was corked
+    // in the meantime
+    if(!g_atomic_int_get(&data->corked)) {
+        pa_stream_cork(data->stream, 0, stream_success_cb, data);
+        for(;;) {
+            if (pa_stream_is_corked(data->stream) == 0) break;
+            pa_threaded_mainloop_wait(data->mainloop);
+        }
     }
 
+    buffer_attr_cb(data->stream, 1, data);
+    schedule_update(data);
+
+    // Follow changes of the default sink or source
+    pa_context_set_subscribe_callback(data->context, subscribe_callback, data);
+    pa_operation *o = pa_context_subscribe(data->context, PA_SUBSCRIPTION_MASK_SERVER, NULL, NULL);
+    if(o != NULL) pa_operation_unref(o);
+
     pa_threaded_mainloop_unlock(data->mainloop);
 
     return NULL;
@@ -166,33 +316,58 @@ static void stream_state_cb(pa_stream *s, void *userdata) {
 static void stream_read_cb(pa_stream *stream, size_t nbytes, void *userdata) {
     audio_thread_pa data = (audio_thread_pa)userdata;
 
+    if(data->realtime && !data->promoted) {
+        rt_make_current_thread_realtime("PulseAudio capture", RT_PRIORITY_CAPTURE);
+        data->promoted = true;
+    }
+
+    gint64 start = capture_stats_begin(&data->stats, g_atomic_int_get(&data->fragment_ms) * 1000);
+
+    size_t frame_size = pa_frame_size(&data->sample_spec);
+    size_t frames = 0;
+
     ssize_t nbytes1 = (ssize_t)nbytes;
     while(nbytes1 > 0) {
         size_t count = nbytes1;
         const void *audio_data;
         int result = pa_stream_peek(stream, &audio_data, &count);
 
-        if(count == 0) return;
+        if(result != 0) {
+            printf("pa_stream_peek error %d\n", result);
+            capture_stats_error(&data->stats);
+            break;
+        }
+
+        if(count == 0) break;
 
         if(audio_data == NULL) {
             // hole
+            capture_stats_hole(&data->stats, pa_bytes_to_usec(count, &data->sample_spec));
             pa_stream_drop(stream);
-            return;
+            break;
         }
 
-        if(result != 0) {
-            printf("pa_stream_peek error %d\n", result);
-            return;
-        }
+        if(data->realtime) rt_section_enter();
 
-        if(data->asr != NULL){
-            asr_thread_enqueue_audio(data->asr, (short *)audio_data, count/2);
+        if(data->native){
+            native_converter_feed(&data->converter, data->asr, data->source, (const float *)audio_data, count / frame_size);
+        }else if(data->asr != NULL){
+            asr_thread_enqueue_audio(data->asr, data->source, (short *)audio_data, count/2);
         }
 
+        if(data->realtime) rt_section_leave();
+
         pa_stream_drop(stream);
 
+        frames += count / frame_size;
         nbytes1 -= count;
     }
+
+    capture_stats_end(&data->stats, start, frames, data->sample_spec.rate);
+
+    // Small fragments are needed right away once there's speech again
+    if(fragment_control_power_changed(&data->fragment, data->asr, data->source))
+        update_fragment(data);
 }
 
 static void stream_success_cb(pa_stream *stream, int success, void *userdata) {
@@ -205,16 +380,51 @@ audio_thread_pa create_audio_thread_pa(bool microphone, asr_thread asr) {
     audio_thread_pa data = calloc(1, sizeof(struct audio_thread_pa_i));
 
     data->microphone = microphone;
+    data->source = microphone ? CAPTION_SOURCE_MICROPHONE : CAPTION_SOURCE_DESKTOP;
     data->asr = asr;
     data->sample_rate = asr_thread_samplerate(asr);
+    data->realtime = realtime_capture_enabled();
 
     return data;
 }
 
 
+void audio_thread_pa_get_latency(audio_thread_pa thread, int *fragment_ms, double *latency_ms) {
+    *fragment_ms = g_atomic_int_get(&thread->fragment_ms);
+    *latency_ms = g_atomic_int_get(&thread->latency_us) / 1000.0;
+}
+
+void audio_thread_pa_set_corked(audio_thread_pa thread, bool corked) {
+    g_atomic_int_set(&thread->corked, corked);
+
+    // Before the stream is ready, run_audio_thread_pa checks the flag
+    if(thread->mainloop == NULL) return;
+
+    pa_threaded_mainloop_lock(thread->mainloop);
+
+    if((thread->stream != NULL) && (pa_stream_get_state(thread->stream) == PA_STREAM_READY)) {
+        pa_operation *o = pa_stream_cork(thread->stream, corked, NULL, NULL);
+        if(o != NULL) pa_operation_unref(o);
+    }
+
+    pa_threaded_mainloop_unlock(thread->mainloop);
+}
+
+struct capture_stats_recorder *audio_thread_pa_get_stats(audio_thread_pa thread) {
+    return &thread->stats;
+}
+
 void free_audio_thread_pa(audio_thread_pa thread){
     // Cork the stream
     pa_threaded_mainloop_lock(thread->mainloop);
+
+    pa_context_set_subscribe_callback(thread->context, NULL, NULL);
+
+    if(thread->update_event != NULL) {
+        thread->mainloop_api->time_free(thread->update_event);
+        thread->update_event = NULL;
+    }
+
     pa_stream_cork(thread->stream, 1, stream_success_cb, thread);
     for(;;) {
         if (pa_stream_is_corked(thread->stream) == 1) break;
@@ -236,4 +446,6 @@ void free_audio_thread_pa(audio_thread_pa thread){
 
     free(thread->sink_name);
     free(thread->source_name);
+
+    native_converter_free(&thread->converter);
 }
@@ -1,6 +1,5 @@
 /* audiocap-pw.c
- * This file contains the pipewire implementation of audio_thread. Currently
- * not used since pulse works fine. Probably to be deleted
+ * This file contains the pipewire implementation of audio_thread
  *
  * Copyright 2022 abb128
  *
@@ -21,12 +20,7 @@
 #ifdef LIVE_CAPTIONS_PIPEWIRE
 #include <stdio.h>
 #include <errno.h>
-#include <signal.h>
-#include <math.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <ctype.h>
-#include <sys/mman.h>
+#include <string.h>
 #include <spa/param/audio/format-utils.h>
 #include <pipewire/pipewire.h>
 #include <glib.h>
@@ -34,60 +28,140 @@
 #include <april_api.h>
 
 #include "audiocap-internal.h"
+#include "rt.h"
 #include "audiocap.h"
 
 struct audio_thread_pw_i {
     asr_thread asr;
 
     bool microphone;
+    CaptionSource source;
     size_t sample_rate;
-    size_t channels;
 
-    struct pw_main_loop *loop;
+    struct pw_thread_loop *loop;
+    struct pw_context *context;
+    struct pw_core *core;
     struct pw_stream *stream;
+    struct spa_hook stream_listener;
+    struct spa_source *update_timer;
 
     struct spa_audio_info format;
+    struct fragment_control fragment;
+
+    // Capturing in the graph's format and converting it ourselves
+    bool native;
+    struct native_converter converter;
+
+    // Read from other threads
+    gint fragment_ms;
+    gint latency_us;
+
+    struct capture_stats_recorder stats;
+    size_t last_frames;
+
+    // on_process already runs on PipeWire's data thread, which module-rt
+    // makes realtime. This only checks that nothing allocates there
+    bool realtime;
+
+    // An update was requested from on_process and hasn't run yet
+    gint update_pending;
 };
 
-/* our data processing function is in general:
- *
- *  struct pw_buffer *b;
- *  b = pw_stream_dequeue_buffer(stream);
- *
- *  .. consume stuff in the buffer ...
- *
- *  pw_stream_queue_buffer(stream, b);
- */
+// The requested quantum, the graph may still pick a different one
+static void format_node_latency(audio_thread_pw data, char *out, size_t len) {
+    unsigned int rate = data->sample_rate;
+    unsigned int nom = data->fragment.fragment_ms * rate / 1000;
+
+    snprintf(out, len, "%u/%u", nom, rate);
+    g_atomic_int_set(&data->fragment_ms, data->fragment.fragment_ms);
+}
+
+// Runs on the loop thread with the loop lock held
+static void on_update_timer(void *userdata, uint64_t expirations) {
+    audio_thread_pw data = userdata;
+
+    struct pw_time time;
+    if((pw_stream_get_time_n(data->stream, &time, sizeof(time)) == 0) && (time.rate.denom != 0)) {
+        int64_t latency_us = time.delay * 1000000 * time.rate.num / time.rate.denom;
+        g_atomic_int_set(&data->latency_us, (gint)MAX(latency_us, 0));
+    }
+
+    if(fragment_control_update(&data->fragment, data->asr, data->source)) {
+        char latency[64];
+        format_node_latency(data, latency, sizeof(latency));
+
+        struct spa_dict_item items[] = { SPA_DICT_ITEM_INIT(PW_KEY_NODE_LATENCY, latency) };
+        pw_stream_update_properties(data->stream, &SPA_DICT_INIT_ARRAY(items));
+
+        printf("Capture node latency: %s\n", latency);
+    }
+}
+
+static int invoke_update(struct spa_loop *loop, bool async, uint32_t seq, const void *payload, size_t size, void *userdata) {
+    audio_thread_pw data = userdata;
+
+    g_atomic_int_set(&data->update_pending, 0);
+    on_update_timer(data, 0);
+
+    return 0;
+}
+
+// Called on the realtime data thread. The buffers are mapped, so the samples
+// are passed to the ASR straight out of the pw_buffer without a copy
 static void on_process(void *userdata) {
     audio_thread_pw data = userdata;
     struct pw_buffer *b;
-    struct spa_buffer *buf;
-    short *samples;
-    uint32_t n_channels, n_samples;
+
+    // Each cycle is one quantum, whatever the graph picked, so the last
+    // buffer's length is what the time between callbacks should be
+    unsigned int rate = data->format.info.raw.rate;
+    gint64 interval_us = g_atomic_int_get(&data->fragment_ms) * 1000;
+    if((data->last_frames > 0) && (rate > 0))
+        interval_us = (gint64)data->last_frames * G_USEC_PER_SEC / rate;
+
+    gint64 start = capture_stats_begin(&data->stats, interval_us);
+    size_t frames = 0;
 
     if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL) {
         pw_log_warn("out of buffers: %m");
+        capture_stats_error(&data->stats);
+        capture_stats_end(&data->stats, start, 0, rate);
         return;
     }
 
-    buf = b->buffer;
-    if ((samples = buf->datas[0].data) == NULL) {
-        printf("null buff\n");
-        return;
-    }
+    struct spa_data *d = &b->buffer->datas[0];
+    if((d->data != NULL) && (d->chunk != NULL) && (data->asr != NULL)) {
+        uint32_t offset = SPA_MIN(d->chunk->offset, d->maxsize);
+        uint32_t size = SPA_MIN(d->chunk->size, d->maxsize - offset);
+
+        size_t frame_size = (data->native ? sizeof(float) : sizeof(short)) * MAX(data->format.info.raw.channels, 1);
+        frames = size / frame_size;
 
-    n_channels = data->format.info.raw.channels;
-    n_samples = buf->datas[0].chunk->size / sizeof(short);
+        if(data->realtime) rt_section_enter();
 
-    g_assert(n_channels == 1);
-    g_assert(sizeof(short) == 2);
+        if(d->chunk->flags & SPA_CHUNK_FLAG_CORRUPTED) {
+            capture_stats_hole(&data->stats, interval_us);
+        } else if(data->native) {
+            native_converter_feed(&data->converter, data->asr, data->source, SPA_PTROFF(d->data, offset, float), frames);
+        } else {
+            asr_thread_enqueue_audio(data->asr, data->source, SPA_PTROFF(d->data, offset, short), size / sizeof(short));
+        }
 
-    if(data->asr != NULL){
-        asr_thread_enqueue_audio(data->asr, samples, n_samples);
+        if(data->realtime) rt_section_leave();
     }
-    // ...
 
     pw_stream_queue_buffer(data->stream, b);
+
+    if(frames > 0) data->last_frames = frames;
+    capture_stats_end(&data->stats, start, frames, rate);
+
+    // Small fragments are needed right away once there's speech again. The
+    // stream can't be changed from here, so the loop thread does it
+    if(fragment_control_power_changed(&data->fragment, data->asr, data->source) &&
+       g_atomic_int_compare_and_exchange(&data->update_pending, 0, 1))
+    {
+        pw_loop_invoke(pw_thread_loop_get_loop(data->loop), invoke_update, 0, NULL, 0, false, data);
+    }
 }
 
 
@@ -112,106 +186,196 @@ static void on_stream_param_changed(void *_data, uint32_t id, const struct spa_p
     fprintf(stdout, "capturing rate:%d channels:%d\n",
             data->format.info.raw.rate, data->format.info.raw.channels);
 
-    data->sample_rate = data->format.info.raw.rate;
-    data->channels = data->format.info.raw.channels;
+    if(data->native) {
+        if(!native_converter_init(&data->converter, data->format.info.raw.rate, data->format.info.raw.channels, data->sample_rate)) {
+            printf("Unsupported native capture format\n");
+        }
+
+        return;
+    }
+
+    // The stream adapter should convert to what we asked for
+    if((data->format.info.raw.channels != 1) || (data->format.info.raw.rate != data->sample_rate)) {
+        printf("Unexpected capture format, expected rate:%zu channels:1\n", data->sample_rate);
+    }
+}
+
+static void on_stream_state_changed(void *_data, enum pw_stream_state old, enum pw_stream_state state, const char *error) {
+    if(state == PW_STREAM_STATE_ERROR) {
+        printf("PipeWire stream error: %s\n", error ? error : "unknown");
+    }
 }
 
 static const struct pw_stream_events stream_events = {
     PW_VERSION_STREAM_EVENTS,
+    .state_changed = on_stream_state_changed,
     .param_changed = on_stream_param_changed,
     .process = on_process,
 };
 
-static void do_quit(void *userdata, G_GNUC_UNUSED int signal_number) {
-    audio_thread_pw data = userdata;
-    pw_main_loop_quit(data->loop);
-}
-
-void *run_audio_thread_pw(void *userdata) {
-    audio_thread_pw data = (audio_thread_pw)userdata;
-
+bool run_audio_thread_pw(audio_thread_pw data) {
     const struct spa_pod *params[1];
     uint8_t buffer[1024];
-    struct pw_properties *props;
     struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-    data->loop = pw_main_loop_new(NULL);
+    data->loop = pw_thread_loop_new("lcap-audiothread", NULL);
+    if(data->loop == NULL) {
+        printf("pw_thread_loop_new failed\n");
+        return false;
+    }
+
+    data->context = pw_context_new(pw_thread_loop_get_loop(data->loop), NULL, 0);
+    if(data->context == NULL) {
+        printf("pw_context_new failed\n");
+        return false;
+    }
 
-    pw_loop_add_signal(pw_main_loop_get_loop(data->loop), SIGINT, do_quit, data);
-    pw_loop_add_signal(pw_main_loop_get_loop(data->loop), SIGTERM, do_quit, data);
+    // Fails if there's no PipeWire daemon, e.g. when running on PulseAudio
+    data->core = pw_context_connect(data->context, NULL, 0);
+    if(data->core == NULL) {
+        printf("Can't connect to PipeWire: %s\n", strerror(errno));
+        return false;
+    }
 
-    unsigned int latency_ms = 100;
     unsigned int rate = data->sample_rate;
-    unsigned int nom = latency_ms * rate / 1000;
 
-    props = pw_properties_new(
+    data->native = native_capture_enabled();
+
+    fragment_control_init(&data->fragment);
+
+    char latency[64];
+    format_node_latency(data, latency, sizeof(latency));
+
+    struct pw_properties *props = pw_properties_new(
             PW_KEY_MEDIA_TYPE,     "Audio",
             PW_KEY_MEDIA_CATEGORY, "Capture",
             PW_KEY_NODE_NAME,      "LiveCaptions",
+            PW_KEY_APP_NAME,       "Live Captions",
             NULL);
-    
-    pw_properties_setf(props, PW_KEY_NODE_RATE, "1/%u", rate);
-    pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%u/%u", nom, rate);
-    pw_properties_set(props, PW_KEY_AUDIO_FORMAT, "S16");
+
+    // In native mode, the graph rate is left alone and we resample
+    if(!data->native) pw_properties_setf(props, PW_KEY_NODE_RATE, "1/%u", rate);
+    pw_properties_set(props, PW_KEY_NODE_LATENCY, latency);
 
     if(data->microphone) {
-        // Ask pipewire to capture microphone input
+        // Capture the default source
         pw_properties_set(props, PW_KEY_MEDIA_ROLE, "Communication");
         pw_properties_set(props, PW_KEY_STREAM_CAPTURE_SINK, "false");
     } else {
-        // Ask pipewire to capture desktop audio
+        // Capture the monitor of the default sink
         pw_properties_set(props, PW_KEY_MEDIA_ROLE, "Accessibility");
         pw_properties_set(props, PW_KEY_STREAM_CAPTURE_SINK, "true");
     }
 
-    data->stream = pw_stream_new_simple(
-            pw_main_loop_get_loop(data->loop),
-            "audio-capture",
-            props,
-            &stream_events,
-            data);
+    // No target object is set, so the session manager moves the stream
+    // along when the default device changes, without reconnecting it.
+    // param_changed then fires again if the new device's format differs
+
+    data->stream = pw_stream_new(data->core, "audio-capture", props);
+    if(data->stream == NULL) {
+        printf("pw_stream_new failed\n");
+        return false;
+    }
+
+    pw_stream_add_listener(data->stream, &data->stream_listener, &stream_events, data);
 
     /* Make one parameter with the supported formats. The SPA_PARAM_EnumFormat
      * id means that this is a format enumeration (of 1 value).
-     * We leave the channels and rate empty to accept the native graph
-     * rate and channels. */
-    params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
-            &SPA_AUDIO_INFO_RAW_INIT(
-                .format = SPA_AUDIO_FORMAT_S16,
-                .rate = rate,
-                .channels = 1 ));
+     * Normally rate and channels are fixed to what the model takes, so the
+     * conversion happens in the PipeWire adapter. In native mode they are
+     * left unset, so the graph's own format is negotiated */
+    if(data->native) {
+        params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
+                &SPA_AUDIO_INFO_RAW_INIT(
+                    .format = SPA_AUDIO_FORMAT_F32 ));
+    } else {
+        params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
+                &SPA_AUDIO_INFO_RAW_INIT(
+                    .format = SPA_AUDIO_FORMAT_S16,
+                    .rate = rate,
+                    .channels = 1 ));
+    }
 
     /* Now connect this stream. We ask that our process function is
      * called in a realtime thread. */
-    pw_stream_connect(data->stream,
+    int result = pw_stream_connect(data->stream,
               PW_DIRECTION_INPUT,
               PW_ID_ANY,
               PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS,
-                      // TODO: RT_PROCESS may not be correct here, but omitting
-                      // it causes on_process to stop getting called sometimes
-                      // for some reason
               params, 1);
 
-    /* and wait while we let things run */
-    pw_main_loop_run(data->loop);
+    if(result < 0) {
+        printf("pw_stream_connect failed: %s\n", strerror(-result));
+        return false;
+    }
+
+    struct pw_loop *loop = pw_thread_loop_get_loop(data->loop);
+    data->update_timer = pw_loop_add_timer(loop, on_update_timer, data);
+
+    struct timespec interval = {
+        .tv_sec = FRAGMENT_UPDATE_INTERVAL_MS / 1000,
+        .tv_nsec = (FRAGMENT_UPDATE_INTERVAL_MS % 1000) * 1000000
+    };
+    pw_loop_update_timer(loop, data->update_timer, &interval, &interval, false);
+
+    printf("Capture node latency: %s\n", latency);
+
+    if(pw_thread_loop_start(data->loop) < 0) {
+        printf("pw_thread_loop_start failed\n");
+        return false;
+    }
+
+    return true;
+}
 
-    pw_stream_destroy(data->stream);
-    pw_main_loop_destroy(data->loop);
-    
-    return NULL;
+void audio_thread_pw_get_latency(audio_thread_pw thread, int *fragment_ms, double *latency_ms) {
+    *fragment_ms = g_atomic_int_get(&thread->fragment_ms);
+    *latency_ms = g_atomic_int_get(&thread->latency_us) / 1000.0;
+}
+
+void audio_thread_pw_set_corked(audio_thread_pw thread, bool corked) {
+    if((thread->loop == NULL) || (thread->stream == NULL)) return;
+
+    pw_thread_loop_lock(thread->loop);
+    pw_stream_set_active(thread->stream, !corked);
+    pw_thread_loop_unlock(thread->loop);
+}
+
+struct capture_stats_recorder *audio_thread_pw_get_stats(audio_thread_pw thread) {
+    return &thread->stats;
 }
 
 audio_thread_pw create_audio_thread_pw(bool microphone, asr_thread asr){
     audio_thread_pw data = calloc(1, sizeof(struct audio_thread_pw_i));
-    
+
+    pw_init(NULL, NULL);
+
     data->microphone = microphone;
+    data->source = microphone ? CAPTION_SOURCE_MICROPHONE : CAPTION_SOURCE_DESKTOP;
     data->asr = asr;
     data->sample_rate = asr_thread_samplerate(asr);
+    data->realtime = realtime_capture_enabled();
 
     return data;
 }
 
+// Also cleans up after a failed run_audio_thread_pw
 void free_audio_thread_pw(audio_thread_pw thread) {
-    pw_main_loop_quit(thread->loop);
+    if(thread->loop != NULL) pw_thread_loop_stop(thread->loop);
+
+    if(thread->update_timer != NULL) pw_loop_destroy_source(pw_thread_loop_get_loop(thread->loop), thread->update_timer);
+
+    if(thread->stream != NULL) pw_stream_destroy(thread->stream);
+    if(thread->core != NULL) pw_core_disconnect(thread->core);
+    if(thread->context != NULL) pw_context_destroy(thread->context);
+    if(thread->loop != NULL) pw_thread_loop_destroy(thread->loop);
+
+    native_converter_free(&thread->converter);
+
+    thread->update_timer = NULL;
+    thread->stream = NULL;
+    thread->core = NULL;
+    thread->context = NULL;
+    thread->loop = NULL;
 }
 #endif
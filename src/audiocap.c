@@ -1,6 +1,8 @@
 /* audiocap.c
  * This file implements audio_thread using either the pipewire or pulse backend.
- * Currently only the pulse backend is used.
+ * The backend is picked by the audio-backend setting, automatically
+ * preferring PipeWire when it's available. An input given on the command
+ * line overrides both with the file backend.
  *
  * Copyright 2022 abb128
  *
@@ -20,65 +22,417 @@
 
 #include "audiocap.h"
 #include "audiocap-internal.h"
+#include "rt.h"
 
+#include <string.h>
 #include <pulse/pulseaudio.h>
 #include <april_api.h>
-
-#define USE_PULSEAUDIO 1
+#include <adwaita.h>
 
 struct audio_thread_i {
-#ifdef LIVE_CAPTIONS_PIPEWIRE
-    GThread * pw_thread_id;
-#endif
-
-    bool using_pulse;
+    AudioBackend backend;
     union {
         audio_thread_pa pulse;
+        audio_thread_file file;
 #ifdef LIVE_CAPTIONS_PIPEWIRE
         audio_thread_pw pipewire;
 #endif
     } thread;
 };
 
+static GSettings *settings = NULL;
 
-static void *run_audio_thread(void *userdata) {
-    audio_thread data = (audio_thread)userdata;
+#ifdef LIVE_CAPTIONS_PIPEWIRE
+static bool try_pipewire(audio_thread data, bool microphone, asr_thread asr) {
+    audio_thread_pw pw = create_audio_thread_pw(microphone, asr);
+
+    if(!run_audio_thread_pw(pw)) {
+        free_audio_thread_pw(pw);
+        free(pw);
+        return false;
+    }
 
-    return NULL;
+    data->backend = AUDIO_BACKEND_PIPEWIRE;
+    data->thread.pipewire = pw;
+    return true;
 }
+#endif
 
 audio_thread create_audio_thread(bool microphone, asr_thread asr){
+    if(settings == NULL) settings = g_settings_new("net.sapples.LiveCaptions");
+
     audio_thread data = calloc(1, sizeof(struct audio_thread_i));
-    
-    data->using_pulse = USE_PULSEAUDIO;
 
-    if(data->using_pulse) {
-        data->thread.pulse = create_audio_thread_pa(microphone, asr);
-        run_audio_thread_pa(data->thread.pulse);
+    if(audio_file_input_is_open()) {
+        data->backend = AUDIO_BACKEND_FILE;
+        data->thread.file = create_audio_thread_file(asr);
+        return data;
     }
+
+    char *backend = g_settings_get_string(settings, "audio-backend");
+    bool want_pulse = g_str_equal(backend, "pulseaudio");
+
 #ifdef LIVE_CAPTIONS_PIPEWIRE
-      else {
-        data->thread.pipewire = create_audio_thread_pw(microphone, asr);
-        data->pw_thread_id = g_thread_new("lcap-audiothread", run_audio_thread_pw, data->thread.pipewire);
+    if(!want_pulse && try_pipewire(data, microphone, asr)) {
+        g_free(backend);
+        printf("Capturing audio with PipeWire\n");
+        return data;
     }
+
+    if(!want_pulse) printf("PipeWire is not available, falling back to PulseAudio\n");
+#else
+    if(g_str_equal(backend, "pipewire")) printf("Built without PipeWire support, using PulseAudio\n");
 #endif
 
+    g_free(backend);
+
+    data->backend = AUDIO_BACKEND_PULSE;
+    data->thread.pulse = create_audio_thread_pa(microphone, asr);
+    run_audio_thread_pa(data->thread.pulse);
+
+    printf("Capturing audio with PulseAudio\n");
+
     return data;
 }
 
-void free_audio_thread(audio_thread thread) {
-    if(thread->using_pulse){
-        free_audio_thread_pa(thread->thread.pulse);
-        free(thread->thread.pulse);
+AudioBackend audio_thread_get_backend(audio_thread thread) {
+    return thread->backend;
+}
+
+const char *audio_backend_name(AudioBackend backend) {
+    switch(backend) {
+        case AUDIO_BACKEND_PULSE: return "PulseAudio";
+        case AUDIO_BACKEND_PIPEWIRE: return "PipeWire";
+        case AUDIO_BACKEND_FILE: return "file input";
+        default: return "unknown";
+    }
+}
+
+void audio_thread_get_latency(audio_thread thread, int *fragment_ms, double *latency_ms) {
+    switch(thread->backend) {
+        case AUDIO_BACKEND_PULSE:
+            audio_thread_pa_get_latency(thread->thread.pulse, fragment_ms, latency_ms);
+            break;
+        case AUDIO_BACKEND_FILE:
+            audio_thread_file_get_latency(thread->thread.file, fragment_ms, latency_ms);
+            break;
+#ifdef LIVE_CAPTIONS_PIPEWIRE
+        case AUDIO_BACKEND_PIPEWIRE:
+            audio_thread_pw_get_latency(thread->thread.pipewire, fragment_ms, latency_ms);
+            break;
+#endif
+        default:
+            *fragment_ms = 0;
+            *latency_ms = 0.0;
+            break;
+    }
+}
+
+void audio_thread_set_corked(audio_thread thread, bool corked) {
+    switch(thread->backend) {
+        case AUDIO_BACKEND_PULSE:
+            audio_thread_pa_set_corked(thread->thread.pulse, corked);
+            break;
+#ifdef LIVE_CAPTIONS_PIPEWIRE
+        case AUDIO_BACKEND_PIPEWIRE:
+            audio_thread_pw_set_corked(thread->thread.pipewire, corked);
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+bool native_capture_enabled(void) {
+    if(settings == NULL) settings = g_settings_new("net.sapples.LiveCaptions");
+
+    return g_settings_get_boolean(settings, "native-capture-format");
+}
+
+bool realtime_capture_enabled(void) {
+    if(settings == NULL) settings = g_settings_new("net.sapples.LiveCaptions");
+
+    return g_settings_get_boolean(settings, "realtime-capture") && !audio_file_input_is_open();
+}
+
+bool native_converter_init(struct native_converter *nc, unsigned int rate, unsigned int channels, unsigned int model_rate) {
+    if((nc->resampler != NULL) && (nc->rate == rate) && (nc->channels == channels)) return true;
+
+    native_converter_free(nc);
+
+    nc->resampler = resampler_new(rate, model_rate, channels, RESAMPLER_DEFAULT_TAPS);
+    if(nc->resampler == NULL) {
+        printf("Can't resample %u Hz %u channels to %u Hz\n", rate, channels, model_rate);
+        return false;
+    }
+
+    nc->scratch_len = resampler_max_output(nc->resampler, RESAMPLER_MAX_BLOCK_FRAMES);
+    nc->scratch = calloc(nc->scratch_len, sizeof(short));
+    if(realtime_capture_enabled()) rt_lock_memory(nc->scratch, nc->scratch_len * sizeof(short));
+
+    nc->rate = rate;
+    nc->channels = channels;
+
+    printf("Resampling %u Hz %u channels to %u Hz\n", rate, channels, model_rate);
+    return true;
+}
+
+void native_converter_feed(struct native_converter *nc, asr_thread asr, CaptionSource source, const float *data, size_t frames) {
+    if((nc->resampler == NULL) || (asr == NULL)) return;
+
+    size_t channels = resampler_get_channels(nc->resampler);
+    for(size_t i=0; i<frames; i+=RESAMPLER_MAX_BLOCK_FRAMES){
+        size_t block = MIN(frames - i, RESAMPLER_MAX_BLOCK_FRAMES);
+
+        size_t count = resampler_process(nc->resampler, &data[i * channels], block, nc->scratch);
+        if(count > 0) asr_thread_enqueue_audio(asr, source, nc->scratch, count);
+    }
+}
+
+void native_converter_free(struct native_converter *nc) {
+    if(nc->scratch != NULL) rt_unlock_memory(nc->scratch, nc->scratch_len * sizeof(short));
+
+    resampler_free(nc->resampler);
+    free(nc->scratch);
+
+    nc->resampler = NULL;
+    nc->scratch = NULL;
+}
+
+void fragment_control_init(struct fragment_control *fc) {
+    if(settings == NULL) settings = g_settings_new("net.sapples.LiveCaptions");
+
+    fc->adaptive = g_settings_get_boolean(settings, "adaptive-fragment-size");
+    fc->fragment_ms = CLAMP(g_settings_get_int(settings, "fragment-size-ms"), FRAGMENT_MIN_MS, FRAGMENT_MAX_MS);
+}
+
+bool fragment_control_power_changed(struct fragment_control *fc, asr_thread asr, CaptionSource source) {
+    if(asr == NULL) return false;
+
+    return fc->idle != (asr_thread_get_power_state(asr, source) == POWER_IDLE);
+}
+
+bool fragment_control_update(struct fragment_control *fc, asr_thread asr, CaptionSource source) {
+    if(asr == NULL) return false;
+
+    // Only the level is checked while idle, and the chunk that has sound
+    // is decoded whole, so the latency doesn't matter
+    bool idle = asr_thread_get_power_state(asr, source) == POWER_IDLE;
+    if(idle != fc->idle) {
+        fc->idle = idle;
+
+        if(idle) {
+            fc->active_fragment_ms = fc->fragment_ms;
+            fc->fragment_ms = FRAGMENT_MAX_MS;
+        } else {
+            fc->fragment_ms = fc->active_fragment_ms;
+        }
+
+        printf("Capture %s, fragment size %d ms\n", idle ? "idle" : "active again", fc->fragment_ms);
+        return true;
+    }
+
+    if(!fc->adaptive || idle) return false;
+
+    // Same thresholds as the slow warning in the main window. At 1.0 the
+    // decoder keeps up, so smaller fragments only cost some extra wakeups.
+    // Above that it's falling behind, and larger fragments take load off
+    float speedup = asr_thread_get_speedup(asr, source);
+    if(speedup < 0.0f) return false;
+
+    int fragment_ms = fc->fragment_ms;
+    if(speedup <= 1.0f) fragment_ms = fragment_ms * 3 / 4;
+    else if(speedup > 1.1f) fragment_ms = fragment_ms * 3 / 2;
+
+    fragment_ms = CLAMP(fragment_ms, FRAGMENT_MIN_MS, FRAGMENT_MAX_MS);
+    if(fragment_ms == fc->fragment_ms) return false;
+
+    printf("Adaptive fragment size: speedup %.2f, %d ms -> %d ms\n", speedup, fc->fragment_ms, fragment_ms);
+
+    fc->fragment_ms = fragment_ms;
+    return true;
+}
+
+// A gap between callbacks longer than this is the stream being suspended
+// (e.g. an idle sink), not audio being lost
+#define CAPTURE_SUSPEND_US (1000 * 1000)
+
+// Overruns are checked over windows of this length, and only count when
+// the missing audio is more than the buffering can explain
+#define CAPTURE_OVERRUN_WINDOW_US (2000 * 1000)
+#define CAPTURE_OVERRUN_MIN_US (50 * 1000)
+
+const int capture_callback_bounds_us[CAPTURE_HISTOGRAM_BUCKETS - 1] = { 50, 100, 200, 500, 1000, 2000, 5000 };
+const int capture_jitter_bounds_us[CAPTURE_HISTOGRAM_BUCKETS - 1] = { 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+
+static void histogram_add(gint *hist, const int *bounds, gint *max, gint64 value_us) {
+    int value = (int)MIN(value_us, G_MAXINT);
+
+    int bucket = 0;
+    while((bucket < CAPTURE_HISTOGRAM_BUCKETS - 1) && (value > bounds[bucket])) bucket++;
+
+    g_atomic_int_inc(&hist[bucket]);
+
+    // Only the capturing thread writes
+    if(value > g_atomic_int_get(max)) g_atomic_int_set(max, value);
+}
+
+gint64 capture_stats_begin(struct capture_stats_recorder *rec, gint64 interval_us) {
+    gint64 now = g_get_monotonic_time();
+
+    if(rec->last_callback != 0) {
+        gint64 interval = now - rec->last_callback;
+
+        if(interval > CAPTURE_SUSPEND_US + interval_us) {
+            rec->window_start = 0;
+        } else {
+            gint64 jitter = interval - interval_us;
+            histogram_add(rec->jitter_hist, capture_jitter_bounds_us, &rec->max_jitter_us, (jitter < 0) ? -jitter : jitter);
+        }
+    }
+
+    rec->last_callback = now;
+    rec->interval_us = interval_us;
+    g_atomic_int_inc(&rec->callbacks);
+
+    return now;
+}
+
+static void add_lost(struct capture_stats_recorder *rec, guint64 lost_us) {
+    rec->lost_us += lost_us;
+    g_atomic_int_set(&rec->lost_ms, (gint)MIN(rec->lost_us / 1000, G_MAXINT));
+}
+
+void capture_stats_end(struct capture_stats_recorder *rec, gint64 start, size_t frames, unsigned int rate) {
+    gint64 now = g_get_monotonic_time();
+    histogram_add(rec->callback_hist, capture_callback_bounds_us, &rec->max_callback_us, now - start);
+
+    if(rate == 0) return;
+
+    // The window starts after a callback, so the audio counted in it was
+    // captured within the window
+    if(rec->window_start == 0) {
+        rec->window_start = now;
+        rec->window_frames = 0;
+        return;
+    }
+
+    rec->window_frames += frames;
+
+    gint64 elapsed = now - rec->window_start;
+    if(elapsed < CAPTURE_OVERRUN_WINDOW_US) return;
+
+    gint64 received_us = (gint64)(rec->window_frames * G_USEC_PER_SEC / rate);
+    gint64 missing_us = elapsed - received_us;
+
+    // Up to a fragment or two may still be buffered in the server
+    if(missing_us > MAX(2 * rec->interval_us, CAPTURE_OVERRUN_MIN_US)) {
+        g_atomic_int_inc(&rec->overruns);
+        add_lost(rec, missing_us);
     }
+
+    rec->window_start = now;
+    rec->window_frames = 0;
+}
+
+void capture_stats_hole(struct capture_stats_recorder *rec, guint64 lost_us) {
+    g_atomic_int_inc(&rec->holes);
+    add_lost(rec, lost_us);
+
+    // Lost audio is counted here, not again as an overrun
+    rec->window_start = 0;
+}
+
+void capture_stats_error(struct capture_stats_recorder *rec) {
+    g_atomic_int_inc(&rec->errors);
+}
+
+void capture_stats_read(struct capture_stats_recorder *rec, struct capture_stats *stats) {
+    stats->available = true;
+    stats->callbacks = g_atomic_int_get(&rec->callbacks);
+    stats->holes = g_atomic_int_get(&rec->holes);
+    stats->errors = g_atomic_int_get(&rec->errors);
+    stats->overruns = g_atomic_int_get(&rec->overruns);
+    stats->lost_ms = g_atomic_int_get(&rec->lost_ms);
+    stats->max_callback_us = g_atomic_int_get(&rec->max_callback_us);
+    stats->max_jitter_us = g_atomic_int_get(&rec->max_jitter_us);
+
+    for(size_t i=0; i<CAPTURE_HISTOGRAM_BUCKETS; i++){
+        stats->callback_hist[i] = g_atomic_int_get(&rec->callback_hist[i]);
+        stats->jitter_hist[i] = g_atomic_int_get(&rec->jitter_hist[i]);
+    }
+}
+
+void audio_thread_get_stats(audio_thread thread, struct capture_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    switch(thread->backend) {
+        case AUDIO_BACKEND_PULSE:
+            capture_stats_read(audio_thread_pa_get_stats(thread->thread.pulse), stats);
+            break;
 #ifdef LIVE_CAPTIONS_PIPEWIRE
-      else {
-        free_audio_thread_pw(thread->thread.pipewire);
-        g_thread_join(thread->pw_thread_id);
-        g_thread_unref(thread->pw_thread_id); // ?
-        free(thread->thread.pipewire);
+        case AUDIO_BACKEND_PIPEWIRE:
+            capture_stats_read(audio_thread_pw_get_stats(thread->thread.pipewire), stats);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    audio_thread_get_latency(thread, &stats->fragment_ms, &stats->latency_ms);
+}
+
+static void append_histogram(GString *str, const int *hist, const int *bounds) {
+    for(size_t i=0; i<CAPTURE_HISTOGRAM_BUCKETS; i++){
+        if(i < CAPTURE_HISTOGRAM_BUCKETS - 1)
+            g_string_append_printf(str, " <=%d: %d", bounds[i], hist[i]);
+        else
+            g_string_append_printf(str, " >%d: %d", bounds[i - 1], hist[i]);
+    }
+}
+
+char *capture_stats_to_string(const struct capture_stats *stats, const char *indent) {
+    GString *str = g_string_new(NULL);
+
+    g_string_append_printf(str, "%sfragment %d ms, stream latency %.1f ms\n", indent, stats->fragment_ms, stats->latency_ms);
+
+    if(!stats->available) {
+        g_string_append_printf(str, "%sno capture statistics for this backend\n", indent);
+        return g_string_free(str, false);
     }
+
+    g_string_append_printf(str, "%scallbacks %d, holes %d, errors %d, overruns %d, lost %d ms\n",
+                           indent, stats->callbacks, stats->holes, stats->errors, stats->overruns, stats->lost_ms);
+
+    g_string_append_printf(str, "%scallback time (us), max %d:", indent, stats->max_callback_us);
+    append_histogram(str, stats->callback_hist, capture_callback_bounds_us);
+
+    g_string_append_printf(str, "\n%scallback jitter (us), max %d:", indent, stats->max_jitter_us);
+    append_histogram(str, stats->jitter_hist, capture_jitter_bounds_us);
+    g_string_append_c(str, '\n');
+
+    return g_string_free(str, false);
+}
+
+void free_audio_thread(audio_thread thread) {
+    switch(thread->backend) {
+        case AUDIO_BACKEND_PULSE:
+            free_audio_thread_pa(thread->thread.pulse);
+            free(thread->thread.pulse);
+            break;
+        case AUDIO_BACKEND_FILE:
+            free_audio_thread_file(thread->thread.file);
+            free(thread->thread.file);
+            break;
+#ifdef LIVE_CAPTIONS_PIPEWIRE
+        case AUDIO_BACKEND_PIPEWIRE:
+            free_audio_thread_pw(thread->thread.pipewire);
+            free(thread->thread.pipewire);
+            break;
 #endif
+        default:
+            break;
+    }
 
     free(thread);
 }
@@ -25,5 +25,101 @@
 struct audio_thread_i;
 typedef struct audio_thread_i * audio_thread;
 
+typedef enum AudioBackend {
+    AUDIO_BACKEND_PULSE = 0,
+    AUDIO_BACKEND_PIPEWIRE = 1,
+    AUDIO_BACKEND_FILE = 2
+} AudioBackend;
+
+// Input for the file backend, from the command line
+struct audio_file_options {
+    // A file, a named pipe, or - for stdin
+    const char *path;
+
+    // auto, wav, s16le or f32le. auto detects WAV and otherwise reads s16le
+    const char *format;
+
+    // Format of raw input, 0 for the model's sample rate and mono
+    unsigned int rate;
+    unsigned int channels;
+
+    // Pace the input in real time instead of reading it as fast as it
+    // can be decoded
+    bool realtime;
+
+    // Start over at the end of a regular file instead of quitting
+    bool loop;
+};
+
+// Makes every audio thread created after this read from the given input
+// instead of a sound server. Returns false if it can't be opened
+bool audio_file_input_open(const struct audio_file_options *options);
+bool audio_file_input_is_open(void);
+
+// The realtime-capture setting, except with file input: capture callbacks
+// run at realtime priority and only touch locked memory, and the audio is
+// passed on through the asr_thread's capture queue
+bool realtime_capture_enabled(void);
+
+// Uses the file input if one is open, otherwise the backend from the
+// audio-backend setting. If PipeWire is requested but not available (or not
+// compiled in), falls back to PulseAudio
 audio_thread create_audio_thread(bool microphone, asr_thread asr);
 void free_audio_thread(audio_thread thread);
+
+AudioBackend audio_thread_get_backend(audio_thread thread);
+const char *audio_backend_name(AudioBackend backend);
+
+// Current capture fragment size, and the stream latency as last measured
+// by the backend (0 until the first measurement)
+void audio_thread_get_latency(audio_thread thread, int *fragment_ms, double *latency_ms);
+
+// Stops the sound server from delivering audio, so capture costs nothing
+// until uncorked. Audio in between is lost. File input keeps being read
+void audio_thread_set_corked(audio_thread thread, bool corked);
+
+#define CAPTURE_HISTOGRAM_BUCKETS 8
+
+// Upper bounds of the histogram buckets in microseconds. The last bucket
+// holds everything above the last bound
+extern const int capture_callback_bounds_us[CAPTURE_HISTOGRAM_BUCKETS - 1];
+extern const int capture_jitter_bounds_us[CAPTURE_HISTOGRAM_BUCKETS - 1];
+
+// Health of a capture stream since it was created, to tell apart audio
+// that never reached the decoder from audio the decoder didn't keep up with
+struct capture_stats {
+    // False for backends that don't record statistics (file input)
+    bool available;
+
+    int callbacks;
+
+    // Gaps the sound server reported in the stream
+    int holes;
+
+    // Failed reads and missing buffers
+    int errors;
+
+    // Stretches where less audio arrived than time passed, i.e. the server
+    // dropped audio because it wasn't read in time
+    int overruns;
+
+    // Audio lost to holes and overruns
+    int lost_ms;
+
+    // How long the capture callback took, including feeding the decoder
+    int callback_hist[CAPTURE_HISTOGRAM_BUCKETS];
+    int max_callback_us;
+
+    // How far the time between callbacks was from the fragment size
+    int jitter_hist[CAPTURE_HISTOGRAM_BUCKETS];
+    int max_jitter_us;
+
+    int fragment_ms;
+    double latency_ms;
+};
+
+void audio_thread_get_stats(audio_thread thread, struct capture_stats *stats);
+
+// A few lines describing the stats, for the diagnostics and the log. Free
+// with g_free
+char *capture_stats_to_string(const struct capture_stats *stats, const char *indent);
@@ -0,0 +1,543 @@
+/* benchmark.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/utsname.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <april_api.h>
+
+#include "livecaptions-config.h"
+#include "benchmark.h"
+#include "resampler.h"
+#include "wav.h"
+#include "common.h"
+
+// Audio is fed in pieces of this size, like capture fragments
+#define BENCHMARK_CHUNK_MS 100
+
+static char **wav_paths = NULL;
+static char **model_paths = NULL;
+static char *output_path = NULL;
+static int runs = 5;
+static int warmup_runs = 1;
+
+const GOptionEntry benchmark_option_entries[] = {
+    { "benchmark", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME_ARRAY, &wav_paths,
+      N_("Measure decoding speed on a speech WAV file instead of captioning, can be repeated"), N_("FILE") },
+    { "benchmark-model", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME_ARRAY, &model_paths,
+      N_("Model to benchmark, can be repeated. Defaults to the active model"), N_("FILE") },
+    { "benchmark-runs", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &runs,
+      N_("Measured runs over all files, 5 by default"), N_("COUNT") },
+    { "benchmark-warmup", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &warmup_runs,
+      N_("Runs before measuring, 1 by default"), N_("COUNT") },
+    { "benchmark-output", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &output_path,
+      N_("Write the JSON results here instead of to stdout"), N_("FILE") },
+    { NULL }
+};
+
+// A recording, as read from the file
+struct bench_file {
+    const char *path;
+    struct wav_format format;
+    float *samples;
+    size_t frames;
+
+    // Converted for the model being benchmarked
+    short *pcm;
+    size_t pcm_len;
+};
+
+// Times of one model
+struct bench_model {
+    const char *path;
+    char *language;
+    size_t sample_rate;
+
+    double load_ms;
+    double load_rss_mb;
+    double peak_rss_mb;
+
+    // Processing time over audio time, of each file in each run, and of
+    // each file on its own
+    GArray *rtf;
+    GArray **file_rtf;
+
+    // Of every chunk fed, to show stalls the averages hide
+    GArray *chunk_rtf;
+
+    int final_results;
+};
+
+static void count_results(void *userdata, AprilResultType result, size_t count, const AprilToken *tokens) {
+    int *finals = userdata;
+    if(result == APRIL_RESULT_RECOGNITION_FINAL) (*finals)++;
+}
+
+bool benchmark_parse_options(int *argc, char ***argv) {
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, benchmark_option_entries, GETTEXT_PACKAGE);
+
+    // Everything else is for the application
+    g_option_context_set_ignore_unknown_options(context, true);
+    g_option_context_set_help_enabled(context, false);
+
+    GError *error = NULL;
+    if(!g_option_context_parse(context, argc, argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_option_context_free(context);
+
+    return wav_paths != NULL;
+}
+
+static bool read_file(void *userdata, void *out, size_t len) {
+    return fread(out, 1, len, userdata) == len;
+}
+
+static bool load_file(struct bench_file *file) {
+    FILE *f = fopen(file->path, "rb");
+    if(f == NULL) {
+        fprintf(stderr, "Can't open %s: %s\n", file->path, strerror(errno));
+        return false;
+    }
+
+    uint64_t data_size;
+    if(!wav_parse_header(read_file, f, false, &file->format, &data_size)) {
+        fprintf(stderr, "%s is not a supported WAV file\n", file->path);
+        fclose(f);
+        return false;
+    }
+
+    size_t frame_bytes = wav_bytes_per_frame(&file->format);
+    GByteArray *bytes = g_byte_array_new();
+
+    guint8 buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        g_byte_array_append(bytes, buffer, n);
+        if((data_size != WAV_DATA_SIZE_UNKNOWN) && (bytes->len >= data_size)) break;
+    }
+
+    fclose(f);
+
+    size_t len = bytes->len;
+    if((data_size != WAV_DATA_SIZE_UNKNOWN) && (len > data_size)) len = data_size;
+
+    file->frames = len / frame_bytes;
+    file->samples = g_new(float, file->frames * file->format.channels);
+    wav_to_float(&file->format, bytes->data, file->frames, file->samples);
+
+    g_byte_array_free(bytes, true);
+
+    if(file->frames == 0) {
+        fprintf(stderr, "%s has no audio\n", file->path);
+        return false;
+    }
+
+    return true;
+}
+
+// Mono 16-bit at the model's rate, done up front so it isn't timed
+static bool convert_file(struct bench_file *file, size_t rate) {
+    g_free(file->pcm);
+    file->pcm = NULL;
+    file->pcm_len = 0;
+
+    struct resampler *r = resampler_new(file->format.rate, rate, file->format.channels, RESAMPLER_DEFAULT_TAPS);
+    if(r == NULL) {
+        fprintf(stderr, "Can't convert %s to %zu Hz\n", file->path, rate);
+        return false;
+    }
+
+    size_t capacity = 0;
+    for(size_t i=0; i<file->frames; i+=RESAMPLER_MAX_BLOCK_FRAMES)
+        capacity += resampler_max_output(r, MIN(file->frames - i, RESAMPLER_MAX_BLOCK_FRAMES));
+
+    file->pcm = g_new(short, capacity);
+
+    for(size_t i=0; i<file->frames; i+=RESAMPLER_MAX_BLOCK_FRAMES){
+        size_t count = MIN(file->frames - i, RESAMPLER_MAX_BLOCK_FRAMES);
+        file->pcm_len += resampler_process(r, &file->samples[i * file->format.channels], count, &file->pcm[file->pcm_len]);
+    }
+
+    resampler_free(r);
+    return true;
+}
+
+static double file_seconds(const struct bench_file *file, size_t rate) {
+    return file->pcm_len / (double)rate;
+}
+
+// Decodes the file with a new session. Returns its realtime factor, and
+// adds each chunk's to chunk_rtf unless it's NULL
+static double decode_file(AprilASRModel model, size_t rate, const struct bench_file *file, GArray *chunk_rtf, int *finals) {
+    AprilConfig config = {
+        .handler = count_results,
+        .userdata = finals,
+        .flags = APRIL_CONFIG_FLAG_ZERO_BIT
+    };
+
+    AprilASRSession session = aas_create_session(model, config);
+    if(session == NULL) return -1.0;
+
+    size_t chunk = rate * BENCHMARK_CHUNK_MS / 1000;
+    gint64 start = g_get_monotonic_time();
+
+    for(size_t i=0; i<file->pcm_len; i+=chunk){
+        size_t count = MIN(file->pcm_len - i, chunk);
+
+        gint64 chunk_start = g_get_monotonic_time();
+        aas_feed_pcm16(session, &file->pcm[i], count);
+        gint64 chunk_end = g_get_monotonic_time();
+
+        if(chunk_rtf != NULL) {
+            double rtf = (chunk_end - chunk_start) / (double)G_USEC_PER_SEC / (count / (double)rate);
+            g_array_append_val(chunk_rtf, rtf);
+        }
+    }
+
+    aas_flush(session);
+
+    double elapsed = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+
+    aas_free(session);
+
+    return elapsed / file_seconds(file, rate);
+}
+
+// From /proc/self/status, in MB
+static double status_mb(const char *field) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if(f == NULL) return 0.0;
+
+    size_t field_len = strlen(field);
+    double result = 0.0;
+
+    char line[256];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if((strncmp(line, field, field_len) == 0) && (line[field_len] == ':')) {
+            result = g_ascii_strtod(&line[field_len + 1], NULL) / 1024.0;
+            break;
+        }
+    }
+
+    fclose(f);
+    return result;
+}
+
+// So the next peak is the next model's own. Needs Linux 4.0
+static void reset_peak_rss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if(fd < 0) return;
+
+    if(write(fd, "5", 1) < 0) {
+        // Then the peak covers every model so far, still an upper bound
+    }
+
+    close(fd);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank, of a sorted array
+static double percentile(GArray *values, double p) {
+    if(values->len == 0) return 0.0;
+
+    size_t rank = (size_t)ceil(p / 100.0 * values->len);
+    return g_array_index(values, double, CLAMP(rank, 1, values->len) - 1);
+}
+
+static void append_json_string(GString *str, const char *value) {
+    g_string_append_c(str, '"');
+
+    for(const char *c=value; *c; c++){
+        switch(*c) {
+            case '"': g_string_append(str, "\\\""); break;
+            case '\\': g_string_append(str, "\\\\"); break;
+            case '\n': g_string_append(str, "\\n"); break;
+            case '\t': g_string_append(str, "\\t"); break;
+            default:
+                if((unsigned char)*c < 0x20) g_string_append_printf(str, "\\u%04x", *c);
+                else g_string_append_c(str, *c);
+        }
+    }
+
+    g_string_append_c(str, '"');
+}
+
+static void append_stats(GString *str, const char *name, GArray *values) {
+    g_array_sort(values, compare_doubles);
+
+    double sum = 0.0;
+    for(guint i=0; i<values->len; i++) sum += g_array_index(values, double, i);
+
+    g_string_append_printf(str, "\"%s\": {\"count\": %u, \"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+                           name, values->len,
+                           (values->len > 0) ? sum / values->len : 0.0,
+                           percentile(values, 0.0),
+                           percentile(values, 50.0),
+                           percentile(values, 90.0),
+                           percentile(values, 99.0),
+                           percentile(values, 100.0));
+}
+
+static char *cpu_name(void) {
+    char *contents = NULL;
+    if(!g_file_get_contents("/proc/cpuinfo", &contents, NULL, NULL)) return g_strdup("unknown");
+
+    char *result = NULL;
+    char **lines = g_strsplit(contents, "\n", -1);
+
+    for(size_t i=0; (lines[i] != NULL) && (result == NULL); i++){
+        if(g_str_has_prefix(lines[i], "model name")) {
+            char *colon = strchr(lines[i], ':');
+            if(colon != NULL) result = g_strdup(g_strstrip(colon + 1));
+        }
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+
+    return (result != NULL) ? result : g_strdup("unknown");
+}
+
+static void append_machine(GString *str) {
+    struct utsname uts;
+    bool have_uts = uname(&uts) == 0;
+
+    char *cpu = cpu_name();
+
+    g_string_append(str, "  \"machine\": {\"cpu\": ");
+    append_json_string(str, cpu);
+    g_string_append_printf(str, ", \"cpus\": %ld, \"kernel\": ", sysconf(_SC_NPROCESSORS_ONLN));
+    append_json_string(str, have_uts ? uts.release : "unknown");
+    g_string_append(str, ", \"arch\": ");
+    append_json_string(str, have_uts ? uts.machine : "unknown");
+    g_string_append(str, "},\n");
+
+    g_free(cpu);
+}
+
+static bool benchmark_model(struct bench_model *result, struct bench_file *files, size_t file_count) {
+    reset_peak_rss();
+
+    double rss_before = status_mb("VmRSS");
+    gint64 load_start = g_get_monotonic_time();
+
+    AprilASRModel model = aam_create_model(result->path);
+    if(model == NULL) {
+        fprintf(stderr, "Loading model %s failed\n", result->path);
+        return false;
+    }
+
+    result->load_ms = (g_get_monotonic_time() - load_start) / 1000.0;
+    result->load_rss_mb = MAX(status_mb("VmRSS") - rss_before, 0.0);
+    result->language = g_strdup(aam_get_language(model));
+    result->sample_rate = aam_get_sample_rate(model);
+
+    result->rtf = g_array_new(false, false, sizeof(double));
+    result->chunk_rtf = g_array_new(false, false, sizeof(double));
+
+    bool success = true;
+
+    for(size_t i=0; i<file_count; i++){
+        if(!convert_file(&files[i], result->sample_rate)) {
+            success = false;
+            goto end;
+        }
+    }
+
+    for(int run=0; run<warmup_runs + runs; run++){
+        bool warmup = run < warmup_runs;
+
+        fprintf(stderr, "%s: %s run %d of %d\n", result->path, warmup ? "warm-up" : "measured",
+                warmup ? (run + 1) : (run - warmup_runs + 1), warmup ? warmup_runs : runs);
+
+        for(size_t i=0; i<file_count; i++){
+            int finals = 0;
+            double rtf = decode_file(model, result->sample_rate, &files[i], warmup ? NULL : result->chunk_rtf, &finals);
+            if(rtf < 0.0) {
+                fprintf(stderr, "Creating a session with %s failed\n", result->path);
+                success = false;
+                goto end;
+            }
+
+            if(warmup) continue;
+
+            g_array_append_val(result->rtf, rtf);
+            g_array_append_val(result->file_rtf[i], rtf);
+
+            // Always the same, as the input is
+            result->final_results = finals;
+        }
+    }
+
+end:
+    result->peak_rss_mb = status_mb("VmHWM");
+    aam_free(model);
+
+    return success;
+}
+
+static char *format_results(struct bench_model *models, size_t model_count, struct bench_file *files, size_t file_count) {
+    GString *str = g_string_new("{\n");
+
+    g_string_append(str, "  \"version\": ");
+    append_json_string(str, PACKAGE_VERSION);
+    g_string_append(str, ",\n");
+
+    append_machine(str);
+
+    g_string_append_printf(str, "  \"settings\": {\"runs\": %d, \"warmup_runs\": %d, \"chunk_ms\": %d},\n",
+                           runs, warmup_runs, BENCHMARK_CHUNK_MS);
+
+    g_string_append(str, "  \"files\": [");
+    for(size_t i=0; i<file_count; i++){
+        g_string_append(str, (i == 0) ? "\n    {\"path\": " : ",\n    {\"path\": ");
+        append_json_string(str, files[i].path);
+        g_string_append_printf(str, ", \"seconds\": %.3f, \"rate\": %u, \"channels\": %u}",
+                               files[i].frames / (double)files[i].format.rate, files[i].format.rate, files[i].format.channels);
+    }
+    g_string_append(str, "\n  ],\n");
+
+    g_string_append(str, "  \"models\": [");
+    for(size_t i=0; i<model_count; i++){
+        struct bench_model *m = &models[i];
+
+        g_string_append(str, (i == 0) ? "\n    {\n      \"path\": " : ",\n    {\n      \"path\": ");
+        append_json_string(str, m->path);
+        g_string_append(str, ",\n      \"language\": ");
+        append_json_string(str, m->language);
+        g_string_append_printf(str, ",\n      \"sample_rate\": %zu,\n      \"load_ms\": %.1f,\n      \"load_rss_mb\": %.1f,\n      \"peak_rss_mb\": %.1f,\n      ",
+                               m->sample_rate, m->load_ms, m->load_rss_mb, m->peak_rss_mb);
+
+        append_stats(str, "rtf", m->rtf);
+        g_string_append(str, ",\n      ");
+        append_stats(str, "chunk_rtf", m->chunk_rtf);
+
+        g_string_append(str, ",\n      \"files\": [");
+        for(size_t j=0; j<file_count; j++){
+            g_string_append(str, (j == 0) ? "\n        {\"path\": " : ",\n        {\"path\": ");
+            append_json_string(str, files[j].path);
+            g_string_append(str, ", ");
+            append_stats(str, "rtf", m->file_rtf[j]);
+            g_string_append(str, "}");
+        }
+        g_string_append_printf(str, "\n      ],\n      \"final_results\": %d\n    }", m->final_results);
+    }
+    g_string_append(str, "\n  ],\n");
+
+    g_string_append_printf(str, "  \"peak_rss_mb\": %.1f\n}\n", status_mb("VmHWM"));
+
+    return g_string_free(str, false);
+}
+
+int benchmark_run(void) {
+    // Libraries may log to stdout, which is for the results unless they
+    // go to a file
+    int results_fd = dup(STDOUT_FILENO);
+    if(output_path == NULL) dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    size_t file_count = g_strv_length(wav_paths);
+    struct bench_file *files = g_new0(struct bench_file, file_count);
+
+    int status = 0;
+
+    for(size_t i=0; i<file_count; i++){
+        files[i].path = wav_paths[i];
+        if(!load_file(&files[i])) status = 1;
+    }
+
+    char *active_model = NULL;
+    if(model_paths == NULL) {
+        GSettings *settings = g_settings_new("net.sapples.LiveCaptions");
+        active_model = g_settings_get_string(settings, "active-model");
+        g_object_unref(G_OBJECT(settings));
+
+        if((active_model == NULL) || (*active_model == '\0')) {
+            g_free(active_model);
+            active_model = g_strdup(GET_MODEL_PATH());
+        }
+    }
+
+    size_t model_count = (model_paths != NULL) ? g_strv_length(model_paths) : 1;
+    struct bench_model *models = g_new0(struct bench_model, model_count);
+
+    runs = MAX(runs, 1);
+    warmup_runs = MAX(warmup_runs, 0);
+
+    for(size_t i=0; (status == 0) && (i<model_count); i++){
+        models[i].path = (model_paths != NULL) ? model_paths[i] : active_model;
+
+        models[i].file_rtf = g_new(GArray *, file_count);
+        for(size_t j=0; j<file_count; j++) models[i].file_rtf[j] = g_array_new(false, false, sizeof(double));
+
+        if(!benchmark_model(&models[i], files, file_count)) status = 1;
+    }
+
+    if(status == 0) {
+        char *json = format_results(models, model_count, files, file_count);
+
+        FILE *out = (output_path != NULL) ? fopen(output_path, "w") : fdopen(results_fd, "w");
+        if(out == NULL) {
+            fprintf(stderr, "Can't write %s: %s\n", output_path, strerror(errno));
+            status = 1;
+        } else {
+            fputs(json, out);
+            fclose(out);
+
+            if(output_path != NULL) close(results_fd);
+
+            if(output_path != NULL) fprintf(stderr, "Results written to %s\n", output_path);
+        }
+
+        g_free(json);
+    }
+
+    for(size_t i=0; i<model_count; i++){
+        for(size_t j=0; (models[i].file_rtf != NULL) && (j<file_count); j++) g_array_free(models[i].file_rtf[j], true);
+        g_free(models[i].file_rtf);
+
+        if(models[i].rtf != NULL) g_array_free(models[i].rtf, true);
+        if(models[i].chunk_rtf != NULL) g_array_free(models[i].chunk_rtf, true);
+        g_free(models[i].language);
+    }
+
+    for(size_t i=0; i<file_count; i++){
+        g_free(files[i].samples);
+        g_free(files[i].pcm);
+    }
+
+    g_free(models);
+    g_free(files);
+    g_free(active_model);
+
+    return status;
+}
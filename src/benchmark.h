@@ -0,0 +1,36 @@
+/* benchmark.h
+ * Replays speech recordings through the models without the UI and reports
+ * how fast they decode, as JSON that can be compared across machines
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <glib.h>
+
+// The --benchmark options, also listed in the application's --help
+extern const GOptionEntry benchmark_option_entries[];
+
+// Takes the benchmark options out of the arguments. Returns true if a
+// benchmark was requested, in which case main runs it instead of the UI
+bool benchmark_parse_options(int *argc, char ***argv);
+
+// Loads every model fresh and decodes every file with it, after warm-up
+// runs that aren't counted. Progress goes to stderr, the results to
+// stdout or the --benchmark-output file. Returns the exit status
+int benchmark_run(void);
@@ -0,0 +1,462 @@
+/* fake-april.c
+ * Stands in for aprilasr when built with -Dfake_april=true. Instead of
+ * recognizing speech it produces results from a script, so everything
+ * after the model can be run and loaded without one
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <april_api.h>
+
+// The model path names a key file with a [Fake April] group, see the
+// README. Anything else, including a real model, gets the defaults and
+// random words
+#define FAKE_GROUP "Fake April"
+
+// Asynchronous realtime sessions drop audio past this much backlog, and
+// report that they can't keep up
+#define FAKE_MAX_BACKLOG_SECONDS 3.0
+
+// Longer scripted utterances are cut, as the line generator only takes so
+// many tokens at once
+#define FAKE_MAX_WORDS 200
+
+static const char *fake_words[] = {
+    "the", "and", "you", "that", "was", "for", "are", "with", "his", "they",
+    "this", "have", "from", "one", "had", "word", "but", "not", "what", "all",
+    "were", "when", "your", "can", "said", "there", "use", "each", "which", "she",
+    "people", "because", "something", "actually", "important", "everything",
+    "probably", "information", "understand", "government", "development",
+    "weather", "tomorrow", "captions", "listening", "computer", "meeting",
+};
+
+struct AprilASRModel_i {
+    char *name;
+    char *description;
+    char *language;
+    size_t sample_rate;
+
+    double words_per_second;
+    double partial_interval;
+    int min_words;
+    int max_words;
+    double silence_seconds;
+    double cant_keep_up_chance;
+    double realtime_factor;
+    guint32 seed;
+
+    // Scripted utterances, played in order and then from the start again.
+    // Random words are used if there are none
+    char **utterances;
+
+    // Token text has to outlive the results, as it does with a real model
+    GMutex strings_mutex;
+    GStringChunk *strings;
+
+    guint sessions_created;
+};
+
+typedef enum FakePhase {
+    FAKE_SPEECH,
+    FAKE_SILENCE
+} FakePhase;
+
+struct AprilASRSession_i {
+    AprilASRModel model;
+    AprilConfig config;
+    GRand *rand;
+
+    size_t next_utterance;
+
+    // The utterance being spoken, and the index after each word's last token
+    GArray *tokens;
+    GArray *word_ends;
+
+    FakePhase phase;
+    double position;
+    double phase_length;
+    double next_event;
+
+    // Asynchronous sessions take audio here and produce results on their
+    // own thread
+    GThread *thread;
+    GMutex mutex;
+    GCond cond;
+    size_t pending_samples;
+    bool flush_requested;
+    bool stop;
+};
+
+
+void aam_api_init(int version) {
+    (void)version;
+    printf("Using the fake April backend, no speech is recognized\n");
+}
+
+static char *key_string(GKeyFile *file, const char *key, const char *fallback) {
+    char *value = (file != NULL) ? g_key_file_get_string(file, FAKE_GROUP, key, NULL) : NULL;
+    return (value != NULL) ? value : g_strdup(fallback);
+}
+
+static double key_double(GKeyFile *file, const char *key, double fallback) {
+    GError *error = NULL;
+    double value = (file != NULL) ? g_key_file_get_double(file, FAKE_GROUP, key, &error) : fallback;
+    if(error != NULL) {
+        g_error_free(error);
+        return fallback;
+    }
+
+    return value;
+}
+
+AprilASRModel aam_create_model(const char *model_path) {
+    GKeyFile *file = g_key_file_new();
+    if(!g_key_file_load_from_file(file, model_path, G_KEY_FILE_NONE, NULL) || !g_key_file_has_group(file, FAKE_GROUP)) {
+        g_key_file_free(file);
+        file = NULL;
+    }
+
+    AprilASRModel model = g_new0(struct AprilASRModel_i, 1);
+
+    char *basename = g_path_get_basename(model_path);
+    model->name = key_string(file, "name", basename);
+    model->description = key_string(file, "description", "Scripted results for testing");
+    model->language = key_string(file, "language", "en");
+    g_free(basename);
+
+    model->sample_rate = (size_t)CLAMP(key_double(file, "sample-rate", 16000), 8000, 48000);
+    model->words_per_second = CLAMP(key_double(file, "words-per-second", 2.5), 0.1, 1000.0);
+    model->partial_interval = CLAMP(key_double(file, "partial-interval", 0.2), 0.01, 10.0);
+    model->min_words = (int)CLAMP(key_double(file, "min-words", 6), 1, FAKE_MAX_WORDS);
+    model->max_words = (int)CLAMP(key_double(file, "max-words", 16), model->min_words, FAKE_MAX_WORDS);
+    model->silence_seconds = CLAMP(key_double(file, "silence-seconds", 1.5), 0.0, 3600.0);
+    model->cant_keep_up_chance = CLAMP(key_double(file, "cant-keep-up-chance", 0.0), 0.0, 1.0);
+    model->realtime_factor = CLAMP(key_double(file, "realtime-factor", 0.0), 0.0, 100.0);
+    model->seed = (guint32)key_double(file, "seed", 1234);
+
+    if(file != NULL) model->utterances = g_key_file_get_string_list(file, FAKE_GROUP, "utterances", NULL, NULL);
+
+    g_mutex_init(&model->strings_mutex);
+    model->strings = g_string_chunk_new(4096);
+
+    printf("Fake model %s: %s, %.1f words/s, %s\n", model->name,
+           (file != NULL) ? "scripted" : "defaults",
+           model->words_per_second,
+           (model->utterances != NULL) ? "scripted utterances" : "random words");
+
+    if(file != NULL) g_key_file_free(file);
+
+    return model;
+}
+
+const char *aam_get_name(AprilASRModel model) {
+    return model->name;
+}
+
+const char *aam_get_description(AprilASRModel model) {
+    return model->description;
+}
+
+const char *aam_get_language(AprilASRModel model) {
+    return model->language;
+}
+
+size_t aam_get_sample_rate(AprilASRModel model) {
+    return model->sample_rate;
+}
+
+void aam_free(AprilASRModel model) {
+    if(model == NULL) return;
+
+    g_free(model->name);
+    g_free(model->description);
+    g_free(model->language);
+    g_strfreev(model->utterances);
+    g_string_chunk_free(model->strings);
+    g_mutex_clear(&model->strings_mutex);
+    g_free(model);
+}
+
+
+static const char *intern(AprilASRModel model, const char *text) {
+    g_mutex_lock(&model->strings_mutex);
+    const char *interned = g_string_chunk_insert_const(model->strings, text);
+    g_mutex_unlock(&model->strings_mutex);
+
+    return interned;
+}
+
+static void add_token(struct AprilASRSession_i *s, const char *text, AprilTokenFlagBits flags) {
+    AprilToken token = {
+        .token = intern(s->model, text),
+        .logprob = -(float)g_rand_double_range(s->rand, 0.0, 3.0),
+        .flags = flags,
+        .time_ms = (size_t)((s->word_ends->len / s->model->words_per_second) * 1000.0)
+    };
+
+    g_array_append_val(s->tokens, token);
+}
+
+// Split into pieces of up to four characters like the models' tokens, the
+// first starting with a space
+static void add_word(struct AprilASRSession_i *s, const char *word) {
+    for(const char *p = word; *p != '\0';){
+        bool first = (p == word);
+
+        const char *end = p;
+        int piece = g_rand_int_range(s->rand, 1, 5);
+        for(int i=0; (i < piece) && (*end != '\0'); i++) end = g_utf8_next_char(end);
+
+        char text[24];
+        g_snprintf(text, sizeof(text), "%s%.*s", first ? " " : "", (int)(end - p), p);
+
+        add_token(s, text, first ? APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT : 0);
+        p = end;
+    }
+
+    size_t end = s->tokens->len;
+    g_array_append_val(s->word_ends, end);
+}
+
+static void start_utterance(struct AprilASRSession_i *s) {
+    AprilASRModel model = s->model;
+
+    g_array_set_size(s->tokens, 0);
+    g_array_set_size(s->word_ends, 0);
+
+    if((model->utterances != NULL) && (model->utterances[0] != NULL)) {
+        char **words = g_strsplit(model->utterances[s->next_utterance], " ", -1);
+        for(char **w = words; (*w != NULL) && (s->word_ends->len < FAKE_MAX_WORDS); w++){
+            if((*w)[0] != '\0') add_word(s, *w);
+        }
+        g_strfreev(words);
+
+        s->next_utterance++;
+        if(model->utterances[s->next_utterance] == NULL) s->next_utterance = 0;
+    }
+
+    if(s->word_ends->len == 0) {
+        int words = g_rand_int_range(s->rand, model->min_words, model->max_words + 1);
+        for(int i=0; i<words; i++)
+            add_word(s, fake_words[g_rand_int_range(s->rand, 0, G_N_ELEMENTS(fake_words))]);
+    }
+
+    s->phase = FAKE_SPEECH;
+    s->position = 0.0;
+    s->phase_length = s->word_ends->len / model->words_per_second;
+    s->next_event = MIN(model->partial_interval, s->phase_length);
+}
+
+static void emit(struct AprilASRSession_i *s, AprilResultType result, size_t count) {
+    s->config.handler(s->config.userdata, result, count, (const AprilToken *)s->tokens->data);
+}
+
+// Ends the utterance with everything said so far, then stays silent for a
+// while. Without any silence the next utterance starts right away
+static void finish_utterance(struct AprilASRSession_i *s, size_t words) {
+    if(words > 0) {
+        size_t count = g_array_index(s->word_ends, size_t, words - 1);
+        g_array_set_size(s->tokens, count);
+
+        if(words == s->word_ends->len) add_token(s, ".", APRIL_TOKEN_FLAG_SENTENCE_END_BIT);
+
+        emit(s, APRIL_RESULT_RECOGNITION_FINAL, s->tokens->len);
+    }
+
+    if(s->model->silence_seconds <= 0.0) {
+        start_utterance(s);
+        return;
+    }
+
+    g_array_set_size(s->tokens, 0);
+    emit(s, APRIL_RESULT_SILENCE, 0);
+
+    s->phase = FAKE_SILENCE;
+    s->position = 0.0;
+    s->phase_length = s->model->silence_seconds;
+    s->next_event = s->phase_length;
+}
+
+static size_t words_spoken(struct AprilASRSession_i *s) {
+    size_t words = (size_t)(s->position * s->model->words_per_second) + 1;
+    return MIN(words, s->word_ends->len);
+}
+
+static void handle_event(struct AprilASRSession_i *s) {
+    if(s->phase == FAKE_SILENCE) {
+        start_utterance(s);
+        return;
+    }
+
+    if(s->position >= s->phase_length) {
+        finish_utterance(s, s->word_ends->len);
+        return;
+    }
+
+    if((s->config.flags & APRIL_CONFIG_FLAG_ASYNC_RT_BIT) &&
+       (g_rand_double(s->rand) < s->model->cant_keep_up_chance * s->model->partial_interval))
+        emit(s, APRIL_RESULT_ERROR_CANT_KEEP_UP, 0);
+
+    size_t words = words_spoken(s);
+    emit(s, APRIL_RESULT_RECOGNITION_PARTIAL, g_array_index(s->word_ends, size_t, words - 1));
+
+    s->next_event = MIN(s->position + s->model->partial_interval, s->phase_length);
+}
+
+// Spends the CPU time decoding would take
+static void burn(double seconds) {
+    gint64 until = g_get_monotonic_time() + (gint64)(seconds * G_USEC_PER_SEC);
+    while(g_get_monotonic_time() < until) {
+        // Busy, like a decoder
+    }
+}
+
+// Moves through the script by the length of the audio
+static void advance(struct AprilASRSession_i *s, size_t samples) {
+    double remaining = samples / (double)s->model->sample_rate;
+
+    burn(remaining * s->model->realtime_factor);
+
+    while(remaining > 0.0) {
+        double to_event = s->next_event - s->position;
+        if(to_event > remaining) {
+            s->position += remaining;
+            break;
+        }
+
+        remaining -= to_event;
+        s->position = s->next_event;
+        handle_event(s);
+    }
+}
+
+static void flush(struct AprilASRSession_i *s) {
+    if((s->phase == FAKE_SPEECH) && (s->position > 0.0)) finish_utterance(s, words_spoken(s));
+}
+
+static void *run_session(void *userdata) {
+    struct AprilASRSession_i *s = userdata;
+
+    g_mutex_lock(&s->mutex);
+    for(;;) {
+        while(!s->stop && (s->pending_samples == 0) && !s->flush_requested)
+            g_cond_wait(&s->cond, &s->mutex);
+
+        if(s->stop) break;
+
+        size_t samples = s->pending_samples;
+        bool flush_requested = s->flush_requested;
+        s->pending_samples = 0;
+        s->flush_requested = false;
+
+        g_mutex_unlock(&s->mutex);
+
+        size_t max_samples = (size_t)(FAKE_MAX_BACKLOG_SECONDS * s->model->sample_rate);
+        if((s->config.flags & APRIL_CONFIG_FLAG_ASYNC_RT_BIT) && (samples > max_samples)) {
+            emit(s, APRIL_RESULT_ERROR_CANT_KEEP_UP, 0);
+            samples = max_samples;
+        }
+
+        advance(s, samples);
+        if(flush_requested) flush(s);
+
+        g_mutex_lock(&s->mutex);
+    }
+    g_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+AprilASRSession aas_create_session(AprilASRModel model, AprilConfig config) {
+    struct AprilASRSession_i *s = g_new0(struct AprilASRSession_i, 1);
+
+    s->model = model;
+    s->config = config;
+
+    g_mutex_lock(&model->strings_mutex);
+    guint index = model->sessions_created++;
+    g_mutex_unlock(&model->strings_mutex);
+
+    s->rand = g_rand_new_with_seed(model->seed + index);
+
+    s->tokens = g_array_new(false, false, sizeof(AprilToken));
+    s->word_ends = g_array_new(false, false, sizeof(size_t));
+
+    start_utterance(s);
+
+    g_mutex_init(&s->mutex);
+    g_cond_init(&s->cond);
+
+    if(config.flags & (APRIL_CONFIG_FLAG_ASYNC_RT_BIT | APRIL_CONFIG_FLAG_ASYNC_NO_RT_BIT))
+        s->thread = g_thread_new("fake-april", run_session, s);
+
+    return s;
+}
+
+void aas_feed_pcm16(AprilASRSession session, short *pcm16, size_t short_count) {
+    (void)pcm16;
+
+    if(session->thread == NULL) {
+        advance(session, short_count);
+        return;
+    }
+
+    g_mutex_lock(&session->mutex);
+    session->pending_samples += short_count;
+    g_cond_signal(&session->cond);
+    g_mutex_unlock(&session->mutex);
+}
+
+void aas_flush(AprilASRSession session) {
+    if(session->thread == NULL) {
+        flush(session);
+        return;
+    }
+
+    g_mutex_lock(&session->mutex);
+    session->flush_requested = true;
+    g_cond_signal(&session->cond);
+    g_mutex_unlock(&session->mutex);
+}
+
+float aas_realtime_get_speedup(AprilASRSession session) {
+    // Above 1 when decoding takes longer than the audio
+    return (float)MAX(1.0, session->model->realtime_factor);
+}
+
+void aas_free(AprilASRSession session) {
+    if(session == NULL) return;
+
+    if(session->thread != NULL) {
+        g_mutex_lock(&session->mutex);
+        session->stop = true;
+        g_cond_signal(&session->cond);
+        g_mutex_unlock(&session->mutex);
+
+        g_thread_join(session->thread);
+    }
+
+    g_array_free(session->tokens, true);
+    g_array_free(session->word_ends, true);
+    g_rand_free(session->rand);
+    g_mutex_clear(&session->mutex);
+    g_cond_clear(&session->cond);
+    g_free(session);
+}
@@ -0,0 +1,342 @@
+/* history-render.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "history-render.h"
+#include "history.h"
+#include "line-gen.h"
+#include "token-view.h"
+#include "common.h"
+
+struct render_job {
+    size_t session_idx;
+    size_t first_row;
+    size_t num_rows;
+    struct history_render_options options;
+
+    GCancellable *cancellable;
+    GWeakRef target;
+    history_render_cb callback;
+
+    struct history_render_chunk *chunk;
+};
+
+static GAsyncQueue *job_queue = NULL;
+static GThread *render_thread = NULL;
+
+
+static void free_job(struct render_job *job) {
+    g_clear_object(&job->cancellable);
+    g_weak_ref_clear(&job->target);
+    history_render_chunk_free(job->chunk);
+    g_free(job);
+}
+
+// Appends the entry in a single forward pass, applying the same filtering,
+// lowercasing and capitalization as the line generator. The capitalizer is
+// carried over from the previous entries of the session. With a NULL string
+// only the capitalizer is advanced
+static void append_entry(GString *string, const struct history_entry *entry, const struct history_render_options *options, const struct filter_matcher *filter, struct token_capitalizer *tcap) {
+    bool use_lowercase = options->use_lowercase;
+    FilterMode filter_mode = options->filter_mode;
+
+    // Nothing is capitalized without lowercasing, so there's nothing to carry
+    if((string == NULL) && !use_lowercase) return;
+
+    // An entry that starts a new word starts a sentence, one that continues
+    // a word carries on from the previous entry
+    if(entry->tokens[0].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) {
+        tcap->previous_was_period = true;
+    }
+
+    struct token_view view = token_view_from_history(entry->tokens, entry->tokens_count);
+
+    for(size_t j=0; j<entry->tokens_count;) {
+        size_t skipahead = 1;
+        const char *token = entry->tokens[j].token;
+
+        if((filter_mode > FILTER_NONE) && (entry->tokens[j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            size_t skip = get_filter_skip(filter, &view, j, filter_mode);
+            if(skip > 0) {
+                skipahead = skip;
+                token = SWEAR_REPLACEMENT;
+            }
+        }
+
+        if((j == 0) && (*token == ' ')) token++;
+
+        bool should_be_capitalized = false;
+        if((j+skipahead) < entry->tokens_count){
+            should_be_capitalized = use_lowercase && token_capitalizer_next(tcap, token, entry->tokens[j].flags, entry->tokens[j+skipahead].token, entry->tokens[j+skipahead].flags);
+        }else{
+            should_be_capitalized = use_lowercase && token_capitalizer_next(tcap, token, entry->tokens[j].flags, NULL, 0);
+        }
+
+        if(string == NULL){
+            // Only advancing the capitalizer
+        }else if(use_lowercase){
+            const char *p = token;
+            gunichar c;
+            while (*p) {
+                c = g_utf8_get_char_validated(p, -1);
+                if((c == ((gunichar)-1)) || (c == ((gunichar)-2))) {
+                    g_warning("Invalid UTF-8 in history token, truncating it");
+                    break;
+                }
+
+                c = g_unichar_tolower(c);
+
+                if(should_be_capitalized){
+                    gunichar c1 = g_unichar_toupper(c);
+                    if(c != c1){
+                        c = c1;
+                        should_be_capitalized = false;
+                    }
+                }
+
+                g_string_append_unichar(string, c);
+
+                p = g_utf8_next_char(p);
+            }
+        }else{
+            g_string_append(string, token);
+        }
+
+        j += skipahead;
+    }
+}
+
+static void append_time(GString *string, time_t timestamp, bool date) {
+    char text[64];
+
+    struct tm tm;
+    localtime_r(&timestamp, &tm);
+    strftime(text, 64, date ? "\n\nStart of session %F | %H:%M" : "%H:%M:%S", &tm);
+
+    g_string_append(string, text);
+}
+
+static void render_row(GString *string, const struct history_session *session, size_t row, bool *is_text, const struct history_render_options *options, const struct filter_matcher *filter, struct token_capitalizer *tcap) {
+    *is_text = false;
+
+    // The session may have been erased since the request was made
+    if((session == NULL) || (session->entries_count == 0) || (row > session->entries_count)) return;
+
+    if(row == 0) {
+        append_time(string, session->entries[0].timestamp, true);
+        return;
+    }
+
+    size_t i = row - 1;
+    const struct history_entry *entry = &session->entries[i];
+
+    if(entry->tokens_count == 0) {
+        // Silence, marks the time at which the next entry started
+        if((i + 1) < session->entries_count)
+            append_time(string, session->entries[i + 1].timestamp, false);
+
+        return;
+    }
+
+    *is_text = true;
+
+    if(history_session_is_mixed(session))
+        g_string_append_printf(string, "[%s] ", caption_source_name(entry->source));
+
+    if(history_session_is_multilingual(session) && (entry->language[0] != '\0'))
+        g_string_append_printf(string, "[%s] ", entry->language);
+
+    append_entry(string, entry, options, filter, tcap);
+}
+
+// Capitalizer state before every HISTORY_RENDER_CHUNK_ROWS-th entry of the
+// session rendered last, so that a chunk further down doesn't carry it
+// through every entry above again. Only used by the render thread, with
+// history_lock held
+static struct {
+    unsigned int generation;
+    const struct history_session *session;
+    const struct history_entry *entries;
+    size_t entries_count;
+    struct history_render_options options;
+
+    GArray *states;
+} checkpoints = { 0 };
+
+// The capitalizer as it is after the entries before the given one
+static void capitalizer_before_entry(const struct history_session *session,
+                                     size_t entry,
+                                     const struct history_render_options *options,
+                                     const struct filter_matcher *filter,
+                                     struct token_capitalizer *tcap)
+{
+    if(checkpoints.states == NULL)
+        checkpoints.states = g_array_new(false, false, sizeof(struct token_capitalizer));
+
+    // The active session grows and moves, and any session may be gone
+    if((checkpoints.generation != get_history_generation()) ||
+       (checkpoints.session != session) ||
+       (checkpoints.entries != session->entries) ||
+       (checkpoints.entries_count != session->entries_count) ||
+       (checkpoints.options.use_lowercase != options->use_lowercase) ||
+       (checkpoints.options.filter_mode != options->filter_mode))
+    {
+        checkpoints.generation = get_history_generation();
+        checkpoints.session = session;
+        checkpoints.entries = session->entries;
+        checkpoints.entries_count = session->entries_count;
+        checkpoints.options = *options;
+
+        token_capitalizer_init(tcap);
+        g_array_set_size(checkpoints.states, 0);
+        g_array_append_val(checkpoints.states, *tcap);
+    }
+
+    size_t k = MIN(entry / HISTORY_RENDER_CHUNK_ROWS, checkpoints.states->len - 1);
+    *tcap = g_array_index(checkpoints.states, struct token_capitalizer, k);
+
+    for(size_t i=k * HISTORY_RENDER_CHUNK_ROWS; i<entry; i++){
+        if(session->entries[i].tokens_count > 0)
+            append_entry(NULL, &session->entries[i], options, filter, tcap);
+
+        if((((i + 1) % HISTORY_RENDER_CHUNK_ROWS) == 0) && (checkpoints.states->len == ((i + 1) / HISTORY_RENDER_CHUNK_ROWS)))
+            g_array_append_val(checkpoints.states, *tcap);
+    }
+}
+
+static void render_job(struct render_job *job) {
+    struct history_render_chunk *chunk = g_new0(struct history_render_chunk, 1);
+    chunk->session_idx = job->session_idx;
+    chunk->first_row = job->first_row;
+    chunk->num_rows = job->num_rows;
+    chunk->text = g_string_sized_new(job->num_rows * 64);
+    chunk->segments = g_new0(struct history_segment, job->num_rows);
+
+    // Held until the last row is rendered, the main thread may erase or
+    // reload the history meanwhile
+    history_lock();
+
+    // Once for the whole chunk rather than for every word
+    struct filter_matcher *filter = profanity_filter_acquire();
+
+    // Decodes the session if this is the first time it's accessed
+    const struct history_session *session = get_history_session(job->session_idx);
+
+    // Row 0 is the header, so row r shows entry r - 1
+    struct token_capitalizer tcap;
+    if((session != NULL) && (session->entries_count > 0))
+        capitalizer_before_entry(session, MIN((job->first_row > 0) ? (job->first_row - 1) : 0, session->entries_count), &job->options, filter, &tcap);
+    else
+        token_capitalizer_init(&tcap);
+
+    for(size_t i=0; i<job->num_rows; i++){
+        struct history_segment *segment = &chunk->segments[i];
+
+        segment->offset = chunk->text->len;
+        render_row(chunk->text, session, job->first_row + i, &segment->is_text, &job->options, filter, &tcap);
+        segment->length = chunk->text->len - segment->offset;
+
+        g_string_append_c(chunk->text, '\0');
+    }
+
+    profanity_filter_release(filter);
+    history_unlock();
+
+    job->chunk = chunk;
+}
+
+static gboolean deliver_chunk(gpointer userdata) {
+    struct render_job *job = userdata;
+
+    if(!g_cancellable_is_cancelled(job->cancellable)) {
+        GObject *target = g_weak_ref_get(&job->target);
+        if(target != NULL) {
+            job->callback(target, job->chunk);
+            job->chunk = NULL;
+
+            g_object_unref(target);
+        }
+    }
+
+    free_job(job);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void *run_render_thread(void *userdata) {
+    for(;;) {
+        struct render_job *job = g_async_queue_pop(job_queue);
+
+        // Stale requests, e.g. from before a refresh, are dropped here
+        if(g_cancellable_is_cancelled(job->cancellable)) {
+            free_job(job);
+            continue;
+        }
+
+        render_job(job);
+        g_idle_add(deliver_chunk, job);
+    }
+
+    return NULL;
+}
+
+void history_render_request(size_t session_idx,
+                            size_t first_row,
+                            size_t num_rows,
+                            const struct history_render_options *options,
+                            GCancellable *cancellable,
+                            GObject *target,
+                            history_render_cb callback)
+{
+    if(render_thread == NULL) {
+        job_queue = g_async_queue_new();
+        render_thread = g_thread_new("lcap-historyrender", run_render_thread, NULL);
+    }
+
+    struct render_job *job = g_new0(struct render_job, 1);
+    job->session_idx = session_idx;
+    job->first_row = first_row;
+    job->num_rows = num_rows;
+    job->options = *options;
+    job->cancellable = g_object_ref(cancellable);
+    g_weak_ref_init(&job->target, target);
+    job->callback = callback;
+
+    g_async_queue_push(job_queue, job);
+}
+
+const char *history_render_chunk_get_row(const struct history_render_chunk *chunk,
+                                         size_t row,
+                                         bool *is_text)
+{
+    g_assert(row < chunk->num_rows);
+
+    const struct history_segment *segment = &chunk->segments[row];
+
+    *is_text = segment->is_text;
+    return &chunk->text->str[segment->offset];
+}
+
+void history_render_chunk_free(struct history_render_chunk *chunk) {
+    if(chunk == NULL) return;
+
+    g_string_free(chunk->text, true);
+    g_free(chunk->segments);
+    g_free(chunk);
+}
@@ -0,0 +1,76 @@
+/* history-render.h
+ * Prepares the display text of history sessions on a worker thread, so that
+ * lowercasing, capitalization and filtering of long sessions does not block
+ * the GTK thread. Rows are rendered in chunks into a single buffer and handed
+ * back to the main loop.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <gio/gio.h>
+#include "profanity-filter.h"
+
+// Number of rows rendered per chunk
+#define HISTORY_RENDER_CHUNK_ROWS 256
+
+struct history_render_options {
+    bool use_lowercase;
+    FilterMode filter_mode;
+};
+
+// A ready-to-display row. The text is NUL-terminated within the chunk buffer
+struct history_segment {
+    size_t offset;
+    size_t length;
+
+    // false for session headers and timestamps
+    bool is_text;
+};
+
+// Row 0 of a session is the session header, row i+1 is entry i
+struct history_render_chunk {
+    size_t session_idx;
+    size_t first_row;
+    size_t num_rows;
+
+    GString *text;
+    struct history_segment *segments;
+};
+
+// Called on the main thread, takes ownership of the chunk
+typedef void (*history_render_cb)(GObject *target, struct history_render_chunk *chunk);
+
+// Queues rows [first_row, first_row + num_rows) of a session (same indexing as
+// get_history_session) for rendering. The callback is not called if the
+// cancellable is cancelled or the target has been finalized in the meantime
+void history_render_request(size_t session_idx,
+                            size_t first_row,
+                            size_t num_rows,
+                            const struct history_render_options *options,
+                            GCancellable *cancellable,
+                            GObject *target,
+                            history_render_cb callback);
+
+// Returns the text of a row within the chunk
+const char *history_render_chunk_get_row(const struct history_render_chunk *chunk,
+                                         size_t row,
+                                         bool *is_text);
+
+void history_render_chunk_free(struct history_render_chunk *chunk);
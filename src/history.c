@@ -19,12 +19,49 @@
 
 
 #include <time.h>
+#include <glib/gi18n.h>
 #include <adwaita.h>
 #include "history.h"
 
+// Files start with the magic and a version. Files without the magic are
+// version 1, which has no source in the entries. Version 3 adds the
+// language of each entry
+#define HISTORY_MAGIC "LCAPHIST"
+#define HISTORY_MAGIC_LEN 8
+#define HISTORY_VERSION 3
+
 static struct history_session active_session = { 0 };
 static struct past_history_sessions past_sessions = { 0 };
 
+// Past sessions are only indexed when loading, and decoded from the raw file
+// contents on first access so that opening a large history stays cheap
+struct session_blob {
+    size_t offset;
+    size_t size;
+    bool decoded;
+};
+
+static gchar *loaded_data = NULL;
+static gsize loaded_size = 0;
+static uint32_t loaded_version = HISTORY_VERSION;
+static struct session_blob *past_blobs = NULL;
+
+// Guards the sessions against the ASR thread appending entries and the
+// history renderer reading them. Recursive so get_history_session can be
+// called with the lock held
+static GRecMutex history_mutex;
+
+// Bumped whenever the sessions are erased or reloaded
+static unsigned int generation = 0;
+
+void history_lock(void) {
+    g_rec_mutex_lock(&history_mutex);
+}
+
+void history_unlock(void) {
+    g_rec_mutex_unlock(&history_mutex);
+}
+
 char default_history_file_v[1024] = { 0 };
 char *default_history_file = NULL;
 
@@ -49,15 +86,52 @@ void history_init(void){
 }
 
 
-static struct history_entry *allocate_new_entry(size_t tokens_count) {
+const char *caption_source_name(CaptionSource source) {
+    switch(source) {
+        case CAPTION_SOURCE_MICROPHONE:
+            return _("Mic");
+        case CAPTION_SOURCE_DESKTOP:
+        default:
+            return _("Desktop");
+    }
+}
+
+bool history_session_is_mixed(const struct history_session *session) {
+    // More than one bit set
+    return (session->sources & (session->sources - 1)) != 0;
+}
+
+bool history_session_is_multilingual(const struct history_session *session) {
+    return session->multilingual;
+}
+
+static void note_language(struct history_session *session, const char *language) {
+    if(language[0] == '\0') return;
+
+    if(session->language[0] == '\0')
+        g_strlcpy(session->language, language, HISTORY_LANGUAGE_MAX_CHARS);
+    else if(strcmp(session->language, language) != 0)
+        session->multilingual = true;
+}
+
+static struct history_entry *allocate_new_entry(size_t tokens_count, CaptionSource source, const char *language) {
     active_session.entries_count += 1;
     active_session.entries = realloc(active_session.entries,
         active_session.entries_count * sizeof(struct history_entry));
 
     struct history_entry *entry = &active_session.entries[active_session.entries_count - 1];
 
+    entry->source = source;
     entry->tokens_count = tokens_count;
 
+    memset(entry->language, 0, HISTORY_LANGUAGE_MAX_CHARS);
+    g_strlcpy(entry->language, language, HISTORY_LANGUAGE_MAX_CHARS);
+
+    if(tokens_count > 0) {
+        active_session.sources |= 1u << source;
+        note_language(&active_session, entry->language);
+    }
+
     if(tokens_count > 0)
         entry->tokens = calloc(tokens_count, sizeof(struct history_token));
     else
@@ -66,10 +140,14 @@ static struct history_entry *allocate_new_entry(size_t tokens_count) {
     return entry;
 }
 
-void commit_tokens_to_current_history(const AprilToken *tokens,
+void commit_tokens_to_current_history(CaptionSource source,
+                                      const char *language,
+                                      const AprilToken *tokens,
                                       size_t tokens_count)
 {
-    struct history_entry *entry = allocate_new_entry(tokens_count);
+    history_lock();
+
+    struct history_entry *entry = allocate_new_entry(tokens_count, source, language);
 
     entry->timestamp = time(NULL);
 
@@ -85,11 +163,17 @@ void commit_tokens_to_current_history(const AprilToken *tokens,
         token->logprob = tokens[i].logprob;
         token->flags   = tokens[i].flags;
     }
+
+    history_unlock();
 }
 
-void save_silence_to_history(void){
-    struct history_entry *entry = allocate_new_entry(0);
+void save_silence_to_history(CaptionSource source){
+    history_lock();
+
+    struct history_entry *entry = allocate_new_entry(0, source, "");
     entry->timestamp = time(NULL);
+
+    history_unlock();
 }
 
 
@@ -99,8 +183,12 @@ static void write_session_to_file(FILE *f, const struct history_session *session
     for(size_t i=0; i<session->entries_count; i++){
         struct history_entry *entry = &session->entries[i];
 
+        int32_t source = entry->source;
+
         fwrite(&entry->timestamp, sizeof(entry->timestamp), 1, f);
         fwrite(&entry->tokens_count, sizeof(entry->tokens_count), 1, f);
+        fwrite(&source, sizeof(source), 1, f);
+        fwrite(entry->language, 1, HISTORY_LANGUAGE_MAX_CHARS, f);
 
         for(size_t j=0; j<entry->tokens_count; j++){
             struct history_token *token = &entry->tokens[j];
@@ -110,29 +198,87 @@ static void write_session_to_file(FILE *f, const struct history_session *session
     }
 }
 
+static void decode_session(struct history_session *session, struct session_blob *blob);
+
 void save_current_history(const char *path){
     FILE *f = fopen(path, "w");
 
+    history_lock();
+
     bool write_active_session = active_session.entries_count > 0;
     write_active_session = write_active_session && g_settings_get_boolean(settings, "save-history");
 
+    uint32_t version = HISTORY_VERSION;
+    fwrite(HISTORY_MAGIC, 1, HISTORY_MAGIC_LEN, f);
+    fwrite(&version, sizeof(version), 1, f);
+
     size_t num_sessions_to_write = past_sessions.num_sessions + (write_active_session ? 1 : 0);
     fwrite(&num_sessions_to_write, sizeof(num_sessions_to_write), 1, f);
 
     for(size_t i=0; i<past_sessions.num_sessions; i++){
-        write_session_to_file(f, &past_sessions.sessions[i]);
+        // Sessions from an older file version are upgraded on the way out
+        if(!past_blobs[i].decoded && (loaded_version != HISTORY_VERSION))
+            decode_session(&past_sessions.sessions[i], &past_blobs[i]);
+
+        if(past_blobs[i].decoded)
+            write_session_to_file(f, &past_sessions.sessions[i]);
+        else
+            fwrite(&loaded_data[past_blobs[i].offset], 1, past_blobs[i].size, f);
     }
 
     if(write_active_session)
         write_session_to_file(f, &active_session);
 
+    history_unlock();
+
     fclose(f);
 }
 
 
-static void read_session_from_file(FILE *f, struct history_session *session) {
-    fread(&session->timestamp, sizeof(session->timestamp), 1, f);
-    fread(&session->entries_count, sizeof(session->entries_count), 1, f);
+static bool read_bytes(size_t *offset, void *out, size_t len) {
+    if((len > loaded_size) || (*offset > (loaded_size - len))) return false;
+
+    memcpy(out, &loaded_data[*offset], len);
+    *offset += len;
+
+    return true;
+}
+
+static bool index_session(size_t *offset, struct history_session *session, struct session_blob *blob) {
+    blob->offset = *offset;
+    blob->decoded = false;
+
+    session->entries = NULL;
+    if(!read_bytes(offset, &session->timestamp, sizeof(session->timestamp))) return false;
+    if(!read_bytes(offset, &session->entries_count, sizeof(session->entries_count))) return false;
+
+    for(size_t i=0; i<session->entries_count; i++){
+        time_t timestamp;
+        size_t tokens_count;
+        int32_t source;
+
+        if(!read_bytes(offset, &timestamp, sizeof(timestamp))) return false;
+        if(!read_bytes(offset, &tokens_count, sizeof(tokens_count))) return false;
+        if((loaded_version >= 2) && !read_bytes(offset, &source, sizeof(source))) return false;
+
+        if(loaded_version >= 3) {
+            char language[HISTORY_LANGUAGE_MAX_CHARS];
+            if(!read_bytes(offset, language, HISTORY_LANGUAGE_MAX_CHARS)) return false;
+        }
+
+        if(tokens_count > ((loaded_size - *offset) / sizeof(struct history_token))) return false;
+        *offset += tokens_count * sizeof(struct history_token);
+    }
+
+    blob->size = *offset - blob->offset;
+    return true;
+}
+
+static void decode_session(struct history_session *session, struct session_blob *blob) {
+    if(blob->decoded) return;
+
+    // Skip timestamp and entries_count, they were read during indexing
+    size_t offset = blob->offset + sizeof(session->timestamp) + sizeof(session->entries_count);
 
     session->entries = calloc(
         session->entries_count,
@@ -142,8 +288,26 @@ static void read_session_from_file(FILE *f, struct history_session *session) {
     for(size_t i=0; i<session->entries_count; i++){
         struct history_entry *entry = &session->entries[i];
 
-        fread(&entry->timestamp, sizeof(entry->timestamp), 1, f);
-        fread(&entry->tokens_count, sizeof(entry->tokens_count), 1, f);
+        read_bytes(&offset, &entry->timestamp, sizeof(entry->timestamp));
+        read_bytes(&offset, &entry->tokens_count, sizeof(entry->tokens_count));
+
+        // Version 1 could only caption one source at a time, and did not
+        // record which. Those sessions are never shown as mixed
+        int32_t source = CAPTION_SOURCE_DESKTOP;
+        if(loaded_version >= 2) read_bytes(&offset, &source, sizeof(source));
+
+        entry->source = ((source >= 0) && (source < CAPTION_SOURCE_COUNT)) ? (CaptionSource)source : CAPTION_SOURCE_DESKTOP;
+
+        // Older versions did not record it, those entries have none
+        if(loaded_version >= 3) {
+            read_bytes(&offset, entry->language, HISTORY_LANGUAGE_MAX_CHARS);
+            entry->language[HISTORY_LANGUAGE_MAX_CHARS - 1] = '\0';
+        }
+
+        if(entry->tokens_count > 0) {
+            session->sources |= 1u << entry->source;
+            note_language(session, entry->language);
+        }
 
         if(entry->tokens_count == 0){
             entry->tokens = NULL;
@@ -155,32 +319,69 @@ static void read_session_from_file(FILE *f, struct history_session *session) {
             sizeof(struct history_token)
         );
 
-        for(size_t j=0; j<entry->tokens_count; j++){
-            struct history_token *token = &entry->tokens[j];
-            fread(token, sizeof(struct history_token), 1, f);
-        }
+        read_bytes(&offset, entry->tokens, entry->tokens_count * sizeof(struct history_token));
     }
+
+    blob->decoded = true;
 }
 
-void load_history_from(const char *path){
-    FILE *f = fopen(path, "r");
+// Called with history_lock held, as the render thread may be reading the
+// sessions this replaces
+static void load_history_locked(const char *path){
+    GError *error = NULL;
+    if(!g_file_get_contents(path, &loaded_data, &loaded_size, &error)) {
+        printf("Loading history %s failed: %s\n", path, error->message);
+        g_error_free(error);
 
-    if(f == NULL) {
-        printf("fopen %s returned NULL\n", path);
+        loaded_data = NULL;
+        loaded_size = 0;
         return;
     }
 
+    size_t offset = 0;
+
+    loaded_version = 1;
+    if((loaded_size >= HISTORY_MAGIC_LEN) && (memcmp(loaded_data, HISTORY_MAGIC, HISTORY_MAGIC_LEN) == 0)) {
+        offset = HISTORY_MAGIC_LEN;
+        if(!read_bytes(&offset, &loaded_version, sizeof(loaded_version))) return;
+
+        if((loaded_version < 2) || (loaded_version > HISTORY_VERSION)) {
+            printf("History file %s has unsupported version %u\n", path, loaded_version);
+
+            g_free(loaded_data);
+            loaded_data = NULL;
+            loaded_size = 0;
+            loaded_version = HISTORY_VERSION;
+            return;
+        }
+    }
+
     size_t num_sessions_in_file = 0;
-    fread(&num_sessions_in_file, sizeof(num_sessions_in_file), 1, f);
+    if(!read_bytes(&offset, &num_sessions_in_file, sizeof(num_sessions_in_file))) return;
 
-    past_sessions.num_sessions = num_sessions_in_file;
-    past_sessions.sessions = calloc(past_sessions.num_sessions, sizeof(struct history_session));
-    
-    for(size_t i=0; i<num_sessions_in_file; i++){
-        read_session_from_file(f, &past_sessions.sessions[i]);
+    // Each session takes at least a timestamp and an entry count
+    size_t max_sessions = loaded_size / (sizeof(time_t) + sizeof(size_t));
+    if(num_sessions_in_file > max_sessions) num_sessions_in_file = max_sessions;
+
+    past_sessions.sessions = calloc(num_sessions_in_file, sizeof(struct history_session));
+    past_blobs = calloc(num_sessions_in_file, sizeof(struct session_blob));
+
+    size_t i;
+    for(i=0; i<num_sessions_in_file; i++){
+        if(!index_session(&offset, &past_sessions.sessions[i], &past_blobs[i])) {
+            printf("History file %s is truncated, keeping %zu sessions\n", path, i);
+            break;
+        }
     }
 
-    fclose(f);
+    past_sessions.num_sessions = i;
+}
+
+void load_history_from(const char *path){
+    history_lock();
+    load_history_locked(path);
+    generation++;
+    history_unlock();
 }
 
 
@@ -192,13 +393,24 @@ static void export_session_into_text(FILE *f, const struct history_session *sess
 
     fprintf(f, "    -[ %s ]-    ", time_buff);
 
+    bool mixed = history_session_is_mixed(session);
+    bool multilingual = history_session_is_multilingual(session);
+
     for(size_t i=0; i<session->entries_count; i++){
         struct history_entry *entry = &session->entries[i];
 
         tm = localtime_r(&entry->timestamp, tm);
         strftime(time_buff, 512, "%T", tm);
 
-        fprintf(f, "\n(%s) - ", time_buff);
+        fprintf(f, "\n(%s)", time_buff);
+
+        if(mixed && (entry->tokens_count > 0))
+            fprintf(f, " [%s]", caption_source_name(entry->source));
+
+        if(multilingual && (entry->language[0] != '\0'))
+            fprintf(f, " [%s]", entry->language);
+
+        fprintf(f, " - ");
 
         for(size_t j=0; j<entry->tokens_count; j++){
             fprintf(f, "%s", entry->tokens[j].token);
@@ -214,43 +426,102 @@ void export_history_as_text(const char *path) {
     FILE *f = fopen(path, "w");
     g_assert(f != NULL);
 
+    history_lock();
+
     for(size_t i=0; i<past_sessions.num_sessions; i++){
         if(past_sessions.sessions[i].entries_count == 0) continue;
 
+        decode_session(&past_sessions.sessions[i], &past_blobs[i]);
         export_session_into_text(f, &past_sessions.sessions[i]);
     }
 
     if(active_session.entries_count > 0)
         export_session_into_text(f, &active_session);
 
+    history_unlock();
+
     fclose(f);
 }
 
+const struct history_session *peek_history_session(size_t idx) {
+    if(idx == 0) return &active_session;
+
+    history_lock();
+
+    ssize_t i = ((ssize_t)past_sessions.num_sessions - (ssize_t)idx);
+    const struct history_session *session = (i < 0) ? NULL : &past_sessions.sessions[i];
+
+    history_unlock();
+
+    return session;
+}
+
 const struct history_session *get_history_session(size_t idx) {
     if(idx == 0) return &active_session;
 
+    history_lock();
+
     ssize_t i = ((ssize_t)past_sessions.num_sessions - (ssize_t)idx);
-    if(i < 0) return NULL;
+    const struct history_session *session = NULL;
+    if(i >= 0) {
+        decode_session(&past_sessions.sessions[i], &past_blobs[i]);
+        session = &past_sessions.sessions[i];
+    }
+
+    history_unlock();
+
+    return session;
+}
+
+unsigned int get_history_generation(void) {
+    return generation;
+}
 
-    return &past_sessions.sessions[i];
+size_t get_history_session_count(void) {
+    return past_sessions.num_sessions + 1;
 }
 
 
+static void free_session_entries(struct history_session *session) {
+    if(session->entries == NULL) return;
+
+    for(size_t i=0; i<session->entries_count; i++){
+        free(session->entries[i].tokens);
+    }
+    free(session->entries);
+}
+
 void erase_all_history(void){
+    history_lock();
+
     for(size_t i=0; i<past_sessions.num_sessions; i++){
-        free(past_sessions.sessions[i].entries);
+        free_session_entries(&past_sessions.sessions[i]);
     }
     free(past_sessions.sessions);
+    free(past_blobs);
+    past_blobs = NULL;
 
-    free(active_session.entries);
+    g_free(loaded_data);
+    loaded_data = NULL;
+    loaded_size = 0;
+    loaded_version = HISTORY_VERSION;
+
+    free_session_entries(&active_session);
 
 
     active_session.timestamp = time(NULL);
     active_session.entries_count = 0;
     active_session.entries = NULL;
+    active_session.sources = 0;
+    active_session.language[0] = '\0';
+    active_session.multilingual = false;
 
     past_sessions.num_sessions = 0;
     past_sessions.sessions = NULL;
 
+    generation++;
+
     save_current_history(default_history_file);
+
+    history_unlock();
 }
\ No newline at end of file
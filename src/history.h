@@ -27,9 +27,22 @@
 
 #define HISTORY_TOKEN_MAX_CHARS 32
 #define HISTORY_MAX_TOKENS 256
+#define HISTORY_LANGUAGE_MAX_CHARS 8
 
 extern char *default_history_file;
 
+// Where the captioned audio came from. Stored in history, so existing values
+// must not be renumbered
+typedef enum CaptionSource {
+    CAPTION_SOURCE_DESKTOP = 0,
+    CAPTION_SOURCE_MICROPHONE = 1,
+
+    CAPTION_SOURCE_COUNT
+} CaptionSource;
+
+// Translated, human readable name of the source, e.g. for tagging captions
+const char *caption_source_name(CaptionSource source);
+
 
 // A single token. The token text is inline for serialization simplicity
 struct history_token {
@@ -42,6 +55,12 @@ struct history_token {
 // An entry consisting of 0 tokens denotes silence
 struct history_entry {
     time_t timestamp;
+    CaptionSource source;
+
+    // Language code of the model that produced the tokens, empty for
+    // silence and for entries from before it was recorded
+    char language[HISTORY_LANGUAGE_MAX_CHARS];
+
     size_t tokens_count;
     struct history_token *tokens;
 };
@@ -51,6 +70,15 @@ struct history_session {
     time_t timestamp;
     size_t entries_count;
     struct history_entry *entries;
+
+    // Bitmask of (1 << CaptionSource) for every source in the entries.
+    // Only valid once the session has been decoded
+    unsigned int sources;
+
+    // The first language in the entries, and whether any other follows.
+    // Only valid once the session has been decoded
+    char language[HISTORY_LANGUAGE_MAX_CHARS];
+    bool multilingual;
 };
 
 // List of past sessions
@@ -64,13 +92,28 @@ struct past_history_sessions {
 // Initialize history
 void history_init(void);
 
+// Held while reading sessions from another thread, as the ASR thread
+// may append to (and reallocate) the active session at any time
+void history_lock(void);
+void history_unlock(void);
+
 // Every time finalized, commit to list of history_entry
-void commit_tokens_to_current_history(const AprilToken *tokens,
+void commit_tokens_to_current_history(CaptionSource source,
+                                      const char *language,
+                                      const AprilToken *tokens,
                                       size_t tokens_count);
 
 
 // Puts an empty entry into history meaning silence
-void save_silence_to_history(void);
+void save_silence_to_history(CaptionSource source);
+
+// True if the session has captions from more than one source, in which case
+// entries should be tagged with their source when shown
+bool history_session_is_mixed(const struct history_session *session);
+
+// True if the session has captions in more than one language, in which
+// case entries should be tagged with their language when shown
+bool history_session_is_multilingual(const struct history_session *session);
 
 // Serialize/Deserialize list of history_entry
 void save_current_history(const char *path);
@@ -85,7 +128,23 @@ void export_history_as_text(const char *path);
 // 2 returns the one prior to the previous
 // ...
 // returns NULL once reached the first session
+// Past sessions are decoded from the loaded file on first access. The
+// session may be freed by erase_all_history or load_history_from, so hold
+// history_lock for as long as it is used
 const struct history_session *get_history_session(size_t idx);
 
+// Same indexing as get_history_session, but does not decode the session.
+// Only timestamp and entries_count are valid, entries may be NULL. Also
+// only valid while history_lock is held
+const struct history_session *peek_history_session(size_t idx);
+
+// Number of sessions including the active one
+size_t get_history_session_count(void);
+
+
+void erase_all_history(void);
 
-void erase_all_history(void);
\ No newline at end of file
+// Changes whenever erase_all_history or load_history_from replace the
+// sessions, so pointers to them taken before can be told apart. Call with
+// history_lock held
+unsigned int get_history_generation(void);
\ No newline at end of file
@@ -33,6 +33,7 @@
 
 #include "line-gen.h"
 #include "profanity-filter.h"
+#include "token-view.h"
 #include "common.h"
 
 void token_capitalizer_init(struct token_capitalizer *tc) {
@@ -124,7 +125,7 @@ static int line_generator_get_text_width(struct line_generator *lg, const char *
 }
 
 #define MAX_TOKEN_SCRATCH 72
-void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens) {
+static void update_lines(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens, const struct filter_matcher *filter) {
     // Add capitalization information
     static bool should_capitalize[1024];
 
@@ -143,6 +144,7 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
     bool filter_profanity = g_settings_get_boolean(settings, "filter-profanity");
 
     FilterMode filter_mode = filter_profanity ? FILTER_PROFANITY : (filter_slurs ? FILTER_SLURS : FILTER_NONE);
+    struct token_view view = token_view_from_april(tokens, num_tokens);
 
     bool use_lowercase = !g_settings_get_boolean(settings, "text-uppercase");
     char token_scratch[MAX_TOKEN_SCRATCH] = { 0 };
@@ -166,7 +168,7 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
                 // backtrack to the previous line
                 lg->active_start_of_lines[lg->current_line] = -1;
                 lg->current_line = REL_LINE_IDX(lg->current_line, -1);
-                return line_generator_update(lg, num_tokens, tokens);
+                return update_lines(lg, num_tokens, tokens, filter);
             } else {
                 continue;
             }
@@ -223,7 +225,7 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
 
             // filter current word, if applicable
             if((filter_mode > FILTER_NONE) && (tokens[j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-                size_t skip = get_filter_skip(tokens, j, num_tokens, filter_mode);
+                size_t skip = get_filter_skip(filter, &view, j, filter_mode);
                 if(skip > 0) {
                     skipahead = skip;
                     token = SWEAR_REPLACEMENT;
@@ -254,7 +256,7 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
                     lg->active_start_of_lines[lg->current_line] = tgt_brk;
                     lg->lines[lg->current_line].start_head = 0;
                     lg->lines[lg->current_line].start_len = 0;
-                    return line_generator_update(lg, num_tokens, tokens);
+                    return update_lines(lg, num_tokens, tokens, filter);
                 }
             }
 
@@ -277,6 +279,13 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
     }
 }
 
+void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens) {
+    // Once for the whole update rather than for every word
+    struct filter_matcher *filter = profanity_filter_acquire();
+    update_lines(lg, num_tokens, tokens, filter);
+    profanity_filter_release(filter);
+}
+
 void line_generator_finalize(struct line_generator *lg) {
     // reset active
     for(size_t i=0; i<AC_LINE_COUNT; i++) lg->active_start_of_lines[i] = -1;
@@ -309,6 +318,28 @@ void line_generator_break(struct line_generator *lg) {
     lg->lines[lg->current_line].start_len = 0;
 }
 
+void line_generator_add_tag(struct line_generator *lg, const char *markup) {
+    // The line the active tokens start on
+    for(size_t i=0; i<AC_LINE_COUNT; i++){
+        if(lg->active_start_of_lines[i] != 0) continue;
+
+        struct line *curr = &lg->lines[i];
+        if((curr->start_head + strlen(markup)) > (AC_LINE_MAX - 256)) return;
+
+        int width, height;
+        pango_layout_set_width(lg->layout, -1);
+        pango_layout_set_markup(lg->layout, markup, -1);
+        pango_layout_get_size(lg->layout, &width, &height);
+
+        curr->start_head += sprintf(&curr->text[curr->start_head], "%s", markup);
+        curr->start_len += width / PANGO_SCALE;
+
+        curr->head = curr->start_head;
+        curr->len = curr->start_len;
+        return;
+    }
+}
+
 void line_generator_set_text(struct line_generator *lg, GtkLabel *lbl) {
     char *head = &lg->output[0];
     *head = '\0';
@@ -323,6 +354,15 @@ void line_generator_set_text(struct line_generator *lg, GtkLabel *lbl) {
     gtk_label_set_markup(lbl, lg->output);
 }
 
+const char *line_generator_get_last_line(struct line_generator *lg) {
+    for(int i=0; i<AC_LINE_COUNT; i++) {
+        struct line *curr = &lg->lines[REL_LINE_IDX(lg->current_line, -i)];
+        if(curr->text[0] != '\0') return curr->text;
+    }
+
+    return "";
+}
+
 void line_generator_set_language(struct line_generator *lg, const char* language) {
     lg->is_english = (language[0] == 'e') && (language[1] == 'n');
     lg->tcap.is_english = lg->is_english;
@@ -74,5 +74,12 @@ void line_generator_init(struct line_generator *lg);
 void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens);
 void line_generator_finalize(struct line_generator *lg);
 void line_generator_break(struct line_generator *lg);
+
+// Inserts markup in front of the tokens not yet finalized, e.g. to tag
+// which language they are in
+void line_generator_add_tag(struct line_generator *lg, const char *markup);
 void line_generator_set_text(struct line_generator *lg, GtkLabel *lbl);
+
+// Markup of the most recent line with any text in it, or an empty string
+const char *line_generator_get_last_line(struct line_generator *lg);
 void line_generator_set_language(struct line_generator *lg, const char* language);
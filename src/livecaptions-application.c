@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <glib/gi18n.h>
 #include "livecaptions-application.h"
 #include "livecaptions-settings.h"
 #include "livecaptions-window.h"
@@ -24,21 +25,252 @@
 #include "asrproc.h"
 #include "common.h"
 #include "history.h"
+#include "profanity-filter.h"
+#include "preprocess.h"
+#include "model-cache.h"
+#include "asr-governor.h"
+#include "rt.h"
+#include "benchmark.h"
+#include "replay.h"
 
 G_DEFINE_TYPE (LiveCaptionsApplication, livecaptions_application, ADW_TYPE_APPLICATION)
 
+static char *input_path = NULL;
+static char *input_format = NULL;
+static int input_rate = 0;
+static int input_channels = 0;
+static gboolean input_fast = FALSE;
+static gboolean input_loop = FALSE;
+
+// Override the settings of the same name when given
+static char *decoder_cpus = NULL;
+static int decoder_nice = -1;
+static gboolean decoder_idle = FALSE;
+static int decoder_threads = -1;
+
+static const GOptionEntry option_entries[] = {
+    { "input", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &input_path,
+      N_("Caption audio from a WAV or raw PCM file, a named pipe, or - for stdin"), N_("FILE") },
+    { "input-format", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &input_format,
+      N_("Format of the input: auto, wav, s16le or f32le"), N_("FORMAT") },
+    { "input-rate", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &input_rate,
+      N_("Sample rate of raw input, defaults to the model's"), N_("HZ") },
+    { "input-channels", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &input_channels,
+      N_("Channel count of raw input, defaults to 1"), N_("COUNT") },
+    { "input-fast", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &input_fast,
+      N_("Read the input as fast as it can be decoded instead of in real time"), NULL },
+    { "input-loop", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &input_loop,
+      N_("Start over at the end of the input file instead of quitting"), NULL },
+    { "decoder-cpus", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &decoder_cpus,
+      N_("CPUs speech recognition may run on, like 0-3,8"), N_("LIST") },
+    { "decoder-nice", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &decoder_nice,
+      N_("Nice value of the speech recognition threads, 0 to 19"), N_("NICE") },
+    { "decoder-idle", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &decoder_idle,
+      N_("Run speech recognition only when the CPU is otherwise idle"), NULL },
+    { "decoder-threads", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &decoder_threads,
+      N_("How many sessions may decode at once with a backlog policy, 0 for all"), N_("COUNT") },
+    { NULL }
+};
+
 static void deinit_audio(LiveCaptionsApplication *self){
-    if(self->audio != NULL) {
-        free_audio_thread(self->audio);
-        self->audio = NULL;
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(self->audio[i] != NULL) {
+            free_audio_thread(self->audio[i]);
+            self->audio[i] = NULL;
+        }
+    }
+}
+
+// Capture statistics of each source, for the about dialog and the log
+static char *capture_diagnostics(LiveCaptionsApplication *self) {
+    GString *str = g_string_new(NULL);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(self->audio[i] == NULL) continue;
+
+        struct capture_stats stats;
+        audio_thread_get_stats(self->audio[i], &stats);
+
+        char *text = capture_stats_to_string(&stats, "  ");
+        g_string_append_printf(str, "%s capture (%s)\n%s",
+                               caption_source_name((CaptionSource)i),
+                               audio_backend_name(audio_thread_get_backend(self->audio[i])),
+                               text);
+        g_free(text);
+    }
+
+    char *sessions = asr_thread_describe_sessions(self->asr);
+    g_string_append_printf(str, "\n%s", sessions);
+    g_free(sessions);
+
+    char *power = asr_thread_describe_power(self->asr);
+    g_string_append(str, power);
+    g_free(power);
+
+    if(self->governor != NULL) {
+        char *governor = asr_governor_describe(self->governor);
+        g_string_append(str, governor);
+        g_free(governor);
+    }
+
+    char *placement = rt_describe_placement();
+    g_string_append(str, placement);
+    g_free(placement);
+
+    return g_string_free(str, false);
+}
+
+static gboolean log_capture_stats(void *userdata) {
+    LiveCaptionsApplication *self = userdata;
+
+    char *text = capture_diagnostics(self);
+    printf("\n-- Capture statistics --\n%s-- --\n\n", text);
+    g_free(text);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void update_stats_log(LiveCaptionsApplication *self) {
+    if(self->stats_log_source != 0) {
+        g_source_remove(self->stats_log_source);
+        self->stats_log_source = 0;
+    }
+
+    int interval = g_settings_get_int(self->settings, "capture-stats-log-interval");
+    if(interval > 0) self->stats_log_source = g_timeout_add_seconds(interval, log_capture_stats, self);
+}
+
+static void update_model_cache(LiveCaptionsApplication *self) {
+    int budget_mb = g_settings_get_int(self->settings, "model-cache-budget-mb");
+    model_cache_set_budget((size_t)budget_mb * 1024 * 1024);
+}
+
+static void update_parallel_models(LiveCaptionsApplication *self) {
+    char **models = g_settings_get_strv(self->settings, "parallel-models");
+    asr_thread_set_parallel_models(self->asr, (const char *const *)models);
+    g_strfreev(models);
+}
+
+// Files read as fast as possible never fall behind
+static void update_governor(LiveCaptionsApplication *self) {
+    if(self->governor == NULL) self->governor = asr_governor_new(self);
+
+    bool enabled = g_settings_get_boolean(self->settings, "adaptive-quality") && !input_fast;
+    asr_governor_set_enabled(self->governor, enabled);
+}
+
+static void update_backlog(LiveCaptionsApplication *self) {
+    char *name = g_settings_get_string(self->settings, "backlog-policy");
+
+    BacklogPolicy policy = BACKLOG_OFF;
+    if(g_str_equal(name, "drop-oldest")) policy = BACKLOG_DROP_OLDEST;
+    else if(g_str_equal(name, "skip-silence")) policy = BACKLOG_SKIP_SILENCE;
+    else if(g_str_equal(name, "squash-silence")) policy = BACKLOG_SQUASH_SILENCE;
+
+    g_free(name);
+
+    asr_thread_set_backlog(self->asr, policy,
+                           g_settings_get_int(self->settings, "backlog-max-seconds") * 1000,
+                           g_settings_get_int(self->settings, "backlog-squash-ms"));
+}
+
+static void update_placement(LiveCaptionsApplication *self) {
+    char *cpus = (decoder_cpus != NULL) ? g_strdup(decoder_cpus) : g_settings_get_string(self->settings, "decoder-cpus");
+    int nice = (decoder_nice >= 0) ? decoder_nice : g_settings_get_int(self->settings, "decoder-nice");
+    bool idle = decoder_idle || g_settings_get_boolean(self->settings, "decoder-idle");
+
+    rt_set_asr_placement(cpus, nice, idle);
+    g_free(cpus);
+
+    int threads = (decoder_threads >= 0) ? decoder_threads : g_settings_get_int(self->settings, "decoder-threads");
+    asr_thread_set_decoder_threads(self->asr, threads);
+}
+
+static bool window_hidden(LiveCaptionsApplication *self) {
+    if((self->window == NULL) || !gtk_widget_get_visible(GTK_WIDGET(self->window))) return true;
+
+    GdkSurface *surface = gtk_native_get_surface(GTK_NATIVE(self->window));
+    if((surface == NULL) || !GDK_IS_TOPLEVEL(surface)) return false;
+
+    GdkToplevelState state = gdk_toplevel_get_state(GDK_TOPLEVEL(surface));
+    // Not GDK_TOPLEVEL_STATE_SUSPENDED, a covered window or one on another
+    // workspace is still a session the user expects to be recorded
+    return (state & GDK_TOPLEVEL_STATE_MINIMIZED) != 0;
+}
+
+// File input is always read to the end, as there's no one to wait for
+static void update_power(LiveCaptionsApplication *self) {
+    asr_thread_set_idle_timeout(self->asr, g_settings_get_int(self->settings, "idle-after-seconds") * 1000);
+
+    bool suspend = g_settings_get_boolean(self->settings, "suspend-when-hidden") &&
+                   !audio_file_input_is_open() && window_hidden(self);
+
+    if(suspend == self->suspended) return;
+    self->suspended = suspend;
+
+    printf("%s captioning\n", suspend ? "The window is hidden, suspending" : "Resuming");
+
+    asr_thread_set_suspended(self->asr, suspend);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(self->audio[i] != NULL) audio_thread_set_corked(self->audio[i], suspend);
     }
 }
 
+static void on_window_state_changed(GObject *object, GParamSpec *pspec, gpointer userdata) {
+    update_power(LIVECAPTIONS_APPLICATION(userdata));
+}
+
+// The surface only exists once the window is realized
+static void on_window_realize(GtkWidget *widget, gpointer userdata) {
+    GdkSurface *surface = gtk_native_get_surface(GTK_NATIVE(widget));
+    g_signal_connect_object(surface, "notify::state", G_CALLBACK(on_window_state_changed), userdata, 0);
+}
+
+static void update_preprocess(LiveCaptionsApplication *self) {
+    unsigned int stages = 0;
+    if(g_settings_get_boolean(self->settings, "preprocess-highpass")) stages |= PREPROCESS_HIGHPASS;
+    if(g_settings_get_boolean(self->settings, "preprocess-agc")) stages |= PREPROCESS_AGC;
+    if(g_settings_get_boolean(self->settings, "preprocess-noise-gate")) stages |= PREPROCESS_NOISE_GATE;
+
+    asr_thread_set_preprocess_stages(self->asr, stages);
+}
+
 static void init_audio(LiveCaptionsApplication *self) {
     deinit_audio(self);
 
+    // The results come from the recording, the sessions only have to exist
+    if(replay_is_active()) {
+        unsigned int sources = replay_get_sources();
+        asr_thread_enable_source(self->asr, CAPTION_SOURCE_DESKTOP, (sources & (1u << CAPTION_SOURCE_DESKTOP)) != 0);
+        asr_thread_enable_source(self->asr, CAPTION_SOURCE_MICROPHONE, (sources & (1u << CAPTION_SOURCE_MICROPHONE)) != 0);
+        return;
+    }
+
     gboolean use_microphone = g_settings_get_boolean(self->settings, "microphone");
-    self->audio = create_audio_thread(use_microphone, self->asr);
+    gboolean capture_both = g_settings_get_boolean(self->settings, "capture-both-sources");
+
+    bool desktop = capture_both || !use_microphone;
+    bool microphone = capture_both || use_microphone;
+
+    // There's only one input to read from
+    if(audio_file_input_is_open()) {
+        desktop = true;
+        microphone = false;
+    }
+
+    // No audio threads exist at this point
+    asr_thread_set_capture_queue(self->asr, realtime_capture_enabled());
+
+    asr_thread_enable_source(self->asr, CAPTION_SOURCE_DESKTOP, desktop);
+    asr_thread_enable_source(self->asr, CAPTION_SOURCE_MICROPHONE, microphone);
+
+    if(desktop) self->audio[CAPTION_SOURCE_DESKTOP] = create_audio_thread(false, self->asr);
+    if(microphone) self->audio[CAPTION_SOURCE_MICROPHONE] = create_audio_thread(true, self->asr);
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(self->suspended && (self->audio[i] != NULL)) audio_thread_set_corked(self->audio[i], true);
+    }
 
     asr_thread_flush(self->asr);
 }
@@ -54,13 +286,19 @@ static void livecaptions_application_finalize(GObject *object) {
     LiveCaptionsApplication *self = (LiveCaptionsApplication *)object;
     asr_thread_pause(self->asr, true);
 
+    if(self->stats_log_source != 0) g_source_remove(self->stats_log_source);
+    if(self->governor != NULL) asr_governor_free(self->governor);
+
     save_current_history(default_history_file);
 
-    audio_thread audio = self->audio;
+    audio_thread audio[CAPTION_SOURCE_COUNT];
+    memcpy(audio, self->audio, sizeof(audio));
 
     G_OBJECT_CLASS(livecaptions_application_parent_class)->finalize(object);
 
-    if(audio != NULL) free_audio_thread(audio);
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        if(audio[i] != NULL) free_audio_thread(audio[i]);
+    }
 }
 
 
@@ -85,6 +323,8 @@ static void livecaptions_application_activate(GApplication *app) {
     history_init();
     load_history_from(default_history_file);
 
+    profanity_filter_init();
+
     GtkWindow *window;
 
     g_assert(LIVECAPTIONS_IS_APPLICATION(app));
@@ -96,6 +336,9 @@ static void livecaptions_application_activate(GApplication *app) {
 
         LiveCaptionsWindow *lc_window = LIVECAPTIONS_WINDOW(window);
         asr_thread_set_main_window(self->asr, lc_window);
+
+        g_signal_connect(window, "notify::visible", G_CALLBACK(on_window_state_changed), self);
+        g_signal_connect_after(window, "realize", G_CALLBACK(on_window_realize), self);
         gtk_label_set_text(lc_window->label, " \n ");
 
         self->window = lc_window;
@@ -109,7 +352,41 @@ static void livecaptions_application_activate(GApplication *app) {
         livecaptions_application_show_welcome(self);
     }
 
+    update_model_cache(self);
+    update_parallel_models(self);
+    update_preprocess(self);
+    update_backlog(self);
+    update_placement(self);
     init_audio(self);
+    update_stats_log(self);
+    update_governor(self);
+    update_power(self);
+
+    replay_start(self->asr);
+}
+
+static gint livecaptions_application_handle_local_options(GApplication *app, GVariantDict *options) {
+    LiveCaptionsApplication *self = LIVECAPTIONS_APPLICATION(app);
+
+    if(input_path != NULL) {
+        struct audio_file_options file_options = {
+            .path = input_path,
+            .format = input_format,
+            .rate = (unsigned int)MAX(input_rate, 0),
+            .channels = (unsigned int)MAX(input_channels, 0),
+            .realtime = !input_fast,
+            .loop = input_loop
+        };
+
+        if(!audio_file_input_open(&file_options)) return 1;
+
+        if(input_fast) asr_thread_set_realtime(self->asr, false);
+    }
+
+    if(!replay_open_recording()) return 1;
+
+    // Continue with the default handling
+    return -1;
 }
 
 static gboolean on_handle_allow_keep_above(DBLCapExternal *dbus_external,
@@ -189,6 +466,7 @@ static void livecaptions_application_class_init(LiveCaptionsApplicationClass *kl
     * to do that, we'll just present any existing window.
     */
     app_class->activate = livecaptions_application_activate;
+    app_class->handle_local_options = livecaptions_application_handle_local_options;
 
     app_class->dbus_register = livecaptions_application_dbus_register;
     app_class->dbus_unregister = livecaptions_application_dbus_unregister;
@@ -218,11 +496,20 @@ livecaptions_application_show_about(G_GNUC_UNUSED GSimpleAction *action,
 
     window = gtk_application_get_active_window(GTK_APPLICATION(self));
 
+    char *capture = capture_diagnostics(self);
+    char *models = model_cache_describe();
+    char *diagnostics = g_strconcat(capture, "\n", models, NULL);
+    g_free(capture);
+    g_free(models);
+
     gtk_show_about_dialog(window,
                            "program-name", "livecaptions",
                            "authors", authors,
                            "version", "0.1.0",
+                           "system-information", diagnostics,
                              NULL);
+
+    g_free(diagnostics);
 }
 
 
@@ -253,6 +540,26 @@ static void on_settings_change(G_GNUC_UNUSED GSettings *settings,
     if(g_str_equal(key, "microphone")) {
         init_audio(self);
         g_simple_action_set_state(self->mic_action, g_variant_new_boolean(g_settings_get_boolean(self->settings, "microphone")));
+    }else if(g_str_equal(key, "capture-both-sources") || g_str_equal(key, "audio-backend") || g_str_equal(key, "fragment-size-ms") || g_str_equal(key, "adaptive-fragment-size") || g_str_equal(key, "native-capture-format") || g_str_equal(key, "realtime-capture")) {
+        init_audio(self);
+    }else if(g_str_equal(key, "capture-stats-log-interval")) {
+        update_stats_log(self);
+    }else if(g_str_equal(key, "model-cache-budget-mb")) {
+        update_model_cache(self);
+    }else if(g_str_equal(key, "parallel-models")) {
+        update_parallel_models(self);
+    }else if(g_str_equal(key, "adaptive-quality")) {
+        update_governor(self);
+    }else if(g_str_equal(key, "backlog-policy") || g_str_equal(key, "backlog-max-seconds") || g_str_equal(key, "backlog-squash-ms")) {
+        update_backlog(self);
+    }else if(g_str_equal(key, "idle-after-seconds") || g_str_equal(key, "suspend-when-hidden")) {
+        update_power(self);
+    }else if(g_str_equal(key, "decoder-cpus") || g_str_equal(key, "decoder-nice") || g_str_equal(key, "decoder-idle") || g_str_equal(key, "decoder-threads")) {
+        update_placement(self);
+    }else if(g_str_equal(key, "active-model")) {
+        if(self->governor != NULL) asr_governor_model_changed(self->governor);
+    }else if(g_str_equal(key, "preprocess-highpass") || g_str_equal(key, "preprocess-agc") || g_str_equal(key, "preprocess-noise-gate")) {
+        update_preprocess(self);
     }else if(g_str_equal(key, "filter-slurs")) {
         if(g_settings_get_boolean(self->settings, "filter-profanity") && !g_settings_get_boolean(self->settings, "filter-slurs")){
             // Filter slurs was turned off but profanity is still on, this is invalid state, turn off filter profanity
@@ -294,6 +601,12 @@ livecaptions_application_toggle_microphone(GSimpleAction *action,
 static void livecaptions_application_init(LiveCaptionsApplication *self) {
     self->settings = g_settings_new("net.sapples.LiveCaptions");
 
+    g_application_add_main_option_entries(G_APPLICATION(self), option_entries);
+
+    // Handled in main, only listed here for --help
+    g_application_add_main_option_entries(G_APPLICATION(self), benchmark_option_entries);
+    g_application_add_main_option_entries(G_APPLICATION(self), replay_option_entries);
+
     g_autoptr(GSimpleAction) quit_action = g_simple_action_new("quit", NULL);
     g_signal_connect_swapped(quit_action, "activate", G_CALLBACK(g_application_quit), self);
     g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(quit_action));
@@ -317,6 +630,9 @@ static void livecaptions_application_init(LiveCaptionsApplication *self) {
 
     self->mic_action = mic_action;
 
+    g_autoptr(GAction) both_action = g_settings_create_action(self->settings, "capture-both-sources");
+    g_action_map_add_action(G_ACTION_MAP(self), both_action);
+
     gtk_application_set_accels_for_action(GTK_APPLICATION(self),
                                            "app.quit",
                                            (const char *[]) {
@@ -336,6 +652,10 @@ static void livecaptions_application_init(LiveCaptionsApplication *self) {
 }
 
 
+void livecaptions_application_restart_audio(LiveCaptionsApplication *self) {
+    init_audio(self);
+}
+
 void livecaptions_application_finish_setup(LiveCaptionsApplication *self, gdouble result) {
     gtk_widget_set_visible(GTK_WIDGET(self->window), true);
 
@@ -33,7 +33,16 @@ struct _LiveCaptionsApplication {
     GtkWindow *welcome;
 
     asr_thread asr;
-    audio_thread audio;
+    audio_thread audio[CAPTION_SOURCE_COUNT];
+
+    // Lowers the decoding quality while it can't keep up
+    struct asr_governor *governor;
+
+    // Periodically prints the capture statistics, 0 if not enabled
+    guint stats_log_source;
+
+    // Capture is corked while the window can't be seen
+    bool suspended;
 
     DBLCapExternal *dbus_external;
 };
@@ -47,6 +56,9 @@ G_DECLARE_FINAL_TYPE (LiveCaptionsApplication, livecaptions_application, LIVECAP
 
 void livecaptions_application_finish_setup(LiveCaptionsApplication *self, gdouble result);
 
+// Recreates the audio threads, e.g. after the model's sample rate changed
+void livecaptions_application_restart_audio(LiveCaptionsApplication *self);
+
 LiveCaptionsApplication *livecaptions_application_new (gchar *application_id,
                                                        GApplicationFlags  flags);
 
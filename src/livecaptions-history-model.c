@@ -0,0 +1,217 @@
+/* livecaptions-history-model.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "livecaptions-history-model.h"
+
+G_DEFINE_TYPE(LiveCaptionsHistoryRow, livecaptions_history_row, G_TYPE_OBJECT)
+
+static void livecaptions_history_row_class_init(LiveCaptionsHistoryRowClass *klass) {
+}
+
+static void livecaptions_history_row_init(LiveCaptionsHistoryRow *self) {
+}
+
+
+// Returns the list-order index of the session containing this row
+static size_t find_session(LiveCaptionsHistoryModel *self, guint position) {
+    size_t lo = 0;
+    size_t hi = self->num_sessions;
+    while((hi - lo) > 1) {
+        size_t mid = (lo + hi) / 2;
+        if(self->row_offsets[mid] <= position) lo = mid;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+static GType livecaptions_history_model_get_item_type(GListModel *list) {
+    return LIVECAPTIONS_TYPE_HISTORY_ROW;
+}
+
+static guint livecaptions_history_model_get_n_items(GListModel *list) {
+    LiveCaptionsHistoryModel *self = LIVECAPTIONS_HISTORY_MODEL(list);
+
+    if(self->row_offsets == NULL) return 0;
+    return (guint)self->row_offsets[self->num_sessions];
+}
+
+static gpointer livecaptions_history_model_get_item(GListModel *list, guint position) {
+    LiveCaptionsHistoryModel *self = LIVECAPTIONS_HISTORY_MODEL(list);
+
+    if(position >= livecaptions_history_model_get_n_items(list)) return NULL;
+
+    return g_object_new(LIVECAPTIONS_TYPE_HISTORY_ROW, NULL);
+}
+
+static void livecaptions_history_model_list_init(GListModelInterface *iface) {
+    iface->get_item_type = livecaptions_history_model_get_item_type;
+    iface->get_n_items = livecaptions_history_model_get_n_items;
+    iface->get_item = livecaptions_history_model_get_item;
+}
+
+G_DEFINE_TYPE_WITH_CODE(LiveCaptionsHistoryModel, livecaptions_history_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, livecaptions_history_model_list_init))
+
+static void livecaptions_history_model_finalize(GObject *object) {
+    LiveCaptionsHistoryModel *self = LIVECAPTIONS_HISTORY_MODEL(object);
+
+    g_cancellable_cancel(self->cancellable);
+    g_clear_object(&self->cancellable);
+    g_clear_pointer(&self->chunks, g_hash_table_destroy);
+    g_queue_clear(&self->chunk_order);
+
+    free(self->row_offsets);
+
+    G_OBJECT_CLASS(livecaptions_history_model_parent_class)->finalize(object);
+}
+
+static void livecaptions_history_model_class_init(LiveCaptionsHistoryModelClass *klass) {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize = livecaptions_history_model_finalize;
+}
+
+static void livecaptions_history_model_init(LiveCaptionsHistoryModel *self) {
+    self->num_sessions = 0;
+    self->row_offsets = NULL;
+
+    self->options.use_lowercase = false;
+    self->options.filter_mode = FILTER_NONE;
+
+    self->chunks = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                         (GDestroyNotify)history_render_chunk_free);
+    g_queue_init(&self->chunk_order);
+    self->cancellable = g_cancellable_new();
+}
+
+void livecaptions_history_model_refresh(LiveCaptionsHistoryModel *self) {
+    guint old_count = livecaptions_history_model_get_n_items(G_LIST_MODEL(self));
+
+    g_cancellable_cancel(self->cancellable);
+    g_object_unref(self->cancellable);
+    self->cancellable = g_cancellable_new();
+
+    g_hash_table_remove_all(self->chunks);
+    g_queue_clear(&self->chunk_order);
+
+    free(self->row_offsets);
+
+    history_lock();
+
+    self->num_sessions = get_history_session_count();
+    self->row_offsets = calloc(self->num_sessions + 1, sizeof(size_t));
+
+    // Only entry counts are needed here, so sessions are not decoded
+    size_t rows = 0;
+    for(size_t i=0; i<self->num_sessions; i++){
+        self->row_offsets[i] = rows;
+
+        const struct history_session *session = peek_history_session(self->num_sessions - 1 - i);
+        if((session != NULL) && (session->entries_count > 0))
+            rows += session->entries_count + 1;
+    }
+    self->row_offsets[self->num_sessions] = rows;
+
+    history_unlock();
+
+    g_list_model_items_changed(G_LIST_MODEL(self), 0, old_count, (guint)rows);
+}
+
+void livecaptions_history_model_set_options(LiveCaptionsHistoryModel *self,
+                                            const struct history_render_options *options)
+{
+    self->options = *options;
+}
+
+// Moves the chunk to the front, dropping the least recently shown ones past
+// the limit. A chunk dropped while still rendering is discarded when ready
+static void touch_chunk(LiveCaptionsHistoryModel *self, gpointer key) {
+    GList *link = g_queue_find(&self->chunk_order, key);
+    if(link != NULL) {
+        if(link == self->chunk_order.head) return;
+        g_queue_unlink(&self->chunk_order, link);
+        g_queue_push_head_link(&self->chunk_order, link);
+    } else {
+        g_queue_push_head(&self->chunk_order, key);
+    }
+
+    while(self->chunk_order.length > HISTORY_MODEL_MAX_CHUNKS)
+        g_hash_table_remove(self->chunks, g_queue_pop_tail(&self->chunk_order));
+}
+
+static void chunk_ready_cb(GObject *target, struct history_render_chunk *chunk) {
+    LiveCaptionsHistoryModel *self = LIVECAPTIONS_HISTORY_MODEL(target);
+
+    size_t k = self->num_sessions - 1 - chunk->session_idx;
+    guint first = (guint)(self->row_offsets[k] + chunk->first_row);
+    guint count = (guint)chunk->num_rows;
+
+    // Scrolled far away while it was rendering, it's requested again if
+    // it's ever shown
+    if(!g_hash_table_contains(self->chunks, GUINT_TO_POINTER(first))) {
+        history_render_chunk_free(chunk);
+        return;
+    }
+
+    g_hash_table_replace(self->chunks, GUINT_TO_POINTER(first), chunk);
+
+    // Rebinds the rows that were shown with placeholder text
+    g_list_model_items_changed(G_LIST_MODEL(self), first, count, count);
+}
+
+const char *livecaptions_history_model_get_row_text(LiveCaptionsHistoryModel *self,
+                                                    guint position,
+                                                    bool *is_text)
+{
+    *is_text = false;
+    if(position >= livecaptions_history_model_get_n_items(G_LIST_MODEL(self))) return NULL;
+
+    size_t k = find_session(self, position);
+    size_t row = position - self->row_offsets[k];
+    size_t session_rows = self->row_offsets[k + 1] - self->row_offsets[k];
+
+    size_t chunk_row = row - (row % HISTORY_RENDER_CHUNK_ROWS);
+    gpointer key = GUINT_TO_POINTER((guint)(self->row_offsets[k] + chunk_row));
+
+    gpointer value;
+    if(g_hash_table_lookup_extended(self->chunks, key, NULL, &value)) {
+        touch_chunk(self, key);
+        if(value == NULL) return NULL;
+
+        return history_render_chunk_get_row(value, row - chunk_row, is_text);
+    }
+
+    g_hash_table_insert(self->chunks, key, NULL);
+    touch_chunk(self, key);
+
+    size_t num_rows = MIN(HISTORY_RENDER_CHUNK_ROWS, session_rows - chunk_row);
+    history_render_request(self->num_sessions - 1 - k, chunk_row, num_rows,
+                           &self->options, self->cancellable,
+                           G_OBJECT(self), chunk_ready_cb);
+
+    return NULL;
+}
+
+LiveCaptionsHistoryModel *livecaptions_history_model_new(void) {
+    LiveCaptionsHistoryModel *self = g_object_new(LIVECAPTIONS_TYPE_HISTORY_MODEL, NULL);
+
+    livecaptions_history_model_refresh(self);
+
+    return self;
+}
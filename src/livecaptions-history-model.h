@@ -0,0 +1,89 @@
+/* livecaptions-history-model.h
+ * A GListModel that exposes the history sessions as a flat list of rows,
+ * one row per session header and one row per history entry. Rows are created
+ * on demand, and their text is rendered off the main thread in chunks once
+ * one of their rows is shown.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include "history.h"
+#include "history-render.h"
+
+// A single row. Rows are looked up by their position in the model, see
+// livecaptions_history_model_get_row_text
+struct _LiveCaptionsHistoryRow {
+    GObject parent_instance;
+};
+
+struct _LiveCaptionsHistoryModel {
+    GObject parent_instance;
+
+    // Snapshot of the session count, the active session may keep growing
+    // until the next refresh
+    size_t num_sessions;
+
+    // row_offsets[i] is the first row of the i-th oldest session,
+    // row_offsets[num_sessions] is the total row count
+    size_t *row_offsets;
+
+    struct history_render_options options;
+
+    // Rendered chunks keyed by the first row of the chunk. A key with a NULL
+    // value is a chunk that is still being rendered
+    GHashTable *chunks;
+
+    // Keys of the chunks, most recently shown first. Rows are only looked up
+    // while they're on screen, so the last ones are the furthest scrolled
+    // away and are dropped beyond HISTORY_MODEL_MAX_CHUNKS
+    GQueue chunk_order;
+
+    // Cancelled on refresh, so that chunks for the old layout are dropped
+    GCancellable *cancellable;
+};
+
+// Rendered chunks kept around, about 8000 rows
+#define HISTORY_MODEL_MAX_CHUNKS 32
+
+G_BEGIN_DECLS
+
+#define LIVECAPTIONS_TYPE_HISTORY_ROW (livecaptions_history_row_get_type())
+G_DECLARE_FINAL_TYPE (LiveCaptionsHistoryRow, livecaptions_history_row, LIVECAPTIONS, HISTORY_ROW, GObject);
+
+#define LIVECAPTIONS_TYPE_HISTORY_MODEL (livecaptions_history_model_get_type())
+G_DECLARE_FINAL_TYPE (LiveCaptionsHistoryModel, livecaptions_history_model, LIVECAPTIONS, HISTORY_MODEL, GObject);
+
+LiveCaptionsHistoryModel *livecaptions_history_model_new(void);
+
+// Re-reads the session list from history, drops all rendered text and emits
+// items-changed
+void livecaptions_history_model_refresh(LiveCaptionsHistoryModel *self);
+
+// Takes effect on the next refresh
+void livecaptions_history_model_set_options(LiveCaptionsHistoryModel *self,
+                                            const struct history_render_options *options);
+
+// Returns the text of the row at position, or NULL if it is not rendered yet.
+// In that case the chunk containing the row is queued for rendering, and
+// items-changed is emitted for its rows once it's ready
+const char *livecaptions_history_model_get_row_text(LiveCaptionsHistoryModel *self,
+                                                    guint position,
+                                                    bool *is_text);
+
+G_END_DECLS
@@ -25,7 +25,6 @@
 #include "profanity-filter.h"
 #include "common.h"
 #include "window-helper.h"
-#include "line-gen.h"
 
 G_DEFINE_TYPE(LiveCaptionsHistoryWindow, livecaptions_history_window, GTK_TYPE_WINDOW)
 
@@ -75,160 +74,75 @@ static void warn_deletion_cb(LiveCaptionsHistoryWindow *self){
 static gboolean force_bottom(gpointer userdata) {
     LiveCaptionsHistoryWindow *self = LIVECAPTIONS_HISTORY_WINDOW(userdata);
 
+    guint count = g_list_model_get_n_items(G_LIST_MODEL(self->model));
+    if(count == 0) return G_SOURCE_REMOVE;
+
+#if GTK_CHECK_VERSION(4, 12, 0)
+    gtk_list_view_scroll_to(self->list_view, count - 1, GTK_LIST_SCROLL_NONE, NULL);
+#else
     GtkAdjustment *adj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(self->scroll));
     gtk_adjustment_set_value(adj, gtk_adjustment_get_upper(adj));
+#endif
 
     return G_SOURCE_REMOVE;
 }
 
-static void add_text(LiveCaptionsHistoryWindow *self, char *text, bool is_text) {
-    GtkWidget *label = gtk_label_new(text);
-
-    if(is_text){
-        PangoFontDescription *desc = pango_font_description_from_string(g_settings_get_string(self->settings, "font-name"));
-        PangoAttribute *attr_font = pango_attr_font_desc_new(desc);
-        PangoAttrList *attr = gtk_label_get_attributes(GTK_LABEL(label));
-        if(attr == NULL){
-            attr = pango_attr_list_new();
-        }
-        pango_attr_list_change(attr, attr_font);
-        gtk_label_set_attributes(GTK_LABEL(label), attr);
-        pango_font_description_free(desc);
-    }
+static void update_text_settings(LiveCaptionsHistoryWindow *self) {
+    if(self->text_attrs != NULL) pango_attr_list_unref(self->text_attrs);
 
-    gtk_label_set_selectable(GTK_LABEL(label), true);
-    gtk_label_set_wrap(GTK_LABEL(label), true);
-    gtk_label_set_xalign(GTK_LABEL(label), 0.0f);
-    gtk_widget_add_css_class(label, is_text ? "history-label" : "timestamp-label");
+    char *font_name = g_settings_get_string(self->settings, "font-name");
+    PangoFontDescription *desc = pango_font_description_from_string(font_name);
 
-    gtk_widget_set_hexpand(label, true);
-    gtk_widget_set_halign(label, GTK_ALIGN_FILL);
+    self->text_attrs = pango_attr_list_new();
+    pango_attr_list_change(self->text_attrs, pango_attr_font_desc_new(desc));
 
-    gtk_box_prepend(self->main_box, label);
-}
+    pango_font_description_free(desc);
+    g_free(font_name);
 
-static void add_time(LiveCaptionsHistoryWindow *self, time_t timestamp, bool date) {
-    char text[64];
+    struct history_render_options options;
+    options.use_lowercase = !g_settings_get_boolean(self->settings, "text-uppercase");
 
-    struct tm *tm = localtime(&timestamp);
-    strftime(text, 64, date ? "\n\nStart of session %F | %H:%M" : "%H:%M:%S", tm);
+    bool filter_slurs = g_settings_get_boolean(self->settings, "filter-slurs");
+    bool filter_profanity = g_settings_get_boolean(self->settings, "filter-profanity");
+
+    options.filter_mode = filter_profanity ? FILTER_PROFANITY : (filter_slurs ? FILTER_SLURS : FILTER_NONE);
 
-    add_text(self, text, false);
+    livecaptions_history_model_set_options(self->model, &options);
 }
 
-static void add_session(LiveCaptionsHistoryWindow *self, const struct history_session *session){
-    if(session->entries_count == 0) return;
+static void set_label_kind(GtkLabel *label, PangoAttrList *attrs, bool is_text) {
+    gtk_label_set_attributes(label, is_text ? attrs : NULL);
 
-    bool use_lowercase = !g_settings_get_boolean(self->settings, "text-uppercase");
-    GString *string = g_string_new(NULL);
+    gtk_widget_remove_css_class(GTK_WIDGET(label), is_text ? "timestamp-label" : "history-label");
+    gtk_widget_add_css_class(GTK_WIDGET(label), is_text ? "history-label" : "timestamp-label");
+}
 
-    bool filter_slurs = g_settings_get_boolean(self->settings, "filter-slurs");
-    bool filter_profanity = g_settings_get_boolean(self->settings, "filter-profanity");
+static void setup_row_cb(G_GNUC_UNUSED GtkSignalListItemFactory *factory, GtkListItem *item, G_GNUC_UNUSED gpointer userdata) {
+    GtkWidget *label = gtk_label_new(NULL);
 
-    FilterMode filter_mode = filter_profanity ? FILTER_PROFANITY : (filter_slurs ? FILTER_SLURS : FILTER_NONE);
-    struct token_capitalizer tcap;
-    token_capitalizer_init(&tcap);
-
-    for(size_t i_1=0; i_1<session->entries_count; i_1++){
-        size_t i = session->entries_count - i_1 - 1;
-
-        const struct history_entry *entry = &session->entries[i];
-
-        if(entry->tokens_count == 0){
-            // Silence
-            if((i + 1) >= session->entries_count) continue;
-            const struct history_entry *next_entry = &session->entries[i+1];
-
-            add_text(self, string->str, true);
-            add_time(self, next_entry->timestamp, false);
-
-            g_string_truncate(string, 0);
-        } else {
-            GString *entry_text = g_string_new(NULL);
-
-            if(entry->tokens[0].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) {
-                tcap.previous_was_period = true;
-            }
-
-            for(size_t j=0; j<entry->tokens_count;) {
-                size_t skipahead = 1;
-                const char *token = entry->tokens[j].token;
-
-                if((filter_mode > FILTER_NONE) && (entry->tokens[j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-                    size_t skip = get_filter_skip_history(entry->tokens, j, entry->tokens_count, filter_mode);
-                    if(skip > 0) {
-                        skipahead = skip;
-                        token = SWEAR_REPLACEMENT;
-                    }
-                }
-
-                if((j == 0) && (*token == ' ')) token++;
-
-                bool should_be_capitalized = false;
-                if((j+skipahead) < entry->tokens_count){
-                    should_be_capitalized = use_lowercase && token_capitalizer_next(&tcap, token, entry->tokens[j].flags, entry->tokens[j+skipahead].token, entry->tokens[j+skipahead].flags);
-                }else{
-                    should_be_capitalized = use_lowercase && token_capitalizer_next(&tcap, token, entry->tokens[j].flags, NULL, 0);
-                }
-
-                if(use_lowercase){
-                    const char *p = token;
-                    gunichar c;
-                    while (*p) {
-                        c = g_utf8_get_char_validated(p, -1);
-                        if(c == ((gunichar)-2)) {
-                            printf("gunichar -2 \n");
-                            break;
-                        }else if(c == ((gunichar)-1)) {
-                            printf("gunichar -1 \n");
-                            break;
-                        }
-
-                        c = g_unichar_tolower(c);
-
-                        if(should_be_capitalized){
-                            gunichar c1 = g_unichar_toupper(c);
-                            if(c != c1){
-                                c = c1;
-                                should_be_capitalized = false;
-                            }
-                        }
-
-                        g_string_append_unichar(entry_text, c);
-
-                        p = g_utf8_next_char(p);
-                    }
-                }else{
-                    g_string_append(entry_text, token);
-                }
-
-                j += skipahead;
-            }
-
-            g_string_append_c(entry_text, '\n');
-            g_string_prepend(string, entry_text->str);
-
-            g_string_free(entry_text, true);
-        }
-    }
+    gtk_label_set_selectable(GTK_LABEL(label), true);
+    gtk_label_set_wrap(GTK_LABEL(label), true);
+    gtk_label_set_xalign(GTK_LABEL(label), 0.0f);
 
-    add_text(self, string->str, true);
-    add_time(self, session->entries[0].timestamp, true);
+    gtk_widget_set_hexpand(label, true);
+    gtk_widget_set_halign(label, GTK_ALIGN_FILL);
+
+    gtk_list_item_set_activatable(item, false);
+    gtk_list_item_set_child(item, label);
 }
 
-static void load_to(LiveCaptionsHistoryWindow *self, size_t idx){
-    for(size_t i_1=0; i_1<1; i_1++){
-        const struct history_session *session = get_history_session(idx - i_1 - 1);
-        if(session == NULL) break;
+// Only called for the rows that are actually realized. The text is prepared
+// on the render thread, until it arrives the row is left empty
+static void bind_row_cb(G_GNUC_UNUSED GtkSignalListItemFactory *factory, GtkListItem *item, gpointer userdata) {
+    LiveCaptionsHistoryWindow *self = LIVECAPTIONS_HISTORY_WINDOW(userdata);
 
-        // TODO: text fading?
-        add_session(self, session);
-    }
-}
+    GtkLabel *label = GTK_LABEL(gtk_list_item_get_child(item));
 
-static void load_more_cb(LiveCaptionsHistoryWindow *self) {
-    // gets very laggy
-    load_to(self, ++self->session_load);
+    bool is_text = false;
+    const char *text = livecaptions_history_model_get_row_text(self->model, gtk_list_item_get_position(item), &is_text);
+
+    set_label_kind(label, self->text_attrs, is_text);
+    gtk_label_set_text(label, (text != NULL) ? text : "");
 }
 
 
@@ -290,27 +204,33 @@ static gboolean deferred_update_keep_above(void *userdata) {
 
 
 static void refresh_cb(LiveCaptionsHistoryWindow *self) {
-    GtkWidget *childs = gtk_widget_get_first_child(GTK_WIDGET(self->main_box));
-    while (childs != NULL) {
-        gtk_box_remove(self->main_box, childs);
-        childs = gtk_widget_get_first_child(GTK_WIDGET(self->main_box));
-    }
-
-    self->session_load = 0;
-    load_to(self, ++self->session_load);
+    update_text_settings(self);
+    livecaptions_history_model_refresh(self->model);
 
     g_idle_add(force_bottom, self);
 }
 
+static void livecaptions_history_window_finalize(GObject *object) {
+    LiveCaptionsHistoryWindow *self = LIVECAPTIONS_HISTORY_WINDOW(object);
+
+    g_clear_object(&self->model);
+    g_clear_object(&self->settings);
+    g_clear_pointer(&self->text_attrs, pango_attr_list_unref);
+
+    G_OBJECT_CLASS(livecaptions_history_window_parent_class)->finalize(object);
+}
+
 static void livecaptions_history_window_class_init(LiveCaptionsHistoryWindowClass *klass) {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
     GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
 
+    object_class->finalize = livecaptions_history_window_finalize;
+
     gtk_widget_class_set_template_from_resource(widget_class, "/net/sapples/LiveCaptions/livecaptions-history-window.ui");
 
     gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, scroll);
-    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, main_box);
+    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, list_view);
 
-    gtk_widget_class_bind_template_callback(widget_class, load_more_cb);
     gtk_widget_class_bind_template_callback(widget_class, export_cb);
     gtk_widget_class_bind_template_callback(widget_class, warn_deletion_cb);
     gtk_widget_class_bind_template_callback(widget_class, refresh_cb);
@@ -322,9 +242,19 @@ static void livecaptions_history_window_init(LiveCaptionsHistoryWindow *self) {
 
     self->settings = g_settings_new("net.sapples.LiveCaptions");
 
+    self->model = livecaptions_history_model_new();
+
+    update_text_settings(self);
+
+    GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(setup_row_cb), self);
+    g_signal_connect(factory, "bind", G_CALLBACK(bind_row_cb), self);
+    gtk_list_view_set_factory(self->list_view, factory);
+    g_object_unref(factory);
 
-    self->session_load = 0;
-    load_to(self, ++self->session_load);
+    GtkNoSelection *selection = gtk_no_selection_new(G_LIST_MODEL(g_object_ref(self->model)));
+    gtk_list_view_set_model(self->list_view, GTK_SELECTION_MODEL(selection));
+    g_object_unref(selection);
 
     g_idle_add(force_bottom, self);
     g_idle_add(deferred_update_keep_above, self);
@@ -20,17 +20,20 @@
 #pragma once
 
 #include <gtk/gtk.h>
+#include "livecaptions-history-model.h"
 
 struct _LiveCaptionsHistoryWindow {
     GtkWindow  parent_instance;
 
     GSettings *settings;
 
-    GtkBox *main_box;
+    GtkListView *list_view;
 
     GtkScrolledWindow *scroll;
 
-    size_t session_load;
+    LiveCaptionsHistoryModel *model;
+
+    PangoAttrList *text_attrs;
 };
 
 G_BEGIN_DECLS
@@ -173,8 +173,13 @@ static void add_model_cb(LiveCaptionsSettings *self) {
 
 static void on_builtin_toggled(LiveCaptionsSettings *self);
 
+static void livecaptions_settings_dispose(GObject *object);
+
 static void livecaptions_settings_class_init(LiveCaptionsSettingsClass *klass) {
     GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->dispose = livecaptions_settings_dispose;
 
     gtk_widget_class_set_template_from_resource(widget_class, "/net/sapples/LiveCaptions/livecaptions-settings.ui");
 
@@ -222,24 +227,19 @@ static gboolean deferred_update_keep_above(void *userdata) {
 }
 
 static void model_load_failsafe(LiveCaptionsSettings *self, bool load_default);
+static void start_model_load(LiveCaptionsSettings *self, const char *model, bool adds);
+
 static void on_model_selected(GtkCheckButton* button, LiveCaptionsSettings *self){
     if(!gtk_check_button_get_active(button)) return;
 
     const char *model = g_quark_to_string((GQuark)g_object_get_data(button, "lcap-model-path"));
-    if(!asr_thread_update_model(self->application->asr, model)) {
-        model_load_failsafe(self, false);
-        return;
-    }
-
-    g_settings_set_string(self->settings, "active-model", model);
+    start_model_load(self, model, false);
 }
 
 static void on_builtin_toggled(LiveCaptionsSettings *self) {
     if(!gtk_check_button_get_active(self->radio_button_1)) return;
 
-    const char *model_path = GET_MODEL_PATH();
-    asr_thread_update_model(self->application->asr, model_path);
-    g_settings_set_string(self->settings, "active-model", model_path);
+    start_model_load(self, GET_MODEL_PATH(), false);
 }
 
 static void on_model_deleted(GtkButton *button, LiveCaptionsSettings *self) {
@@ -355,17 +355,100 @@ static void model_load_failsafe(LiveCaptionsSettings *self, bool load_default) {
     g_signal_connect (dialog, "response",
                     G_CALLBACK (gtk_window_destroy),
                     NULL);
-    
-    char *prev_model;
+
+    // Otherwise the previous model is still loaded, as a failed load
+    // doesn't replace it
     if(load_default) {
-        prev_model = GET_MODEL_PATH();
-    }else{
-        prev_model = g_settings_get_string(self->settings, "active-model");
+        start_model_load(self, GET_MODEL_PATH(), false);
+        gtk_check_button_set_active(self->radio_button_1, true);
+    }
+}
+
+static void stop_model_load_pulse(LiveCaptionsSettings *self) {
+    if(self->model_load_pulse != 0) {
+        g_source_remove(self->model_load_pulse);
+        self->model_load_pulse = 0;
+    }
+}
+
+static gboolean pulse_model_load(void *userdata) {
+    LiveCaptionsSettings *self = userdata;
+    gtk_progress_bar_pulse(self->model_load_progress);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_model_load_progress(GObject *target, ModelLoadStage stage, double fraction) {
+    LiveCaptionsSettings *self = LIVECAPTIONS_SETTINGS(target);
+
+    const char *stages[] = {
+        [MODEL_LOAD_READING] = _("Reading the model"),
+        [MODEL_LOAD_PARSING] = _("Preparing the model"),
+        [MODEL_LOAD_CREATING_SESSIONS] = _("Starting captioning")
+    };
+
+    adw_action_row_set_subtitle(self->model_load_row, stages[stage]);
+
+    if(fraction < 0.0) {
+        if(self->model_load_pulse == 0) self->model_load_pulse = g_timeout_add(100, pulse_model_load, self);
+    } else {
+        stop_model_load_pulse(self);
+        gtk_progress_bar_set_fraction(self->model_load_progress, fraction);
+    }
+}
+
+static void on_model_loaded(GObject *target, const char *model_path, bool success, bool cancelled) {
+    LiveCaptionsSettings *self = LIVECAPTIONS_SETTINGS(target);
+
+    // A newer load replaced this one and owns the progress row
+    if(cancelled) return;
+
+    stop_model_load_pulse(self);
+    gtk_widget_set_visible(GTK_WIDGET(self->model_load_row), false);
+    g_clear_object(&self->model_load_cancellable);
+
+    if(!success) {
+        model_load_failsafe(self, false);
+        return;
+    }
+
+    // The audio threads capture at the model's rate
+    if(asr_thread_samplerate(self->application->asr) != self->model_load_rate)
+        livecaptions_application_restart_audio(self->application);
+
+    g_settings_set_string(self->settings, "active-model", model_path);
+
+    if(self->model_load_adds) {
+        char *model = g_strdup(model_path);
+        insert_model_to_list(self, model);
+        add_new_model(self, model);
+        g_free(model);
     }
+}
+
+static void cancel_model_load_cb(LiveCaptionsSettings *self) {
+    if(self->model_load_cancellable != NULL) g_cancellable_cancel(self->model_load_cancellable);
+
+    stop_model_load_pulse(self);
+    gtk_widget_set_visible(GTK_WIDGET(self->model_load_row), false);
+    g_clear_object(&self->model_load_cancellable);
+}
+
+// The current model keeps captioning while the new one loads
+static void start_model_load(LiveCaptionsSettings *self, const char *model, bool adds) {
+    if(self->model_load_cancellable != NULL) g_object_unref(self->model_load_cancellable);
+    self->model_load_cancellable = g_cancellable_new();
 
-    asr_thread_update_model(self->application->asr, prev_model);
+    self->model_load_adds = adds;
+    self->model_load_rate = asr_thread_samplerate(self->application->asr);
 
-    if(load_default) gtk_check_button_set_active(self->radio_button_1, true);
+    adw_preferences_row_set_title(ADW_PREFERENCES_ROW(self->model_load_row), _("Loading model…"));
+    adw_action_row_set_subtitle(self->model_load_row, "");
+    gtk_progress_bar_set_fraction(self->model_load_progress, 0.0);
+    gtk_widget_set_visible(GTK_WIDGET(self->model_load_row), true);
+
+    asr_thread_load_model_async(self->application->asr, model, self->model_load_cancellable,
+                                G_OBJECT(self), on_model_load_progress, on_model_loaded);
 }
 
 static void on_add_model_response(GtkNativeDialog *native,
@@ -379,25 +462,42 @@ static void on_add_model_response(GtkNativeDialog *native,
         
         char *model = g_file_get_path(file);
 
+        start_model_load(self, model, true);
 
-        if(!asr_thread_update_model(self->application->asr, model)){
-            model_load_failsafe(self, false);
+        g_free(model);
+    }
 
-            g_free(model);
-            g_object_unref(native);
-            return;
-        }
-        
-        g_settings_set_string(self->settings, "active-model", model);
+    g_object_unref(native);
+}
 
+static void init_model_load_row(LiveCaptionsSettings *self) {
+    self->model_load_row = g_object_new(ADW_TYPE_ACTION_ROW, NULL);
 
-        insert_model_to_list(self, model);
-        add_new_model(self, model);
+    self->model_load_progress = GTK_PROGRESS_BAR(gtk_progress_bar_new());
+    gtk_widget_set_valign(GTK_WIDGET(self->model_load_progress), GTK_ALIGN_CENTER);
+    gtk_widget_set_size_request(GTK_WIDGET(self->model_load_progress), 120, -1);
 
-        g_free(model);
-    }
+    GtkButton *cancel_button = GTK_BUTTON(gtk_button_new_with_mnemonic(_("_Cancel")));
+    gtk_widget_set_valign(GTK_WIDGET(cancel_button), GTK_ALIGN_CENTER);
+    g_signal_connect_swapped(cancel_button, "clicked", G_CALLBACK(cancel_model_load_cb), self);
 
-    g_object_unref(native);
+    adw_action_row_add_suffix(self->model_load_row, GTK_WIDGET(self->model_load_progress));
+    adw_action_row_add_suffix(self->model_load_row, GTK_WIDGET(cancel_button));
+
+    gtk_widget_set_visible(GTK_WIDGET(self->model_load_row), false);
+    adw_preferences_group_add(self->models_list, GTK_WIDGET(self->model_load_row));
+}
+
+static void livecaptions_settings_dispose(GObject *object) {
+    LiveCaptionsSettings *self = LIVECAPTIONS_SETTINGS(object);
+
+    // Closing the window before the model has loaded abandons it, as
+    // nothing would save the choice otherwise
+    if(self->model_load_cancellable != NULL) g_cancellable_cancel(self->model_load_cancellable);
+    g_clear_object(&self->model_load_cancellable);
+    stop_model_load_pulse(self);
+
+    G_OBJECT_CLASS(livecaptions_settings_parent_class)->dispose(object);
 }
 
 static void livecaptions_settings_init(LiveCaptionsSettings *self) {
@@ -441,5 +541,6 @@ static void livecaptions_settings_init(LiveCaptionsSettings *self) {
         gtk_label_set_label(self->keep_above_instructions, always_on_top_text);
     }
 
+    init_model_load_row(self);
     init_models_page(self);
 }
@@ -52,6 +52,16 @@ struct _LiveCaptionsSettings {
     GtkCheckButton *radio_button_1;
 
     GtkFileFilter *file_filter;
+
+    // Shown while a model is loading in the background
+    AdwActionRow *model_load_row;
+    GtkProgressBar *model_load_progress;
+    GCancellable *model_load_cancellable;
+    guint model_load_pulse;
+
+    // What to do once the model has loaded
+    bool model_load_adds;
+    int model_load_rate;
 };
 
 G_BEGIN_DECLS
@@ -89,7 +89,11 @@ static void *run_benchmark_thread(void *userdata) {
     size_t sr = aam_get_sample_rate(model);
     g_assert(sr < 48000);
 
-    time_t begin = time(NULL);
+    // The first second is slower while the model's buffers are set up,
+    // and isn't counted
+    aas_feed_pcm16(session, noise_data, sr);
+
+    gint64 begin = g_get_monotonic_time();
 
 
     int idx = 0;
@@ -100,9 +104,9 @@ static void *run_benchmark_thread(void *userdata) {
         self->benchmark_progress_v = ((double)sec) / 30.0;
 
 
-        time_t current = time(NULL);
-        if(difftime(current, begin) > 55.0) {
-            double speed = ((double)sec) / difftime(current, begin);
+        double elapsed = (g_get_monotonic_time() - begin) / (double)G_USEC_PER_SEC;
+        if(elapsed > 55.0) {
+            double speed = ((double)(sec + 1)) / elapsed;
             self->benchmark_result_v = speed;
             
             goto end;
@@ -111,9 +115,9 @@ static void *run_benchmark_thread(void *userdata) {
         g_idle_add(update_progress, self);
     }
 
-    time_t end = time(NULL);
+    double elapsed = (g_get_monotonic_time() - begin) / (double)G_USEC_PER_SEC;
 
-    double speed = 30.0 / difftime(end, begin);
+    double speed = 30.0 / elapsed;
     self->benchmark_result_v = speed;
 
 end:
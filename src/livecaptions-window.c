@@ -163,10 +163,18 @@ static gboolean show_relevant_slow_warning(void *userdata) {
         gtk_label_set_text(self->label, "");
     }
 
-    AprilASRSession session = (AprilASRSession)asr_thread_get_session(asr);
-    if(session == NULL) return G_SOURCE_CONTINUE;
+    // Warn about whichever source is furthest behind
+    bool have_session = false;
+    float speedup = 0.0f;
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        float source_speedup = asr_thread_get_speedup(asr, (CaptionSource)i);
+        if(source_speedup < 0.0f) continue;
+
+        have_session = true;
+        speedup = MAX(speedup, source_speedup);
+    }
 
-    float speedup = aas_realtime_get_speedup(session);
+    if(!have_session) return G_SOURCE_CONTINUE;
 
     if(speedup <= 1.1) {
         gtk_widget_set_visible(GTK_WIDGET(self->slow_warning), false);
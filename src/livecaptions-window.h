@@ -58,4 +58,7 @@ G_DECLARE_FINAL_TYPE (LiveCaptionsWindow, livecaptions_window, LIVECAPTIONS, WIN
 
 void livecaptions_window_warn_slow(LiveCaptionsWindow *self);
 
+// The line-width setting is a number of characters of this text
+extern const char LINE_WIDTH_TEXT_TEMPLATE[];
+
 G_END_DECLS
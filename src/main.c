@@ -29,11 +29,20 @@
 #include "livecaptions-application.h"
 #include "audiocap.h"
 #include "asrproc.h"
+#include "benchmark.h"
+#include "replay.h"
 #include "common.h"
 
 int main (int argc, char *argv[]) {
     aam_api_init(APRIL_VERSION);
 
+    // Without the UI or the active model loaded, so nothing skews the results
+    if(benchmark_parse_options(&argc, &argv)) return benchmark_run();
+
+    // Needs neither, so a recording can be profiled on its own
+    if(replay_parse_options(&argc, &argv)) return replay_run_headless();
+    if(!replay_start_recording()) return 1;
+
 #ifdef LIVE_CAPTIONS_PIPEWIRE
     pw_init(&argc, &argv);
 
@@ -86,6 +95,7 @@ int main (int argc, char *argv[]) {
         ret = g_application_run(G_APPLICATION(app), argc, argv);
     }
 
+    replay_stop();
     free_asr_thread(asr);
 
     return ret;
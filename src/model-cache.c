@@ -0,0 +1,311 @@
+/* model-cache.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "model-cache.h"
+
+struct cache_entry {
+    char *path;
+    AprilASRModel model;
+
+    // Users of the model, it can only be freed at 0
+    int refs;
+
+    // Estimated from the growth of the resident set while loading
+    size_t resident_bytes;
+
+    gint64 last_used;
+    gint64 load_time_us;
+
+    // Times the model was acquired while already loaded
+    int hits;
+};
+
+// Remembered for every model ever loaded, so finding one in a language
+// doesn't take loading them all again
+struct known_language {
+    gint64 size;
+    gint64 mtime;
+    char *language;
+};
+
+static GMutex cache_mutex;
+static GPtrArray *entries = NULL;
+static GHashTable *languages = NULL;
+static size_t budget = 512 * 1024 * 1024;
+
+// Loads that found nothing cached, for the statistics
+static int misses = 0;
+
+
+static size_t resident_set_size(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(f == NULL) return 0;
+
+    unsigned long size = 0, resident = 0;
+    if(fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Called with cache_mutex held
+static struct cache_entry *find_by_path(const char *model_path) {
+    if(entries == NULL) return NULL;
+
+    for(guint i=0; i<entries->len; i++){
+        struct cache_entry *entry = g_ptr_array_index(entries, i);
+        if(g_str_equal(entry->path, model_path)) return entry;
+    }
+
+    return NULL;
+}
+
+static void free_known_language(gpointer data) {
+    struct known_language *known = data;
+    g_free(known->language);
+    g_free(known);
+}
+
+// Called with cache_mutex held
+static void remember_language(const char *model_path, const struct stat *st, AprilASRModel model) {
+    if(languages == NULL) languages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_known_language);
+
+    struct known_language *known = g_new0(struct known_language, 1);
+    known->size = st->st_size;
+    known->mtime = st->st_mtime;
+    known->language = g_strdup(aam_get_language(model));
+
+    g_hash_table_insert(languages, g_strdup(model_path), known);
+}
+
+// Called with cache_mutex held. Takes the least recently used unused
+// models out of the cache until everything fits, to be freed without the
+// lock held
+static GPtrArray *take_evicted(void) {
+    GPtrArray *evicted = g_ptr_array_new();
+    if(entries == NULL) return evicted;
+
+    for(;;) {
+        size_t total = 0;
+        struct cache_entry *oldest = NULL;
+
+        for(guint i=0; i<entries->len; i++){
+            struct cache_entry *entry = g_ptr_array_index(entries, i);
+            total += entry->resident_bytes;
+
+            if((entry->refs == 0) && ((oldest == NULL) || (entry->last_used < oldest->last_used)))
+                oldest = entry;
+        }
+
+        if((total <= budget) || (oldest == NULL)) break;
+
+        g_ptr_array_remove(entries, oldest);
+        g_ptr_array_add(evicted, oldest);
+    }
+
+    return evicted;
+}
+
+static void free_evicted(GPtrArray *evicted) {
+    for(guint i=0; i<evicted->len; i++){
+        struct cache_entry *entry = g_ptr_array_index(evicted, i);
+
+        printf("Unloading model %s (%.0f MB)\n", entry->path, entry->resident_bytes / (1024.0 * 1024.0));
+
+        aam_free(entry->model);
+        g_free(entry->path);
+        g_free(entry);
+    }
+
+    g_ptr_array_free(evicted, true);
+}
+
+AprilASRModel model_cache_acquire(const char *model_path) {
+    g_mutex_lock(&cache_mutex);
+
+    struct cache_entry *entry = find_by_path(model_path);
+    if(entry != NULL) {
+        entry->refs++;
+        entry->hits++;
+        entry->last_used = g_get_monotonic_time();
+
+        AprilASRModel model = entry->model;
+        g_mutex_unlock(&cache_mutex);
+
+        printf("Using cached model %s\n", model_path);
+        return model;
+    }
+
+    misses++;
+    g_mutex_unlock(&cache_mutex);
+
+    gint64 start = g_get_monotonic_time();
+    size_t rss_before = resident_set_size();
+
+    AprilASRModel model = aam_create_model(model_path);
+    if(model == NULL) return NULL;
+
+    gint64 load_time = g_get_monotonic_time() - start;
+    size_t rss_after = resident_set_size();
+
+    // Other threads allocating at the same time make this rough. The file
+    // size is a lower bound, as the weights are read into memory
+    size_t resident = (rss_after > rss_before) ? (rss_after - rss_before) : 0;
+    struct stat st;
+    bool have_stat = stat(model_path, &st) == 0;
+    if(have_stat && ((size_t)st.st_size > resident)) resident = st.st_size;
+
+    printf("Loaded model %s in %.0f ms, about %.0f MB\n",
+           model_path, load_time / 1000.0, resident / (1024.0 * 1024.0));
+
+    g_mutex_lock(&cache_mutex);
+
+    if(have_stat) remember_language(model_path, &st, model);
+
+    // Someone else loaded it meanwhile, use theirs
+    entry = find_by_path(model_path);
+    if(entry != NULL) {
+        entry->refs++;
+        entry->last_used = g_get_monotonic_time();
+
+        AprilASRModel cached = entry->model;
+        g_mutex_unlock(&cache_mutex);
+
+        aam_free(model);
+        return cached;
+    }
+
+    if(entries == NULL) entries = g_ptr_array_new();
+
+    entry = g_new0(struct cache_entry, 1);
+    entry->path = g_strdup(model_path);
+    entry->model = model;
+    entry->refs = 1;
+    entry->resident_bytes = resident;
+    entry->last_used = g_get_monotonic_time();
+    entry->load_time_us = load_time;
+
+    g_ptr_array_add(entries, entry);
+
+    GPtrArray *evicted = take_evicted();
+    g_mutex_unlock(&cache_mutex);
+
+    free_evicted(evicted);
+
+    return model;
+}
+
+bool model_cache_contains(const char *model_path) {
+    g_mutex_lock(&cache_mutex);
+    bool found = find_by_path(model_path) != NULL;
+    g_mutex_unlock(&cache_mutex);
+
+    return found;
+}
+
+char *model_cache_get_language(const char *model_path) {
+    struct stat st;
+    if(stat(model_path, &st) != 0) return NULL;
+
+    g_mutex_lock(&cache_mutex);
+
+    struct known_language *known = (languages != NULL) ? g_hash_table_lookup(languages, model_path) : NULL;
+
+    char *language = NULL;
+    if((known != NULL) && (known->size == st.st_size) && (known->mtime == st.st_mtime))
+        language = g_strdup(known->language);
+
+    g_mutex_unlock(&cache_mutex);
+
+    return language;
+}
+
+void model_cache_release(AprilASRModel model) {
+    if(model == NULL) return;
+
+    g_mutex_lock(&cache_mutex);
+
+    struct cache_entry *entry = NULL;
+    for(guint i=0; (entries != NULL) && (i<entries->len); i++){
+        struct cache_entry *e = g_ptr_array_index(entries, i);
+        if(e->model == model) {
+            entry = e;
+            break;
+        }
+    }
+
+    g_assert(entry != NULL);
+    g_assert(entry->refs > 0);
+
+    entry->refs--;
+    entry->last_used = g_get_monotonic_time();
+
+    GPtrArray *evicted = take_evicted();
+    g_mutex_unlock(&cache_mutex);
+
+    free_evicted(evicted);
+}
+
+void model_cache_set_budget(size_t bytes) {
+    g_mutex_lock(&cache_mutex);
+
+    budget = bytes;
+    GPtrArray *evicted = take_evicted();
+
+    g_mutex_unlock(&cache_mutex);
+
+    free_evicted(evicted);
+}
+
+char *model_cache_describe(void) {
+    GString *str = g_string_new(NULL);
+
+    g_mutex_lock(&cache_mutex);
+
+    size_t total = 0;
+    gint64 now = g_get_monotonic_time();
+
+    for(guint i=0; (entries != NULL) && (i<entries->len); i++){
+        struct cache_entry *entry = g_ptr_array_index(entries, i);
+        total += entry->resident_bytes;
+
+        g_string_append_printf(str, "  %s%s\n    %.0f MB, loaded in %.0f ms, %d hits, last used %.0f s ago\n",
+                               entry->path,
+                               (entry->refs > 0) ? " (in use)" : "",
+                               entry->resident_bytes / (1024.0 * 1024.0),
+                               entry->load_time_us / 1000.0,
+                               entry->hits,
+                               (now - entry->last_used) / (double)G_USEC_PER_SEC);
+    }
+
+    char *header = g_strdup_printf("Model cache: %.0f of %.0f MB, %d loads\n",
+                                   total / (1024.0 * 1024.0), budget / (1024.0 * 1024.0), misses);
+
+    g_mutex_unlock(&cache_mutex);
+
+    g_string_prepend(str, header);
+    g_free(header);
+
+    return g_string_free(str, false);
+}
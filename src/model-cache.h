@@ -0,0 +1,50 @@
+/* model-cache.h
+ * Keeps recently used models loaded, up to a memory budget, so switching
+ * back to one of them doesn't load it again
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <april_api.h>
+
+// Returns the model loaded from the path, loading it if it's not cached.
+// Each successful call must be paired with model_cache_release. Thread
+// safe, and loads don't block other callers
+AprilASRModel model_cache_acquire(const char *model_path);
+
+// Whether acquiring the model would return immediately
+bool model_cache_contains(const char *model_path);
+
+// The language of the model at the path, if it was loaded before and the
+// file hasn't changed since, even if it's no longer cached. Free with
+// g_free, NULL if unknown
+char *model_cache_get_language(const char *model_path);
+
+// Models no longer in use stay loaded until the budget is exceeded, then
+// the least recently used ones are freed
+void model_cache_release(AprilASRModel model);
+
+// Memory all loaded models may take up together. Models in use are never
+// freed, so with a budget of 0 a model is freed as soon as it's released
+void model_cache_set_budget(size_t bytes);
+
+// A few lines listing the cached models with their size, when they were
+// last used and how long they took to load. Free with g_free
+char *model_cache_describe(void);
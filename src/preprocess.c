@@ -0,0 +1,357 @@
+/* preprocess.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Like the resampler, the per-sample loops are kept free of branches and
+// aliasing so the compiler vectorizes them. The high-pass filter is
+// recursive and runs one sample at a time.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "preprocess.h"
+
+// Samples are processed in blocks of at most this many
+#define BLOCK 1024
+
+// AGC: target level, gain range, and how fast the gain follows
+#define AGC_TARGET_RMS 0.1f        // -20 dBFS
+#define AGC_MAX_GAIN 31.6f         // +30 dB
+#define AGC_MIN_GAIN 0.25f         // -12 dB
+#define AGC_SILENCE_RMS 0.001f     // -60 dBFS, the gain is held below this
+#define AGC_ATTACK 0.5f            // per 10 ms, when reducing the gain
+#define AGC_RELEASE 0.05f          // per 10 ms, when raising the gain
+#define LIMITER_CEILING 0.9f
+
+// Noise gate: 50% overlapping frames with a square-root Hann window on
+// both analysis and synthesis, which reconstructs perfectly
+#define GATE_N PREPROCESS_GATE_FRAME
+#define GATE_HOP (GATE_N / 2)
+#define GATE_BINS (GATE_N / 2 + 1)
+#define GATE_OVERSUBTRACT 3.0f
+#define GATE_FLOOR 0.1f            // -20 dB, to avoid musical noise
+#define GATE_NOISE_UP 1.002f       // slow rise of the noise estimate
+#define GATE_NOISE_DOWN 0.1f       // fast fall towards quieter frames
+
+struct biquad {
+    float b0, b1, b2, a1, a2;
+    float z1, z2;
+};
+
+struct agc {
+    float gain;
+    size_t window;     // 10 ms in samples
+};
+
+struct gate {
+    float window[GATE_N];
+
+    float input[GATE_N];
+    float output[GATE_N];
+    size_t pos;
+
+    float noise[GATE_BINS];
+    float gains[GATE_BINS];
+    bool noise_valid;
+
+    // FFT scratch and tables
+    float re[GATE_N];
+    float im[GATE_N];
+    float cos_table[GATE_N / 2];
+    float sin_table[GATE_N / 2];
+    unsigned short bitrev[GATE_N];
+};
+
+struct preprocessor {
+    unsigned int sample_rate;
+    unsigned int last_stages;
+
+    struct biquad highpass;
+    struct agc agc;
+    struct gate gate;
+
+    float block[BLOCK];
+};
+
+
+// RBJ cookbook high-pass, Butterworth Q
+static void highpass_init(struct biquad *bq, unsigned int sample_rate) {
+    double w0 = 2.0 * M_PI * PREPROCESS_HIGHPASS_HZ / sample_rate;
+    double alpha = sin(w0) / (2.0 * M_SQRT1_2);
+    double cosw = cos(w0);
+    double a0 = 1.0 + alpha;
+
+    bq->b0 = (float)(((1.0 + cosw) / 2.0) / a0);
+    bq->b1 = (float)(-(1.0 + cosw) / a0);
+    bq->b2 = bq->b0;
+    bq->a1 = (float)((-2.0 * cosw) / a0);
+    bq->a2 = (float)((1.0 - alpha) / a0);
+
+    bq->z1 = 0.0f;
+    bq->z2 = 0.0f;
+}
+
+static void highpass_process(struct biquad *bq, float *x, size_t count) {
+    float z1 = bq->z1, z2 = bq->z2;
+
+    // Transposed direct form II
+    for(size_t i=0; i<count; i++){
+        float in = x[i];
+        float out = bq->b0 * in + z1;
+        z1 = bq->b1 * in - bq->a1 * out + z2;
+        z2 = bq->b2 * in - bq->a2 * out;
+        x[i] = out;
+    }
+
+    // Keep denormals out of the state during silence
+    bq->z1 = (fabsf(z1) < 1e-20f) ? 0.0f : z1;
+    bq->z2 = (fabsf(z2) < 1e-20f) ? 0.0f : z2;
+}
+
+
+static void agc_init(struct agc *agc, unsigned int sample_rate) {
+    agc->gain = 1.0f;
+    agc->window = sample_rate / 100;
+    if(agc->window == 0) agc->window = 1;
+}
+
+static float sum_squares(const float *restrict x, size_t count) {
+    float sum = 0.0f;
+    for(size_t i=0; i<count; i++)
+        sum += x[i] * x[i];
+
+    return sum;
+}
+
+static float peak(const float *restrict x, size_t count) {
+    float p = 0.0f;
+    for(size_t i=0; i<count; i++)
+        p = fmaxf(p, fabsf(x[i]));
+
+    return p;
+}
+
+// Multiplies by a gain going linearly from g0 to g1 across the block, so
+// gain changes don't click
+static void apply_ramp(float *restrict x, size_t count, float g0, float g1) {
+    float step = (g1 - g0) / (float)count;
+    for(size_t i=0; i<count; i++)
+        x[i] *= g0 + step * (float)i;
+}
+
+static void agc_process(struct agc *agc, float *x, size_t count) {
+    for(size_t start=0; start<count; start+=agc->window){
+        size_t n = count - start;
+        if(n > agc->window) n = agc->window;
+
+        float *block = &x[start];
+        float rms = sqrtf(sum_squares(block, n) / (float)n);
+
+        float gain = agc->gain;
+        if(rms > AGC_SILENCE_RMS) {
+            float desired = fminf(fmaxf(AGC_TARGET_RMS / rms, AGC_MIN_GAIN), AGC_MAX_GAIN);
+            gain += (desired - gain) * ((desired < gain) ? AGC_ATTACK : AGC_RELEASE);
+        }
+
+        // Limiter: neither end of the ramp may push the peak over the
+        // ceiling, the gain is pulled down for this block right away
+        float limit = LIMITER_CEILING / fmaxf(peak(block, n), 1e-9f);
+        gain = fminf(gain, limit);
+
+        apply_ramp(block, n, fminf(agc->gain, limit), gain);
+        agc->gain = gain;
+    }
+}
+
+
+static void gate_init(struct gate *g) {
+    memset(g, 0, sizeof(struct gate));
+
+    for(size_t i=0; i<GATE_N; i++)
+        g->window[i] = (float)sqrt(0.5 * (1.0 - cos(2.0 * M_PI * i / GATE_N)));
+
+    for(size_t i=0; i<GATE_N / 2; i++){
+        g->cos_table[i] = (float)cos(2.0 * M_PI * i / GATE_N);
+        g->sin_table[i] = (float)-sin(2.0 * M_PI * i / GATE_N);
+    }
+
+    unsigned int bits = 0;
+    while((1u << bits) < GATE_N) bits++;
+
+    for(unsigned int i=0; i<GATE_N; i++){
+        unsigned int r = 0;
+        for(unsigned int b=0; b<bits; b++)
+            if(i & (1u << b)) r |= 1u << (bits - 1 - b);
+
+        g->bitrev[i] = (unsigned short)r;
+    }
+
+    for(size_t i=0; i<GATE_BINS; i++)
+        g->gains[i] = 1.0f;
+}
+
+// In-place iterative radix-2 FFT. The inverse is done by the caller by
+// conjugating around a forward transform
+static void fft(struct gate *g) {
+    float *re = g->re, *im = g->im;
+
+    for(size_t i=0; i<GATE_N; i++){
+        size_t j = g->bitrev[i];
+        if(j > i) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for(size_t len=2; len<=GATE_N; len<<=1){
+        size_t half = len / 2;
+        size_t stride = GATE_N / len;
+
+        for(size_t start=0; start<GATE_N; start+=len){
+            for(size_t k=0; k<half; k++){
+                float wr = g->cos_table[k * stride];
+                float wi = g->sin_table[k * stride];
+
+                size_t a = start + k;
+                size_t b = a + half;
+
+                float tr = re[b] * wr - im[b] * wi;
+                float ti = re[b] * wi + im[b] * wr;
+
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+static void gate_frame(struct gate *g) {
+    for(size_t i=0; i<GATE_N; i++){
+        g->re[i] = g->input[i] * g->window[i];
+        g->im[i] = 0.0f;
+    }
+
+    fft(g);
+
+    for(size_t k=0; k<GATE_BINS; k++){
+        float mag = sqrtf(g->re[k] * g->re[k] + g->im[k] * g->im[k]);
+
+        // Tracks the quieter parts of each bin, which are mostly noise
+        float noise = g->noise_valid ? g->noise[k] : mag;
+        if(mag < noise) noise += (mag - noise) * GATE_NOISE_DOWN;
+        else noise *= GATE_NOISE_UP;
+        g->noise[k] = fmaxf(noise, 1e-9f);
+
+        float gain = 1.0f - GATE_OVERSUBTRACT * g->noise[k] / fmaxf(mag, 1e-9f);
+        gain = fmaxf(gain, GATE_FLOOR);
+
+        // Smooth over time against flutter
+        g->gains[k] = 0.5f * (g->gains[k] + gain);
+    }
+    g->noise_valid = true;
+
+    // Real input has a conjugate-symmetric spectrum, apply the same gains
+    // to the mirrored bins, then inverse transform via conjugation
+    for(size_t k=0; k<GATE_N; k++){
+        size_t bin = (k < GATE_BINS) ? k : (GATE_N - k);
+        g->re[k] *= g->gains[bin];
+        g->im[k] *= -g->gains[bin];
+    }
+
+    fft(g);
+
+    const float scale = 1.0f / GATE_N;
+    for(size_t i=0; i<GATE_N; i++)
+        g->output[i] += g->re[i] * scale * g->window[i];
+}
+
+// Output lags the input by one frame
+static void gate_process(struct gate *g, float *x, size_t count) {
+    for(size_t i=0; i<count; i++){
+        g->input[GATE_HOP + g->pos] = x[i];
+        x[i] = g->output[g->pos];
+
+        if(++g->pos < GATE_HOP) continue;
+        g->pos = 0;
+
+        // The first hop of the output has been read out
+        memmove(g->output, &g->output[GATE_HOP], (GATE_N - GATE_HOP) * sizeof(float));
+        memset(&g->output[GATE_N - GATE_HOP], 0, GATE_HOP * sizeof(float));
+
+        gate_frame(g);
+
+        memmove(g->input, &g->input[GATE_HOP], (GATE_N - GATE_HOP) * sizeof(float));
+    }
+}
+
+
+struct preprocessor *preprocessor_new(unsigned int sample_rate) {
+    struct preprocessor *pp = calloc(1, sizeof(struct preprocessor));
+    pp->sample_rate = sample_rate;
+
+    highpass_init(&pp->highpass, sample_rate);
+    agc_init(&pp->agc, sample_rate);
+    gate_init(&pp->gate);
+
+    return pp;
+}
+
+static void to_float(const short *restrict in, float *restrict out, size_t count) {
+    for(size_t i=0; i<count; i++)
+        out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+static void to_s16(const float *restrict in, short *restrict out, size_t count) {
+    for(size_t i=0; i<count; i++){
+        float s = fminf(fmaxf(in[i] * 32768.0f, -32768.0f), 32767.0f);
+        out[i] = (short)lrintf(s);
+    }
+}
+
+void preprocessor_process(struct preprocessor *pp, short *samples, size_t count, unsigned int stages) {
+    // Stages that were bypassed hold stale state
+    unsigned int enabled = stages & ~pp->last_stages;
+    if(enabled & PREPROCESS_HIGHPASS) highpass_init(&pp->highpass, pp->sample_rate);
+    if(enabled & PREPROCESS_AGC) agc_init(&pp->agc, pp->sample_rate);
+    if(enabled & PREPROCESS_NOISE_GATE) gate_init(&pp->gate);
+    pp->last_stages = stages;
+
+    if(stages == 0) return;
+
+    for(size_t start=0; start<count; start+=BLOCK){
+        size_t n = count - start;
+        if(n > BLOCK) n = BLOCK;
+
+        to_float(&samples[start], pp->block, n);
+
+        if(stages & PREPROCESS_HIGHPASS) highpass_process(&pp->highpass, pp->block, n);
+        if(stages & PREPROCESS_NOISE_GATE) gate_process(&pp->gate, pp->block, n);
+        if(stages & PREPROCESS_AGC) agc_process(&pp->agc, pp->block, n);
+
+        to_s16(pp->block, &samples[start], n);
+    }
+}
+
+float preprocessor_get_gain_db(const struct preprocessor *pp) {
+    return 20.0f * log10f(pp->agc.gain);
+}
+
+void preprocessor_free(struct preprocessor *pp) {
+    free(pp);
+}
@@ -0,0 +1,54 @@
+/* preprocess.h
+ * Audio preprocessing applied to each source before it reaches the
+ * decoder: a high-pass filter, automatic gain control with a limiter, and
+ * a spectral noise gate. Each stage can be bypassed at runtime.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum PreprocessStage {
+    PREPROCESS_HIGHPASS = 1,
+    PREPROCESS_AGC = 2,
+    PREPROCESS_NOISE_GATE = 4
+} PreprocessStage;
+
+#define PREPROCESS_ALL (PREPROCESS_HIGHPASS | PREPROCESS_AGC | PREPROCESS_NOISE_GATE)
+
+// Cutoff of the high-pass filter, below speech but above DC and rumble
+#define PREPROCESS_HIGHPASS_HZ 80.0
+
+// The noise gate works on frames of this many samples, and delays the audio
+// by the same amount
+#define PREPROCESS_GATE_FRAME 256
+
+struct preprocessor;
+
+struct preprocessor *preprocessor_new(unsigned int sample_rate);
+
+// Processes the samples in place through the stages in the stages bitmask.
+// A stage that was bypassed starts over from a clean state when enabled.
+// Does not allocate, so it can be used from realtime threads
+void preprocessor_process(struct preprocessor *pp, short *samples, size_t count, unsigned int stages);
+
+// Current AGC gain in dB, for diagnostics
+float preprocessor_get_gain_db(const struct preprocessor *pp);
+
+void preprocessor_free(struct preprocessor *pp);
@@ -18,21 +18,25 @@
  */
 
 #include "profanity-filter.h"
-#include "history.h"
+#include "token-view.h"
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
+#include <gio/gio.h>
 
-#define MAX_CURSE_WORD_LENGTH 64
-
-#define NUM_CURSE_WORDS 22
-const char curse_words[NUM_CURSE_WORDS][MAX_CURSE_WORD_LENGTH] = {
+// Built-in English lists, used for any category without a user list.
+// Words ending in * match any word starting with them, other words only
+// match the entire word
+static const char *slur_words[] = {
     "FAG*",
     "HOMO",
     "SLUT*",
     "NIGG*",
     "PUSSY*",
     "TRANN*",
-    "\1",
+};
+
+static const char *profanity_words[] = {
     "CUM*",
     "SEX*",
     "FUCK*",
@@ -50,96 +54,442 @@ const char curse_words[NUM_CURSE_WORDS][MAX_CURSE_WORD_LENGTH] = {
     "MASTURBAT*",
 };
 
-typedef enum WordState {
-    WORD_STILL_SCANNING = 0,
-    WORD_NON_MATCHING = 1,
-    WORD_MATCHED = 2
-} WordState;
+// Categories a word can belong to, combined as a mask in the trie
+#define CATEGORY_SLURS     (1 << 0)
+#define CATEGORY_PROFANITY (1 << 1)
 
-size_t get_filter_skip(const AprilToken *tokens, size_t curr_idx, size_t count, FilterMode mode) {
-    if(mode <= FILTER_NONE) return 0;
+// User lists are read from <user data dir>/live-captions-filters/<lang>.<category>.txt
+// with one word per line. Empty lines and lines starting with # are ignored.
+// Matching ignores case for ASCII letters only, other characters have to
+// be written the way the model outputs them
+#define FILTERS_DIR_NAME "live-captions-filters"
 
-    WordState is_match[NUM_CURSE_WORDS] = { 0 };
+struct category_info {
+    const char *name;
+    uint8_t mask;
+    const char **builtin_words;
+    size_t builtin_count;
+};
 
-    size_t num_to_skip = 0;
-    size_t curr_character = 0;
-    bool matched_badword = false;
-    bool still_scanning_any = true;
-    for(size_t i=curr_idx; i<count; i++){
-        if((i > curr_idx) && (tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-            // Once we've arrived at the next word, stop looking.
-            // we only want to filter the word starting at curr_idx
-            break;
+static const struct category_info categories[] = {
+    { "slurs",     CATEGORY_SLURS,     slur_words,      G_N_ELEMENTS(slur_words) },
+    { "profanity", CATEGORY_PROFANITY, profanity_words, G_N_ELEMENTS(profanity_words) },
+};
+
+#define NO_NODE ((uint32_t)-1)
+
+// The word list is compiled into a trie stored as flat arrays. Each node's
+// edges are contiguous and sorted by character so a step is a binary search.
+// Filtering is always anchored at the start of a word, so unlike a full
+// Aho-Corasick automaton no failure links are needed and a word is matched
+// in a single pass over its characters.
+struct filter_edge {
+    char c;
+    uint32_t target;
+};
+
+struct filter_node {
+    uint32_t first_edge;
+    uint32_t num_edges;
+
+    // Categories of the wildcard words ending at this node
+    uint8_t prefix_mask;
+
+    // Categories of the whole words ending at this node
+    uint8_t exact_mask;
+};
+
+// Immutable once compiled. Allocated with g_atomic_rc_box so that a reload
+// can swap it out while other threads are still matching against it
+struct filter_matcher {
+    struct filter_node *nodes;
+    size_t num_nodes;
+
+    struct filter_edge *edges;
+    size_t num_edges;
+};
+
+
+// Trie node used while compiling, children are kept sorted
+struct build_node {
+    GArray *children; // struct filter_edge
+    uint8_t prefix_mask;
+    uint8_t exact_mask;
+};
+
+static uint32_t build_child(GArray *nodes, uint32_t parent, char c) {
+    struct build_node *node = &g_array_index(nodes, struct build_node, parent);
+
+    guint i;
+    for(i=0; i<node->children->len; i++){
+        struct filter_edge *edge = &g_array_index(node->children, struct filter_edge, i);
+        if(edge->c == c) return edge->target;
+        if(edge->c > c) break;
+    }
+
+    struct build_node child = { g_array_new(false, false, sizeof(struct filter_edge)), 0, 0 };
+    struct filter_edge edge = { c, nodes->len };
+
+    g_array_insert_val(node->children, i, edge);
+    g_array_append_val(nodes, child);
+
+    return edge.target;
+}
+
+static void build_word(GArray *nodes, const char *word, uint8_t category) {
+    uint32_t node = 0;
+
+    const char *c;
+    for(c=word; (*c != '\0') && (*c != '*'); c++)
+        node = build_child(nodes, node, g_ascii_toupper(*c));
+
+    // An empty word would match everything
+    if(node == 0) return;
+
+    struct build_node *end = &g_array_index(nodes, struct build_node, node);
+    if(*c == '*') end->prefix_mask |= category;
+    else end->exact_mask |= category;
+}
+
+static void clear_matcher(gpointer data) {
+    struct filter_matcher *matcher = data;
+
+    g_free(matcher->nodes);
+    g_free(matcher->edges);
+}
+
+// words[i] is the list of words for categories[i]
+static struct filter_matcher *compile_matcher(GPtrArray **words) {
+    GArray *nodes = g_array_new(false, false, sizeof(struct build_node));
+
+    struct build_node root = { g_array_new(false, false, sizeof(struct filter_edge)), 0, 0 };
+    g_array_append_val(nodes, root);
+
+    for(size_t i=0; i<G_N_ELEMENTS(categories); i++){
+        for(guint j=0; j<words[i]->len; j++)
+            build_word(nodes, g_ptr_array_index(words[i], j), categories[i].mask);
+    }
+
+    struct filter_matcher *matcher = g_atomic_rc_box_new0(struct filter_matcher);
+    matcher->num_nodes = nodes->len;
+    matcher->nodes = g_new0(struct filter_node, nodes->len);
+    matcher->num_edges = nodes->len - 1;
+    matcher->edges = g_new0(struct filter_edge, nodes->len);
+
+    uint32_t next_edge = 0;
+    for(guint i=0; i<nodes->len; i++){
+        struct build_node *node = &g_array_index(nodes, struct build_node, i);
+
+        matcher->nodes[i].first_edge = next_edge;
+        matcher->nodes[i].num_edges = node->children->len;
+        matcher->nodes[i].prefix_mask = node->prefix_mask;
+        matcher->nodes[i].exact_mask = node->exact_mask;
+
+        memcpy(&matcher->edges[next_edge], node->children->data, node->children->len * sizeof(struct filter_edge));
+        next_edge += node->children->len;
+
+        g_array_free(node->children, true);
+    }
+
+    g_array_free(nodes, true);
+
+    return matcher;
+}
+
+// Returns NULL if the file doesn't exist or can't be read
+static GPtrArray *load_word_list(const char *path) {
+    gchar *contents = NULL;
+    if(!g_file_get_contents(path, &contents, NULL, NULL)) return NULL;
+
+    GPtrArray *words = g_ptr_array_new_with_free_func(g_free);
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    for(gchar **line = lines; *line != NULL; line++){
+        gchar *word = g_strstrip(*line);
+        if((word[0] == '\0') || (word[0] == '#')) continue;
+
+        if(!g_utf8_validate(word, -1, NULL)) {
+            printf("Filter list %s: skipping invalid UTF-8 line\n", path);
+            continue;
         }
 
-        num_to_skip++;
+        // Folded by build_word, the same way get_filter_skip folds tokens
+        g_ptr_array_add(words, g_strdup(word));
+    }
 
-        if(matched_badword) continue;
+    g_strfreev(lines);
+    g_free(contents);
 
-        still_scanning_any = false;
-        size_t token_len = strlen(tokens[i].token);
-        for(size_t c=0; c<token_len; c++){
-            if(curr_character >= MAX_CURSE_WORD_LENGTH) break;
-
-            if((c == 0) && (tokens[i].token[c] == ' ')) continue;
-
-            for(size_t j=0; j<NUM_CURSE_WORDS; j++){
-                const char *rule = curse_words[j];
-                if((rule[0] == '\1') && mode < FILTER_PROFANITY) break;
-
-                if(is_match[j] == WORD_STILL_SCANNING) {
-                    still_scanning_any = true;
-
-                    if(rule[curr_character] != tokens[i].token[c]) {
-                        is_match[j] = WORD_NON_MATCHING;
-                        continue;
-                    }
-
-                    if(rule[curr_character + 1] == '*') {
-                        is_match[j] = WORD_MATCHED;
-                        matched_badword = true;
-                        break;
-                    }else if(rule[curr_character + 1] == '\0') {
-                        // if doesn't end in *, must be the end of word to match
-                        if(((i + 1) >= count) || (tokens[i + 1].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-                            is_match[j] = WORD_MATCHED;
-                            matched_badword = true;
-                            break;
-                        }else{
-                            is_match[j] = WORD_NON_MATCHING;
-                            continue;
-                        }
-                    }
-                }
-            }
+    return words;
+}
+
+static GPtrArray *load_category(const char *language, const struct category_info *category, bool use_builtin) {
+    char *filename = g_strdup_printf("%s.%s.txt", language, category->name);
+    char *path = g_build_filename(g_get_user_data_dir(), FILTERS_DIR_NAME, filename, NULL);
 
-            curr_character++;
+    GPtrArray *words = load_word_list(path);
+    if(words != NULL) {
+        printf("Loaded %u %s words from %s\n", words->len, category->name, path);
+    } else {
+        // The built-in lists are not used for other languages
+        words = g_ptr_array_new_with_free_func(g_free);
+        if(use_builtin) {
+            for(size_t i=0; i<category->builtin_count; i++)
+                g_ptr_array_add(words, g_strdup(category->builtin_words[i]));
         }
+    }
+
+    g_free(filename);
+    g_free(path);
+
+    return words;
+}
+
+static struct filter_matcher *load_matcher(const char *language) {
+    bool is_english = (language[0] == 'e') && (language[1] == 'n');
+
+    GPtrArray *words[G_N_ELEMENTS(categories)];
+    for(size_t i=0; i<G_N_ELEMENTS(categories); i++)
+        words[i] = load_category(language, &categories[i], is_english);
+
+    struct filter_matcher *matcher = compile_matcher(words);
 
-        if(!still_scanning_any) break;
+    for(size_t i=0; i<G_N_ELEMENTS(categories); i++)
+        g_ptr_array_unref(words[i]);
+
+    return matcher;
+}
+
+// The built-in lists alone, without reading any files
+static struct filter_matcher *builtin_matcher(void) {
+    GPtrArray *words[G_N_ELEMENTS(categories)];
+    for(size_t i=0; i<G_N_ELEMENTS(categories); i++){
+        words[i] = g_ptr_array_new();
+        for(size_t j=0; j<categories[i].builtin_count; j++)
+            g_ptr_array_add(words[i], (gpointer)categories[i].builtin_words[j]);
     }
 
+    struct filter_matcher *matcher = compile_matcher(words);
 
-    if(matched_badword) return num_to_skip;
-    else return 0;
+    for(size_t i=0; i<G_N_ELEMENTS(categories); i++)
+        g_ptr_array_unref(words[i]);
+
+    return matcher;
 }
 
-size_t get_filter_skip_history(const struct history_token *tokens,
-                               size_t curr_idx,
-                               size_t count,
-                               FilterMode mode)
-{
-    // Construct a list of AprilToken * and copy data
-    AprilToken *a_tokens = calloc(sizeof(AprilToken), count);
-    for(size_t i=0; i<count; i++){
-        a_tokens[i].token   = &tokens[i].token[0];
-        a_tokens[i].flags   = tokens[i].flags;
-        a_tokens[i].logprob = tokens[i].logprob;
+
+// The active matcher holds a reference of its own. Matching threads take a
+// reference for a batch of words, so swapping in a new matcher never frees
+// one that's still in use
+static GMutex matcher_mutex;
+static struct filter_matcher *active_matcher = NULL;
+static char active_language[16] = "en";
+
+// Bumped for every reload so that a slow compile finishing late does not
+// replace a newer matcher
+static guint reload_generation = 0;
+static guint active_generation = 0;
+
+static guint reload_timeout = 0;
+static GFileMonitor *filters_monitor = NULL;
+
+struct filter_matcher *profanity_filter_acquire(void) {
+    struct filter_matcher *matcher = NULL;
+
+    g_mutex_lock(&matcher_mutex);
+    if(active_matcher != NULL) matcher = g_atomic_rc_box_acquire(active_matcher);
+
+    g_mutex_unlock(&matcher_mutex);
+
+    return matcher;
+}
+
+static void release_matcher(struct filter_matcher *matcher) {
+    g_atomic_rc_box_release_full(matcher, clear_matcher);
+}
+
+void profanity_filter_release(struct filter_matcher *matcher) {
+    if(matcher != NULL) release_matcher(matcher);
+}
+
+struct reload_data {
+    char language[16];
+    guint generation;
+};
+
+static void *run_reload_thread(void *userdata) {
+    struct reload_data *data = userdata;
+
+    struct filter_matcher *matcher = load_matcher(data->language);
+    struct filter_matcher *old_matcher = NULL;
+
+    g_mutex_lock(&matcher_mutex);
+    if(data->generation > active_generation) {
+        old_matcher = active_matcher;
+        active_matcher = matcher;
+        active_generation = data->generation;
+        matcher = NULL;
+    }
+    g_mutex_unlock(&matcher_mutex);
+
+    if(old_matcher != NULL) release_matcher(old_matcher);
+    if(matcher != NULL) release_matcher(matcher);
+
+    g_free(data);
+
+    return NULL;
+}
+
+static gboolean start_reload(gpointer userdata) {
+    reload_timeout = 0;
+
+    struct reload_data *data = g_new0(struct reload_data, 1);
+
+    g_mutex_lock(&matcher_mutex);
+    g_strlcpy(data->language, active_language, sizeof(data->language));
+    g_mutex_unlock(&matcher_mutex);
+
+    data->generation = ++reload_generation;
+
+    g_thread_unref(g_thread_new("lcap-filterload", run_reload_thread, data));
+
+    return G_SOURCE_REMOVE;
+}
+
+// Editors usually produce several events per save, so wait for them to settle
+static void queue_reload(void) {
+    if(reload_timeout != 0) g_source_remove(reload_timeout);
+    reload_timeout = g_timeout_add(250, start_reload, NULL);
+}
+
+static gboolean queue_reload_idle(gpointer userdata) {
+    queue_reload();
+    return G_SOURCE_REMOVE;
+}
+
+static void filters_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event, gpointer userdata) {
+    switch(event) {
+        case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+        case G_FILE_MONITOR_EVENT_DELETED:
+        case G_FILE_MONITOR_EVENT_CREATED:
+        case G_FILE_MONITOR_EVENT_MOVED_IN:
+        case G_FILE_MONITOR_EVENT_MOVED_OUT:
+        case G_FILE_MONITOR_EVENT_RENAMED:
+            queue_reload();
+            break;
+        default:
+            break;
+    }
+}
+
+void profanity_filter_init(void) {
+    // Until the first reload completes, use the built-in lists. Compiled
+    // here so that the threads filtering captions never have to
+    g_mutex_lock(&matcher_mutex);
+    if(active_matcher == NULL) active_matcher = builtin_matcher();
+    g_mutex_unlock(&matcher_mutex);
+
+    if(filters_monitor != NULL) return;
+
+    char *path = g_build_filename(g_get_user_data_dir(), FILTERS_DIR_NAME, NULL);
+    g_mkdir_with_parents(path, 0755);
+
+    GFile *dir = g_file_new_for_path(path);
+
+    GError *error = NULL;
+    filters_monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+    if(filters_monitor == NULL) {
+        printf("Can't watch filter lists in %s: %s\n", path, error->message);
+        g_error_free(error);
+    } else {
+        g_signal_connect(filters_monitor, "changed", G_CALLBACK(filters_changed_cb), NULL);
+    }
+
+    g_object_unref(dir);
+    g_free(path);
+
+    queue_reload();
+}
+
+void profanity_filter_set_language(const char *language) {
+    // Only used as part of a file name
+    for(const char *c = language; *c; c++){
+        if(!g_ascii_isalnum(*c) && (*c != '-') && (*c != '_')) {
+            printf("Ignoring filter language %s\n", language);
+            return;
+        }
     }
 
-    size_t result = get_filter_skip(a_tokens, curr_idx, count, mode);
+    g_mutex_lock(&matcher_mutex);
+    bool changed = !g_str_equal(active_language, language);
+    g_strlcpy(active_language, language, sizeof(active_language));
+    g_mutex_unlock(&matcher_mutex);
+
+    // May be called from the ASR thread, the reload is started from the main loop
+    if(changed) g_idle_add(queue_reload_idle, NULL);
+}
+
+static uint32_t matcher_step(const struct filter_matcher *matcher, uint32_t node, char c) {
+    const struct filter_node *n = &matcher->nodes[node];
+    const struct filter_edge *edges = &matcher->edges[n->first_edge];
+
+    uint32_t lo = 0;
+    uint32_t hi = n->num_edges;
+    while(lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if(edges[mid].c == c) return edges[mid].target;
+        else if(edges[mid].c < c) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return NO_NODE;
+}
+
+static uint8_t mode_to_mask(FilterMode mode) {
+    switch(mode) {
+        case FILTER_SLURS: return CATEGORY_SLURS;
+        case FILTER_PROFANITY: return CATEGORY_SLURS | CATEGORY_PROFANITY;
+        default: return 0;
+    }
+}
+
+size_t get_filter_skip(const struct filter_matcher *matcher, const struct token_view *tokens, size_t curr_idx, FilterMode mode) {
+    if((mode <= FILTER_NONE) || (matcher == NULL)) return 0;
 
-    free(a_tokens);
+    uint8_t mask = mode_to_mask(mode);
 
-    return result;
-}
\ No newline at end of file
+    uint32_t node = 0;
+    bool matched_badword = false;
+
+    size_t i;
+    for(i=curr_idx; i<tokens->count; i++){
+        if((i > curr_idx) && (token_view_flags(tokens, i) & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            // Once we've arrived at the next word, stop looking.
+            // we only want to filter the word starting at curr_idx
+            break;
+        }
+
+        // Keep going to count the remaining tokens of the word
+        if(matched_badword) continue;
+
+        const char *c = token_view_text(tokens, i);
+        if(*c == ' ') c++;
+
+        for(; *c != '\0'; c++){
+            node = matcher_step(matcher, node, g_ascii_toupper(*c));
+            if(node == NO_NODE) return 0;
+
+            if(matcher->nodes[node].prefix_mask & mask) {
+                matched_badword = true;
+                break;
+            }
+        }
+    }
+
+    // Whole-word rules must end exactly at the end of the word
+    if(!matched_badword && (matcher->nodes[node].exact_mask & mask))
+        matched_badword = true;
+
+    if(matched_badword) return i - curr_idx;
+    else return 0;
+}
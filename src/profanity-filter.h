@@ -29,19 +29,32 @@ typedef enum FilterMode {
     FILTER_PROFANITY = 2
 } FilterMode;
 
-// Takes in an array of tokens, the current index in the list of tokens, and
-// token count. The current index should be at a word boundary.
+// Starts watching the user word lists for changes and compiles them in the
+// background. Until then the built-in lists are used, nothing is filtered
+// before this is called. Call from the main thread
+void profanity_filter_init(void);
+
+// Selects the word lists of the given language (e.g. "en"). Thread safe, the
+// new lists take effect once they've been compiled
+void profanity_filter_set_language(const char *language);
+
+struct token_view;
+struct filter_matcher;
+
+// Takes a reference to the compiled word lists, so that a reload meanwhile
+// doesn't free them. Hold it for a batch of words, such as one update of
+// the captions, and release it afterwards. NULL before profanity_filter_init
+struct filter_matcher *profanity_filter_acquire(void);
+
+// Accepts NULL
+void profanity_filter_release(struct filter_matcher *matcher);
+
+// Takes in the acquired word lists, a view of the tokens and the current
+// index in it. The current index should be at a word boundary. Does not
+// allocate or lock.
 // Returns the number of tokens to skip after the current index if filtered,
 // or 0 if not filtered.
-size_t get_filter_skip(const AprilToken *tokens,
+size_t get_filter_skip(const struct filter_matcher *matcher,
+                       const struct token_view *tokens,
                        size_t curr_idx,
-                       size_t count,
                        FilterMode mode);
-
-struct history_token;
-
-// Exact same but with history_token
-size_t get_filter_skip_history(const struct history_token *tokens,
-                               size_t curr_idx,
-                               size_t count,
-                               FilterMode mode);
\ No newline at end of file
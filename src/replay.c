@@ -0,0 +1,320 @@
+/* replay.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <adwaita.h>
+#include <april_api.h>
+
+#include "livecaptions-config.h"
+#include "replay.h"
+#include "token-log.h"
+#include "line-gen.h"
+#include "history.h"
+#include "livecaptions-window.h"
+
+static char *record_path = NULL;
+static char *replay_path = NULL;
+static double replay_speed = -1.0;
+static gboolean replay_headless = FALSE;
+
+const GOptionEntry replay_option_entries[] = {
+    { "record-tokens", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &record_path,
+      N_("Record every result of the models to a file, to be replayed with --replay-tokens"), N_("FILE") },
+    { "replay-tokens", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &replay_path,
+      N_("Show the results recorded in a file instead of captioning audio"), N_("FILE") },
+    { "replay-speed", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_DOUBLE, &replay_speed,
+      N_("How many times faster than recorded to replay, 0 for as fast as possible"), N_("FACTOR") },
+    { "replay-headless", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &replay_headless,
+      N_("Replay without a window and print how long the captions took to process"), NULL },
+    { NULL }
+};
+
+bool replay_parse_options(int *argc, char ***argv) {
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, replay_option_entries, GETTEXT_PACKAGE);
+
+    // Everything else is for the application
+    g_option_context_set_ignore_unknown_options(context, true);
+    g_option_context_set_help_enabled(context, false);
+
+    GError *error = NULL;
+    if(!g_option_context_parse(context, argc, argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_option_context_free(context);
+
+    if(replay_headless && (replay_path == NULL)) {
+        fprintf(stderr, "--replay-headless needs --replay-tokens\n");
+        replay_headless = FALSE;
+    }
+
+    return replay_headless;
+}
+
+static GMutex stop_mutex;
+static GCond stop_cond;
+static bool stopping = false;
+
+// Sleeps until the record is due. Returns false if stopped meanwhile
+static bool wait_for_record(gint64 start, gint64 time_us, double speed) {
+    if(speed <= 0.0) return true;
+
+    gint64 due = start + (gint64)(time_us / speed);
+
+    g_mutex_lock(&stop_mutex);
+    while(!stopping && (g_get_monotonic_time() < due)) g_cond_wait_until(&stop_cond, &stop_mutex, due);
+    bool stopped = stopping;
+    g_mutex_unlock(&stop_mutex);
+
+    return !stopped;
+}
+
+
+// A layout like the window's, from the font and line width settings. The
+// window's CSS isn't applied, so the lines may break a little differently
+static PangoLayout *headless_layout(int *max_text_width) {
+    GSettings *settings = g_settings_new("net.sapples.LiveCaptions");
+
+    PangoContext *context = pango_font_map_create_context(pango_cairo_font_map_get_default());
+    PangoLayout *layout = pango_layout_new(context);
+    g_object_unref(context);
+
+    char *font = g_settings_get_string(settings, "font-name");
+    PangoFontDescription *desc = pango_font_description_from_string(font);
+    pango_layout_set_font_description(layout, desc);
+    pango_font_description_free(desc);
+    g_free(font);
+
+    size_t text_len = strlen(LINE_WIDTH_TEXT_TEMPLATE);
+    int preferred_width = g_settings_get_int(settings, "line-width");
+    if((preferred_width > 0) && ((size_t)preferred_width < text_len)) text_len = preferred_width;
+
+    int width, height;
+    pango_layout_set_width(layout, -1);
+    pango_layout_set_text(layout, LINE_WIDTH_TEXT_TEMPLATE, text_len);
+    pango_layout_get_size(layout, &width, &height);
+
+    *max_text_width = width / PANGO_SCALE;
+
+    g_object_unref(settings);
+
+    return layout;
+}
+
+static struct line_generator headless_lines[CAPTION_SOURCE_COUNT];
+
+// Single calls take microseconds, too short for g_get_monotonic_time
+static gint64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int replay_run_headless(void) {
+    struct token_log *log = token_log_open(replay_path);
+    if(log == NULL) return 1;
+
+    // Nothing is saved, the user's history is left alone
+    history_init();
+
+    int max_text_width;
+    PangoLayout *layout = headless_layout(&max_text_width);
+
+    bool in_silence[CAPTION_SOURCE_COUNT];
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        line_generator_init(&headless_lines[i]);
+        headless_lines[i].layout = layout;
+        headless_lines[i].max_text_width = max_text_width;
+        in_silence[i] = false;
+    }
+
+    double speed = (replay_speed < 0.0) ? 0.0 : replay_speed;
+
+    size_t results = 0, finals = 0, silences = 0, cant_keep_up = 0, other_lanes = 0;
+    size_t update_tokens = 0, history_tokens = 0;
+    gint64 update_ns = 0, history_ns = 0, duration_us = 0;
+
+    gint64 start = g_get_monotonic_time();
+
+    struct token_log_record record;
+    while(token_log_read(log, &record)) {
+        wait_for_record(start, record.time_us, speed);
+        duration_us = record.time_us;
+        results++;
+
+        // Without the other models' results to compare against, only the
+        // main model's are shown
+        if(record.lane != 0) {
+            other_lanes++;
+            continue;
+        }
+
+        struct line_generator *lg = &headless_lines[record.source];
+
+        switch(record.result) {
+            case APRIL_RESULT_RECOGNITION_PARTIAL:
+            case APRIL_RESULT_RECOGNITION_FINAL:
+            {
+                in_silence[record.source] = false;
+
+                gint64 t0 = now_ns();
+                line_generator_set_language(lg, record.language);
+                line_generator_update(lg, record.count, record.tokens);
+                gint64 t1 = now_ns();
+
+                update_ns += t1 - t0;
+                update_tokens += record.count;
+
+                if(record.result == APRIL_RESULT_RECOGNITION_FINAL) {
+                    line_generator_finalize(lg);
+
+                    gint64 t2 = now_ns();
+                    commit_tokens_to_current_history(record.source, record.language, record.tokens, record.count);
+                    gint64 t3 = now_ns();
+
+                    history_ns += t3 - t2;
+                    history_tokens += record.count;
+                    finals++;
+                }
+                break;
+            }
+
+            case APRIL_RESULT_SILENCE:
+                if(!in_silence[record.source]) {
+                    line_generator_break(lg);
+                    save_silence_to_history(record.source);
+                    in_silence[record.source] = true;
+                }
+                silences++;
+                break;
+
+            case APRIL_RESULT_ERROR_CANT_KEEP_UP:
+                cant_keep_up++;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    gint64 elapsed_us = g_get_monotonic_time() - start;
+
+    printf("\nReplayed %zu results (%zu final, %zu silence, %zu can't keep up) covering %.1f s in %.3f s\n",
+           results, finals, silences, cant_keep_up, duration_us / 1e6, elapsed_us / 1e6);
+    if(other_lanes > 0)
+        printf("Skipped %zu results of parallel models\n", other_lanes);
+
+    printf("Line generation: %.1f ns/token over %zu tokens\n",
+           (update_tokens > 0) ? (double)update_ns / update_tokens : 0.0, update_tokens);
+    printf("History: %.1f ns/token over %zu tokens\n",
+           (history_tokens > 0) ? (double)history_ns / history_tokens : 0.0, history_tokens);
+
+    g_object_unref(layout);
+    token_log_close(log);
+
+    return 0;
+}
+
+
+bool replay_start_recording(void) {
+    if(record_path == NULL) return true;
+
+    return token_log_start(record_path);
+}
+
+static struct token_log *window_log = NULL;
+static unsigned int window_sources = 0;
+static GThread *replay_thread = NULL;
+
+bool replay_open_recording(void) {
+    if((replay_path == NULL) || (window_log != NULL)) return true;
+
+    window_log = token_log_open(replay_path);
+    if(window_log == NULL) return false;
+
+    struct token_log_record record;
+    while(token_log_read(window_log, &record)) window_sources |= 1u << record.source;
+
+    token_log_rewind(window_log);
+
+    return true;
+}
+
+bool replay_is_active(void) {
+    return window_log != NULL;
+}
+
+unsigned int replay_get_sources(void) {
+    return window_sources;
+}
+
+static void *run_replay(void *userdata) {
+    asr_thread asr = userdata;
+    double speed = (replay_speed < 0.0) ? 1.0 : replay_speed;
+
+    size_t replayed = 0, dropped = 0;
+    gint64 start = g_get_monotonic_time();
+
+    struct token_log_record record;
+    while(token_log_read(window_log, &record)) {
+        if(!wait_for_record(start, record.time_us, speed)) break;
+
+        if(asr_thread_replay_result(asr, record.source, record.lane, record.result, record.count, record.tokens))
+            replayed++;
+        else
+            dropped++;
+    }
+
+    printf("Replay finished after %.1f s, %zu results", (g_get_monotonic_time() - start) / 1e6, replayed);
+    if(dropped > 0) printf(", %zu for models not loaded now", dropped);
+    printf("\n");
+
+    return NULL;
+}
+
+void replay_start(asr_thread asr) {
+    if((window_log == NULL) || (replay_thread != NULL)) return;
+
+    printf("Replaying %s\n", replay_path);
+    replay_thread = g_thread_new("lcap-replay", run_replay, asr);
+}
+
+void replay_stop(void) {
+    if(replay_thread != NULL) {
+        g_mutex_lock(&stop_mutex);
+        stopping = true;
+        g_cond_broadcast(&stop_cond);
+        g_mutex_unlock(&stop_mutex);
+
+        g_thread_join(replay_thread);
+        replay_thread = NULL;
+    }
+
+    // The lanes may still point at its tokens, but the application paused
+    // the asr thread on the way out so they're not shown anymore
+    token_log_close(window_log);
+    window_log = NULL;
+
+    token_log_stop();
+}
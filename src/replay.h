@@ -0,0 +1,62 @@
+/* replay.h
+ * Records the results of the models to a file, and plays such a recording
+ * back through the captions instead of decoding audio, either into the
+ * window or headless for profiling
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <glib.h>
+
+#include "asrproc.h"
+
+// The --record-tokens and --replay-* options, also listed in the
+// application's --help
+extern const GOptionEntry replay_option_entries[];
+
+// Takes the options out of the arguments. Returns true if a headless replay
+// was requested, in which case main runs it instead of the UI
+bool replay_parse_options(int *argc, char ***argv);
+
+// Replays into line generation, history and the filter without a window or
+// model, as fast as possible unless --replay-speed is given, and prints how
+// long each took. Returns the exit status
+int replay_run_headless(void);
+
+// Starts recording if --record-tokens was given. Returns false if the file
+// can't be created
+bool replay_start_recording(void);
+
+// Reads the recording if --replay-tokens was given. Returns false if it
+// can't be read
+bool replay_open_recording(void);
+
+// A recording was opened, so no audio should be captured
+bool replay_is_active(void);
+
+// Bitmask of (1 << CaptionSource) for the sources in the recording
+unsigned int replay_get_sources(void);
+
+// Starts feeding the recording to the asr thread's sessions in the
+// background, at the original pace unless --replay-speed is given. Only
+// the first call does anything
+void replay_start(asr_thread asr);
+
+// Stops replaying and recording
+void replay_stop(void);
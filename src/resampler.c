@@ -0,0 +1,225 @@
+/* resampler.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The inner loops are written so that the compiler can vectorize them
+// without intrinsics: fixed-width lanes of independent accumulators, no
+// aliasing between buffers, and padded filter lengths.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "resampler.h"
+
+#define LANES 8
+
+struct resampler {
+    unsigned int channels;
+
+    // Output rate / input rate reduced to L / M
+    unsigned int up;
+    unsigned int down;
+
+    unsigned int taps;
+
+    // up phases of taps coefficients each, phase-major
+    float *coeffs;
+
+    // Downmixed input not yet consumed, the first taps-1 samples are history
+    float *hist;
+    size_t hist_len;
+
+    // Position of the next output sample in the upsampled input
+    // (relative to hist[0] * up)
+    size_t next_pos;
+};
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while(b != 0) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+static double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for(int k=1; k<32; k++){
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+
+    return sum;
+}
+
+// Kaiser-windowed sinc lowpass at the upsampled rate, split into phases
+static void design_filter(struct resampler *r) {
+    const double beta = 8.0;
+
+    size_t length = (size_t)r->taps * r->up;
+    double center = (length - 1) / 2.0;
+
+    // Cut off a bit below the lower Nyquist frequency to leave room for
+    // the transition band
+    double cutoff = 0.45 / (double)((r->up > r->down) ? r->up : r->down);
+
+    for(size_t i=0; i<length; i++){
+        double x = i - center;
+        double sinc = (x == 0.0) ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+
+        double w = 2.0 * x / (double)(length - 1);
+        double window = bessel_i0(beta * sqrt(fmax(0.0, 1.0 - w * w))) / bessel_i0(beta);
+
+        // Tap i of the prototype is tap i / up of phase i % up. Scaled by up
+        // to make up for the zeros inserted when upsampling. Taps are stored
+        // reversed so the dot product walks input and coefficients forward
+        size_t phase = i % r->up;
+        size_t tap = r->taps - 1 - (i / r->up);
+        r->coeffs[phase * r->taps + tap] = (float)(sinc * window * r->up);
+    }
+}
+
+struct resampler *resampler_new(unsigned int in_rate,
+                                unsigned int out_rate,
+                                unsigned int channels,
+                                unsigned int taps_per_phase)
+{
+    if((in_rate == 0) || (out_rate == 0) || (channels == 0) || (channels > 32)) return NULL;
+
+    unsigned int g = gcd(in_rate, out_rate);
+
+    struct resampler *r = calloc(1, sizeof(struct resampler));
+    r->channels = channels;
+    r->up = out_rate / g;
+    r->down = in_rate / g;
+
+    // Keeps the coefficient table small, common device rates are well below this
+    if(r->up > 512) {
+        free(r);
+        return NULL;
+    }
+
+    if(taps_per_phase < LANES) taps_per_phase = LANES;
+    r->taps = (taps_per_phase + LANES - 1) / LANES * LANES;
+
+    r->coeffs = calloc((size_t)r->up * r->taps, sizeof(float));
+    design_filter(r);
+
+    r->hist = calloc(r->taps + RESAMPLER_MAX_BLOCK_FRAMES, sizeof(float));
+    r->hist_len = r->taps - 1;
+    r->next_pos = 0;
+
+    return r;
+}
+
+size_t resampler_max_output(const struct resampler *r, size_t in_frames) {
+    // At most taps + down samples are left over from the previous call
+    return ((r->taps + r->down + in_frames) * r->up) / r->down + 1;
+}
+
+static void downmix(const struct resampler *r, const float *restrict in, size_t frames, float *restrict out) {
+    const unsigned int channels = r->channels;
+
+    if(channels == 1) {
+        memcpy(out, in, frames * sizeof(float));
+        return;
+    }
+
+    const float scale = 1.0f / (float)channels;
+    for(size_t i=0; i<frames; i++){
+        float sum = 0.0f;
+        for(unsigned int c=0; c<channels; c++)
+            sum += in[i * channels + c];
+
+        out[i] = sum * scale;
+    }
+}
+
+static float dot(const float *restrict x, const float *restrict h, size_t taps) {
+    float acc[LANES] = { 0 };
+
+    for(size_t k=0; k<taps; k+=LANES){
+        for(size_t j=0; j<LANES; j++)
+            acc[j] += x[k + j] * h[k + j];
+    }
+
+    float sum = 0.0f;
+    for(size_t j=0; j<LANES; j++)
+        sum += acc[j];
+
+    return sum;
+}
+
+static short to_s16(float v) {
+    float s = v * 32767.0f;
+    if(s > 32767.0f) s = 32767.0f;
+    if(s < -32768.0f) s = -32768.0f;
+
+    return (short)lrintf(s);
+}
+
+size_t resampler_process(struct resampler *r,
+                         const float *in,
+                         size_t in_frames,
+                         short *out)
+{
+    if(in_frames > RESAMPLER_MAX_BLOCK_FRAMES) in_frames = RESAMPLER_MAX_BLOCK_FRAMES;
+
+    downmix(r, in, in_frames, &r->hist[r->hist_len]);
+    r->hist_len += in_frames;
+
+    const unsigned int up = r->up;
+    const unsigned int down = r->down;
+    const size_t taps = r->taps;
+
+    // Output n needs input samples [pos / up, pos / up + taps)
+    size_t written = 0;
+    for(;;) {
+        size_t base = r->next_pos / up;
+        if((base + taps) > r->hist_len) break;
+
+        size_t phase = r->next_pos % up;
+        out[written++] = to_s16(dot(&r->hist[base], &r->coeffs[phase * taps], taps));
+
+        r->next_pos += down;
+    }
+
+    // Keep the samples that later outputs still need
+    size_t consumed = r->next_pos / up;
+    if(consumed > r->hist_len) consumed = r->hist_len;
+
+    memmove(r->hist, &r->hist[consumed], (r->hist_len - consumed) * sizeof(float));
+    r->hist_len -= consumed;
+    r->next_pos -= consumed * up;
+
+    return written;
+}
+
+unsigned int resampler_get_channels(const struct resampler *r) {
+    return r->channels;
+}
+
+void resampler_free(struct resampler *r) {
+    if(r == NULL) return;
+
+    free(r->coeffs);
+    free(r->hist);
+    free(r);
+}
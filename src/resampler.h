@@ -0,0 +1,56 @@
+/* resampler.h
+ * Polyphase resampler and downmixer, used to convert audio captured in the
+ * device's native format (interleaved float32 at any rate and channel count)
+ * to mono 16-bit audio at the model's sample rate.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// Filter taps per phase. More taps give a sharper anti-aliasing filter at a
+// proportionally higher cost per output sample. Rounded up to a multiple of 8
+#define RESAMPLER_DEFAULT_TAPS 32
+
+// Largest input block accepted by a single resampler_process call
+#define RESAMPLER_MAX_BLOCK_FRAMES 4096
+
+struct resampler;
+
+// Returns NULL if the rates or channel count are not supported
+struct resampler *resampler_new(unsigned int in_rate,
+                                unsigned int out_rate,
+                                unsigned int channels,
+                                unsigned int taps_per_phase);
+
+// Upper bound of the output of one resampler_process call with in_frames,
+// regardless of the filter state, so buffers can be allocated up front
+size_t resampler_max_output(const struct resampler *r, size_t in_frames);
+
+// Downmixes and resamples in_frames interleaved frames (at most
+// RESAMPLER_MAX_BLOCK_FRAMES). Filter state is kept between calls.
+// Returns the number of samples written to out, which must have room for
+// resampler_max_output(r, in_frames)
+size_t resampler_process(struct resampler *r,
+                         const float *in,
+                         size_t in_frames,
+                         short *out);
+
+unsigned int resampler_get_channels(const struct resampler *r);
+
+void resampler_free(struct resampler *r);
@@ -0,0 +1,427 @@
+/* rt.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For the CPU affinity macros and SCHED_IDLE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <gio/gio.h>
+
+#include "rt.h"
+
+#define RTKIT_NAME "org.freedesktop.RealtimeKit1"
+#define RTKIT_PATH "/org/freedesktop/RealtimeKit1"
+#define RTKIT_INTERFACE "org.freedesktop.RealtimeKit1"
+
+#define PORTAL_NAME "org.freedesktop.portal.Desktop"
+#define PORTAL_PATH "/org/freedesktop/portal/desktop"
+#define PORTAL_INTERFACE "org.freedesktop.portal.Realtime"
+
+static bool set_sched_fifo(int priority) {
+    struct sched_param param = { .sched_priority = priority };
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+// rtkit and the portal report these as either int32 or int64
+static bool get_int_property(GDBusConnection *bus, const char *name, const char *path,
+                             const char *interface, const char *property, gint64 *out)
+{
+    GVariant *result = g_dbus_connection_call_sync(bus, name, path,
+        "org.freedesktop.DBus.Properties", "Get",
+        g_variant_new("(ss)", interface, property),
+        G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NONE, 1000, NULL, NULL);
+
+    if(result == NULL) return false;
+
+    GVariant *value;
+    g_variant_get(result, "(v)", &value);
+
+    bool found = true;
+    if(g_variant_is_of_type(value, G_VARIANT_TYPE_INT32)) *out = g_variant_get_int32(value);
+    else if(g_variant_is_of_type(value, G_VARIANT_TYPE_INT64)) *out = g_variant_get_int64(value);
+    else found = false;
+
+    g_variant_unref(value);
+    g_variant_unref(result);
+
+    return found;
+}
+
+static bool request_realtime(bool portal, int priority) {
+    GError *error = NULL;
+
+    GDBusConnection *bus = g_bus_get_sync(portal ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM, NULL, &error);
+    if(bus == NULL) {
+        g_error_free(error);
+        return false;
+    }
+
+    const char *name = portal ? PORTAL_NAME : RTKIT_NAME;
+    const char *path = portal ? PORTAL_PATH : RTKIT_PATH;
+    const char *interface = portal ? PORTAL_INTERFACE : RTKIT_INTERFACE;
+
+    gint64 max_priority = 0;
+    gint64 max_rttime = 0;
+    if(!get_int_property(bus, name, path, interface, "MaxRealtimePriority", &max_priority) ||
+       !get_int_property(bus, name, path, interface, "RTTimeUSecMax", &max_rttime))
+    {
+        g_object_unref(bus);
+        return false;
+    }
+
+    // Both refuse processes that could hog the CPU indefinitely
+    struct rlimit limit = { .rlim_cur = (rlim_t)max_rttime, .rlim_max = (rlim_t)max_rttime };
+    if(setrlimit(RLIMIT_RTTIME, &limit) != 0)
+        printf("Can't limit realtime CPU time: %s\n", strerror(errno));
+
+    guint64 tid = (guint64)syscall(SYS_gettid);
+    guint32 prio = (guint32)MIN(priority, max_priority);
+
+    GVariant *args = portal ? g_variant_new("(ttu)", (guint64)getpid(), tid, prio)
+                            : g_variant_new("(tu)", tid, prio);
+
+    GVariant *result = g_dbus_connection_call_sync(bus, name, path, interface,
+        portal ? "MakeThreadRealtimeWithPID" : "MakeThreadRealtime",
+        args, NULL, G_DBUS_CALL_FLAGS_NONE, 1000, NULL, &error);
+
+    g_object_unref(bus);
+
+    if(result == NULL) {
+        printf("%s refused realtime priority: %s\n", portal ? "The realtime portal" : "rtkit", error->message);
+        g_error_free(error);
+        return false;
+    }
+
+    g_variant_unref(result);
+    return true;
+}
+
+bool rt_make_current_thread_realtime(const char *name, int priority) {
+    const char *how = "directly";
+
+    if(!set_sched_fifo(priority)) {
+        bool flatpak = g_file_test("/.flatpak-info", G_FILE_TEST_EXISTS);
+
+        if(flatpak && request_realtime(true, priority)) how = "through the portal";
+        else if(request_realtime(false, priority)) how = "through rtkit";
+        else {
+            printf("Can't make the %s thread realtime, it stays at normal priority\n", name);
+            return false;
+        }
+    }
+
+    printf("The %s thread is realtime (%s)\n", name, how);
+    return true;
+}
+
+void rt_lock_memory(const void *ptr, size_t len) {
+    static bool warned = false;
+
+    if((mlock(ptr, len) != 0) && !warned) {
+        printf("Can't lock capture buffers in memory: %s\n", strerror(errno));
+        warned = true;
+    }
+}
+
+void rt_unlock_memory(const void *ptr, size_t len) {
+    munlock(ptr, len);
+}
+
+
+// Threads doing speech recognition work, by thread id
+static GMutex placement_mutex;
+static GArray *placed_threads = NULL;
+static __thread bool current_placed = false;
+
+static bool placement_have_cpus = false;
+static cpu_set_t placement_cpus;
+static cpu_set_t default_cpus;
+static bool have_default_cpus = false;
+static int placement_nice = 0;
+static bool placement_idle = false;
+
+// Returns false if the list is malformed or empty
+static bool parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+
+    char **parts = g_strsplit(list, ",", -1);
+    bool valid = true;
+
+    for(size_t i=0; valid && (parts[i] != NULL); i++){
+        char *part = g_strstrip(parts[i]);
+        if(*part == '\0') continue;
+
+        char *end;
+        guint64 first = g_ascii_strtoull(part, &end, 10);
+        guint64 last = first;
+
+        if(end == part) valid = false;
+        else if(*end == '-') {
+            char *start = end + 1;
+            last = g_ascii_strtoull(start, &end, 10);
+            if(end == start) valid = false;
+        }
+
+        if(!valid || (*end != '\0') || (first > last) || (last >= CPU_SETSIZE)) {
+            valid = false;
+            break;
+        }
+
+        for(guint64 cpu=first; cpu<=last; cpu++) CPU_SET(cpu, set);
+    }
+
+    g_strfreev(parts);
+
+    return valid && (CPU_COUNT(set) > 0);
+}
+
+static char *format_cpu_list(const cpu_set_t *set) {
+    GString *str = g_string_new(NULL);
+
+    for(int cpu=0; cpu<CPU_SETSIZE; cpu++){
+        if(!CPU_ISSET(cpu, set)) continue;
+
+        int last = cpu;
+        while((last + 1 < CPU_SETSIZE) && CPU_ISSET(last + 1, set)) last++;
+
+        if(str->len > 0) g_string_append_c(str, ',');
+        if(last == cpu) g_string_append_printf(str, "%d", cpu);
+        else g_string_append_printf(str, "%d-%d", cpu, last);
+
+        cpu = last;
+    }
+
+    return g_string_free(str, false);
+}
+
+static bool thread_exists(pid_t tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d", (int)tid);
+    return access(path, F_OK) == 0;
+}
+
+// Threads that exited without rt_forget_current_thread, like the ones of
+// freed aprilasr sessions. Called with placement_mutex held
+static void prune_placed_threads(void) {
+    for(guint i=0; i<placed_threads->len;){
+        if(thread_exists(g_array_index(placed_threads, pid_t, i))) i++;
+        else g_array_remove_index_fast(placed_threads, i);
+    }
+}
+
+// Called with placement_mutex held
+static void apply_placement(pid_t tid) {
+    static bool warned_affinity = false, warned_policy = false, warned_nice = false;
+
+    // The capture path stays where it is
+    int policy = sched_getscheduler(tid);
+    if((policy == SCHED_FIFO) || (policy == SCHED_RR)) return;
+
+    const cpu_set_t *cpus = placement_have_cpus ? &placement_cpus : (have_default_cpus ? &default_cpus : NULL);
+    if((cpus != NULL) && (sched_setaffinity(tid, sizeof(cpu_set_t), cpus) != 0) && !warned_affinity) {
+        printf("Can't set the CPU affinity of decoding threads: %s\n", strerror(errno));
+        warned_affinity = true;
+    }
+
+    struct sched_param param = { .sched_priority = 0 };
+    if(placement_idle != (policy == SCHED_IDLE)) {
+        if((sched_setscheduler(tid, placement_idle ? SCHED_IDLE : SCHED_OTHER, &param) != 0) && !warned_policy) {
+            printf("Can't change the scheduling policy of decoding threads: %s\n", strerror(errno));
+            warned_policy = true;
+        }
+    }
+
+    // Lowering it again needs CAP_SYS_NICE or a high enough RLIMIT_NICE
+    if((setpriority(PRIO_PROCESS, (id_t)tid, placement_nice) != 0) && !warned_nice) {
+        printf("Can't set the nice value of decoding threads to %d: %s\n", placement_nice, strerror(errno));
+        warned_nice = true;
+    }
+}
+
+void rt_set_asr_placement(const char *cpus, int nice, bool idle) {
+    g_mutex_lock(&placement_mutex);
+
+    // To go back to once the mask is cleared. The main thread isn't
+    // placed, so it keeps what the process started with
+    if(!have_default_cpus)
+        have_default_cpus = sched_getaffinity(getpid(), sizeof(cpu_set_t), &default_cpus) == 0;
+
+    placement_have_cpus = false;
+    if((cpus != NULL) && (*cpus != '\0')) {
+        placement_have_cpus = parse_cpu_list(cpus, &placement_cpus);
+        if(!placement_have_cpus) printf("Ignoring invalid CPU list \"%s\"\n", cpus);
+    }
+
+    placement_nice = CLAMP(nice, 0, 19);
+    placement_idle = idle;
+
+    if(placed_threads != NULL) {
+        prune_placed_threads();
+
+        for(guint i=0; i<placed_threads->len; i++)
+            apply_placement(g_array_index(placed_threads, pid_t, i));
+    }
+
+    g_mutex_unlock(&placement_mutex);
+}
+
+void rt_place_current_thread(void) {
+    if(current_placed) return;
+    current_placed = true;
+
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    g_mutex_lock(&placement_mutex);
+
+    if(placed_threads == NULL) placed_threads = g_array_new(false, false, sizeof(pid_t));
+    g_array_append_val(placed_threads, tid);
+
+    apply_placement(tid);
+
+    g_mutex_unlock(&placement_mutex);
+}
+
+void rt_forget_current_thread(void) {
+    if(!current_placed) return;
+    current_placed = false;
+
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    g_mutex_lock(&placement_mutex);
+
+    for(guint i=0; i<placed_threads->len; i++){
+        if(g_array_index(placed_threads, pid_t, i) == tid) {
+            g_array_remove_index_fast(placed_threads, i);
+            break;
+        }
+    }
+
+    g_mutex_unlock(&placement_mutex);
+}
+
+static void read_thread_name(pid_t tid, char *name, size_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", (int)tid);
+
+    g_strlcpy(name, "?", size);
+
+    FILE *f = fopen(path, "r");
+    if(f == NULL) return;
+
+    if(fgets(name, size, f) != NULL) g_strchomp(name);
+    fclose(f);
+}
+
+char *rt_describe_placement(void) {
+    GString *str = g_string_new(NULL);
+
+    g_mutex_lock(&placement_mutex);
+
+    char *requested = placement_have_cpus ? format_cpu_list(&placement_cpus) : g_strdup("any");
+    g_string_append_printf(str, "Decoding threads: CPUs %s, nice %d%s\n",
+                           requested, placement_nice, placement_idle ? ", SCHED_IDLE" : "");
+    g_free(requested);
+
+    if(placed_threads != NULL) {
+        prune_placed_threads();
+
+        for(guint i=0; i<placed_threads->len; i++){
+            pid_t tid = g_array_index(placed_threads, pid_t, i);
+
+            char name[32];
+            read_thread_name(tid, name, sizeof(name));
+
+            cpu_set_t cpus;
+            char *cpu_list = (sched_getaffinity(tid, sizeof(cpus), &cpus) == 0) ? format_cpu_list(&cpus) : g_strdup("?");
+
+            errno = 0;
+            int nice = getpriority(PRIO_PROCESS, (id_t)tid);
+
+            int policy = sched_getscheduler(tid);
+            const char *policy_name = (policy == SCHED_IDLE) ? "SCHED_IDLE" :
+                                      (policy == SCHED_BATCH) ? "SCHED_BATCH" :
+                                      (policy == SCHED_OTHER) ? "SCHED_OTHER" : "other";
+
+            g_string_append_printf(str, "  %s (%d): CPUs %s, nice %d, %s\n",
+                                   name, (int)tid, cpu_list, (errno == 0) ? nice : 0, policy_name);
+            g_free(cpu_list);
+        }
+    }
+
+    g_mutex_unlock(&placement_mutex);
+
+    return g_string_free(str, false);
+}
+
+
+#ifdef LIVE_CAPTIONS_RT_ALLOC_CHECK
+// Replaces the allocator for the whole process to catch allocations in the
+// realtime sections. glibc exports its own implementation under these names
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int section_depth = 0;
+
+static void alloc_violation(const char *function) {
+    // Without allocating, so no stdio
+    static const char message[] = " called in a realtime section, aborting\n";
+    if(write(STDERR_FILENO, function, strlen(function)) < 0) abort();
+    if(write(STDERR_FILENO, message, sizeof(message) - 1) < 0) abort();
+    abort();
+}
+
+void *malloc(size_t size) {
+    if(section_depth > 0) alloc_violation("malloc");
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if(section_depth > 0) alloc_violation("calloc");
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if(section_depth > 0) alloc_violation("realloc");
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if((section_depth > 0) && (ptr != NULL)) alloc_violation("free");
+    __libc_free(ptr);
+}
+
+void rt_section_enter(void) {
+    section_depth++;
+}
+
+void rt_section_leave(void) {
+    section_depth--;
+}
+#endif
@@ -0,0 +1,70 @@
+/* rt.h
+ * Realtime scheduling and memory locking for the capture path, and the
+ * debug check that nothing allocates in it
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// SCHED_FIFO priorities, clamped to what rtkit or the portal allow. The
+// capture callback preempts the thread that consumes its audio
+#define RT_PRIORITY_CAPTURE 10
+#define RT_PRIORITY_CONSUMER 9
+
+// Makes the calling thread SCHED_FIFO. Tries sched_setscheduler directly
+// (needs RLIMIT_RTPRIO), then the realtime portal inside Flatpak, then
+// rtkit. Blocks on D-Bus, so call it once before the thread gets going
+bool rt_make_current_thread_realtime(const char *name, int priority);
+
+// Keeps the memory resident so touching it never faults. Failure (e.g. a
+// low RLIMIT_MEMLOCK) is only reported, as it's not fatal
+void rt_lock_memory(const void *ptr, size_t len);
+void rt_unlock_memory(const void *ptr, size_t len);
+
+// Where the threads doing speech recognition run, so they can be kept off
+// the cores the compositor and other applications use. cpus is a list like
+// "0-3,8", NULL or empty for any. nice is 0 to 19, and idle
+// uses SCHED_IDLE so they only get CPU time nothing else wants. Applies to
+// the threads placed so far and any placed later
+void rt_set_asr_placement(const char *cpus, int nice, bool idle);
+
+// Adds the calling thread to the placed ones. Cheap when it already is,
+// so it can be called from callbacks of threads we don't create. SCHED_FIFO
+// threads are left alone. Threads created by a placed thread inherit its
+// placement at that point
+void rt_place_current_thread(void);
+
+// Call before a placed thread exits. Threads that don't are noticed later
+void rt_forget_current_thread(void);
+
+// The requested placement and the effective one of every placed thread.
+// Free with g_free
+char *rt_describe_placement(void);
+
+// Code between these must not allocate or free memory. Built with
+// -Drt_alloc_check=true, doing so prints the function and aborts.
+// Otherwise they do nothing
+#ifdef LIVE_CAPTIONS_RT_ALLOC_CHECK
+void rt_section_enter(void);
+void rt_section_leave(void);
+#else
+static inline void rt_section_enter(void) {}
+static inline void rt_section_leave(void) {}
+#endif
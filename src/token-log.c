@@ -0,0 +1,314 @@
+/* token-log.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "token-log.h"
+
+// Files start with the magic and a version. Each record is the result
+// type, source, lane, microseconds since the previous record, the language,
+// then how many tokens are the same as in the lane's previous result and
+// the rest of the tokens. Partial results mostly repeat the one before, so
+// they only take a few bytes each. Native byte order, like history
+#define TOKEN_LOG_MAGIC "LCAPTOKS"
+#define TOKEN_LOG_MAGIC_LEN 8
+#define TOKEN_LOG_VERSION 1
+
+// More than the asr thread has
+#define TOKEN_LOG_MAX_LANES 8
+
+struct logged_token {
+    char *text;
+    float logprob;
+    AprilTokenFlagBits flags;
+    size_t time_ms;
+};
+
+static GMutex log_mutex;
+static FILE *log_file = NULL;
+static gint64 last_time;
+
+// The previous result of each lane
+static GArray *previous[CAPTION_SOURCE_COUNT][TOKEN_LOG_MAX_LANES];
+
+static void clear_logged_token(void *data) {
+    struct logged_token *token = data;
+    g_free(token->text);
+}
+
+bool token_log_start(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if(f == NULL) {
+        printf("Can't record tokens to %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    uint32_t version = TOKEN_LOG_VERSION;
+    fwrite(TOKEN_LOG_MAGIC, 1, TOKEN_LOG_MAGIC_LEN, f);
+    fwrite(&version, sizeof(version), 1, f);
+
+    g_mutex_lock(&log_mutex);
+
+    if(log_file != NULL) fclose(log_file);
+    log_file = f;
+    last_time = g_get_monotonic_time();
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<TOKEN_LOG_MAX_LANES; j++){
+            if(previous[i][j] == NULL) {
+                previous[i][j] = g_array_new(false, false, sizeof(struct logged_token));
+                g_array_set_clear_func(previous[i][j], clear_logged_token);
+            }
+
+            g_array_set_size(previous[i][j], 0);
+        }
+    }
+
+    g_mutex_unlock(&log_mutex);
+
+    printf("Recording tokens to %s\n", path);
+    return true;
+}
+
+static bool same_token(const struct logged_token *a, const AprilToken *b) {
+    return (a->logprob == b->logprob) && (a->flags == b->flags) &&
+           (a->time_ms == b->time_ms) && (strcmp(a->text, b->token) == 0);
+}
+
+void token_log_result(CaptionSource source,
+                      size_t lane,
+                      const char *language,
+                      AprilResultType result,
+                      size_t count,
+                      const AprilToken *tokens)
+{
+    if(g_atomic_pointer_get(&log_file) == NULL) return;
+    if(((unsigned int)source >= CAPTION_SOURCE_COUNT) || (lane >= TOKEN_LOG_MAX_LANES)) return;
+
+    g_mutex_lock(&log_mutex);
+
+    FILE *f = log_file;
+    if(f == NULL) {
+        g_mutex_unlock(&log_mutex);
+        return;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    uint32_t delta_us = (uint32_t)MIN(now - last_time, (gint64)UINT32_MAX);
+    last_time = now;
+
+    if(count > UINT16_MAX) count = UINT16_MAX;
+
+    GArray *prev = previous[source][lane];
+    size_t kept = 0;
+    while((kept < prev->len) && (kept < count) && same_token(&g_array_index(prev, struct logged_token, kept), &tokens[kept]))
+        kept++;
+
+    uint8_t header[3] = { (uint8_t)result, (uint8_t)source, (uint8_t)lane };
+    uint8_t language_len = (uint8_t)MIN(strlen(language), HISTORY_LANGUAGE_MAX_CHARS - 1);
+    uint16_t kept_count = (uint16_t)kept;
+    uint16_t added_count = (uint16_t)(count - kept);
+
+    fwrite(header, 1, sizeof(header), f);
+    fwrite(&delta_us, sizeof(delta_us), 1, f);
+    fwrite(&language_len, sizeof(language_len), 1, f);
+    fwrite(language, 1, language_len, f);
+    fwrite(&kept_count, sizeof(kept_count), 1, f);
+    fwrite(&added_count, sizeof(added_count), 1, f);
+
+    g_array_set_size(prev, kept);
+
+    for(size_t i=kept; i<count; i++){
+        uint32_t flags = tokens[i].flags;
+        uint32_t time_ms = (uint32_t)tokens[i].time_ms;
+
+        fwrite(tokens[i].token, 1, strlen(tokens[i].token) + 1, f);
+        fwrite(&tokens[i].logprob, sizeof(tokens[i].logprob), 1, f);
+        fwrite(&flags, sizeof(flags), 1, f);
+        fwrite(&time_ms, sizeof(time_ms), 1, f);
+
+        struct logged_token token = {
+            .text = g_strdup(tokens[i].token),
+            .logprob = tokens[i].logprob,
+            .flags = tokens[i].flags,
+            .time_ms = tokens[i].time_ms
+        };
+        g_array_append_val(prev, token);
+    }
+
+    // Partial results are frequent, so they're only written out along
+    // with the rest of the utterance
+    if(result != APRIL_RESULT_RECOGNITION_PARTIAL) fflush(f);
+
+    g_mutex_unlock(&log_mutex);
+}
+
+void token_log_stop(void) {
+    g_mutex_lock(&log_mutex);
+
+    if(log_file != NULL) {
+        fclose(log_file);
+        g_atomic_pointer_set(&log_file, NULL);
+    }
+
+    g_mutex_unlock(&log_mutex);
+}
+
+
+struct token_log {
+    gchar *data;
+    gsize size;
+    size_t offset;
+
+    gint64 time_us;
+
+    // AprilToken of the latest result of each lane, pointing into data
+    GArray *lanes[CAPTION_SOURCE_COUNT][TOKEN_LOG_MAX_LANES];
+};
+
+static bool read_bytes(struct token_log *log, void *out, size_t len) {
+    if((len > log->size) || (log->offset > (log->size - len))) return false;
+
+    memcpy(out, &log->data[log->offset], len);
+    log->offset += len;
+
+    return true;
+}
+
+struct token_log *token_log_open(const char *path) {
+    struct token_log *log = g_new0(struct token_log, 1);
+
+    GError *error = NULL;
+    if(!g_file_get_contents(path, &log->data, &log->size, &error)) {
+        printf("Can't read token recording %s: %s\n", path, error->message);
+        g_error_free(error);
+        g_free(log);
+        return NULL;
+    }
+
+    uint32_t version = 0;
+    if((log->size < TOKEN_LOG_MAGIC_LEN) || (memcmp(log->data, TOKEN_LOG_MAGIC, TOKEN_LOG_MAGIC_LEN) != 0)) {
+        printf("%s is not a token recording\n", path);
+        token_log_close(log);
+        return NULL;
+    }
+
+    log->offset = TOKEN_LOG_MAGIC_LEN;
+    if(!read_bytes(log, &version, sizeof(version)) || (version != TOKEN_LOG_VERSION)) {
+        printf("Token recording %s has unsupported version %u\n", path, version);
+        token_log_close(log);
+        return NULL;
+    }
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<TOKEN_LOG_MAX_LANES; j++)
+            log->lanes[i][j] = g_array_new(false, true, sizeof(AprilToken));
+    }
+
+    token_log_rewind(log);
+
+    return log;
+}
+
+bool token_log_read(struct token_log *log, struct token_log_record *record) {
+    uint8_t header[3];
+    uint32_t delta_us;
+    uint8_t language_len;
+    uint16_t kept_count, added_count;
+
+    if(log->offset == log->size) return false;
+
+    if(!read_bytes(log, header, sizeof(header))) goto damaged;
+    if(!read_bytes(log, &delta_us, sizeof(delta_us))) goto damaged;
+    if(!read_bytes(log, &language_len, sizeof(language_len))) goto damaged;
+    if(language_len >= HISTORY_LANGUAGE_MAX_CHARS) goto damaged;
+
+    memset(record->language, 0, sizeof(record->language));
+    if(!read_bytes(log, record->language, language_len)) goto damaged;
+
+    if(!read_bytes(log, &kept_count, sizeof(kept_count))) goto damaged;
+    if(!read_bytes(log, &added_count, sizeof(added_count))) goto damaged;
+
+    if((header[1] >= CAPTION_SOURCE_COUNT) || (header[2] >= TOKEN_LOG_MAX_LANES)) goto damaged;
+
+    GArray *tokens = log->lanes[header[1]][header[2]];
+    if(kept_count > tokens->len) goto damaged;
+
+    g_array_set_size(tokens, kept_count + added_count);
+
+    for(size_t i=kept_count; i<tokens->len; i++){
+        AprilToken *token = &g_array_index(tokens, AprilToken, i);
+
+        const char *text = &log->data[log->offset];
+        const char *end = memchr(text, '\0', log->size - log->offset);
+        if(end == NULL) goto damaged;
+        log->offset += (end - text) + 1;
+
+        uint32_t flags, time_ms;
+        if(!read_bytes(log, &token->logprob, sizeof(token->logprob))) goto damaged;
+        if(!read_bytes(log, &flags, sizeof(flags))) goto damaged;
+        if(!read_bytes(log, &time_ms, sizeof(time_ms))) goto damaged;
+
+        token->token = text;
+        token->flags = (AprilTokenFlagBits)flags;
+        token->time_ms = time_ms;
+    }
+
+    log->time_us += delta_us;
+
+    record->time_us = log->time_us;
+    record->source = (CaptionSource)header[1];
+    record->lane = header[2];
+    record->result = (AprilResultType)header[0];
+    record->count = tokens->len;
+    record->tokens = (const AprilToken *)tokens->data;
+
+    return true;
+
+damaged:
+    printf("Token recording is damaged at byte %zu, stopping there\n", log->offset);
+    log->offset = log->size;
+    return false;
+}
+
+void token_log_rewind(struct token_log *log) {
+    log->offset = TOKEN_LOG_MAGIC_LEN + sizeof(uint32_t);
+    log->time_us = 0;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<TOKEN_LOG_MAX_LANES; j++)
+            g_array_set_size(log->lanes[i][j], 0);
+    }
+}
+
+void token_log_close(struct token_log *log) {
+    if(log == NULL) return;
+
+    for(size_t i=0; i<CAPTION_SOURCE_COUNT; i++){
+        for(size_t j=0; j<TOKEN_LOG_MAX_LANES; j++){
+            if(log->lanes[i][j] != NULL) g_array_free(log->lanes[i][j], true);
+        }
+    }
+
+    g_free(log->data);
+    g_free(log);
+}
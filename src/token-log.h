@@ -0,0 +1,73 @@
+/* token-log.h
+ * Records the results of the models with their timing, and reads them back,
+ * so caption problems can be reproduced without the audio or the model
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <glib.h>
+#include <april_api.h>
+
+#include "history.h"
+
+// Starts writing every result passed to token_log_result to the file,
+// replacing it. Returns false if it can't be created
+bool token_log_start(const char *path);
+
+// Does nothing unless recording. Thread safe, called from the result handler
+void token_log_result(CaptionSource source,
+                      size_t lane,
+                      const char *language,
+                      AprilResultType result,
+                      size_t count,
+                      const AprilToken *tokens);
+
+void token_log_stop(void);
+
+
+// A result as it was passed to the handler
+struct token_log_record {
+    // Since the recording started
+    gint64 time_us;
+
+    CaptionSource source;
+    size_t lane;
+    char language[HISTORY_LANGUAGE_MAX_CHARS];
+
+    AprilResultType result;
+
+    // The texts are valid until the log is closed, the array only until
+    // the next record of the same lane
+    size_t count;
+    const AprilToken *tokens;
+};
+
+struct token_log;
+
+// Reads the whole file. Returns NULL if it can't be read or isn't a token log
+struct token_log *token_log_open(const char *path);
+
+// Returns false at the end, or at a damaged record
+bool token_log_read(struct token_log *log, struct token_log_record *record);
+
+// Back to the first record
+void token_log_rewind(struct token_log *log);
+
+void token_log_close(struct token_log *log);
@@ -0,0 +1,77 @@
+/* token-view.h
+ * A read-only view over an array of tokens, so that the same code can walk
+ * either AprilToken arrays from aprilasr or history_token arrays from the
+ * history without copying them into a common type
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <april_api.h>
+#include "history.h"
+
+struct token_view {
+    const char *base;
+    size_t stride;
+    size_t count;
+
+    // Offsets of the text and flags within a single token
+    size_t text_offset;
+    size_t flags_offset;
+
+    // AprilToken points to its text, history_token stores it inline
+    bool text_is_pointer;
+};
+
+static inline struct token_view token_view_from_april(const AprilToken *tokens, size_t count) {
+    struct token_view view = {
+        .base = (const char *)tokens,
+        .stride = sizeof(AprilToken),
+        .count = count,
+        .text_offset = offsetof(AprilToken, token),
+        .flags_offset = offsetof(AprilToken, flags),
+        .text_is_pointer = true
+    };
+
+    return view;
+}
+
+static inline struct token_view token_view_from_history(const struct history_token *tokens, size_t count) {
+    struct token_view view = {
+        .base = (const char *)tokens,
+        .stride = sizeof(struct history_token),
+        .count = count,
+        .text_offset = offsetof(struct history_token, token),
+        .flags_offset = offsetof(struct history_token, flags),
+        .text_is_pointer = false
+    };
+
+    return view;
+}
+
+static inline const char *token_view_text(const struct token_view *view, size_t idx) {
+    const char *p = view->base + idx * view->stride + view->text_offset;
+
+    if(view->text_is_pointer) return *(const char *const *)p;
+    else return p;
+}
+
+static inline AprilTokenFlagBits token_view_flags(const struct token_view *view, size_t idx) {
+    return *(const AprilTokenFlagBits *)(view->base + idx * view->stride + view->flags_offset);
+}
@@ -0,0 +1,179 @@
+/* wav.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "wav.h"
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+static uint16_t le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Chunks we don't care about have to be read through, as pipes can't seek
+static bool skip_bytes(wav_read_fn read, void *userdata, uint64_t len) {
+    uint8_t scratch[512];
+    while(len > 0) {
+        size_t n = (len > sizeof(scratch)) ? sizeof(scratch) : (size_t)len;
+        if(!read(userdata, scratch, n)) return false;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool parse_fmt(const uint8_t *fmt, uint32_t size, struct wav_format *format) {
+    if(size < 16) {
+        printf("WAV fmt chunk is too short\n");
+        return false;
+    }
+
+    uint16_t tag = le16(&fmt[0]);
+    uint16_t channels = le16(&fmt[2]);
+    uint32_t rate = le32(&fmt[4]);
+    uint16_t bits = le16(&fmt[14]);
+
+    // The actual format is in the first two bytes of the subformat GUID
+    if((tag == WAVE_FORMAT_EXTENSIBLE) && (size >= 26))
+        tag = le16(&fmt[24]);
+
+    if((channels == 0) || (rate == 0)) {
+        printf("WAV has %u channels at %u Hz\n", channels, rate);
+        return false;
+    }
+
+    format->channels = channels;
+    format->rate = rate;
+
+    if((tag == WAVE_FORMAT_IEEE_FLOAT) && (bits == 32)) {
+        format->sample_format = WAV_FORMAT_F32;
+        return true;
+    }
+
+    if(tag == WAVE_FORMAT_PCM) {
+        switch(bits) {
+            case 8:  format->sample_format = WAV_FORMAT_U8;  return true;
+            case 16: format->sample_format = WAV_FORMAT_S16; return true;
+            case 24: format->sample_format = WAV_FORMAT_S24; return true;
+            case 32: format->sample_format = WAV_FORMAT_S32; return true;
+        }
+    }
+
+    printf("Unsupported WAV sample format 0x%04x with %u bits\n", tag, bits);
+    return false;
+}
+
+bool wav_parse_header(wav_read_fn read, void *userdata, bool skip_magic,
+                      struct wav_format *format, uint64_t *data_size)
+{
+    uint8_t header[12];
+
+    if(skip_magic) {
+        memcpy(header, "RIFF", 4);
+        if(!read(userdata, &header[4], 8)) return false;
+    } else {
+        if(!read(userdata, header, 12)) return false;
+    }
+
+    if((memcmp(&header[0], "RIFF", 4) != 0) || (memcmp(&header[8], "WAVE", 4) != 0)) {
+        printf("Not a WAV file\n");
+        return false;
+    }
+
+    bool have_fmt = false;
+    for(;;) {
+        uint8_t chunk[8];
+        if(!read(userdata, chunk, 8)) {
+            printf("WAV file ended before the data chunk\n");
+            return false;
+        }
+
+        uint32_t size = le32(&chunk[4]);
+
+        if(memcmp(chunk, "fmt ", 4) == 0) {
+            uint8_t fmt[64] = { 0 };
+            uint32_t keep = (size > sizeof(fmt)) ? sizeof(fmt) : size;
+
+            if(!read(userdata, fmt, keep)) return false;
+            if(!skip_bytes(read, userdata, (uint64_t)(size - keep) + (size & 1))) return false;
+
+            if(!parse_fmt(fmt, keep, format)) return false;
+            have_fmt = true;
+        } else if(memcmp(chunk, "data", 4) == 0) {
+            if(!have_fmt) {
+                printf("WAV data chunk comes before the fmt chunk\n");
+                return false;
+            }
+
+            *data_size = ((size == 0) || (size == 0xFFFFFFFFu)) ? WAV_DATA_SIZE_UNKNOWN : size;
+            return true;
+        } else {
+            // Chunks are padded to an even size
+            if(!skip_bytes(read, userdata, (uint64_t)size + (size & 1))) return false;
+        }
+    }
+}
+
+size_t wav_bytes_per_frame(const struct wav_format *format) {
+    static const size_t sample_sizes[] = {
+        [WAV_FORMAT_U8] = 1,
+        [WAV_FORMAT_S16] = 2,
+        [WAV_FORMAT_S24] = 3,
+        [WAV_FORMAT_S32] = 4,
+        [WAV_FORMAT_F32] = 4
+    };
+
+    return sample_sizes[format->sample_format] * format->channels;
+}
+
+void wav_to_float(const struct wav_format *format, const void *in, size_t frames, float *out) {
+    const uint8_t *p = in;
+    size_t samples = frames * format->channels;
+
+    switch(format->sample_format) {
+        case WAV_FORMAT_U8:
+            for(size_t i=0; i<samples; i++)
+                out[i] = ((int)p[i] - 128) / 128.0f;
+            break;
+        case WAV_FORMAT_S16:
+            for(size_t i=0; i<samples; i++)
+                out[i] = (int16_t)le16(&p[i * 2]) / 32768.0f;
+            break;
+        case WAV_FORMAT_S24:
+            for(size_t i=0; i<samples; i++){
+                // Shift into the top of an int32 to sign-extend
+                int32_t v = (int32_t)(((uint32_t)p[i * 3] << 8) | ((uint32_t)p[i * 3 + 1] << 16) | ((uint32_t)p[i * 3 + 2] << 24));
+                out[i] = v / 2147483648.0f;
+            }
+            break;
+        case WAV_FORMAT_S32:
+            for(size_t i=0; i<samples; i++)
+                out[i] = (int32_t)le32(&p[i * 4]) / 2147483648.0f;
+            break;
+        case WAV_FORMAT_F32:
+            memcpy(out, in, samples * sizeof(float));
+            break;
+    }
+}
@@ -0,0 +1,57 @@
+/* wav.h
+ * Minimal WAV header parser and sample conversion, used by the file capture
+ * backend. Headers are read through a callback so that pipes and stdin,
+ * which can't seek, work the same as regular files.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streamed WAV files (e.g. from ffmpeg writing to a pipe) don't know their
+// length up front, and use 0 or 0xFFFFFFFF as the data size
+#define WAV_DATA_SIZE_UNKNOWN UINT64_MAX
+
+typedef enum WavSampleFormat {
+    WAV_FORMAT_U8 = 0,
+    WAV_FORMAT_S16 = 1,
+    WAV_FORMAT_S24 = 2,
+    WAV_FORMAT_S32 = 3,
+    WAV_FORMAT_F32 = 4
+} WavSampleFormat;
+
+struct wav_format {
+    WavSampleFormat sample_format;
+    unsigned int rate;
+    unsigned int channels;
+};
+
+// Reads exactly len bytes, returns false on end of input or error
+typedef bool (*wav_read_fn)(void *userdata, void *out, size_t len);
+
+// Parses up to the start of the sample data. If the 4-byte "RIFF" magic has
+// already been consumed (e.g. to detect the format), pass skip_magic
+bool wav_parse_header(wav_read_fn read, void *userdata, bool skip_magic,
+                      struct wav_format *format, uint64_t *data_size);
+
+size_t wav_bytes_per_frame(const struct wav_format *format);
+
+// Converts interleaved little-endian samples to interleaved float in [-1, 1]
+void wav_to_float(const struct wav_format *format, const void *in, size_t frames, float *out);